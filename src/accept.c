@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -46,19 +47,53 @@
 #include "keyhash.h"
 #include "ssl.h"
 #include "sctp.h"
+#include "ratelimit.h"
+#include "affinity.h"
+#include "handshake.h"
+#include "liveupgrade.h"
+#include "metrics.h"
 
 #ifdef USE_SCTP
 #include <netinet/sctp.h>
 #endif
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
+
 static struct listen_t *listen_list;
 
+/* The workers read the listener list when accepting on their own
+ * SO_REUSEPORT sockets. The accept thread holds the write lock while
+ * modifying it, and bumps the generation so that the workers notice.
+ */
+static rwlock_t listen_rwlock = RWL_INITIALIZER;
+/* SO_REUSEPORT socket group membership of the listeners */
+static pthread_mutex_t reuseport_group_mt = PTHREAD_MUTEX_INITIALIZER;
+volatile int accept_listeners_generation;
+
 //  pthread_mutex_t mt_servercount = PTHREAD_MUTEX_INITIALIZER;
 
 int accept_shutting_down;
 int accept_reconfiguring;
 time_t accept_reconfigure_after_tick = 0;
 
+/* connection rate limiters, per source address and per network */
+#define ACCEPT_RATELIMIT_SETS 1024
+static struct ratelimit_t *ratelimit_ip;
+static struct ratelimit_t *ratelimit_net;
+
+static const char *accept_reject_labels[] = {
+	"server_full",
+	"port_full",
+	"acl",
+	"rate_ip",
+	"rate_net",
+	"login_busy",
+	"alloc",
+	"ssl"
+};
+
 /* pseudoworker + pseudoclient for incoming UDP packets */
 struct worker_t *udp_worker = NULL;
 struct client_t *udp_pseudoclient = NULL;
@@ -161,17 +196,36 @@ static void listener_copy_filters(struct listen_t *l, struct listen_config_t *lc
 }
 
 /*
- *	Open the TCP/SCTP listening socket
+ *	Set TCP_DEFER_ACCEPT on a listening socket, so that connections
+ *	are not handed to accept() before the client has sent something
+ *	(or the timeout expires).
  */
 
-static int open_tcp_listener(struct listen_t *l, const struct addrinfo *ai, char *which)
+static void listener_set_defer_accept(struct listen_t *l, int fd)
+{
+#ifdef TCP_DEFER_ACCEPT
+	int arg = defer_accept;
+	
+	if (l->ai_socktype != SOCK_STREAM || l->ai_protocol != IPPROTO_TCP)
+		return;
+	
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *)&arg, sizeof(arg)) == -1)
+		hlog(LOG_ERR, "setsockopt(%s, TCP_DEFER_ACCEPT, %d) failed for listener: %s", l->addr_s, arg, strerror(errno));
+#endif
+}
+
+/*
+ *	Create a TCP/SCTP socket, bind it to the listener's address and
+ *	start listening. Used for the listener itself, and for the
+ *	per-worker SO_REUSEPORT sockets.
+ */
+
+static int bind_listen_socket(struct listen_t *l)
 {
 	int arg;
 	int f;
 	
-	hlog(LOG_INFO, "Binding listening %s socket: %s", which, l->addr_s);
-	
-	if ((f = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+	if ((f = socket(l->ai_family, l->ai_socktype, l->ai_protocol)) < 0) {
 		hlog(LOG_CRIT, "socket(): %s\n", strerror(errno));
 		return -1;
 	}
@@ -184,7 +238,7 @@ static int open_tcp_listener(struct listen_t *l, const struct addrinfo *ai, char
 		hlog(LOG_ERR, "setsockopt(%s, SO_REUSEPORT) failed for listener: %s", l->addr_s, strerror(errno));
 #endif
 	
-	if (bind(f, ai->ai_addr, ai->ai_addrlen)) {
+	if (bind(f, &l->sa.sa, l->sa_len)) {
 		hlog(LOG_CRIT, "bind(%s): %s", l->addr_s, strerror(errno));
 		close(f);
 		return -1;
@@ -196,6 +250,25 @@ static int open_tcp_listener(struct listen_t *l, const struct addrinfo *ai, char
 		return -1;
 	}
 	
+	if (defer_accept)
+		listener_set_defer_accept(l, f);
+	
+	return f;
+}
+
+/*
+ *	Open the TCP/SCTP listening socket
+ */
+
+static int open_tcp_listener(struct listen_t *l, const struct addrinfo *ai, char *which)
+{
+	int f;
+	
+	hlog(LOG_INFO, "Binding listening %s socket: %s", which, l->addr_s);
+	
+	if ((f = bind_listen_socket(l)) < 0)
+		return -1;
+	
 	l->fd = f;
 	
 	return f;
@@ -290,6 +363,11 @@ static int open_listener(struct listen_config_t *lc)
 	l->name   = hstrdup(lc->name);
 	l->portnum = lc->portnum;
 	l->ai_protocol = lc->ai->ai_protocol;
+	l->ai_family = lc->ai->ai_family;
+	l->ai_socktype = lc->ai->ai_socktype;
+	l->sa_len = (lc->ai->ai_addrlen < sizeof(l->sa)) ? lc->ai->ai_addrlen : sizeof(l->sa);
+	memcpy(&l->sa, lc->ai->ai_addr, l->sa_len);
+	l->reuseport = lc->reuseport;
 	l->listener_id = keyhash(l->addr_s, strlen(l->addr_s), 0);
 	l->listener_id = keyhash(&lc->ai->ai_socktype, sizeof(lc->ai->ai_socktype), l->listener_id);
 	l->listener_id = keyhash(&lc->ai->ai_protocol, sizeof(lc->ai->ai_protocol), l->listener_id);
@@ -464,6 +542,11 @@ static void listener_update_config(struct listen_t *l, struct listen_config_t *l
 	l->clients_max = lc->clients_max; /* could drop clients when decreasing maxclients (done in worker) */
 	l->hidden = lc->hidden; /* could mark old clients on port hidden, too - needs to be done in worker */
 	l->client_flags = lc->client_flags; /* this one must not change old clients */
+	l->reuseport = lc->reuseport; /* workers open or close their sockets on the next sync */
+	
+	/* applies to the workers' SO_REUSEPORT sockets when they are reopened */
+	if (l->fd >= 0 && !l->udp)
+		listener_set_defer_accept(l, l->fd);
 	
 	/* Filters */
 	listener_copy_filters(l, lc);
@@ -523,6 +606,52 @@ static int close_removed_listeners(void)
 	return closed;
 }
 
+/*
+ *	At shutdown, have the workers close their SO_REUSEPORT sockets
+ *	while the listeners are still there, so that they can take over
+ *	the connections queued on them. The clients are then closed, or
+ *	carried over in a live upgrade, instead of being reset.
+ */
+
+static void close_worker_listeners(void)
+{
+	struct listen_t *l;
+	struct worker_t *w = NULL;
+	int e, i, generation, n = 0;
+	
+	if ((e = rwl_wrlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "close_worker_listeners: Failed to wrlock listen_rwlock!");
+		exit(1);
+	}
+	
+	for (l = listen_list; (l); l = l->next) {
+		if (l->reuseport) {
+			l->reuseport = 0;
+			n++;
+		}
+	}
+	generation = ++accept_listeners_generation;
+	
+	if ((e = rwl_wrunlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "close_worker_listeners: Failed to wrunlock listen_rwlock!");
+		exit(1);
+	}
+	
+	if (!n)
+		return;
+	
+	for (i = 0; i < 500; i++) {
+		for (w = worker_threads; (w); w = w->next)
+			if (w->listeners_generation != generation)
+				break;
+		if (!w)
+			break;
+		usleep(10000);
+	}
+	if (w)
+		hlog(LOG_ERR, "close_worker_listeners: worker %d did not close its SO_REUSEPORT sockets", w->id);
+}
+
 static void close_listeners(void)
 {
 	if (!listen_list)
@@ -558,6 +687,7 @@ static void peerip_clients_config(void)
 		c = client_alloc();
 		if (!c) {
 			hlog(LOG_ERR, "peerip_clients_config: client_alloc returned NULL");
+			hlog_flush();
 			abort();
 		}
 		c->fd = -1; // Right, this client will never have a socket of it's own.
@@ -630,6 +760,7 @@ static void peerip_clients_close(void)
 	c = client_alloc();
 	if (!c) {
 		hlog(LOG_ERR, "peerip_clients_close: client_alloc returned NULL");
+		hlog_flush();
 		abort();
 	}
 	
@@ -742,7 +873,7 @@ static void accept_udp_recv(struct listen_t *l)
  *	Accept a single client
  */
 
-struct client_t *accept_client_for_listener(struct listen_t *l, int fd, char *addr_s, union sockaddr_u *sa, unsigned addr_len)
+struct client_t *accept_client_for_listener(struct listen_t *l, int fd, char *addr_s, union sockaddr_u *sa, unsigned addr_len, int numa_pool)
 {
 	struct client_t *c;
 	char *s;
@@ -750,7 +881,7 @@ struct client_t *accept_client_for_listener(struct listen_t *l, int fd, char *ad
 	union sockaddr_u sa_loc; /* local address */
 	socklen_t addr_len_loc = sizeof(sa_loc);
 	
-	c = client_alloc();
+	c = client_alloc_numa(numa_pool);
 	if (!c)
 		return NULL;
 		
@@ -813,99 +944,135 @@ struct client_t *accept_client_for_listener(struct listen_t *l, int fd, char *ad
 static struct worker_t *pick_next_worker(void)
 {
 	static int next_receiving_worker;
-	struct worker_t *w, *wc;
-	int i;
-
-#if 1
-	/* Use simple round-robin on client feeding.  Least clients is
-	 * quite attractive idea, but when clients arrive at huge bursts
-	 * they tend to move in big bunches, and it takes quite some while
-	 * before the worker updates its client-counters.
+	struct worker_t *w, *wc = NULL;
+	long long score, best = 0;
+	int i, n, cost = 0, clients = 0, avg_cost;
+	
+	/* Pick the least loaded worker. The workers publish a smoothed
+	 * cost every couple of seconds, but clients arrive in bursts, so
+	 * the clients which have not yet logged in (counted right away by
+	 * pass_client_to_worker) are added at the average cost of a client.
+	 * Ties are broken round-robin, so that an idle server spreads the
+	 * clients evenly too.
 	 */
-	for (i = 0, w = worker_threads; w ;  w = w->next, i++) {
-		if ( i >= next_receiving_worker)
-			break;
-	}
-	wc = w;
-	if (! w) {
-		wc = worker_threads;       // ran out of the worker chain, back to the first..
-		next_receiving_worker = 0; // and reset the index too
+	for (w = worker_threads, n = 0; (w); w = w->next, n++) {
+		cost += w->cost;
+		clients += w->client_count;
 	}
-	// in every case, increment the next receiver index for the next call.
-	++next_receiving_worker;
-
-#else
-	/* find the worker with least clients...
-	 * This isn't strictly accurate, since the threads could change their
-	 * client counts during scanning, but we don't really care if the load distribution
-	 * is _exactly_ fair.
-	 */
+	if (n == 0)
+		return NULL;
+	
+	avg_cost = (clients > 0) ? cost / clients : 0;
+	if (avg_cost < 1)
+		avg_cost = 1;
+	
+	next_receiving_worker = (next_receiving_worker + 1) % n;
 	
-	int client_min = -1;
-	for (wc = w = worker_threads; (w); w = w->next)
-		if (w->client_count < client_min || client_min == -1) {
+	for (w = worker_threads, i = 0; (w); w = w->next, i++) {
+		score = (long long)w->cost + (long long)w->logins_pending * avg_cost;
+		if (!wc || score < best || (score == best && i <= next_receiving_worker)) {
 			wc = w;
-			client_min = w->client_count;
+			best = score;
 		}
-#endif
+	}
+	
 	return wc;
 }
 
 /*
- *	Accept a single connection
+ *	Count a rejected connection
  */
 
-static void do_accept(struct listen_t *l)
+static inline void accept_reject_account(struct listen_t *l, AcceptRejectEnum reason)
 {
-	int fd;
-	struct client_t *c;
-	union sockaddr_u sa; /* large enough for also IPv6 address */
-	socklen_t addr_len = sizeof(sa);
-	static time_t last_EMFILE_report;
-	char *s;
-
-	if ((fd = accept(l->fd, (struct sockaddr*)&sa, &addr_len)) < 0) {
-		int e = errno;
-		switch (e) {
-			/* Errors reporting really bad internal (programming) bugs */
-			case EBADF:
-			case EINVAL:
-#ifdef ENOTSOCK
-			case ENOTSOCK: /* Not a socket */
-#endif
-#ifdef EOPNOTSUPP
-			case EOPNOTSUPP: /* Not a SOCK_STREAM */
-#endif
-#ifdef ESOCKTNOSUPPORT
-			case ESOCKTNOSUPPORT: /* Linux errors ? */
-#endif
-#ifdef EPROTONOSUPPORT
-			case EPROTONOSUPPORT: /* Linux errors ? */
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	__sync_fetch_and_add(&l->rejects[reason], 1);
+#else
+	l->rejects[reason]++;
 #endif
+	inbound_connects_account(-1, l->portaccount); /* account rejected connection */
+}
 
-				hlog(LOG_CRIT, "accept() failed: %s (giving up)", strerror(e));
-				exit(1); // ABORT with core-dump ??
-
-				break;
+/*
+ *	Rate limiter keys for a client address: the address itself, and
+ *	the /24 network for IPv4 or the /48 for IPv6. IPv4-mapped IPv6
+ *	addresses are treated as IPv4.
+ */
 
-			/* Too many open files -- rate limit the reporting -- every 10th second or so.. */
-			case EMFILE:
-				if (last_EMFILE_report + 10 <= tick) {
-					last_EMFILE_report = tick;
-					hlog(LOG_ERR, "accept() failed: %s (continuing)", strerror(e));
-				}
-				return;
-			/* Errors reporting system internal/external glitches */
-			default:
-				hlog(LOG_ERR, "accept() failed: %s (continuing)", strerror(e));
-				return;
+static int accept_ratelimit_key(union sockaddr_u *sa, const uint8_t **key)
+{
+	const uint8_t *a;
+	
+	if (sa->sa.sa_family == AF_INET) {
+		*key = (const uint8_t *)&sa->si.sin_addr;
+		return 4;
+	}
+	
+	if (sa->sa.sa_family == AF_INET6) {
+		a = (const uint8_t *)&sa->si6.sin6_addr;
+#ifdef IN6_IS_ADDR_V4MAPPED
+		if (IN6_IS_ADDR_V4MAPPED(&sa->si6.sin6_addr)) {
+			*key = a + 12;
+			return 4;
 		}
+#endif
+		*key = a;
+		return 16;
 	}
 	
-	/* convert client address to string */
-	s = strsockaddr( &sa.sa, addr_len );
+	return 0;
+}
+
+/*
+ *	Admission control for connection storms: rate limits per source
+ *	address and per network, and a cap on the clients waiting for
+ *	login per worker. Returns the reason for rejecting the connection,
+ *	or -1 if it can be accepted.
+ */
+
+static int accept_admission_check(struct worker_t *w, union sockaddr_u *sa)
+{
+	const uint8_t *key;
+	int keylen;
+	
+	if (max_logins_per_worker > 0 && w && w->logins_pending >= max_logins_per_worker)
+		return ACCEPT_REJECT_LOGIN_BUSY;
+	
+	if (!connect_rate_ip.connections && !connect_rate_net.connections)
+		return -1;
+	
+	keylen = accept_ratelimit_key(sa, &key);
+	if (!keylen)
+		return -1;
+	
+	if (connect_rate_ip.connections && ratelimit_check(ratelimit_ip, key, keylen,
+	    connect_rate_ip.connections, connect_rate_ip.interval))
+		return ACCEPT_REJECT_RATE_IP;
+	
+	if (connect_rate_net.connections && ratelimit_check(ratelimit_net, key, (keylen == 4) ? 3 : 6,
+	    connect_rate_net.connections, connect_rate_net.interval))
+		return ACCEPT_REJECT_RATE_NET;
+	
+	return -1;
+}
+
+/*
+ *	Check limits and ACLs for a freshly accepted connection, and set
+ *	up a client for it, to be passed to worker w. Returns NULL if the
+ *	connection was rejected, in which case the socket has been closed.
+ *	Runs in the accept thread, or in a worker thread for SO_REUSEPORT
+ *	listeners.
+ */
+
+static struct client_t *accept_setup_client(struct listen_t *l, int fd, union sockaddr_u *sa, socklen_t addr_len, struct worker_t *w)
+{
+	struct client_t *c;
+	char *s;
+	int reason;
+	static time_t last_admission_report;
 	
-	/* TODO: the dropped connections here are not accounted. */
+	/* convert client address to string */
+	s = strsockaddr( &sa->sa, addr_len );
 	
 	/* Limit amount of connections per port, and globally.
 	 * Error messages written just before closing the socet may or may not get
@@ -919,34 +1086,50 @@ static void do_accept(struct listen_t *l)
 			 * disconnecting the client right now, so we don't care.
 			 */
 			if (write(fd, "# Server full\r\n", 15)) {};
+			reason = ACCEPT_REJECT_SERVER_FULL;
 		} else {
 			hlog(LOG_INFO, "%s - Denied client on fd %d from %s: Too many clients on Listener (%d)", l->addr_s, fd, s, l->portaccount->gauge);
 			if (write(fd, "# Port full\r\n", 13)) {};
+			reason = ACCEPT_REJECT_PORT_FULL;
 		}
 		close(fd);
 		hfree(s);
-		inbound_connects_account(-1, l->portaccount); /* account rejected connection */
-		return;
+		accept_reject_account(l, reason);
+		return NULL;
 	}
 	
 	/* match against acl... could probably have an error message to the client */
 	if (l->acl) {
-		if (!acl_check(l->acl, (struct sockaddr *)&sa, addr_len)) {
+		if (!acl_check(l->acl, (struct sockaddr *)sa, addr_len)) {
 			hlog(LOG_INFO, "%s - Denied client on fd %d from %s (ACL)", l->addr_s, fd, s);
 			close(fd);
 			hfree(s);
-			inbound_connects_account(-1, l->portaccount); /* account rejected connection */
-			return;
+			accept_reject_account(l, ACCEPT_REJECT_ACL);
+			return NULL;
+		}
+	}
+	
+	/* During a connection storm these would flood the log, so
+	 * only log one every 10 seconds - the counters tell the rest.
+	 */
+	if ((reason = accept_admission_check(w, sa)) >= 0) {
+		if (last_admission_report + 10 <= tick) {
+			last_admission_report = tick;
+			hlog(LOG_INFO, "%s - Denied client on fd %d from %s (%s)", l->addr_s, fd, s, accept_reject_labels[reason]);
 		}
+		close(fd);
+		hfree(s);
+		accept_reject_account(l, reason);
+		return NULL;
 	}
 	
-	c = accept_client_for_listener(l, fd, s, &sa, addr_len);
+	c = accept_client_for_listener(l, fd, s, sa, addr_len, (w) ? w->numa_pool : 0);
 	if (!c) {
 		hlog(LOG_ERR, "%s - client_alloc returned NULL, too many clients. Denied client on fd %d from %s", l->addr_s, fd, s);
 		close(fd);
 		hfree(s);
-		inbound_connects_account(-1, l->portaccount); /* account rejected connection */
-		return;
+		accept_reject_account(l, ACCEPT_REJECT_ALLOC);
+		return NULL;
 	}
 	hfree(s);
 
@@ -959,8 +1142,8 @@ static void do_accept(struct listen_t *l)
 	if (l->ssl) {
 		if (ssl_create_connection(l->ssl, c, 0)) {
 			close(fd);
-			inbound_connects_account(-1, l->portaccount); /* account rejected connection */
-			return;
+			accept_reject_account(l, ACCEPT_REJECT_SSL);
+			return NULL;
 		}
 	}
 #endif
@@ -968,11 +1151,79 @@ static void do_accept(struct listen_t *l)
 	hlog(LOG_DEBUG, "%s - Accepted client on fd %d from %s", c->addr_loc, c->fd, c->addr_rem);
 	
 	/* set client socket options, return -1 on serious errors */
-	if (set_client_sockopt(c) != 0)
-		goto err;
+	if (set_client_sockopt(c) != 0) {
+		inbound_connects_account(0, c->portaccount); /* something failed, remove this from accounts.. */
+		client_free(c);
+		return NULL;
+	}
+	
+	return c;
+}
+
+/*
+ *	Accept a single connection
+ */
+
+static void do_accept(struct listen_t *l)
+{
+	int fd;
+	struct client_t *c;
+	struct worker_t *w;
+	union sockaddr_u sa; /* large enough for also IPv6 address */
+	socklen_t addr_len = sizeof(sa);
+	static time_t last_EMFILE_report;
+
+	if ((fd = accept(l->fd, (struct sockaddr*)&sa, &addr_len)) < 0) {
+		int e = errno;
+		switch (e) {
+			/* Errors reporting really bad internal (programming) bugs */
+			case EBADF:
+			case EINVAL:
+#ifdef ENOTSOCK
+			case ENOTSOCK: /* Not a socket */
+#endif
+#ifdef EOPNOTSUPP
+			case EOPNOTSUPP: /* Not a SOCK_STREAM */
+#endif
+#ifdef ESOCKTNOSUPPORT
+			case ESOCKTNOSUPPORT: /* Linux errors ? */
+#endif
+#ifdef EPROTONOSUPPORT
+			case EPROTONOSUPPORT: /* Linux errors ? */
+#endif
+
+				hlog(LOG_CRIT, "accept() failed: %s (giving up)", strerror(e));
+				exit(1); // ABORT with core-dump ??
+
+				break;
+
+			/* Too many open files -- rate limit the reporting -- every 10th second or so.. */
+			case EMFILE:
+				if (last_EMFILE_report + 10 <= tick) {
+					last_EMFILE_report = tick;
+					hlog(LOG_ERR, "accept() failed: %s (continuing)", strerror(e));
+				}
+				return;
+			/* Errors reporting system internal/external glitches */
+			default:
+				hlog(LOG_ERR, "accept() failed: %s (continuing)", strerror(e));
+				return;
+		}
+	}
+	
+	w = pick_next_worker();
+	c = accept_setup_client(l, fd, &sa, addr_len, w);
+	if (!c)
+		return;
+	
+#ifdef USE_SSL
+	/* SSL clients do the handshake in a handshake thread first */
+	if (c->ssl_con && handshake_submit(c, w) == 0)
+		return;
+#endif
 	
 	/* ok, found it... lock the new client queue and pass the client */
-	if (pass_client_to_worker(pick_next_worker(), c))
+	if (pass_client_to_worker(w, c))
 		goto err;
 	
 	return;
@@ -985,36 +1236,394 @@ err:
 }
 
 /*
- *	Find a listener which this client is connected on
+ *	SO_REUSEPORT listeners: each worker opens its own listening socket
+ *	for the listener, in the same SO_REUSEPORT group with the accept
+ *	thread's socket. The kernel distributes new connections between
+ *	the sockets, and the workers accept them without going through the
+ *	accept thread. The listening sockets are pseudoclients in the
+ *	worker's polling set, but not on its client list.
  */
 
-struct listen_t *liveupgrade_find_listener(int listener_id)
-{
-	struct listen_t *l;
-	
-	l = listen_list;
-	
-	while (l) {
-		if (l->listener_id == listener_id)
-			break;
-		l = l->next;
-	}
-	
-	return l;
-}
+#define WORKER_ACCEPT_BURST 32 /* max connections to accept per poll round */
 
 /*
- *	Map old rxerrs counter values to new ones based on the string mapping
+ *	Pass a client accepted on a SO_REUSEPORT socket to worker w,
+ *	through the SSL handshake threads if needed
  */
 
-static int *accept_rx_err_map(cJSON *rx_err_labels, int *old_rxerrs_len)
+static void worker_accept_pass(struct worker_t *w, struct client_t *c)
 {
-	int *rxerr_map = NULL;
-	int i, j;
+#ifdef USE_SSL
+	if (c->ssl_con && handshake_submit(c, w) == 0)
+		return;
+#endif
+	
+	if (pass_client_to_worker(w, c)) {
+		inbound_connects_account(0, c->portaccount); /* something failed, remove this from accounts.. */
+		client_free(c);
+	}
+}
 
-	*old_rxerrs_len = cJSON_GetArraySize(rx_err_labels);
+static int worker_accept_readable(struct worker_t *self, struct client_t *lc)
+{
+	int fd, e, n;
+	struct listen_t *l;
+	struct client_t *c;
+	union sockaddr_u sa; /* large enough for also IPv6 address */
+	socklen_t addr_len;
+	static time_t last_error_report;
 	
-	if (*old_rxerrs_len > 0) {
+	for (n = 0; n < WORKER_ACCEPT_BURST; n++) {
+		addr_len = sizeof(sa);
+		if ((fd = accept(lc->fd, (struct sockaddr*)&sa, &addr_len)) < 0) {
+			e = errno;
+			if (e == EAGAIN || e == EWOULDBLOCK) {
+				xpoll_would_block(&self->xp, lc->xfd, XP_IN);
+				break;
+			}
+			if (e == EINTR || e == ECONNABORTED)
+				break;
+			/* rate limit the reporting, EMFILE and friends tend to repeat */
+			if (last_error_report + 10 <= tick) {
+				last_error_report = tick;
+				hlog(LOG_ERR, "worker %d: accept() on %s failed: %s (continuing)", self->id, lc->addr_loc, strerror(e));
+			}
+			break;
+		}
+		
+		if ((e = rwl_rdlock(&listen_rwlock))) {
+			hlog(LOG_CRIT, "worker_accept_readable: Failed to rdlock listen_rwlock!");
+			exit(1);
+		}
+		
+		l = find_listener_hash_id(lc->listener_id);
+		if (!l) {
+			/* listener has been removed, the socket will be closed on next sync */
+			close(fd);
+			c = NULL;
+		} else {
+			c = accept_setup_client(l, fd, &sa, addr_len, self);
+		}
+		
+		if ((e = rwl_rdunlock(&listen_rwlock))) {
+			hlog(LOG_CRIT, "worker_accept_readable: Failed to rdunlock listen_rwlock!");
+			exit(1);
+		}
+		
+		/* queue it for ourselves, collect_new_clients() picks it up
+		 * right after this poll round
+		 */
+		if (c)
+			worker_accept_pass(self, c);
+	}
+	
+	return 0;
+}
+
+/*
+ *	Accept the connections queued in the backlog of a worker's
+ *	SO_REUSEPORT socket which is about to be closed, and queue them
+ *	for worker w. Linux resets the connections left in the backlog of
+ *	a closed socket instead of moving them to the other sockets in the
+ *	group, unless net.ipv4.tcp_migrate_req is enabled. Called with
+ *	listen_rwlock held.
+ */
+
+static void worker_listener_drain(struct worker_t *self, struct client_t *lc, struct listen_t *l, struct worker_t *w)
+{
+	int fd, n = 0;
+	struct client_t *c;
+	union sockaddr_u sa; /* large enough for also IPv6 address */
+	socklen_t addr_len;
+	
+	while (1) {
+		addr_len = sizeof(sa);
+		if ((fd = accept(lc->fd, (struct sockaddr*)&sa, &addr_len)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				hlog(LOG_ERR, "worker %d: accept() on %s failed while closing: %s", self->id, lc->addr_loc, strerror(errno));
+			break;
+		}
+		
+		n++;
+		c = accept_setup_client(l, fd, &sa, addr_len, w);
+		if (c)
+			worker_accept_pass(w, c);
+	}
+	
+	if (n)
+		hlog(LOG_INFO, "worker %d: passed %d connections queued on the SO_REUSEPORT socket for %s to worker %d",
+			self->id, n, lc->addr_loc, w->id);
+}
+
+/*
+ *	Steer new connections of a SO_REUSEPORT group to the workers' sockets
+ *	based on the CPU which received the SYN, using a classic BPF program.
+ *	The kernel indexes the group's sockets in the order they joined it,
+ *	and when one leaves, the last one takes its place. The accept
+ *	thread's socket joined first (index 0), reuseport_workers[] tracks
+ *	the order of the workers' sockets after it, and the program is
+ *	rebuilt whenever it changes. If the worker has no socket in the
+ *	group, the program returns an index out of range, and the kernel
+ *	falls back to hashing. Called with reuseport_group_mt held.
+ */
+
+static void listener_steer_by_cpu(struct listen_t *l)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[3 + 2 * WORKERS_MAX];
+	struct sock_fprog prog;
+	int workers = workers_running;
+	int i, n = 0;
+	
+	if (workers < 1 || l->fd < 0)
+		return;
+	
+	/* A = CPU number % workers */
+	code[n++] = (struct sock_filter){ BPF_LD  | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+	code[n++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, workers };
+	
+	/* return the index of the socket of worker A */
+	for (i = 0; i < l->reuseport_workers_n; i++) {
+		code[n++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, l->reuseport_workers[i] };
+		code[n++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, i + 1 };
+	}
+	
+	code[n++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, 0xffffffff };
+	
+	prog.len = n;
+	prog.filter = code;
+	
+	if (setsockopt(l->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+		hlog(LOG_ERR, "setsockopt(%s, SO_ATTACH_REUSEPORT_CBPF) failed: %s", l->addr_s, strerror(errno));
+	else
+		hlog(LOG_DEBUG, "%s: steering connections to %d/%d workers by CPU", l->addr_s, l->reuseport_workers_n, workers);
+#else
+	hlog(LOG_INFO, "%s: SO_ATTACH_REUSEPORT_CBPF not supported on this platform, not steering connections by CPU", l->addr_s);
+#endif
+}
+
+/*
+ *	Close a worker's SO_REUSEPORT socket, and drop it from the group
+ *	of the listener, if the listener is still there. If w is set and
+ *	the listener is still there, the connections queued on the socket
+ *	are passed to worker w first.
+ */
+
+static void worker_listener_close(struct worker_t *self, struct client_t *lc, struct worker_t *w)
+{
+	struct listen_t *l;
+	int i;
+	
+	hlog(LOG_DEBUG, "worker %d: closing SO_REUSEPORT listener socket %d for %s", self->id, lc->fd, lc->addr_loc);
+	if (lc->xfd)
+		xpoll_remove(&self->xp, lc->xfd);
+	
+	l = find_listener_hash_id(lc->listener_id);
+	if (l && w)
+		worker_listener_drain(self, lc, l, w);
+	
+	pthread_mutex_lock(&reuseport_group_mt);
+	close(lc->fd);
+	lc->fd = -1;
+	
+	if (l) {
+		for (i = 0; i < l->reuseport_workers_n; i++) {
+			if (l->reuseport_workers[i] == self->id) {
+				l->reuseport_workers[i] = l->reuseport_workers[--l->reuseport_workers_n];
+				break;
+			}
+		}
+		if (l->reuseport == 2)
+			listener_steer_by_cpu(l);
+	}
+	pthread_mutex_unlock(&reuseport_group_mt);
+	
+	client_free(lc);
+}
+
+static struct client_t *worker_listener_open(struct worker_t *self, struct listen_t *l)
+{
+	struct client_t *lc;
+	int fd;
+	
+	hlog(LOG_DEBUG, "worker %d: binding SO_REUSEPORT listener socket for %s", self->id, l->addr_s);
+	
+	lc = client_alloc();
+	if (!lc)
+		return NULL;
+	
+	/* the socket joins the group in listen(), keep track of the order */
+	pthread_mutex_lock(&reuseport_group_mt);
+	
+	if ((fd = bind_listen_socket(l)) < 0) {
+		pthread_mutex_unlock(&reuseport_group_mt);
+		client_free(lc);
+		return NULL;
+	}
+	
+	/* The connections are accepted in a polling loop, and the live
+	 * upgrade must not inherit the listening socket.
+	 */
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		hlog(LOG_ERR, "worker %d: fcntl on SO_REUSEPORT listener socket for %s failed: %s", self->id, l->addr_s, strerror(errno));
+		close(fd);
+		pthread_mutex_unlock(&reuseport_group_mt);
+		client_free(lc);
+		return NULL;
+	}
+	
+	l->reuseport_workers[l->reuseport_workers_n++] = self->id;
+	if (l->reuseport == 2)
+		listener_steer_by_cpu(l);
+	
+	pthread_mutex_unlock(&reuseport_group_mt);
+	
+	lc->fd = fd;
+	lc->listener_id = l->listener_id;
+	strncpy(lc->addr_loc, l->addr_s, sizeof(lc->addr_loc));
+	lc->addr_loc[sizeof(lc->addr_loc)-1] = 0;
+	lc->handler_client_readable = &worker_accept_readable;
+	
+	lc->xfd = xpoll_add(&self->xp, fd, (void *)lc);
+	if (!lc->xfd) {
+		worker_listener_close(self, lc, NULL);
+		return NULL;
+	}
+	
+	return lc;
+}
+
+/*
+ *	Synchronize the worker's SO_REUSEPORT listening sockets with the
+ *	listener list. Called by the worker thread when the listener
+ *	generation has changed.
+ */
+
+void accept_worker_listeners(struct worker_t *self)
+{
+	struct client_t *lc, **lcp;
+	struct listen_t *l;
+	int e, generation;
+	
+	if ((e = rwl_rdlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_worker_listeners: Failed to rdlock listen_rwlock!");
+		exit(1);
+	}
+	
+	generation = accept_listeners_generation;
+	
+	/* close sockets of removed listeners, and listeners no longer in
+	 * reuseport mode - the connections queued on the latter are
+	 * taken over by this worker, the former go away with the port
+	 */
+	for (lcp = &self->listen_clients; (lc = *lcp); ) {
+		l = find_listener_hash_id(lc->listener_id);
+		if (l && l->reuseport) {
+			lcp = &lc->next;
+			continue;
+		}
+		*lcp = lc->next;
+		worker_listener_close(self, lc, self);
+	}
+	
+	/* open the missing ones */
+	for (l = listen_list; (l); l = l->next) {
+		if (!l->reuseport)
+			continue;
+		
+		for (lc = self->listen_clients; (lc); lc = lc->next)
+			if (lc->listener_id == l->listener_id)
+				break;
+		if (lc)
+			continue;
+		
+		lc = worker_listener_open(self, l);
+		if (!lc)
+			continue;
+		
+		lc->next = self->listen_clients;
+		self->listen_clients = lc;
+	}
+	
+	self->listeners_generation = generation;
+	
+	if ((e = rwl_rdunlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_worker_listeners: Failed to rdunlock listen_rwlock!");
+		exit(1);
+	}
+}
+
+/*
+ *	Close all of the worker's SO_REUSEPORT sockets, at worker shutdown,
+ *	when the amount of workers is reduced. The connections queued on
+ *	them are passed to a worker which keeps running, or if there is
+ *	none, to this one, to be closed or carried over with its clients.
+ */
+
+void accept_worker_listeners_close(struct worker_t *self)
+{
+	struct client_t *lc;
+	struct worker_t *w;
+	int e;
+	
+	if (!self->listen_clients)
+		return;
+	
+	if ((e = rwl_rdlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_worker_listeners_close: Failed to rdlock listen_rwlock!");
+		exit(1);
+	}
+	
+	for (w = worker_threads; (w); w = w->next)
+		if (w != self && !w->shutting_down)
+			break;
+	if (!w)
+		w = self;
+	
+	while ((lc = self->listen_clients)) {
+		self->listen_clients = lc->next;
+		worker_listener_close(self, lc, w);
+	}
+	
+	if ((e = rwl_rdunlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_worker_listeners_close: Failed to rdunlock listen_rwlock!");
+		exit(1);
+	}
+}
+
+/*
+ *	Find a listener which this client is connected on
+ */
+
+struct listen_t *liveupgrade_find_listener(int listener_id)
+{
+	struct listen_t *l;
+	
+	l = listen_list;
+	
+	while (l) {
+		if (l->listener_id == listener_id)
+			break;
+		l = l->next;
+	}
+	
+	return l;
+}
+
+/*
+ *	Map old rxerrs counter values to new ones based on the string mapping
+ */
+
+static int *accept_rx_err_map(cJSON *rx_err_labels, int *old_rxerrs_len)
+{
+	int *rxerr_map = NULL;
+	int i, j;
+
+	*old_rxerrs_len = cJSON_GetArraySize(rx_err_labels);
+	
+	if (*old_rxerrs_len > 0) {
 		rxerr_map = hmalloc(sizeof(*rxerr_map) * *old_rxerrs_len);
 		for (i = 0; i < *old_rxerrs_len; i++) {
 			rxerr_map[i] = -1; // default: no mapping
@@ -1187,7 +1796,7 @@ static int accept_liveupgrade_single(cJSON *client, int *rxerr_map, int rxerr_ma
 		return -1;
 	}
 	
-	struct client_t *c = accept_client_for_listener(l, fd->valueint, client_addr_s, &sa, addr_len);
+	struct client_t *c = accept_client_for_listener(l, fd->valueint, client_addr_s, &sa, addr_len, 0);
 	if (!c) {
 		hlog(LOG_ERR, "Live upgrade - client_alloc returned NULL, too many clients. Denied client %s on fd %d from %s",
 			username->valuestring, fd->valueint, client_addr_s);
@@ -1373,6 +1982,259 @@ static void accept_liveupgrade_accept(void)
 		hfree(rxerr_map);
 }
 
+/*
+ *	Recreate a client from a binary live upgrade handover record
+ */
+
+static struct client_t *accept_liveupgrade_binary_single(const struct liveupgrade_client_t *rec)
+{
+	struct liveupgrade_fields_t f;
+	char username_s[sizeof(((struct client_t *)0)->username)];
+	char app_name_s[sizeof(((struct client_t *)0)->app_name)];
+	char app_version_s[sizeof(((struct client_t *)0)->app_version)];
+	unsigned addr_len;
+	union sockaddr_u sa;
+	int l;
+	
+	if (rec->fd < 0) {
+		hlog(LOG_INFO, "Live upgrade: Client has negative fd %d, ignoring (corepeer?)", rec->fd);
+		return NULL;
+	}
+	
+	if (liveupgrade_client_fields(rec, &f) != 0) {
+		hlog(LOG_ERR, "Live upgrade: Invalid client record, discarding client fd %d", rec->fd);
+		close(rec->fd);
+		return NULL;
+	}
+	
+	l = (rec->username_len < sizeof(username_s)) ? rec->username_len : sizeof(username_s) - 1;
+	memcpy(username_s, f.username, l);
+	username_s[l] = 0;
+	
+	hlog(LOG_DEBUG, "Old client on fd %d: %s", rec->fd, username_s);
+	
+	/* fetch peer address from the fd */
+	addr_len = sizeof(sa);
+	if (getpeername(rec->fd, &sa.sa, &addr_len) != 0) {
+		/* Sometimes clients disconnect during upgrade, especially on slow RPi servers... */
+		if (errno == ENOTCONN)
+			hlog(LOG_INFO, "Live upgrade: Client %s on fd %d has disconnected during upgrade (%s)",
+				username_s, rec->fd, strerror(errno));
+		else
+			hlog(LOG_ERR, "Live upgrade: getpeername client fd %d failed: %s", rec->fd, strerror(errno));
+		close(rec->fd);
+		return NULL;
+	}
+	
+	/* convert client address to string */
+	char *client_addr_s = strsockaddr( &sa.sa, addr_len );
+	
+	/* find the right listener for this client, for configuration and accounting */
+	struct listen_t *lst = liveupgrade_find_listener(rec->listener_id);
+	if (!lst) {
+		hlog(LOG_INFO, "Live upgrade: Listener has been removed for fd %d (%s): disconnecting %s",
+			rec->fd, client_addr_s, username_s);
+		close(rec->fd);
+		hfree(client_addr_s);
+		return NULL;
+	}
+	
+	struct client_t *c = accept_client_for_listener(lst, rec->fd, client_addr_s, &sa, addr_len, 0);
+	if (!c) {
+		hlog(LOG_ERR, "Live upgrade - client_alloc returned NULL, too many clients. Denied client %s on fd %d from %s",
+			username_s, rec->fd, client_addr_s);
+		close(rec->fd);
+		hfree(client_addr_s);
+		return NULL;
+	}
+	
+	hfree(client_addr_s);
+	
+	if (rec->state == LIVEUPGRADE_STATE_CONNECTED) {
+		c->state   = CSTATE_CONNECTED;
+		c->handler_line_in = &incoming_handler;
+		strcpy(c->username, username_s);
+		c->username_len = strlen(c->username);
+	} else if (rec->state == LIVEUPGRADE_STATE_LOGIN) {
+		c->state   = CSTATE_LOGIN;
+		c->handler_line_in = &login_handler;
+	} else {
+		hlog(LOG_ERR, "Live upgrade: Client %s is in invalid state %d (fd %d)", c->addr_rem, rec->state, c->fd);
+		goto err;
+	}
+	/* distribute keepalive intervals for the existing old clients
+	 * but send them rather sooner than later */
+	// coverity[dont_call]  // squelch warning: not security sensitive use of random(): load distribution
+	c->keepalive = tick + (random() % (keepalive_interval/2));
+	/* distribute cleanup intervals over the next 2 minutes */
+	// coverity[dont_call]  // squelch warning: not security sensitive use of random(): load distribution
+	c->cleanup = tick + (random() % 120);
+	
+	c->connect_time = rec->connect_time;
+	c->connect_tick = rec->connect_tick;
+	
+	c->validated = rec->validated;
+	c->localaccount.rxbytes = rec->rxbytes;
+	c->localaccount.txbytes = rec->txbytes;
+	c->localaccount.rxpackets = rec->rxpackets;
+	c->localaccount.txpackets = rec->txpackets;
+	c->localaccount.rxdrops = rec->rxdrops;
+	c->localaccount.rxdupes = rec->rxdupes;
+	
+	l = (rec->app_name_len < sizeof(app_name_s)) ? rec->app_name_len : sizeof(app_name_s) - 1;
+	memcpy(app_name_s, f.app_name, l);
+	app_name_s[l] = 0;
+	l = (rec->app_version_len < sizeof(app_version_s)) ? rec->app_version_len : sizeof(app_version_s) - 1;
+	memcpy(app_version_s, f.app_version, l);
+	app_version_s[l] = 0;
+	login_set_app_name(c, app_name_s, app_version_s);
+	
+	// set up UDP downstream if necessary
+	if (rec->udp_port > 1024 && rec->udp_port < 65536) {
+		if (login_setup_udp_feed(c, rec->udp_port) != 0) {
+			hlog(LOG_DEBUG, "%s/%s: Requested UDP on client port with no UDP configured", c->addr_rem, c->username);
+		}
+	}
+	
+	// fill up ibuf and obuf
+	if (rec->ibuf_len > 0) {
+		if (rec->ibuf_len > (unsigned)c->ibuf_size) {
+			hlog(LOG_ERR, "Live upgrade: %s/%s: ibuf contents do not fit (%u bytes), dropped", c->addr_rem, c->username, rec->ibuf_len);
+		} else {
+			memcpy(c->ibuf, f.ibuf, rec->ibuf_len);
+			c->ibuf_end = rec->ibuf_len;
+		}
+	}
+	
+	if (rec->obuf_len > 0) {
+		if (rec->obuf_len > (unsigned)c->obuf_size) {
+			hlog(LOG_ERR, "Live upgrade: %s/%s: obuf contents do not fit (%u bytes), dropped", c->addr_rem, c->username, rec->obuf_len);
+		} else {
+			memcpy(c->obuf, f.obuf, rec->obuf_len);
+			c->obuf_start = 0;
+			c->obuf_end = rec->obuf_len;
+		}
+	}
+	
+	/* load rxerrs counters, with error name string mapping to support
+	 * adding/reordering of error counters
+	 */
+	liveupgrade_client_rxerrs(c, rec, &f);
+	
+	/* set client lat/lon, if they're known
+	 */
+	if (rec->loc_known) {
+		c->loc_known = 1;
+		c->lat = rec->lat;
+		c->lng = rec->lng;
+	}
+	
+	/* the filters and the heard list are restored by the worker */
+	liveupgrade_client_attach(c, rec);
+	
+	hlog(LOG_DEBUG, "%s - Accepted live upgrade client on fd %d from %s", c->addr_loc, c->fd, c->addr_rem);
+	
+	/* set client socket options, return -1 on serious errors */
+	if (set_client_sockopt(c) != 0)
+		goto err;
+	
+	/* Add the client to the client list. */
+	int old_fd = clientlist_add(c);
+	if (c->validated && old_fd != -1) {
+		hlog(LOG_INFO, "fd %d: Disconnecting duplicate validated client with username '%s'", old_fd, c->username);
+		shutdown(old_fd, SHUT_RDWR);
+	}
+	
+	/* ok, found it... lock the new client queue and pass the client */
+	if (pass_client_to_worker(pick_next_worker(), c))
+		goto err;
+	
+	return c;
+	
+err:
+	close(c->fd);
+	inbound_connects_account(0, c->portaccount); /* something failed, remove this from accounts.. */
+	client_free(c);
+	return NULL;
+}
+
+/*
+ *	Put the packets which had not been through the dupecheck in the old
+ *	process in the incoming queue, through the UDP pseudo-worker which
+ *	the accept thread owns. The clients they came from are looked up by
+ *	fd, so that the packets are not echoed back to them.
+ */
+
+static void accept_liveupgrade_pbufs(struct client_t **by_fd, int by_fd_len)
+{
+	struct liveupgrade_batch_reader_t r;
+	struct liveupgrade_pbuf_t e;
+	struct client_t *origin;
+	const char *data;
+	int len, n = 0, ok = 0;
+	
+	/* The workers own the clients already, and may have closed and
+	 * freed some of them. Those are no longer on the client list, and
+	 * their packets are restored without an origin, so that a new
+	 * client at the same address does not get mistaken for it.
+	 */
+	if (by_fd)
+		clientlist_prune_by_fd(by_fd, by_fd_len);
+	
+	liveupgrade_batch_open(&r, LIVEUPGRADE_REC_PBUFS);
+	while (liveupgrade_batch_next(&r, &e, sizeof(e), &data, &len)) {
+		n++;
+		origin = (e.origin_fd >= 0 && e.origin_fd < by_fd_len) ? by_fd[e.origin_fd] : NULL;
+		if (incoming_restore(udp_worker, origin, data, len, e.flags) == 0)
+			ok++;
+	}
+	
+	/* make sure they get to the dupecheck, the flush may fail to lock */
+	while (udp_worker->pbuf_incoming_local) {
+		incoming_flush(udp_worker);
+		if (udp_worker->pbuf_incoming_local)
+			usleep(1000);
+	}
+	
+	if (n)
+		hlog(LOG_INFO, "Live upgrade: Restored %d of %d incoming packets", ok, n);
+}
+
+static void accept_liveupgrade_binary(void)
+{
+	const struct liveupgrade_client_t *rec = NULL;
+	struct client_t **by_fd = NULL;
+	struct client_t *c;
+	int by_fd_len = 0;
+	int accepted = 0;
+	
+	hlog(LOG_INFO, "Accept: Collecting live upgrade clients...");
+	
+	while ((rec = liveupgrade_next_client(rec))) {
+		c = accept_liveupgrade_binary_single(rec);
+		if (!c)
+			continue;
+		
+		accepted++;
+		
+		/* the worker owns the client now, the pointer is only compared */
+		if (rec->fd >= by_fd_len) {
+			int l = by_fd_len;
+			by_fd_len = rec->fd + 256;
+			by_fd = hrealloc(by_fd, sizeof(*by_fd) * by_fd_len);
+			memset(by_fd + l, 0, sizeof(*by_fd) * (by_fd_len - l));
+		}
+		by_fd[rec->fd] = c;
+	}
+	
+	accept_liveupgrade_pbufs(by_fd, by_fd_len);
+	
+	if (by_fd)
+		hfree(by_fd);
+	
+	liveupgrade_load_done(accepted);
+}
+
 /*
  *	Accept thread
  */
@@ -1386,8 +2248,11 @@ void accept_thread(void *asdf)
 	int listen_n = 0;
 	int poll_n = 0;
 	struct listen_t *l;
+	time_t next_rebalance = tick + 10;
+	int affinity_generation = 0;
 
 	pthreads_profiling_reset("accept");
+	thread_affinity_update(&affinity_generation, AFFINITY_ACCEPT, 0);
 	
 	sigemptyset(&sigs_to_block);
 	sigaddset(&sigs_to_block, SIGALRM);
@@ -1417,15 +2282,32 @@ void accept_thread(void *asdf)
 	udp_pseudoclient = pseudoclient_setup(81);
 	udp_pseudoclient->flags |= CLFLAGS_UDPSUBMIT;
 	
+	ratelimit_ip = ratelimit_alloc(ACCEPT_RATELIMIT_SETS);
+	ratelimit_net = ratelimit_alloc(ACCEPT_RATELIMIT_SETS);
+	
 	accept_reconfiguring = 1;
 	while (!accept_shutting_down) {
 		if (accept_reconfiguring) {
 			accept_reconfiguring = 0;
+			
+			/* the workers with SO_REUSEPORT sockets read the list */
+			if ((e = rwl_wrlock(&listen_rwlock))) {
+				hlog(LOG_CRIT, "accept_thread: Failed to wrlock listen_rwlock!");
+				exit(1);
+			}
+			
 			listen_n -= close_removed_listeners();
 			
 			/* start listening on the sockets */
 			listen_n += open_missing_listeners();
 			
+			accept_listeners_generation++;
+			
+			if ((e = rwl_wrunlock(&listen_rwlock))) {
+				hlog(LOG_CRIT, "accept_thread: Failed to wrunlock listen_rwlock!");
+				exit(1);
+			}
+			
 			if (listen_n < 1) {
 				hlog(LOG_CRIT, "Failed to listen on any ports.");
 				exit(2);
@@ -1492,10 +2374,24 @@ void accept_thread(void *asdf)
 			if (workers_running != workers_configured) {
 				uplink_stop();
 				dupecheck_stop();
+#ifdef USE_SSL
+				/* the handshake threads hold clients for the workers */
+				handshake_stop();
+#endif
 				workers_start();
 				dupecheck_start();
 				uplink_start();
 			}
+#ifdef USE_SSL
+			handshake_start();
+#endif
+			
+			/* the amount of workers may have changed, update steering */
+			pthread_mutex_lock(&reuseport_group_mt);
+			for (l = listen_list; (l); l = l->next)
+				if (l->reuseport == 2)
+					listener_steer_by_cpu(l);
+			pthread_mutex_unlock(&reuseport_group_mt);
 			
 			/*
 			 * generate UDP peer clients
@@ -1505,7 +2401,9 @@ void accept_thread(void *asdf)
 				peerip_clients_config();
 			
 			/* accept liveupgrade clients */
-			if (liveupgrade_status)
+			if (liveupgrade_loaded())
+				accept_liveupgrade_binary();
+			else if (liveupgrade_status)
 				accept_liveupgrade_accept();
 		} else if (accept_reconfigure_after_tick != 0 && accept_reconfigure_after_tick <= tick) {
 			hlog(LOG_INFO, "Trying to reconfigure listeners due to a previous failure");
@@ -1513,6 +2411,14 @@ void accept_thread(void *asdf)
 			accept_reconfigure_after_tick = 0;
 		}
 		
+		thread_affinity_update(&affinity_generation, AFFINITY_ACCEPT, 0);
+		
+		/* move clients from busy workers to less busy ones */
+		if (rebalance_interval > 0 && (tick >= next_rebalance || next_rebalance > tick + rebalance_interval)) {
+			next_rebalance = tick + rebalance_interval;
+			workers_rebalance();
+		}
+		
 		/* check for new connections */
 		e = poll(acceptpfd, poll_n, 200);
 		if (e == 0)
@@ -1541,12 +2447,25 @@ void accept_thread(void *asdf)
 	}
 	
 	if (accept_shutting_down == 2)
-		worker_shutdown_clients = cJSON_CreateArray();
+		liveupgrade_dump_start();
 	
 	hlog(LOG_DEBUG, "Accept thread shutting down listening sockets and worker threads...");
 	uplink_stop();
+	close_worker_listeners();
+	if ((e = rwl_wrlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_thread: Failed to wrlock listen_rwlock!");
+		exit(1);
+	}
 	close_listeners();
+	accept_listeners_generation++;
+	if ((e = rwl_wrunlock(&listen_rwlock))) {
+		hlog(LOG_CRIT, "accept_thread: Failed to wrunlock listen_rwlock!");
+		exit(1);
+	}
 	dupecheck_stop();
+#ifdef USE_SSL
+	handshake_stop();
+#endif
 	http_shutting_down = 1;
 	workers_stop(accept_shutting_down);
 	hfree(acceptpfd);
@@ -1559,9 +2478,35 @@ void accept_thread(void *asdf)
 	udp_pseudoclient = NULL;
 	
 	/* free up the pseudo-worker structure, after dupecheck is long dead */
+	if (accept_shutting_down == 2)
+		liveupgrade_dump_pbufs(udp_worker);
 	worker_free_buffers(udp_worker);
 	hfree(udp_worker);
 	udp_worker = NULL;
+	
+	/* the workers are gone, nobody accepts any more */
+	ratelimit_free(ratelimit_ip);
+	ratelimit_free(ratelimit_net);
+	ratelimit_ip = ratelimit_net = NULL;
+}
+
+/*
+ *	Map the listener id shown in status.json to the hash id stored
+ *	in the clients, for the client list API
+ */
+
+int accept_listener_hash_id(int id, int *listener_id)
+{
+	struct listen_t *l;
+	
+	for (l = listen_list; (l); l = l->next) {
+		if (l->id == id && !l->hidden) {
+			*listener_id = l->listener_id;
+			return 0;
+		}
+	}
+	
+	return -1;
 }
 
 /*
@@ -1571,6 +2516,7 @@ void accept_thread(void *asdf)
 int accept_listener_status(cJSON *listeners, cJSON *totals)
 {
 	int n = 0;
+	int i;
 	struct listen_t *l;
 	long total_clients = 0;
 	long total_connects = 0;
@@ -1592,6 +2538,8 @@ int accept_listener_status(cJSON *listeners, cJSON *totals)
 		cJSON_AddStringToObject(jl, "name", l->name);
 		cJSON_AddStringToObject(jl, "proto", (l->udp) ? "udp" : "tcp");
 		cJSON_AddStringToObject(jl, "addr", l->addr_s);
+		if (l->reuseport)
+			cJSON_AddStringToObject(jl, "accept", (l->reuseport == 2) ? "reuseportcpu" : "reuseport");
 		if (l->filter_s)
 			cJSON_AddStringToObject(jl, "filter", l->filter_s);
 		cJSON_AddNumberToObject(jl, "clients", l->portaccount->gauge);
@@ -1605,6 +2553,12 @@ int accept_listener_status(cJSON *listeners, cJSON *totals)
 		cJSON_AddNumberToObject(jl, "pkts_ign", l->portaccount->rxdrops);
 		cJSON_AddNumberToObject(jl, "pkts_dup", l->portaccount->rxdupes);
 		json_add_rxerrs(jl, "rx_errs", l->portaccount->rxerrs);
+		if (!l->udp) {
+			cJSON *jr = cJSON_CreateObject();
+			for (i = 0; i < ACCEPT_REJECT_COUNT; i++)
+				cJSON_AddNumberToObject(jr, accept_reject_labels[i], l->rejects[i]);
+			cJSON_AddItemToObject(jl, "rejects", jr);
+		}
 		cJSON_AddItemToArray(listeners, jl);
 		
 		if (!(l->udp)) {
@@ -1631,3 +2585,101 @@ int accept_listener_status(cJSON *listeners, cJSON *totals)
 	
 	return n;
 }
+
+/*
+ *	Per-listener metrics for the /metrics page
+ */
+
+static int accept_listener_labels(struct listen_t *l, char *buf, int size)
+{
+	int n;
+	
+	n = snprintf(buf, size, "listener=\"%d\",proto=\"%s\",", l->id, (l->udp) ? "udp" : "tcp");
+	metrics_label(buf + n, size - n, "name", l->name);
+	n += strlen(buf + n);
+	if (n < size - 1)
+		buf[n++] = ',';
+	metrics_label(buf + n, size - n, "addr", l->addr_s);
+	
+	return n + strlen(buf + n);
+}
+
+static void accept_listener_metric(struct metrics_t *m, const char *name, const char *type, const char *help, size_t offset)
+{
+	struct listen_t *l;
+	char labels[256];
+	
+	metrics_family(m, name, type, help);
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden)
+			continue;
+		accept_listener_labels(l, labels, sizeof(labels));
+		metrics_sample(m, name, labels, *(long long *)((char *)l->portaccount + offset));
+	}
+}
+
+void accept_listener_metrics(struct metrics_t *m)
+{
+	struct listen_t *l;
+	char labels[256];
+	int i, n;
+	
+	metrics_family(m, "aprsc_listener_clients", "gauge", "Clients connected to the listener");
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden)
+			continue;
+		accept_listener_labels(l, labels, sizeof(labels));
+		metrics_sample(m, "aprsc_listener_clients", labels, l->portaccount->gauge);
+	}
+	
+	metrics_family(m, "aprsc_listener_clients_max", "gauge", "Maximum number of clients allowed on the listener");
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden)
+			continue;
+		accept_listener_labels(l, labels, sizeof(labels));
+		metrics_sample(m, "aprsc_listener_clients_max", labels, l->clients_max);
+	}
+	
+	metrics_family(m, "aprsc_listener_connects_total", "counter", "Connections accepted on the listener");
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden)
+			continue;
+		accept_listener_labels(l, labels, sizeof(labels));
+		metrics_sample(m, "aprsc_listener_connects_total", labels, l->portaccount->counter);
+	}
+	
+	accept_listener_metric(m, "aprsc_listener_received_bytes_total", "counter", "Bytes received on the listener",
+		offsetof(struct portaccount_t, rxbytes));
+	accept_listener_metric(m, "aprsc_listener_sent_bytes_total", "counter", "Bytes sent on the listener",
+		offsetof(struct portaccount_t, txbytes));
+	accept_listener_metric(m, "aprsc_listener_received_packets_total", "counter", "APRS-IS packets received on the listener",
+		offsetof(struct portaccount_t, rxpackets));
+	accept_listener_metric(m, "aprsc_listener_sent_packets_total", "counter", "APRS-IS packets sent on the listener",
+		offsetof(struct portaccount_t, txpackets));
+	accept_listener_metric(m, "aprsc_listener_dropped_packets_total", "counter", "Received APRS-IS packets dropped due to an error",
+		offsetof(struct portaccount_t, rxdrops));
+	accept_listener_metric(m, "aprsc_listener_duplicate_packets_total", "counter", "Received APRS-IS packets dropped as duplicates",
+		offsetof(struct portaccount_t, rxdupes));
+	
+	metrics_family(m, "aprsc_listener_rx_errors_total", "counter", "Received APRS-IS packets dropped on the listener, by reason");
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden)
+			continue;
+		n = accept_listener_labels(l, labels, sizeof(labels));
+		for (i = 0; i < INERR_BUCKETS; i++) {
+			snprintf(labels + n, sizeof(labels) - n, ",reason=\"%s\"", inerr_labels[i]);
+			metrics_sample(m, "aprsc_listener_rx_errors_total", labels, l->portaccount->rxerrs[i]);
+		}
+	}
+	
+	metrics_family(m, "aprsc_listener_rejects_total", "counter", "Connections rejected on the listener, by reason");
+	for (l = listen_list; (l); l = l->next) {
+		if (l->corepeer || l->hidden || l->udp)
+			continue;
+		n = accept_listener_labels(l, labels, sizeof(labels));
+		for (i = 0; i < ACCEPT_REJECT_COUNT; i++) {
+			snprintf(labels + n, sizeof(labels) - n, ",reason=\"%s\"", accept_reject_labels[i]);
+			metrics_sample(m, "aprsc_listener_rejects_total", labels, l->rejects[i]);
+		}
+	}
+}
@@ -13,6 +13,23 @@
 
 #include "config.h"
 #include "cJSON.h"
+#include "worker.h"
+
+/*
+ *	Reasons for rejecting a new connection, counted per listener
+ */
+
+typedef enum {
+	ACCEPT_REJECT_SERVER_FULL,	/* MaxClients reached */
+	ACCEPT_REJECT_PORT_FULL,	/* listener's maxclients reached */
+	ACCEPT_REJECT_ACL,		/* denied by listener's ACL */
+	ACCEPT_REJECT_RATE_IP,		/* ConnectRateIP exceeded */
+	ACCEPT_REJECT_RATE_NET,		/* ConnectRateNet exceeded */
+	ACCEPT_REJECT_LOGIN_BUSY,	/* MaxLoginsPerWorker reached */
+	ACCEPT_REJECT_ALLOC,		/* client allocation failed */
+	ACCEPT_REJECT_SSL,		/* TLS setup failed */
+	ACCEPT_REJECT_COUNT
+} AcceptRejectEnum;
 
 /*
  *	The listen_t structure holds data for a currently open
@@ -33,7 +50,23 @@ struct listen_t {
 	int corepeer;
 	int hidden;
 	int ai_protocol;
+	int reuseport; /* 1: workers accept on their own SO_REUSEPORT sockets, 2: steered by CPU */
+	
+	/* bound address, for opening the per-worker SO_REUSEPORT sockets */
+	int ai_family;
+	int ai_socktype;
+	union sockaddr_u sa;
+	socklen_t sa_len;
 
+	long long rejects[ACCEPT_REJECT_COUNT]; /* rejected connections by reason */
+	
+	/* worker ids of the workers' SO_REUSEPORT sockets in the order of
+	 * the kernel's socket group, after our own socket at index 0;
+	 * protected by reuseport_group_mt
+	 */
+	int reuseport_workers[WORKERS_MAX];
+	int reuseport_workers_n;
+	
 	struct client_udp_t *udp;
 	struct portaccount_t *portaccount;
 	struct acl_t *acl;
@@ -56,6 +89,14 @@ extern struct worker_t *udp_worker;
 extern void accept_thread(void *asdf);
 
 extern int accept_listener_status(cJSON *listeners, cJSON *totals);
+extern int accept_listener_hash_id(int id, int *listener_id);
+
+struct metrics_t;
+extern void accept_listener_metrics(struct metrics_t *m);
+
+extern volatile int accept_listeners_generation;
+extern void accept_worker_listeners(struct worker_t *self);
+extern void accept_worker_listeners_close(struct worker_t *self);
 
 extern int connections_accepted;
 
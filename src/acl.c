@@ -13,6 +13,8 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "hmalloc.h"
 #include "acl.h"
@@ -20,6 +22,9 @@
 #include "hlog.h"
 #include "cfgfile.h"
 
+/* protects the reference counts of the shared, compiled ACLs */
+static pthread_mutex_t acl_refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  *	allocate an empty acl structure
  */
@@ -29,17 +34,37 @@ struct acl_t *acl_new(void)
 	struct acl_t *a;
 	
 	a = hmalloc(sizeof(struct acl_t));
+	memset(a, 0, sizeof(*a));
 	
 	a->entries4 = NULL;
 	a->entries6 = NULL;
+	a->refcount = 1;
 	
 	return a;
 }
 
+static void acl_tree_free(struct acl_node_t *n)
+{
+	if (!n)
+		return;
+	
+	acl_tree_free(n->child[0]);
+	acl_tree_free(n->child[1]);
+	hfree(n);
+}
+
 void acl_free(struct acl_t *acl)
 {
 	struct acl_e4_t *e4;
 	struct acl_e6_t *e6;
+	int refs;
+	
+	pthread_mutex_lock(&acl_refcount_mutex);
+	refs = --acl->refcount;
+	pthread_mutex_unlock(&acl_refcount_mutex);
+	
+	if (refs > 0)
+		return;
 	
 	while (acl->entries4) {
 		e4 = acl->entries4->next;
@@ -53,30 +78,24 @@ void acl_free(struct acl_t *acl)
 		acl->entries6 = e6;
 	}
 	
+	acl_tree_free(acl->tree4);
+	acl_tree_free(acl->tree6);
+	
 	hfree(acl);
 }
 
+/*
+ *	A loaded ACL is compiled and read-only, so it is not copied for each
+ *	listener, but shared with a reference count.
+ */
+
 struct acl_t *acl_dup(struct acl_t *acl)
 {
-	struct acl_e4_t *e4, *ne4;
-	struct acl_e6_t *e6, *ne6;
-	struct acl_t *a = acl_new();
+	pthread_mutex_lock(&acl_refcount_mutex);
+	acl->refcount++;
+	pthread_mutex_unlock(&acl_refcount_mutex);
 	
-	for (e4 = acl->entries4; (e4); e4 = e4->next) {
-		ne4 = hmalloc(sizeof(*ne4));
-		memcpy(ne4, e4, sizeof(*ne4));
-		ne4->next = a->entries4;
-		a->entries4 = ne4;
-	}
-	
-	for (e6 = acl->entries6; (e6); e6 = e6->next) {
-		ne6 = hmalloc(sizeof(*ne6));
-		memcpy(ne6, e6, sizeof(*ne6));
-		ne6->next = a->entries6;
-		a->entries6 = ne6;
-	}
-	
-	return a;
+	return acl;
 }
 
 /*
@@ -172,6 +191,7 @@ int acl_add(struct acl_t *acl, char *netspec, int allow)
 			e4->allow = allow;
 			
 			e4->addr = ntohl(sup->si.sin_addr.s_addr);
+			e4->prefixlen = prefixlen;
 			e4->mask = 0;
 			for (i = 0; i < prefixlen; i++) {
 				e4->mask = e4->mask >> 1;
@@ -188,6 +208,158 @@ int acl_add(struct acl_t *acl, char *netspec, int allow)
 	return 0;
 }
 
+/*
+ *	Radix tree: keys are up to 128 bits, in host byte order words
+ */
+
+static inline int acl_key_bit(const uint32_t *key, int i)
+{
+	return (key[i >> 5] >> (31 - (i & 31))) & 1;
+}
+
+/* number of leading bits which are the same in a and b, up to maxbits */
+static int acl_key_common(const uint32_t *a, const uint32_t *b, int maxbits)
+{
+	int i, n = 0;
+	uint32_t x;
+	
+	for (i = 0; i < 4 && n < maxbits; i++) {
+		x = a[i] ^ b[i];
+		if (x) {
+			while (!(x & 0x80000000)) {
+				x <<= 1;
+				n++;
+			}
+			break;
+		}
+		n += 32;
+	}
+	
+	return (n < maxbits) ? n : maxbits;
+}
+
+static struct acl_node_t *acl_node_new(struct acl_t *acl, const uint32_t *key, int bits, int allow)
+{
+	struct acl_node_t *n = hmalloc(sizeof(*n));
+	int i, s;
+	
+	memset(n, 0, sizeof(*n));
+	
+	/* only keep the prefix bits of the key */
+	for (i = 0; i < 4; i++) {
+		s = bits - i * 32;
+		if (s >= 32)
+			n->key[i] = key[i];
+		else if (s > 0)
+			n->key[i] = key[i] & (0xffffffffUL << (32 - s));
+	}
+	
+	n->bits = bits;
+	n->allow = allow;
+	acl->nodes++;
+	
+	return n;
+}
+
+/*
+ *	Insert a prefix in a tree. If the same prefix is already there,
+ *	the new rule replaces the old one.
+ */
+
+static void acl_tree_insert(struct acl_t *acl, struct acl_node_t **np, const uint32_t *key, int bits, int allow)
+{
+	struct acl_node_t *n, *nn, *branch;
+	int common;
+	
+	while ((n = *np)) {
+		common = acl_key_common(n->key, key, (n->bits < bits) ? n->bits : bits);
+		
+		if (common < n->bits) {
+			if (common == bits) {
+				/* the new prefix covers this node */
+				nn = acl_node_new(acl, key, bits, allow);
+				nn->child[acl_key_bit(n->key, bits)] = n;
+				*np = nn;
+				return;
+			}
+			
+			/* the prefixes differ at bit 'common': branch there */
+			branch = acl_node_new(acl, key, common, -1);
+			nn = acl_node_new(acl, key, bits, allow);
+			branch->child[acl_key_bit(n->key, common)] = n;
+			branch->child[acl_key_bit(key, common)] = nn;
+			*np = branch;
+			return;
+		}
+		
+		/* this node is a prefix of the new one, or the same */
+		if (n->bits == bits) {
+			n->allow = allow;
+			return;
+		}
+		
+		np = &n->child[acl_key_bit(key, n->bits)];
+	}
+	
+	*np = acl_node_new(acl, key, bits, allow);
+}
+
+/*
+ *	Longest prefix match: the rule of the most specific matching
+ *	prefix applies. Deny by default.
+ */
+
+static int acl_tree_lookup(const struct acl_node_t *n, const uint32_t *addr, int maxbits)
+{
+	int allow = 0;
+	
+	while (n) {
+		if (acl_key_common(n->key, addr, n->bits) < n->bits)
+			break;
+		
+		if (n->allow >= 0)
+			allow = n->allow;
+		
+		if (n->bits >= maxbits)
+			break;
+		
+		n = n->child[acl_key_bit(addr, n->bits)];
+	}
+	
+	return allow;
+}
+
+/*
+ *	Compile the entries to the radix trees. acl_add() prepends entries,
+ *	so they are in reverse file order here, and for identical prefixes
+ *	the rule which is first in the file ends up winning.
+ */
+
+void acl_compile(struct acl_t *acl)
+{
+	struct acl_e4_t *e4;
+	struct acl_e6_t *e6;
+	uint32_t key[4];
+	int i;
+	
+	acl_tree_free(acl->tree4);
+	acl_tree_free(acl->tree6);
+	acl->tree4 = acl->tree6 = NULL;
+	acl->nodes = 0;
+	
+	for (e4 = acl->entries4; (e4); e4 = e4->next) {
+		key[0] = e4->addr;
+		key[1] = key[2] = key[3] = 0;
+		acl_tree_insert(acl, &acl->tree4, key, e4->prefixlen, e4->allow);
+	}
+	
+	for (e6 = acl->entries6; (e6); e6 = e6->next) {
+		for (i = 0; i < 4; i++)
+			key[i] = ntohl(e6->addr[i]);
+		acl_tree_insert(acl, &acl->tree6, key, e6->prefixlen, e6->allow);
+	}
+}
+
 #define ACL_LINEBUF 1024
 
 struct acl_t *acl_load(char *s)
@@ -200,6 +372,8 @@ struct acl_t *acl_load(char *s)
 	int argc;
 	int failed = 0;
 	int line = 0;
+	int rules = 0;
+	struct timeval tv_start, tv_end;
 	
 	//hlog(LOG_DEBUG, "ACL: Loading ACL file \"%s\"", s);
 	
@@ -250,6 +424,8 @@ struct acl_t *acl_load(char *s)
 		if (acl_add(acl, argv[1], allow)) {
 			hlog(LOG_ERR, "ACL load failed: %s: invalid netspec on line %d: %s", s, line, argv[1]);
 			failed = 1;
+		} else {
+			rules++;
 		}
 	}
 	
@@ -263,54 +439,15 @@ struct acl_t *acl_load(char *s)
 		return NULL;
 	}
 	
-	return acl;
-}
-
-/*
- *	Match an IPv4 address agaist the ACL list
- */
- 
-static int acl_check_4(struct acl_t *acl, uint32_t addr)
-{
-	struct acl_e4_t *a = acl->entries4;
-	
-	while (a) {
-		if ((addr & a->mask) == a->addr)
-			return a->allow;
-		a = a->next;
-	}
-	
-	return 0;
-}
-
-/*
- *	Match an IPv6 address agaist the ACL list
- */
-
-static int acl_check_6(struct acl_t *acl, uint32_t addr[4])
-{
-	struct acl_e6_t *a = acl->entries6;
-	int i;
+	gettimeofday(&tv_start, NULL);
+	acl_compile(acl);
+	gettimeofday(&tv_end, NULL);
 	
-	//hlog(LOG_DEBUG, "acl_check_6");
-	
-	while (a) {
-		int fail = 0;
-		for (i = 0; i < 4 && !fail; i++) {
-			if ((addr[i] & a->mask[i]) != a->addr[i]) {
-				fail = 1;
-			}
-		}
-		
-		if (!fail) {
-			return a->allow;
-		}
-		
-		a = a->next;
-	}
+	hlog(LOG_DEBUG, "ACL: Loaded \"%s\": %d rules compiled to %d tree nodes in %ld us",
+		s, rules, acl->nodes,
+		(long)(tv_end.tv_sec - tv_start.tv_sec) * 1000000L + (long)(tv_end.tv_usec - tv_start.tv_usec));
 	
-	// Disallow by default
-	return 0;
+	return acl;
 }
 
 /*
@@ -320,6 +457,8 @@ static int acl_check_6(struct acl_t *acl, uint32_t addr[4])
 int acl_check(struct acl_t *acl, struct sockaddr *sa, int addr_len)
 {
 	union sockaddr_u su, *sup;
+	uint32_t key[4];
+	int i;
 	sup = (union sockaddr_u *)sa;
 	
 	/* When we're listening on [::] address, IPv4 connections will be
@@ -342,10 +481,17 @@ int acl_check(struct acl_t *acl, struct sockaddr *sa, int addr_len)
 #endif
 	
 	
-	if (sup->sa.sa_family == AF_INET)
-		return acl_check_4(acl, ntohl(sup->si.sin_addr.s_addr));
-	if (sup->sa.sa_family == AF_INET6)
-		return acl_check_6(acl, (uint32_t *)sup->si6.sin6_addr.s6_addr);
+	if (sup->sa.sa_family == AF_INET) {
+		key[0] = ntohl(sup->si.sin_addr.s_addr);
+		key[1] = key[2] = key[3] = 0;
+		return acl_tree_lookup(acl->tree4, key, 32);
+	}
+	if (sup->sa.sa_family == AF_INET6) {
+		memcpy(key, sup->si6.sin6_addr.s6_addr, sizeof(key));
+		for (i = 0; i < 4; i++)
+			key[i] = ntohl(key[i]);
+		return acl_tree_lookup(acl->tree6, key, 128);
+	}
 	
 	hlog(LOG_ERR, "acl_check failed: unknown address family or address length (family %d, length %d)", sup->sa.sa_family, addr_len);
 	
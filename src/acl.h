@@ -7,6 +7,7 @@
 struct acl_e4_t {
 	uint32_t addr;
 	uint32_t mask;
+	int prefixlen;
 	int allow;
 	struct acl_e4_t *next;
 };
@@ -19,9 +20,28 @@ struct acl_e6_t {
 	struct acl_e6_t *next;
 };
 
+/* A node of the compressed (path-compressed binary) radix tree.
+ * The key is kept in host byte order, IPv4 addresses in key[0].
+ */
+struct acl_node_t {
+	uint32_t key[4];
+	int bits;		/* prefix length of this node */
+	int allow;		/* -1: branching node without a rule, 0: deny, 1: allow */
+	struct acl_node_t *child[2];
+};
+
 struct acl_t {
 	struct acl_e4_t *entries4;
 	struct acl_e6_t *entries6;
+	
+	/* the entries compiled to longest-prefix-match trees by acl_compile(),
+	 * read-only after that and shared by all listeners using the acl
+	 */
+	struct acl_node_t *tree4;
+	struct acl_node_t *tree6;
+	int nodes;
+	
+	int refcount;
 };
 
 extern struct acl_t *acl_new(void);
@@ -29,6 +49,7 @@ extern void acl_free(struct acl_t *acl);
 extern struct acl_t *acl_dup(struct acl_t *acl);
 
 extern int acl_add(struct acl_t *acl, char *netspec, int allow);
+extern void acl_compile(struct acl_t *acl);
 
 extern struct acl_t *acl_load(char *s);
 
@@ -0,0 +1,223 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	CPU affinity of the threads.
+ *
+ *	The configuration lists a set of CPUs for each thread class. The
+ *	dupecheck, accept and http threads are pinned to the whole set,
+ *	worker threads are spread one per CPU over the listed CPUs in order,
+ *	so that each worker keeps its caches and its NUMA node.
+ *
+ *	Each thread applies the configuration to itself when it starts,
+ *	and checks for a changed configuration every now and then, so
+ *	that a reload can move threads around without restarting them.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "affinity.h"
+#include "hlog.h"
+
+const char *affinity_thread_names[AFFINITY_THREADS] = {
+	"worker",
+	"dupecheck",
+	"accept",
+	"http"
+};
+
+static struct cpu_affinity_t cpu_affinity[AFFINITY_THREADS];
+static int cpu_affinity_generation;
+static pthread_mutex_t cpu_affinity_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef CPU_SET
+/* the CPU set we were started with, threads return to it when unpinned */
+static cpu_set_t affinity_original;
+static int affinity_original_valid;
+#endif
+
+/*
+ *	Find a thread class by name
+ */
+
+int affinity_thread_class(const char *s)
+{
+	int i;
+
+	for (i = 0; i < AFFINITY_THREADS; i++)
+		if (strcasecmp(s, affinity_thread_names[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+/*
+ *	Parse a CPU list: "0-3,8,10-11"
+ */
+
+int affinity_parse(struct cpu_affinity_t *dest, const char *s)
+{
+	const char *p = s;
+	char *end;
+	long first, last, cpu;
+
+	dest->count = 0;
+
+	while (*p) {
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= 32768)
+			return -1;
+
+		last = first;
+		p = end;
+
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last >= 32768)
+				return -1;
+			p = end;
+		}
+
+		for (cpu = first; cpu <= last; cpu++) {
+			if (dest->count == AFFINITY_CPUS_MAX)
+				return -1;
+			dest->cpus[dest->count++] = cpu;
+		}
+
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return (dest->count > 0) ? 0 : -1;
+}
+
+/*
+ *	Install a new configuration, threads will pick it up when they
+ *	next check for it
+ */
+
+void affinity_install(struct cpu_affinity_t *new_affinity)
+{
+	pthread_mutex_lock(&cpu_affinity_mutex);
+
+#ifdef CPU_SET
+	/* this is first called from the main thread before any threads
+	 * have been pinned, so its mask is what we were given by the
+	 * administrator (or taskset)
+	 */
+	if (!affinity_original_valid) {
+		if (sched_getaffinity(0, sizeof(affinity_original), &affinity_original) == 0)
+			affinity_original_valid = 1;
+		else
+			hlog(LOG_ERR, "affinity: sched_getaffinity failed: %s", strerror(errno));
+	}
+#endif
+
+	if (memcmp(cpu_affinity, new_affinity, sizeof(cpu_affinity)) != 0) {
+		memcpy(cpu_affinity, new_affinity, sizeof(cpu_affinity));
+		cpu_affinity_generation++;
+	}
+
+	pthread_mutex_unlock(&cpu_affinity_mutex);
+}
+
+/*
+ *	Apply the configuration to the calling thread, if it has changed
+ *	since the generation given. Returns 0 if nothing was done,
+ *	1 if the thread was pinned to the configured CPUs, and -1 if it
+ *	was left to run on all of the CPUs.
+ */
+
+int thread_affinity_update(int *generation, int thread, int index)
+{
+#ifdef CPU_SET
+	struct cpu_affinity_t *a = &cpu_affinity[thread];
+	cpu_set_t set;
+	char cpus[64];
+	int pinned, e, i;
+	size_t l;
+
+	/* quick unlocked check, this is called often */
+	if (*generation == cpu_affinity_generation)
+		return 0;
+
+	pthread_mutex_lock(&cpu_affinity_mutex);
+
+	*generation = cpu_affinity_generation;
+	pinned = (a->count > 0);
+
+	CPU_ZERO(&set);
+	cpus[0] = 0;
+
+	if (!pinned) {
+		if (affinity_original_valid)
+			memcpy(&set, &affinity_original, sizeof(set));
+		else
+			for (i = 0; i < CPU_SETSIZE; i++)
+				CPU_SET(i, &set);
+		snprintf(cpus, sizeof(cpus), "all");
+	} else if (thread == AFFINITY_WORKER) {
+		CPU_SET(a->cpus[index % a->count], &set);
+		snprintf(cpus, sizeof(cpus), "%d", a->cpus[index % a->count]);
+	} else {
+		for (i = 0, l = 0; i < a->count; i++) {
+			if (a->cpus[i] < CPU_SETSIZE)
+				CPU_SET(a->cpus[i], &set);
+			if (l < sizeof(cpus) - 8)
+				l += snprintf(cpus + l, sizeof(cpus) - l, (i) ? ",%d" : "%d", a->cpus[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&cpu_affinity_mutex);
+
+	if ((e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+		hlog(LOG_ERR, "affinity: %s thread %d: could not set CPU affinity to %s: %s",
+			affinity_thread_names[thread], index, cpus, strerror(e));
+		return -1;
+	}
+
+	hlog(LOG_INFO, "affinity: %s thread %d: running on CPUs %s",
+		affinity_thread_names[thread], index, cpus);
+
+	return (pinned) ? 1 : -1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ *	Which NUMA node is the calling thread running on right now
+ */
+
+int thread_numa_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+#endif
+	return -1;
+}
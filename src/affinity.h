@@ -0,0 +1,41 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/* thread classes which can be pinned to CPUs with CPUAffinity */
+#define AFFINITY_WORKER		0
+#define AFFINITY_DUPECHECK	1
+#define AFFINITY_ACCEPT		2
+#define AFFINITY_HTTP		3
+#define AFFINITY_THREADS	4
+
+#define AFFINITY_CPUS_MAX	256	/* max CPUs listed for a thread class */
+
+/* highest NUMA node which gets node-local memory pools, others share
+ * the default pools
+ */
+#define NUMA_NODES_MAX		8
+
+struct cpu_affinity_t {
+	int count;			/* number of CPUs listed, 0: not pinned */
+	short cpus[AFFINITY_CPUS_MAX];
+};
+
+extern const char *affinity_thread_names[AFFINITY_THREADS];
+
+extern int affinity_thread_class(const char *s);
+extern int affinity_parse(struct cpu_affinity_t *dest, const char *s);
+extern void affinity_install(struct cpu_affinity_t *new_affinity);
+extern int thread_affinity_update(int *generation, int thread, int index);
+extern int thread_numa_node(void);
+
+#endif
@@ -12,6 +12,8 @@
 	" [-n <logname>] [-e <loglevel>] [-o <logdest>] [-r <logdir>]\n" \
 	" [-y (try config)] [-h (help)]\n"
 
+#define _GNU_SOURCE
+
 #include <pthread.h>
 #include <semaphore.h>
 
@@ -47,9 +49,12 @@
 
 #include "dupecheck.h"
 #include "filter.h"
+#include "parse_aprs.h"
 #include "historydb.h"
 #include "client_heard.h"
 #include "keyhash.h"
+#include "cellmalloc.h"
+#include "liveupgrade.h"
 
 #ifdef USE_POSIX_CAP
 #include <sys/capability.h>
@@ -224,17 +229,27 @@ int sighandler(int signum)
 /*
  *	A very Linux specific thing, as there the pthreads are a special variation
  *	of fork(), and per POSIX the profiling timers are not kept over fork()...
+ *	Also name the thread, so that top -H and perf can tell them apart.
  */
 void pthreads_profiling_reset(const char *name)
 {
 #ifdef __linux__ /* Very Linux-specific code.. */
 	int tid;
+	char tname[16]; /* including the NUL, the kernel limit */
+	
 	if (itv.it_interval.tv_usec || itv.it_interval.tv_sec) {
 	  setitimer(ITIMER_PROF, &itv, NULL);
 	}
 
 	tid = syscall(SYS_gettid);
 	hlog(LOG_DEBUG, "Thread %s: Linux ThreadId: %d", name, tid);
+	
+	snprintf(tname, sizeof(tname), "%s", name);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 12))
+	pthread_setname_np(pthread_self(), tname);
+#elif defined(PR_SET_NAME)
+	prctl(PR_SET_NAME, tname, 0, 0, 0);
+#endif
 #endif
 }
 
@@ -1081,7 +1096,7 @@ int main(int argc, char **argv)
 		hlog(LOG_INFO, "POSIX capabilities available: can bind low ports"); 
 	
 	hlog(LOG_INFO, "After configuration FileLimit is %d, MaxClients is %d, xpoll using %s",
-		fileno_limit, maxclients, xpoll_implementation);
+		fileno_limit, maxclients, xpoll_backend(NULL));
 	
 	/* validate maxclients vs fileno_limit, now when it's determined */
 	if (fileno_limit < maxclients + 50) {
@@ -1101,6 +1116,7 @@ int main(int argc, char **argv)
 	/* Early inits in single-thread mode */
 	keyhash_init();
 	filter_init();
+	parse_aprs_init();
 	pbuf_init();
 	dupecheck_init();
 	historydb_init();
@@ -1112,9 +1128,17 @@ int main(int argc, char **argv)
 
 	/* if live upgrading, load status file and database dumps */
 	if (liveupgrade_startup) {
-		dbload_all();
-		/* historydb must be loaded before applying filters, so do dbload_all first */
-		status_read_liveupgrade();
+		if (liveupgrade_load() == 0) {
+			historydb_load_liveupgrade();
+			dupecheck_load_liveupgrade();
+		} else {
+			/* An older version passed the clients and the historydb
+			 * in JSON files. historydb must be loaded before applying
+			 * filters, so do dbload_all first.
+			 */
+			dbload_all();
+			status_read_liveupgrade();
+		}
 	}
 	
 	pthread_attr_init(&pthr_attrs);
@@ -1122,6 +1146,9 @@ int main(int argc, char **argv)
 	   default of 10 MB is way too much...*/
 	pthread_attr_setstacksize(&pthr_attrs, 128*1024);
 
+	/* from now on, log lines are written by the logger thread */
+	hlog_async_start(&pthr_attrs);
+
 	/* start the time thread, which will update the current time */
 	if (pthread_create(&time_th, &pthr_attrs, (void *)time_thread, NULL))
 		perror("pthread_create failed for time_thread");
@@ -1168,6 +1195,9 @@ int main(int argc, char **argv)
 			historydb_cleanup();
 			filter_wx_cleanup();
 			filter_entrycall_cleanup();
+#ifndef _FOR_VALGRIND_
+			cellcompact_all();
+#endif
 		}
 		
 		if (version_tick < tick || version_tick > tick + 86500) {
@@ -1195,13 +1225,20 @@ int main(int argc, char **argv)
 	if ((e = pthread_join(time_th, NULL)))
 		hlog(LOG_ERR, "Could not pthread_join time_th: %s", strerror(e));
 	
+	/* write out what is left in the log buffers, and log directly
+	 * for the rest of the shutdown
+	 */
+	hlog_async_stop();
+	
 	if (dbdump_at_exit) {
 		dbdump_all();
 	}
 
 	if (liveupgrade_fired) {
-		hlog(LOG_INFO, "Live upgrade: Dumping state to files...");
-		if (dbdump_historydb() || status_dump_liveupgrade()) {
+		hlog(LOG_INFO, "Live upgrade: Dumping state...");
+		historydb_dump_liveupgrade();
+		dupecheck_dump_liveupgrade();
+		if (liveupgrade_dump_finish()) {
 			hlog(LOG_ERR, "Live upgrade: Dumps failed - cannot continue!");
 			return 1;
 		}
@@ -0,0 +1,519 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	Callsign list matcher.
+ *
+ *	A list of callsign patterns (exact callsigns, prefixes and fnmatch()
+ *	style globs with * ? and [...]) is compiled into a single DFA, so
+ *	that checking a callsign against the whole list takes one table
+ *	lookup per character, however long the list is.
+ *
+ *	The input bytes are first mapped to character classes: bytes which
+ *	are treated the same by every pattern share a class, which keeps
+ *	the transition table small. The DFA is built by the subset
+ *	construction from the positions within the patterns.
+ *
+ *	If the patterns use syntax which is not supported here
+ *	([:alpha:] classes and such), or the DFA would get too large, the
+ *	patterns are matched one by one with fnmatch() as before.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <sys/time.h>
+
+#include "callmatch.h"
+#include "hmalloc.h"
+#include "hlog.h"
+
+struct callmatch_tok_t {
+	int star;			/* matches any string, including an empty one */
+	uint8_t set[32];		/* bytes matched by a single character token */
+};
+
+struct callmatch_pattern_t {
+	char *pattern;
+	int flags;
+	int len;			/* number of tokens */
+	struct callmatch_tok_t *toks;
+};
+
+#define SET_BIT(set, b)		((set)[(b) >> 3] |= (1 << ((b) & 7)))
+#define HAS_BIT(set, b)		((set)[(b) >> 3] & (1 << ((b) & 7)))
+
+#define CALLMATCH_HASH_SIZE	(CALLMATCH_STATES_MAX * 4)
+
+struct callmatch_t *callmatch_alloc(const char *name)
+{
+	struct callmatch_t *m = hmalloc(sizeof(*m));
+
+	memset(m, 0, sizeof(*m));
+	m->name = name;
+
+	return m;
+}
+
+void callmatch_free(struct callmatch_t *m)
+{
+	int i;
+
+	if (!m)
+		return;
+
+	for (i = 0; i < m->pattern_count; i++) {
+		hfree(m->patterns[i].pattern);
+		if (m->patterns[i].toks)
+			hfree(m->patterns[i].toks);
+	}
+
+	if (m->patterns)
+		hfree(m->patterns);
+	if (m->trans)
+		hfree(m->trans);
+	if (m->accept)
+		hfree(m->accept);
+
+	hfree(m);
+}
+
+void callmatch_add(struct callmatch_t *m, const char *pattern, int flags)
+{
+	struct callmatch_pattern_t *p;
+
+	m->patterns = hrealloc(m->patterns, sizeof(*m->patterns) * (m->pattern_count + 1));
+	p = &m->patterns[m->pattern_count++];
+	memset(p, 0, sizeof(*p));
+	p->flags = flags;
+
+	/* a glob prefix is the same as a glob with a * in the end, which
+	 * is also what fnmatch() needs if we fall back to it
+	 */
+	if ((flags & CALLMATCH_PREFIX) && !(flags & CALLMATCH_LITERAL)) {
+		p->pattern = hmalloc(strlen(pattern) + 2);
+		sprintf(p->pattern, "%s*", pattern);
+	} else {
+		p->pattern = hstrdup(pattern);
+	}
+}
+
+void callmatch_add_list(struct callmatch_t *m, const char **patterns, int flags)
+{
+	int i;
+
+	for (i = 0; (patterns[i]); i++)
+		callmatch_add(m, patterns[i], flags);
+}
+
+/*
+ *	Parse a [...] bracket expression starting at s. Returns the length
+ *	of the expression, 0 if it is not terminated (and the [ is taken
+ *	literally, like fnmatch does), or -1 if it uses unsupported syntax.
+ *	When folding case, the characters and range ends are lowercased
+ *	first, as glibc fnmatch() does with FNM_CASEFOLD.
+ */
+
+static int callmatch_bracket(const unsigned char *s, uint8_t *set, int fold)
+{
+	const unsigned char *p = s + 1;
+	int negate = 0, first = 1;
+	int c, e, i;
+
+	if (*p == '!' || *p == '^') {
+		negate = 1;
+		p++;
+	}
+
+	while (*p) {
+		if (*p == ']' && !first)
+			break;
+		first = 0;
+
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+			return -1;
+
+		c = *p++;
+		if (c == '\\' && *p)
+			c = *p++;
+
+		if (*p == '-' && p[1] && p[1] != ']') {
+			p++;
+			e = *p++;
+			if (e == '\\' && *p)
+				e = *p++;
+			if (fold) {
+				c = tolower(c);
+				e = tolower(e);
+			}
+			for (i = c; i <= e; i++)
+				SET_BIT(set, i);
+		} else {
+			SET_BIT(set, (fold) ? tolower(c) : c);
+		}
+	}
+
+	if (*p != ']')
+		return 0;
+
+	if (negate)
+		for (i = 0; i < 32; i++)
+			set[i] = ~set[i];
+
+	return p + 1 - s;
+}
+
+/*
+ *	Split a pattern to tokens
+ */
+
+static int callmatch_parse(struct callmatch_pattern_t *p)
+{
+	const unsigned char *s = (const unsigned char *)p->pattern;
+	struct callmatch_tok_t *tok;
+	int n = 0, r, i;
+
+	p->toks = hmalloc(sizeof(*p->toks) * (strlen(p->pattern) + 1));
+
+	while (*s) {
+		tok = &p->toks[n];
+		memset(tok, 0, sizeof(*tok));
+
+		if (!(p->flags & CALLMATCH_LITERAL)) {
+			if (*s == '*') {
+				/* ** is the same as * */
+				if (n == 0 || !p->toks[n-1].star) {
+					tok->star = 1;
+					n++;
+				}
+				s++;
+				continue;
+			}
+
+			if (*s == '?') {
+				memset(tok->set, 0xff, sizeof(tok->set));
+				s++;
+				n++;
+				continue;
+			}
+
+			if (*s == '[') {
+				if ((r = callmatch_bracket(s, tok->set, p->flags & CALLMATCH_CASEFOLD)) < 0)
+					return -1;
+				if (r > 0) {
+					s += r;
+					goto fold;
+				}
+				memset(tok->set, 0, sizeof(tok->set));
+			}
+
+			if (*s == '\\' && s[1])
+				s++;
+		}
+
+		SET_BIT(tok->set, (p->flags & CALLMATCH_CASEFOLD) ? tolower(*s) : *s);
+		s++;
+
+fold:
+		if (p->flags & CALLMATCH_CASEFOLD) {
+			/* the set is in lowercase, a character matches
+			 * if its lowercase version is in the set
+			 */
+			uint8_t folded[32];
+
+			memset(folded, 0, sizeof(folded));
+			for (i = 0; i < 256; i++)
+				if (HAS_BIT(tok->set, tolower(i)))
+					SET_BIT(folded, i);
+			memcpy(tok->set, folded, sizeof(folded));
+		}
+		n++;
+	}
+
+	if ((p->flags & CALLMATCH_PREFIX) && (p->flags & CALLMATCH_LITERAL)
+	    && (n == 0 || !p->toks[n-1].star)) {
+		memset(&p->toks[n], 0, sizeof(p->toks[n]));
+		p->toks[n++].star = 1;
+	}
+
+	p->len = n;
+
+	return 0;
+}
+
+/*
+ *	DFA construction state
+ */
+
+struct callmatch_build_t {
+	struct callmatch_tok_t **pos_tok;	/* token at each position, NULL: end of pattern */
+	int positions;
+	int words;				/* uint64_t words per position set */
+	uint64_t *sets;				/* position set of each DFA state */
+	int sets_alloc;
+	int *hash;				/* position set hash to DFA state */
+};
+
+#define POS_SET(set, j)		((set)[(j) / 64] |= 1ULL << ((j) % 64))
+#define POS_HAS(set, j)		((set)[(j) / 64] & (1ULL << ((j) % 64)))
+
+/*
+ *	Find the DFA state for a set of positions, adding a new one if
+ *	needed. Returns -1 if there would be too many states.
+ */
+
+static int callmatch_state(struct callmatch_t *m, struct callmatch_build_t *bs, uint64_t *set)
+{
+	uint64_t hv = 14695981039346656037ULL;
+	int i, h;
+
+	/* a * can also match nothing, so the position after it is
+	 * reachable too
+	 */
+	for (i = 0; i < bs->positions; i++)
+		if (POS_HAS(set, i) && bs->pos_tok[i] && bs->pos_tok[i]->star)
+			POS_SET(set, i + 1);
+
+	for (i = 0; i < bs->words; i++)
+		hv = (hv ^ set[i]) * 1099511628211ULL;
+	h = hv % CALLMATCH_HASH_SIZE;
+
+	while (bs->hash[h] >= 0) {
+		if (memcmp(bs->sets + (size_t)bs->hash[h] * bs->words, set, sizeof(*set) * bs->words) == 0)
+			return bs->hash[h];
+		h = (h + 1) % CALLMATCH_HASH_SIZE;
+	}
+
+	if (m->states == CALLMATCH_STATES_MAX)
+		return -1;
+
+	if (m->states == bs->sets_alloc) {
+		bs->sets_alloc = (bs->sets_alloc) ? bs->sets_alloc * 2 : 64;
+		bs->sets = hrealloc(bs->sets, sizeof(*bs->sets) * bs->words * bs->sets_alloc);
+		m->trans = hrealloc(m->trans, sizeof(*m->trans) * m->classes * bs->sets_alloc);
+	}
+
+	memcpy(bs->sets + (size_t)m->states * bs->words, set, sizeof(*set) * bs->words);
+	bs->hash[h] = m->states;
+
+	return m->states++;
+}
+
+/*
+ *	Build the DFA
+ */
+
+static int callmatch_build(struct callmatch_t *m)
+{
+	struct callmatch_build_t bs;
+	uint64_t *cur, *from;
+	int newid[2][256];
+	uint8_t newclass[256], rep[256];
+	int i, j, k, s, b, next, in;
+	int ret = -1;
+
+	memset(&bs, 0, sizeof(bs));
+
+	for (i = 0; i < m->pattern_count; i++)
+		bs.positions += m->patterns[i].len + 1;
+
+	bs.pos_tok = hmalloc(sizeof(*bs.pos_tok) * (bs.positions + 1));
+	for (i = 0, j = 0; i < m->pattern_count; i++) {
+		for (k = 0; k < m->patterns[i].len; k++)
+			bs.pos_tok[j++] = &m->patterns[i].toks[k];
+		bs.pos_tok[j++] = NULL;
+	}
+
+	/* refine the character classes with every single-character token */
+	memset(m->class, 0, sizeof(m->class));
+	m->classes = 1;
+	for (j = 0; j < bs.positions; j++) {
+		if (!bs.pos_tok[j] || bs.pos_tok[j]->star)
+			continue;
+
+		memset(newid, 0xff, sizeof(newid));
+		next = 0;
+		for (b = 0; b < 256; b++) {
+			in = HAS_BIT(bs.pos_tok[j]->set, b) ? 1 : 0;
+			if (newid[in][m->class[b]] < 0)
+				newid[in][m->class[b]] = next++;
+			newclass[b] = newid[in][m->class[b]];
+		}
+		memcpy(m->class, newclass, sizeof(m->class));
+		m->classes = next;
+	}
+
+	for (b = 255; b >= 0; b--)
+		rep[m->class[b]] = b;
+
+	bs.words = (bs.positions + 63) / 64;
+	bs.hash = hmalloc(sizeof(*bs.hash) * CALLMATCH_HASH_SIZE);
+	memset(bs.hash, 0xff, sizeof(*bs.hash) * CALLMATCH_HASH_SIZE);
+	cur = hmalloc(sizeof(*cur) * bs.words);
+
+	/* state 0 is the empty set, from which there's no way to a match */
+	m->states = 0;
+	memset(cur, 0, sizeof(*cur) * bs.words);
+	callmatch_state(m, &bs, cur);
+
+	/* the start state has the first position of each pattern */
+	for (i = 0, j = 0; i < m->pattern_count; i++) {
+		POS_SET(cur, j);
+		j += m->patterns[i].len + 1;
+	}
+	m->start = callmatch_state(m, &bs, cur);
+
+	/* subset construction: states are added at the end, and handled
+	 * in order until no new ones appear
+	 */
+	for (s = 0; s < m->states; s++) {
+		for (k = 0; k < m->classes; k++) {
+			memset(cur, 0, sizeof(*cur) * bs.words);
+			from = bs.sets + (size_t)s * bs.words;
+
+			for (j = 0; j < bs.positions; j++) {
+				if (!POS_HAS(from, j) || !bs.pos_tok[j])
+					continue;
+				if (bs.pos_tok[j]->star)
+					POS_SET(cur, j);
+				else if (HAS_BIT(bs.pos_tok[j]->set, rep[k]))
+					POS_SET(cur, j + 1);
+			}
+
+			if ((next = callmatch_state(m, &bs, cur)) < 0)
+				goto out;
+
+			m->trans[s * m->classes + k] = next;
+		}
+	}
+
+	m->accept = hmalloc(m->states);
+	for (s = 0; s < m->states; s++) {
+		m->accept[s] = 0;
+		for (j = 0; j < bs.positions; j++)
+			if (!bs.pos_tok[j] && POS_HAS(bs.sets + (size_t)s * bs.words, j))
+				m->accept[s] = 1;
+	}
+
+	ret = 0;
+
+out:
+	hfree(bs.pos_tok);
+	hfree(bs.hash);
+	hfree(cur);
+	if (bs.sets)
+		hfree(bs.sets);
+
+	return ret;
+}
+
+/*
+ *	Compile the patterns added so far
+ */
+
+int callmatch_compile(struct callmatch_t *m)
+{
+	struct timeval tv_start, tv_end;
+	int i;
+
+	gettimeofday(&tv_start, NULL);
+
+	for (i = 0; i < m->pattern_count; i++) {
+		if (callmatch_parse(&m->patterns[i])) {
+			hlog(LOG_WARNING, "%s: pattern '%s' can not be compiled, matching with fnmatch",
+				m->name, m->patterns[i].pattern);
+			m->fallback = 1;
+			return -1;
+		}
+	}
+
+	if (callmatch_build(m)) {
+		hlog(LOG_WARNING, "%s: %d patterns need more than %d states, matching with fnmatch",
+			m->name, m->pattern_count, CALLMATCH_STATES_MAX);
+		if (m->trans) {
+			hfree(m->trans);
+			m->trans = NULL;
+		}
+		m->fallback = 1;
+		return -1;
+	}
+
+	gettimeofday(&tv_end, NULL);
+
+	hlog(LOG_INFO, "%s: %d patterns compiled to %d states and %d character classes in %ld us",
+		m->name, m->pattern_count, m->states, m->classes,
+		(long)(tv_end.tv_sec - tv_start.tv_sec) * 1000000 + (tv_end.tv_usec - tv_start.tv_usec));
+
+	return 0;
+}
+
+/*
+ *	Match the patterns one by one, if the DFA could not be built
+ */
+
+#define MAX_TEST_CALL_LEN 32
+
+static int callmatch_match_slow(struct callmatch_t *m, const char *call, int len)
+{
+	struct callmatch_pattern_t *p;
+	char ts[MAX_TEST_CALL_LEN+1];
+	int i, l;
+
+	if (len > MAX_TEST_CALL_LEN)
+		return 0; /* no match */
+
+	/* fnmatch requires having a null-terminated string */
+	memcpy(ts, call, len);
+	ts[len] = 0;
+
+	for (i = 0; i < m->pattern_count; i++) {
+		p = &m->patterns[i];
+		if (p->flags & CALLMATCH_LITERAL) {
+			l = strlen(p->pattern);
+			if ((p->flags & CALLMATCH_PREFIX) ? len < l : len != l)
+				continue;
+			if (((p->flags & CALLMATCH_CASEFOLD) ? strncasecmp(ts, p->pattern, l) : strncmp(ts, p->pattern, l)) == 0)
+				return 1;
+		} else if (fnmatch(p->pattern, ts, (p->flags & CALLMATCH_CASEFOLD) ? FNM_CASEFOLD : 0) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Does the callsign match any of the patterns
+ */
+
+int callmatch_match(struct callmatch_t *m, const char *call, int len)
+{
+	const unsigned char *p = (const unsigned char *)call;
+	const unsigned char *end = p + len;
+	int s;
+
+	if (!m)
+		return 0;
+
+	if (m->fallback)
+		return callmatch_match_slow(m, call, len);
+
+	s = m->start;
+	while (p < end && s) {
+		s = m->trans[s * m->classes + m->class[*p]];
+		p++;
+	}
+
+	return m->accept[s];
+}
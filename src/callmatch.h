@@ -0,0 +1,50 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef CALLMATCH_H
+#define CALLMATCH_H
+
+#include <stdint.h>
+
+/* pattern flags */
+#define CALLMATCH_CASEFOLD	1	/* case-insensitive, like FNM_CASEFOLD */
+#define CALLMATCH_PREFIX	2	/* match callsigns starting with the pattern */
+#define CALLMATCH_LITERAL	4	/* no glob characters in the pattern */
+
+#define CALLMATCH_STATES_MAX	8192	/* larger DFAs fall back to fnmatch() */
+
+struct callmatch_pattern_t;
+
+struct callmatch_t {
+	const char *name;		/* for logging */
+
+	/* patterns, as added */
+	struct callmatch_pattern_t *patterns;
+	int pattern_count;
+
+	/* the compiled DFA, read-only after callmatch_compile() */
+	int states;			/* 0 is the dead state */
+	int start;
+	int classes;			/* number of input character classes */
+	uint8_t class[256];		/* input byte to character class */
+	uint16_t *trans;		/* [state * classes + class] */
+	uint8_t *accept;		/* [state] */
+
+	int fallback;			/* could not compile, patterns are matched one by one */
+};
+
+extern struct callmatch_t *callmatch_alloc(const char *name);
+extern void callmatch_free(struct callmatch_t *m);
+extern void callmatch_add(struct callmatch_t *m, const char *pattern, int flags);
+extern void callmatch_add_list(struct callmatch_t *m, const char **patterns, int flags);
+extern int callmatch_compile(struct callmatch_t *m);
+extern int callmatch_match(struct callmatch_t *m, const char *call, int len);
+
+#endif
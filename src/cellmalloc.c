@@ -15,6 +15,10 @@
 #include <pthread.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "cellmalloc.h"
 #include "hmalloc.h"
@@ -28,17 +32,46 @@
 #ifndef _FOR_VALGRIND_
 struct cellhead;
 
+/*
+ *   Per-thread magazine: a small stack of cells cached by a single thread,
+ *   so that cellmalloc() and cellfree() usually do not need to take the
+ *   arena mutex at all. The magazine is refilled from, and drained back
+ *   to the arena in batches of CELLMAGAZINE_BATCH cells.
+ */
+
+#define CELLMAGAZINE_SIZE  32
+#define CELLMAGAZINE_BATCH (CELLMAGAZINE_SIZE/2)
+
+struct cellmagazine_t {
+	cellarena_t *ca;
+	int	count;		/* number of cells in the magazine */
+	long	hits;		/* hits/misses not yet summed to the arena counters */
+	long	misses;
+	void	*cells[CELLMAGAZINE_SIZE];
+};
+
 struct cellarena_t {
+	struct cellarena_t *next;	/* list of all arenas, for cellcompact_all() */
+
 	int	cellsize;
 	int	alignment;
 	int	increment; /* alignment overhead applied.. */
 	int	lifo_policy;
   	int	minfree;
 	int	use_mutex;
+	int	use_magazine;
+	int	use_hugepages;
+	int	use_compact;
+	int	hugetlb_failed;	/* explicit huge pages not available, do not retry */
+	int	numa_node;	/* new blocks are bound to this NUMA node, -1: no binding */
 
 	const char *arenaname;
 
 	pthread_mutex_t mutex;
+	pthread_key_t magazine_key;	/* per-thread struct cellmagazine_t */
+
+	long	magazine_hits;		/* summed from magazines, under mutex */
+	long	magazine_misses;
 
   	struct cellhead *free_head;
   	struct cellhead *free_tail;
@@ -47,10 +80,23 @@ struct cellarena_t {
 	int	 createsize;
 
 	int	 cellblocks_count;
+	int	 cellblocks_released;	/* blocks currently returned to the OS */
+	long	 cellblocks_freed;	/* total count of blocks returned to the OS */
+	long	 cellblocks_reused;	/* total count of released block slots taken back in use */
 #define CELLBLOCKS_MAX 200 /* track client cell allocator limit! */
 	char	*cellblocks[CELLBLOCKS_MAX];	/* ref as 'char pointer' for pointer arithmetics... */
+	char	 cellblocks_flags[CELLBLOCKS_MAX];
+#define CELLBLOCK_RELEASED 1	/* memory returned to the OS, slot can be reused */
+#define CELLBLOCK_HUGETLB  2	/* block is backed by explicit huge pages */
 };
 
+/* list of all arenas */
+static cellarena_t *cellarenas;
+static pthread_mutex_t cellarenas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* huge page size for aligning blocks, 2 MB on x86 */
+#define CELL_HUGEPAGE_SIZE (2*1024*1024)
+
 #define CELLHEAD_DEBUG 0
 
 struct cellhead {
@@ -60,6 +106,113 @@ struct cellhead {
 	struct cellhead *next;
 };
 
+static void cellmagazine_destroy(void *p);
+
+/* from linux/mempolicy.h: prefer the given node, fall back to others */
+#define CELL_MPOL_PREFERRED 1
+
+
+/*
+ * cellblock_mmap() -- map a new block of memory, backed with huge pages
+ * if the arena wants them. Explicit huge pages (MAP_HUGETLB) are tried
+ * first, since they need to be reserved by the admin, and if they're not
+ * available, the block is aligned to the huge page size and transparent
+ * huge pages are requested with madvise().
+ */
+
+#ifndef MAP_ANON
+#  define MAP_ANON 0
+#endif
+
+static char *cellblock_mmap(cellarena_t *ca, char *flags)
+{
+	char *cb;
+
+	*flags = 0;
+
+#ifdef MAP_HUGETLB
+	if (ca->use_hugepages && !ca->hugetlb_failed && (ca->createsize % CELL_HUGEPAGE_SIZE) == 0) {
+		cb = mmap( NULL, ca->createsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+		if (cb != NULL && cb != (char*)-1) {
+			*flags |= CELLBLOCK_HUGETLB;
+			return cb;
+		}
+
+		hlog(LOG_DEBUG, "cellmalloc: %s: explicit huge pages not available, using transparent ones", ca->arenaname);
+		ca->hugetlb_failed = 1;
+	}
+#endif
+
+#ifdef MADV_HUGEPAGE
+	if (ca->use_hugepages && (ca->createsize % CELL_HUGEPAGE_SIZE) == 0) {
+		/* map some extra, so that the block can be aligned to a huge page boundary */
+		char *m = mmap( NULL, ca->createsize + CELL_HUGEPAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		unsigned long head;
+
+		if (m == NULL || m == (char*)-1)
+			return NULL;
+
+		head = (CELL_HUGEPAGE_SIZE - ((unsigned long)m % CELL_HUGEPAGE_SIZE)) % CELL_HUGEPAGE_SIZE;
+		cb = m + head;
+
+		if (head)
+			munmap(m, head);
+		munmap(cb + ca->createsize, CELL_HUGEPAGE_SIZE - head);
+
+		if (madvise(cb, ca->createsize, MADV_HUGEPAGE))
+			hlog(LOG_DEBUG, "cellmalloc: %s: madvise(MADV_HUGEPAGE) failed: %s", ca->arenaname, strerror(errno));
+
+		return cb;
+	}
+#endif
+
+	cb = mmap( NULL, ca->createsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (cb == (char*)-1)
+		return NULL;
+
+	return cb;
+}
+
+/*
+ * cellblock_bind() -- ask the kernel to place the pages of a new block on
+ * the arena's NUMA node, before the free list setup touches them.
+ * Done with the raw system call, so that we don't need libnuma.
+ */
+
+static void cellblock_bind(cellarena_t *ca, char *cb)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	unsigned long mask;
+
+	if (ca->numa_node < 0 || ca->numa_node >= sizeof(mask) * 8 - 1)
+		return;
+
+	mask = 1UL << ca->numa_node;
+
+	if (syscall(SYS_mbind, cb, (unsigned long)ca->createsize, CELL_MPOL_PREFERRED, &mask, (unsigned long)sizeof(mask) * 8, 0) != 0)
+		hlog(LOG_DEBUG, "cellmalloc: %s: mbind to NUMA node %d failed: %s", ca->arenaname, ca->numa_node, strerror(errno));
+#endif
+}
+
+/*
+ * cellblock_release() -- return the memory of a block to the OS.
+ * The address space of normal blocks is kept reserved for reuse, so
+ * that the memory can just be touched again when needed. Explicit huge
+ * page blocks are unmapped, since they come from a limited pool.
+ * Only touches the memory, so it can be called without the mutex; the
+ * caller marks the slot released. Returns 1 if the block was unmapped.
+ */
+
+static int cellblock_release(cellarena_t *ca, char *cb, char flags)
+{
+#ifdef MADV_DONTNEED
+	if (!(flags & CELLBLOCK_HUGETLB) && madvise(cb, ca->createsize, MADV_DONTNEED) == 0)
+		return 0;
+#endif
+
+	munmap(cb, ca->createsize);
+	return 1;
+}
 
 /*
  * new_cellblock() -- must be called MUTEX PROTECTED
@@ -69,43 +222,72 @@ struct cellhead {
 int new_cellblock(cellarena_t *ca)
 {
 	int i;
-	char *cb;
+	int b;
+	char *cb = NULL;
+	char flags = 0;
+
+	/* Take a previously released block slot back in use, if there is one */
+	b = ca->cellblocks_count;
+	if (ca->cellblocks_released) {
+		for (i = 0; i < ca->cellblocks_count; i++) {
+			if (ca->cellblocks_flags[i] & CELLBLOCK_RELEASED) {
+				b = i;
+				break;
+			}
+		}
+	}
+
+	if (b >= CELLBLOCKS_MAX)
+		return -1;
 
+	if (b < ca->cellblocks_count && ca->cellblocks[b]) {
+		/* the address space is still there, pages will be faulted in again */
+		cb = ca->cellblocks[b];
+		flags = ca->cellblocks_flags[b] & ~CELLBLOCK_RELEASED;
+	} else {
 #ifdef MEMDEBUG /* External backing-store files, unique ones for each cellblock,
 		   which at Linux names memory blocks in  /proc/nnn/smaps "file"
 		   with this filename.. */
-	int fd;
-	char name[2048];
-
-	sprintf(name, "/tmp/.-%d-%s-%d.mmap", getpid(), ca->arenaname, ca->cellblocks_count );
-	unlink(name);
-	fd = open(name, O_RDWR|O_CREAT, 644);
-	unlink(name);
-	if (fd >= 0) {
-	  memset(name, 0, sizeof(name));
-	  i = 0;
-	  while (i < ca->createsize) {
-	    int rc = write(fd, name, sizeof(name));
-	    if (rc < 0) break;
-	    i += rc;
-	  }
-	}
+		int fd;
+		char name[2048];
+
+		sprintf(name, "/tmp/.-%d-%s-%d.mmap", getpid(), ca->arenaname, b );
+		unlink(name);
+		fd = open(name, O_RDWR|O_CREAT, 644);
+		unlink(name);
+		if (fd >= 0) {
+		  memset(name, 0, sizeof(name));
+		  i = 0;
+		  while (i < ca->createsize) {
+		    int rc = write(fd, name, sizeof(name));
+		    if (rc < 0) break;
+		    i += rc;
+		  }
+		}
 
-	cb = mmap( NULL, ca->createsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-	close(fd);
+		cb = mmap( NULL, ca->createsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (cb == (char*)-1)
+		  cb = NULL;
 #else
-
-#ifndef MAP_ANON
-#  define MAP_ANON 0
-#endif
-	cb = mmap( NULL, ca->createsize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+		cb = cellblock_mmap(ca, &flags);
+		if (cb)
+			cellblock_bind(ca, cb);
 #endif
-	if (cb == NULL || cb == (char*)-1)
+	}
+
+	if (cb == NULL)
 	  return -1;
 
-	if (ca->cellblocks_count >= CELLBLOCKS_MAX) return -1;
+	if (b < ca->cellblocks_count) {
+		ca->cellblocks_released--;
+		ca->cellblocks_reused++;
+	} else {
+		ca->cellblocks_count++;
+	}
 
-	ca->cellblocks[ca->cellblocks_count++] = cb;
+	ca->cellblocks[b] = cb;
+	ca->cellblocks_flags[b] = flags;
 
 	for (i = 0; i <= ca->createsize-ca->increment; i += ca->increment) {
 		struct cellhead *ch = (struct cellhead *)(cb + i); /* pointer arithmentic! */
@@ -146,6 +328,7 @@ cellarena_t *cellinit( const char *arenaname, const int cellsize, const int alig
 	memset(ca, 0, sizeof(*ca));
 
 	ca->arenaname = arenaname;
+	ca->numa_node = -1;
 
 #if CELLHEAD_DEBUG == 1
 	if (alignment < __alignof__(void*))
@@ -165,17 +348,35 @@ cellarena_t *cellinit( const char *arenaname, const int cellsize, const int alig
 	}
 	ca->lifo_policy =  policy & CELLMALLOC_POLICY_LIFO;
 	ca->use_mutex   = (policy & CELLMALLOC_POLICY_NOMUTEX) ? 0 : 1;
+	/* a magazine only helps to avoid the mutex, so it's useless without one */
+	ca->use_magazine = (ca->use_mutex && (policy & CELLMALLOC_POLICY_MAGAZINE)) ? 1 : 0;
+	ca->use_hugepages = (policy & CELLMALLOC_POLICY_HUGEPAGES) ? 1 : 0;
+	ca->use_compact = (policy & CELLMALLOC_POLICY_COMPACT) ? 1 : 0;
 
 	ca->createsize = createkb * 1024;
 
 	n = ca->createsize / ca->increment;
-	hlog( LOG_DEBUG, "cellinit: %-12s block size %4d kB, cells/block: %d, %s", arenaname, createkb, n, ca->use_mutex ? "mutex" : "no mutex" );
+	hlog( LOG_DEBUG, "cellinit: %-12s block size %4d kB, cells/block: %d, %s%s%s%s", arenaname, createkb, n,
+		ca->use_mutex ? "mutex" : "no mutex",
+		ca->use_magazine ? ", magazines" : "",
+		ca->use_hugepages ? ", huge pages" : "",
+		ca->use_compact ? ", compacting" : "" );
 
 	pthread_mutex_init(&ca->mutex, NULL);
 
+	if (ca->use_magazine && (n = pthread_key_create(&ca->magazine_key, cellmagazine_destroy))) {
+		hlog(LOG_ERR, "cellinit: %s: pthread_key_create failed, magazines disabled: %s", arenaname, strerror(n));
+		ca->use_magazine = 0;
+	}
+
 	while (ca->freecount < ca->minfree)
 		new_cellblock(ca); /* more until minfree is full */
 
+	pthread_mutex_lock(&cellarenas_mutex);
+	ca->next = cellarenas;
+	cellarenas = ca;
+	pthread_mutex_unlock(&cellarenas_mutex);
+
 #if CELLHEAD_DEBUG == 1
 	hlog(LOG_DEBUG, "cellinit()  cellhead=%p", ca);
 #endif
@@ -203,12 +404,203 @@ static struct cellhead *clientptr_to_cellhead(void *v)
 }
 
 
+/*
+ *  cellmallocmany_locked() -- pick cells off the free list,
+ *  must be called MUTEX PROTECTED
+ */
+
+static int cellmallocmany_locked(cellarena_t *ca, void **array, const int numcells)
+{
+	int count;
+	struct cellhead *ch;
+
+	for (count = 0; count < numcells; ++count) {
+
+		while (!ca->free_head ||
+		       ca->freecount < ca->minfree) {
+			/* Out of free cells ? alloc new set */
+			if (new_cellblock(ca)) {
+				/* Failed ! */
+				hlog(LOG_ERR, "cellmallocmany: failed to allocate new block!");
+				break;
+			}
+		}
+
+		/* Pick new one off the free-head ! */
+
+		ch = ca->free_head;
+
+		// hlog( LOG_DEBUG, "cellmallocmany(%d of %d); freecount %d; %p at %p",
+		//       count, numcells, ca->freecount, cellhead_to_clientptr(ch), ca );
+
+		if (!ch)
+		 	break;	// Should not happen...
+
+		ca->free_head = ch->next;
+		ch->next = NULL;
+
+		if (ca->free_head == NULL)
+			ca->free_tail = NULL;
+
+		array[count] = cellhead_to_clientptr(ch);
+
+		ca->freecount -= 1;
+
+	}
+
+	return count;
+}
+
+/*
+ *  cellfreemany_locked() -- put cells back on the free list,
+ *  must be called MUTEX PROTECTED
+ */
+
+static void cellfreemany_locked(cellarena_t *ca, void **array, const int numcells)
+{
+	int count;
+
+	for (count = 0; count < numcells; ++count) {
+
+	  struct cellhead *ch = clientptr_to_cellhead(array[count]);
+
+#if CELLHEAD_DEBUG == 1
+	  if (ch->ca != ca) {
+	    hlog(LOG_ERR, "cellfreemany(%p to %p) wrong cellhead->ca pointer %p", array[count], ca, ch->ca);
+	  }
+#endif
+
+	  // hlog(LOG_DEBUG, "cellfreemany() %p to %p", ch, ca);
+
+	  if (ca->lifo_policy) {
+	    /* Put the cell on free-head */
+	    ch->next = ca->free_head;
+	    ca->free_head = ch;
+
+	  } else {
+	    /* Put the cell on free-tail */
+	    if (ca->free_tail)
+	      ca->free_tail->next = ch;
+	    ca->free_tail = ch;
+	    if (!ca->free_head)
+	      ca->free_head = ch;
+	    ch->next = NULL;
+	  }
+
+	  ca->freecount += 1;
+
+	}
+}
+
+/*
+ *  cellmagazine_get() -- find (or create) the calling thread's
+ *  magazine for the arena
+ */
+
+static struct cellmagazine_t *cellmagazine_get(cellarena_t *ca)
+{
+	struct cellmagazine_t *mag = pthread_getspecific(ca->magazine_key);
+	int e;
+
+	if (mag)
+		return mag;
+
+	mag = hmalloc(sizeof(*mag));
+	memset(mag, 0, sizeof(*mag));
+	mag->ca = ca;
+
+	if ((e = pthread_setspecific(ca->magazine_key, mag))) {
+		hlog(LOG_ERR, "cellmagazine_get: %s: pthread_setspecific failed: %s", ca->arenaname, strerror(e));
+		hfree(mag);
+		return NULL;
+	}
+
+	return mag;
+}
+
+/*
+ *  cellmagazine_refill() and cellmagazine_drain() -- move a batch of cells
+ *  between the magazine and the arena, and sum up the hit/miss counters
+ *  while we have the mutex anyway
+ */
+
+static void cellmagazine_refill(cellarena_t *ca, struct cellmagazine_t *mag)
+{
+	int me;
+
+	if ((me = pthread_mutex_lock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellmagazine_refill: could not lock mutex: %s", strerror(me));
+		return;
+	}
+
+	mag->count += cellmallocmany_locked(ca, &mag->cells[mag->count], CELLMAGAZINE_BATCH);
+
+	ca->magazine_hits += mag->hits;
+	ca->magazine_misses += mag->misses;
+	mag->hits = mag->misses = 0;
+
+	if ((me = pthread_mutex_unlock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellmagazine_refill: could not unlock mutex: %s", strerror(me));
+	}
+}
+
+static void cellmagazine_drain(cellarena_t *ca, struct cellmagazine_t *mag, const int numcells)
+{
+	int me;
+
+	if ((me = pthread_mutex_lock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellmagazine_drain: could not lock mutex: %s", strerror(me));
+		return;
+	}
+
+	mag->count -= numcells;
+	cellfreemany_locked(ca, &mag->cells[mag->count], numcells);
+
+	ca->magazine_hits += mag->hits;
+	ca->magazine_misses += mag->misses;
+	mag->hits = mag->misses = 0;
+
+	if ((me = pthread_mutex_unlock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellmagazine_drain: could not unlock mutex: %s", strerror(me));
+	}
+}
+
+/*
+ *  cellmagazine_destroy() -- called by pthreads when a thread exits,
+ *  returns the cached cells to the arena
+ */
+
+static void cellmagazine_destroy(void *p)
+{
+	struct cellmagazine_t *mag = p;
+
+	cellmagazine_drain(mag->ca, mag, mag->count);
+	hfree(mag);
+}
+
 void *cellmalloc(cellarena_t *ca)
 {
 	void *cp;
 	struct cellhead *ch;
 	int me;
 
+	if (ca->use_magazine) {
+		struct cellmagazine_t *mag = cellmagazine_get(ca);
+		if (mag) {
+			if (mag->count) {
+				mag->hits++;
+			} else {
+				mag->misses++;
+				cellmagazine_refill(ca, mag);
+			}
+
+			if (mag->count)
+				return mag->cells[--mag->count];
+
+			return NULL; /* refill failed, out of memory */
+		}
+	}
+
 	if (ca->use_mutex) {
 		if ((me = pthread_mutex_lock(&ca->mutex))) {
 			hlog(LOG_ERR, "cellmalloc: could not lock mutex: %s", strerror(me));
@@ -256,7 +648,6 @@ void *cellmalloc(cellarena_t *ca)
 int   cellmallocmany(cellarena_t *ca, void **array, int numcells)
 {
 	int count;
-	struct cellhead *ch;
 	int me;
 
 	if (ca->use_mutex) {
@@ -266,39 +657,7 @@ int   cellmallocmany(cellarena_t *ca, void **array, int numcells)
 		}
 	}
 
-	for (count = 0; count < numcells; ++count) {
-
-		while (!ca->free_head ||
-		       ca->freecount < ca->minfree) {
-			/* Out of free cells ? alloc new set */
-			if (new_cellblock(ca)) {
-				/* Failed ! */
-				hlog(LOG_ERR, "cellmallocmany: failed to allocate new block!");
-				break;
-			}
-		}
-
-		/* Pick new one off the free-head ! */
-
-		ch = ca->free_head;
-
-		// hlog( LOG_DEBUG, "cellmallocmany(%d of %d); freecount %d; %p at %p",
-		//       count, numcells, ca->freecount, cellhead_to_clientptr(ch), ca );
-
-		if (!ch)
-		 	break;	// Should not happen...
-
-		ca->free_head = ch->next;
-		ch->next = NULL;
-
-		if (ca->free_head == NULL)
-			ca->free_tail = NULL;
-
-		array[count] = cellhead_to_clientptr(ch);
-
-		ca->freecount -= 1;
-
-	}
+	count = cellmallocmany_locked(ca, array, numcells);
 
 	if (ca->use_mutex) {
 		if ((me = pthread_mutex_unlock(&ca->mutex))) {
@@ -325,6 +684,17 @@ void  cellfree(cellarena_t *ca, void *p)
 
 	// hlog(LOG_DEBUG, "cellfree() %p to %p", p, ca);
 
+	if (ca->use_magazine) {
+		struct cellmagazine_t *mag = cellmagazine_get(ca);
+		if (mag) {
+			if (mag->count == CELLMAGAZINE_SIZE)
+				cellmagazine_drain(ca, mag, CELLMAGAZINE_BATCH);
+
+			mag->cells[mag->count++] = p;
+			return;
+		}
+	}
+
 	if (ca->use_mutex) {
 		if ((me = pthread_mutex_lock(&ca->mutex))) {
 			hlog(LOG_ERR, "cellfree: could not lock mutex: %s", strerror(me));
@@ -363,7 +733,6 @@ void  cellfree(cellarena_t *ca, void *p)
 
 void  cellfreemany(cellarena_t *ca, void **array, int numcells)
 {
-	int count;
 	int me;
 
 	if (ca->use_mutex) {
@@ -373,42 +742,233 @@ void  cellfreemany(cellarena_t *ca, void **array, int numcells)
 		}
 	}
 
-	for (count = 0; count < numcells; ++count) {
+	cellfreemany_locked(ca, array, numcells);
 
-	  struct cellhead *ch = clientptr_to_cellhead(array[count]);
+	if (ca->use_mutex) {
+		if ((me = pthread_mutex_unlock(&ca->mutex))) {
+			hlog(LOG_ERR, "cellfreemany: could not unlock mutex: %s", strerror(me));
+		}
+	}
+}
 
-#if CELLHEAD_DEBUG == 1
-	  if (ch->ca != ca) {
-	    hlog(LOG_ERR, "cellfreemany(%p to %p) wrong cellhead->ca pointer %p", array[count], ca, ch->ca);
-	  }
-#endif
+/*
+ *  cellcompact() -- find cell blocks which are completely free, remove
+ *  their cells from the free list, and return the memory to the OS.
+ *  One block's worth of free cells (and minfree) is kept around to avoid
+ *  thrashing. The rest of the free list is detached under the mutex,
+ *  walked and cleaned up without it, and spliced back in, so that the
+ *  other threads can keep allocating from the cells left on the arena
+ *  meanwhile. Arenas without a mutex need to be compacted by the thread
+ *  owning them.
+ */
 
-	  // hlog(LOG_DEBUG, "cellfreemany() %p to %p", ch, ca);
+static int cellblock_find(char **blocks, int createsize, int *order, int nblocks, char *p)
+{
+	int lo = 0, hi = nblocks - 1;
+
+	/* binary search the block index sorted by address */
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		char *cb = blocks[order[mid]];
+		if (p < cb)
+			hi = mid - 1;
+		else if (p >= cb + createsize)
+			lo = mid + 1;
+		else
+			return order[mid];
+	}
 
-	  if (ca->lifo_policy) {
-	    /* Put the cell on free-head */
-	    ch->next = ca->free_head;
-	    ca->free_head = ch;
+	return -1;
+}
 
-	  } else {
-	    /* Put the cell on free-tail */
-	    if (ca->free_tail)
-	      ca->free_tail->next = ch;
-	    ca->free_tail = ch;
-	    if (!ca->free_head)
-	      ca->free_head = ch;
-	    ch->next = NULL;
-	  }
+static int cellcompact_lock(cellarena_t *ca)
+{
+	int me;
 
-	  ca->freecount += 1;
+	if (ca->use_mutex && (me = pthread_mutex_lock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellcompact: could not lock mutex: %s", strerror(me));
+		return -1;
+	}
 
+	return 0;
+}
+
+static void cellcompact_unlock(cellarena_t *ca)
+{
+	int me;
+
+	if (ca->use_mutex && (me = pthread_mutex_unlock(&ca->mutex))) {
+		hlog(LOG_ERR, "cellcompact: could not unlock mutex: %s", strerror(me));
 	}
+}
 
-	if (ca->use_mutex) {
-		if ((me = pthread_mutex_unlock(&ca->mutex))) {
-			hlog(LOG_ERR, "cellfreemany: could not unlock mutex: %s", strerror(me));
+int cellcompact(cellarena_t *ca)
+{
+	char *blocks[CELLBLOCKS_MAX];
+	char flags[CELLBLOCKS_MAX];
+	int order[CELLBLOCKS_MAX];
+	int freecells[CELLBLOCKS_MAX];
+	int unmapped[CELLBLOCKS_MAX];
+	int nslots, nblocks = 0;
+	int cells_per_block = ca->createsize / ca->increment;
+	int keep, kept = 0, detached, released = 0;
+	int b, i;
+	struct cellhead *ch, *last = NULL, *head, *tail, **prevp;
+
+	if (!ca->use_compact)
+		return 0;
+
+	if (cellcompact_lock(ca))
+		return 0;
+
+	/* quick check: there needs to be a full block's worth of free cells,
+	 * in addition to the block we keep around
+	 */
+	if (ca->freecount < ca->minfree + 2 * cells_per_block) {
+		cellcompact_unlock(ca);
+		return 0;
+	}
+
+	/* leave the cells we keep on the arena, and detach the rest */
+	keep = ca->minfree + cells_per_block;
+	for (ch = ca->free_head; (ch) && kept < keep; ch = ch->next) {
+		last = ch;
+		kept++;
+	}
+
+	if (!ch || !last) {
+		cellcompact_unlock(ca);
+		return 0;
+	}
+
+	head = ch;
+	detached = ca->freecount - kept;
+	last->next = NULL;
+	ca->free_tail = last;
+	ca->freecount = kept;
+
+	/* take a copy of the slots, new_cellblock() may fill in released
+	 * ones while we do not hold the mutex
+	 */
+	nslots = ca->cellblocks_count;
+	memcpy(blocks, ca->cellblocks, nslots * sizeof(blocks[0]));
+	memcpy(flags, ca->cellblocks_flags, nslots * sizeof(flags[0]));
+
+	cellcompact_unlock(ca);
+
+	/* index the blocks in address order, a simple insertion sort will do */
+	for (b = 0; b < nslots; b++) {
+		freecells[b] = 0;
+		if (flags[b] & CELLBLOCK_RELEASED)
+			continue;
+		for (i = nblocks; i > 0 && blocks[order[i-1]] > blocks[b]; i--)
+			order[i] = order[i-1];
+		order[i] = b;
+		nblocks++;
+	}
+
+	/* count the detached free cells in each block */
+	for (ch = head; (ch); ch = ch->next) {
+		b = cellblock_find(blocks, ca->createsize, order, nblocks, (char *)ch);
+		if (b >= 0)
+			freecells[b]++;
+		tail = ch;
+	}
+
+	/* pick the blocks to release, mark them with a negative count */
+	for (b = 0; b < nslots; b++) {
+		if (freecells[b] == cells_per_block) {
+			freecells[b] = -1;
+			released++;
+		}
+	}
+
+	if (released) {
+		/* drop the cells of the released blocks from the detached list */
+		tail = NULL;
+		prevp = &head;
+		for (ch = head; (ch); ch = ch->next) {
+			b = cellblock_find(blocks, ca->createsize, order, nblocks, (char *)ch);
+			if (b >= 0 && freecells[b] < 0) {
+				detached--;
+				continue;
+			}
+			*prevp = ch;
+			prevp = &ch->next;
+			tail = ch;
+		}
+		*prevp = NULL;
+
+		for (b = 0; b < nslots; b++) {
+			if (freecells[b] < 0)
+				unmapped[b] = cellblock_release(ca, blocks[b], flags[b]);
+		}
+	}
+
+	if (cellcompact_lock(ca)) {
+		/* cannot happen with a working mutex, and the cells are lost */
+		return released;
+	}
+
+	for (b = 0; b < nslots; b++) {
+		if (freecells[b] >= 0)
+			continue;
+		if (unmapped[b]) {
+			ca->cellblocks[b] = NULL;
+			ca->cellblocks_flags[b] = CELLBLOCK_RELEASED;
+		} else {
+			ca->cellblocks_flags[b] |= CELLBLOCK_RELEASED;
 		}
+		ca->cellblocks_released++;
+		ca->cellblocks_freed++;
+	}
+
+	/* splice the remaining cells back in at the head */
+	if (head) {
+		tail->next = ca->free_head;
+		if (!ca->free_head)
+			ca->free_tail = tail;
+		ca->free_head = head;
+		ca->freecount += detached;
 	}
+
+	if (released)
+		hlog(LOG_DEBUG, "cellcompact: %s: released %d blocks (%d kB), %d/%d blocks in use",
+			ca->arenaname, released, released * ca->createsize / 1024,
+			ca->cellblocks_count - ca->cellblocks_released, ca->cellblocks_count);
+
+	cellcompact_unlock(ca);
+
+	return released;
+}
+
+/*
+ *  cellcompact_all() -- compact all arenas which have a mutex,
+ *  called periodically by the housekeeping thread
+ */
+
+void cellcompact_all(void)
+{
+	cellarena_t *ca;
+
+	pthread_mutex_lock(&cellarenas_mutex);
+	for (ca = cellarenas; (ca); ca = ca->next) {
+		if (ca->use_compact && ca->use_mutex) {
+			pthread_mutex_unlock(&cellarenas_mutex);
+			cellcompact(ca);
+			pthread_mutex_lock(&cellarenas_mutex);
+		}
+	}
+	pthread_mutex_unlock(&cellarenas_mutex);
+}
+
+/*
+ *  cellnumanode() -- bind the blocks allocated from now on to a NUMA node
+ */
+
+void  cellnumanode(cellarena_t *cellarena, int node)
+{
+	cellarena->numa_node = node;
 }
 
 void  cellstatus(cellarena_t *cellarena, struct cellstatus_t *status)
@@ -421,10 +981,16 @@ void  cellstatus(cellarena_t *cellarena, struct cellstatus_t *status)
 	status->cellsize_aligned = cellarena->increment;
 	status->alignment = cellarena->alignment;
 	status->freecount = cellarena->freecount;
-	status->cellcount = (cellarena->createsize / cellarena->increment) * cellarena->cellblocks_count;
-	status->blocks = cellarena->cellblocks_count;
+	status->cellcount = (cellarena->createsize / cellarena->increment) * (cellarena->cellblocks_count - cellarena->cellblocks_released);
+	status->blocks = cellarena->cellblocks_count - cellarena->cellblocks_released;
 	status->blocks_max = CELLBLOCKS_MAX;
 	status->block_size = cellarena->createsize;
+	/* magazine counters lag a bit, they're summed up on refill and drain */
+	status->magazine_hits = cellarena->magazine_hits;
+	status->magazine_misses = cellarena->magazine_misses;
+	status->blocks_released = cellarena->cellblocks_released;
+	status->blocks_freed = cellarena->cellblocks_freed;
+	status->blocks_reused = cellarena->cellblocks_reused;
 	/* and this:
 	if (ca->use_mutex)
 		pthread_mutex_unlock(&ca->mutex);
@@ -432,4 +998,3 @@ void  cellstatus(cellarena_t *cellarena, struct cellstatus_t *status)
 }
 
 #endif /* (NOT) _FOR_VALGRIND_ */
-
@@ -26,6 +26,11 @@ struct cellstatus_t {
 	int blocks;
 	int blocks_max;
 	int block_size;
+	long magazine_hits;	/* cellmalloc() served from the per-thread magazine */
+	long magazine_misses;	/* magazine was empty, refilled from the arena */
+	int blocks_released;	/* blocks currently returned to the OS */
+	long blocks_freed;	/* total number of blocks returned to the OS */
+	long blocks_reused;	/* total number of released blocks taken back in use */
 };
 
 typedef struct cellarena_t cellarena_t;
@@ -35,12 +40,18 @@ extern cellarena_t *cellinit(const char *arenaname, const int cellsize, const in
 #define CELLMALLOC_POLICY_FIFO    0
 #define CELLMALLOC_POLICY_LIFO    1
 #define CELLMALLOC_POLICY_NOMUTEX 2
+#define CELLMALLOC_POLICY_MAGAZINE 4 /* per-thread cell caches, avoid the mutex on most calls */
+#define CELLMALLOC_POLICY_HUGEPAGES 8 /* back blocks with explicit or transparent huge pages */
+#define CELLMALLOC_POLICY_COMPACT  16 /* return fully free blocks to the OS in cellcompact() */
 
 extern void *cellmalloc(cellarena_t *cellarena);
 extern int   cellmallocmany(cellarena_t *cellarena, void **array, const int numcells);
 extern void  cellfree(cellarena_t *cellarena, void *p);
 extern void  cellfreemany(cellarena_t *cellarena, void **array, const int numcells);
 extern void  cellstatus(cellarena_t *cellarena, struct cellstatus_t *status);
+extern void  cellnumanode(cellarena_t *cellarena, int node);
+extern int   cellcompact(cellarena_t *cellarena);
+extern void  cellcompact_all(void);
 
 #endif
 #else /* _FOR_VALGRIND_  .. normal malloc/free is better */
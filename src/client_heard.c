@@ -295,7 +295,7 @@ void client_heard_init(void)
 	client_heard_cells  = cellinit( "client_heard",
 				  sizeof(struct client_heard_t),
 				  __alignof__(struct client_heard_t),
-				  CELLMALLOC_POLICY_FIFO,
+				  CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_MAGAZINE,
 				  512 /* 512 KB at the time */, 0 /* minfree */ );
 	/* 512 KB arena size -> about 18k entries per single arena */
 #endif
@@ -345,6 +345,19 @@ int client_heard_json_load(struct client_t *c, cJSON *dump)
 	return i;
 }
 
+/*
+ *	Load a single heard list entry, from the binary live upgrade
+ *	handover. The last heard time is kept, tick is monotonic over
+ *	the upgrade.
+ */
+
+void client_heard_load(struct client_t *c, const char *call, int call_len, time_t last_heard)
+{
+	if (last_heard > tick)
+		last_heard = tick;
+	heard_list_update(c, (char *)call, call_len, last_heard, c->client_heard, &c->client_heard_count, "heard");
+}
+
 /*
  *	cellmalloc status
  */
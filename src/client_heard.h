@@ -26,6 +26,7 @@ extern void client_heard_init(void);
 
 extern struct cJSON *client_heard_json(struct client_heard_t **list);
 extern int client_heard_json_load(struct client_t *c, cJSON *dump);
+extern void client_heard_load(struct client_t *c, const char *call, int call_len, time_t last_heard);
 
 #ifndef _FOR_VALGRIND_
 extern void client_heard_cell_stats(struct cellstatus_t *cellst);
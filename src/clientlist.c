@@ -137,6 +137,39 @@ int clientlist_check_if_validated_client(char *username, int len)
 	return fd;
 }
 
+/*
+ *	Drop the clients which are no longer on the client list from a
+ *	table of clients indexed by fd. The pointers in the table are
+ *	only compared, never dereferenced, as the clients may be gone.
+ */
+
+void clientlist_prune_by_fd(struct client_t **by_fd, int by_fd_len)
+{
+	struct clientlist_t *cl;
+	char *found;
+	int i;
+	
+	found = hmalloc(by_fd_len);
+	memset(found, 0, by_fd_len);
+	
+	rwl_rdlock(&clientlist_lock);
+	
+	for (i = 0; i < CLIENTLIST_BUCKETS; i++) {
+		for (cl = clientlist[i]; cl; cl = cl->next) {
+			if (cl->fd >= 0 && cl->fd < by_fd_len && cl->client_id == (void *)by_fd[cl->fd])
+				found[cl->fd] = 1;
+		}
+	}
+	
+	rwl_rdunlock(&clientlist_lock);
+	
+	for (i = 0; i < by_fd_len; i++)
+		if (!found[i])
+			by_fd[i] = NULL;
+	
+	hfree(found);
+}
+
 /*
  *	Add a client to the client list
  */
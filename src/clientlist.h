@@ -14,6 +14,7 @@
 
 extern int clientlist_add(struct client_t *c);
 extern void clientlist_remove(struct client_t *c);
+extern void clientlist_prune_by_fd(struct client_t **by_fd, int by_fd_len);
 
 extern int clientlist_check_if_validated_client(char *username, int len);
 
@@ -33,6 +33,12 @@
 #include "filter.h"
 #include "parse_qc.h"
 #include "ssl.h"
+#include "affinity.h"
+#include "handshake.h"
+#include "callmatch.h"
+#include "incoming.h"
+#include "login.h"
+#include "parse_aprs.h"
 
 char def_cfgfile[] = "aprsc.conf";
 char def_webdir[] = "web";
@@ -68,6 +74,17 @@ char *new_fake_version;
 char **disallow_srccall_glob, **new_disallow_srccall_glob;
 char **disallow_login_glob, **new_disallow_login_glob;
 
+/* the disallowed callsign lists, compiled to matchers */
+struct callmatch_t *disallow_srccall_matcher;
+struct callmatch_t *disallow_login_matcher;
+struct callmatch_t *disallow_msg_dst_matcher;
+
+/* matchers replaced on the previous reload, the workers may have
+ * still been using them, so they are freed on the next one
+ */
+static struct callmatch_t *old_srccall_matcher;
+static struct callmatch_t *old_login_matcher;
+
 int listen_low_ports = 0; /* do we have any < 1024 ports set? need POSIX capabilities? */
 
 struct sockaddr_in uplink_bind_v4;
@@ -102,6 +119,7 @@ int fork_a_daemon;	/* fork a daemon */
 int dump_splay;	/* print splay tree information */
 
 int workers_configured =  2;	/* number of workers to run */
+int rebalance_interval  =  0;	/* how often to move clients between workers, 0: never */
 
 int expiry_interval    = 30;
 int stats_interval     = 1 * 60;
@@ -126,6 +144,15 @@ int quirks_mode           = 0;		/* enable quirks mode for all clients by default
 
 int maxclients = 500;			/* maximum number of clients */
 
+/* connection admission control, all disabled by default */
+struct connect_rate_t connect_rate_ip;	/* new connections per source address */
+struct connect_rate_t connect_rate_net;	/* new connections per /24 (IPv4) or /48 (IPv6) */
+int max_logins_per_worker = 0;		/* max clients in login state per worker */
+int defer_accept = 0;			/* TCP_DEFER_ACCEPT timeout, seconds */
+
+/* CPU affinity of the threads, installed by read_config */
+static struct cpu_affinity_t new_cpu_affinity[AFFINITY_THREADS];
+
 /* These two are not currently used. The fixed defines are in worker.h,
  * OBUF_SIZE and IBUF_SIZE.
  */
@@ -149,6 +176,9 @@ int do_peergroup(struct peerip_config_t **lq, int argc, char **argv);
 int do_uplink(struct uplink_config_t **lq, int argc, char **argv);
 int do_uplinkbind(void *new, int argc, char **argv);
 int do_logrotate(int *dest, int argc, char **argv);
+int do_connectrate(struct connect_rate_t *dest, int argc, char **argv);
+int do_cpuaffinity(struct cpu_affinity_t *dest, int argc, char **argv);
+int do_pollbackend(int *dest, int argc, char **argv);
 
 /*
  *	Configuration file commands
@@ -164,6 +194,11 @@ static struct cfgcmd cfg_cmds[] = {
 	{ "myemail",		_CFUNC_ do_string,	&new_myemail		},
 	{ "myadmin",		_CFUNC_ do_string,	&new_myadmin		},
 	{ "workerthreads",	_CFUNC_ do_int,		&workers_configured	},
+	{ "rebalanceinterval",	_CFUNC_ do_interval,	&rebalance_interval	},
+	{ "cpuaffinity",	_CFUNC_ do_cpuaffinity,	new_cpu_affinity	},
+	{ "pollbackend",	_CFUNC_ do_pollbackend,	&xpoll_backend_config	},
+	{ "pollevents",		_CFUNC_ do_int,		&xpoll_events		},
+	{ "tlshandshakethreads",	_CFUNC_ do_int,		&handshake_threads_configured	},
 	{ "statsinterval",	_CFUNC_ do_interval,	&stats_interval		},
 	{ "expiryinterval",	_CFUNC_ do_interval,	&expiry_interval	},
 	{ "lastpositioncache",	_CFUNC_ do_interval,	&lastposition_storetime	},
@@ -172,6 +207,10 @@ static struct cfgcmd cfg_cmds[] = {
 	{ "logintimeout",	_CFUNC_ do_interval,	&client_login_timeout	},
 	{ "filelimit",		_CFUNC_ do_int,		&new_fileno_limit	},
 	{ "maxclients",		_CFUNC_ do_int,		&maxclients		},
+	{ "connectrateip",	_CFUNC_ do_connectrate,	&connect_rate_ip	},
+	{ "connectratenet",	_CFUNC_ do_connectrate,	&connect_rate_net	},
+	{ "maxloginsperworker",	_CFUNC_ do_int,		&max_logins_per_worker	},
+	{ "deferaccept",	_CFUNC_ do_interval,	&defer_accept		},
 	{ "ibufsize",		_CFUNC_ do_int,		&ibuf_size		},
 	{ "obufsize",		_CFUNC_ do_int,		&obuf_size		},
 	{ "httpstatus",		_CFUNC_ do_httpstatus,	&new_http_bind		},
@@ -448,6 +487,42 @@ int do_interval(int *dest, int argc, char **argv)
 	return 0;
 }
 
+/*
+ *	Parse a connection rate limit: <connections> <interval>
+ *	A connection count of 0 disables the limit.
+ */
+
+int do_connectrate(struct connect_rate_t *dest, int argc, char **argv)
+{
+	int connections, interval;
+	
+	if (argc < 2)
+		return -1;
+	
+	connections = atoi(argv[1]);
+	if (connections <= 0) {
+		dest->connections = 0;
+		dest->interval = 0;
+		return 0;
+	}
+	
+	if (argc < 3) {
+		hlog(LOG_ERR, "%s: Missing interval after connection count %d", argv[0], connections);
+		return -1;
+	}
+	
+	interval = parse_interval(argv[2]);
+	if (interval <= 0 || connections > 100000 || interval > 86400) {
+		hlog(LOG_ERR, "%s: Invalid rate %s connections in %s", argv[0], argv[1], argv[2]);
+		return -1;
+	}
+	
+	dest->connections = connections;
+	dest->interval = interval;
+	
+	return 0;
+}
+
 /*
  *	Parse a peer definition directive
  *
@@ -1103,6 +1178,20 @@ int do_listen(struct listen_config_t **lq, int argc, char **argv)
 		} else if (strcasecmp(argv[i], "hidden") == 0) {
 			/* Hide the listener from status view */
 			l->hidden = 1;
+		} else if (strcasecmp(argv[i], "reuseport") == 0 || strcasecmp(argv[i], "reuseportcpu") == 0) {
+			/* Accept connections in the worker threads, on per-worker
+			 * SO_REUSEPORT sockets, instead of the accept thread
+			 */
+#ifdef SO_REUSEPORT
+			if (req.ai_socktype != SOCK_STREAM || req.ai_protocol != IPPROTO_TCP) {
+				hlog(LOG_ERR, "Listen: '%s' is only supported for TCP listeners, not valid for '%s'", argv[i], argv[1]);
+				free_listen_config(&l);
+				return -2;
+			}
+			l->reuseport = (strcasecmp(argv[i], "reuseportcpu") == 0) ? 2 : 1;
+#else
+			hlog(LOG_ERR, "Listen: '%s' is not supported on this platform (no SO_REUSEPORT), ignored for '%s'", argv[i], argv[1]);
+#endif
 		} else {
 			hlog(LOG_ERR, "Listen: Unknown argument '%s' for '%s'", argv[i], argv[1]);
 			free_listen_config(&l);
@@ -1189,6 +1278,69 @@ int do_httpupload(char *new, int argc, char **argv)
 	return do_http_listener("HTTPUpload", 1, argc, argv);
 }
 
+/*
+ *	CPU affinity: <thread class> <cpu list>
+ */
+
+int do_cpuaffinity(struct cpu_affinity_t *dest, int argc, char **argv)
+{
+	int thread;
+	
+	if (argc != 3) {
+		hlog(LOG_ERR, "CPUAffinity: Invalid number of arguments");
+		return -1;
+	}
+	
+	thread = affinity_thread_class(argv[1]);
+	if (thread < 0) {
+		hlog(LOG_ERR, "CPUAffinity: Unknown thread type '%s' (worker, dupecheck, accept or http)", argv[1]);
+		return -1;
+	}
+	
+	if (affinity_parse(&dest[thread], argv[2])) {
+		hlog(LOG_ERR, "CPUAffinity: Invalid CPU list '%s' for %s", argv[2], argv[1]);
+		dest[thread].count = 0;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/*
+ *	Poll backend of the worker threads: epoll, epoll_et or io_uring
+ */
+
+int do_pollbackend(int *dest, int argc, char **argv)
+{
+	if (argc != 2) {
+		hlog(LOG_ERR, "PollBackend: Invalid number of arguments");
+		return -1;
+	}
+	
+	if (strcasecmp(argv[1], "epoll") == 0 || strcasecmp(argv[1], "poll") == 0) {
+		*dest = XP_BACKEND_EPOLL;
+	} else if (strcasecmp(argv[1], "epoll_et") == 0) {
+#ifdef XP_USE_EPOLL
+		*dest = XP_BACKEND_EPOLL_ET;
+#else
+		hlog(LOG_ERR, "PollBackend: epoll support not compiled in, using %s", xpoll_implementation);
+		*dest = XP_BACKEND_EPOLL;
+#endif
+	} else if (strcasecmp(argv[1], "io_uring") == 0) {
+#ifdef XP_USE_URING
+		*dest = XP_BACKEND_URING;
+#else
+		hlog(LOG_ERR, "PollBackend: io_uring support not compiled in, using %s", xpoll_implementation);
+		*dest = XP_BACKEND_EPOLL;
+#endif
+	} else {
+		hlog(LOG_ERR, "PollBackend: Unknown backend '%s' (epoll, epoll_et or io_uring)", argv[1]);
+		return -1;
+	}
+	
+	return 0;
+}
+
 /*
  *	Log rotation config
  */
@@ -1260,6 +1412,44 @@ static int test_directory(const char *path)
 	return 0;
 }
 
+/*
+ *	Compile the static and configured lists of disallowed callsigns
+ *	to matchers, so that a callsign can be checked against a whole
+ *	list in a single pass
+ */
+
+static void compile_callmatchers(void)
+{
+	struct callmatch_t *m;
+	
+	callmatch_free(old_srccall_matcher);
+	callmatch_free(old_login_matcher);
+	
+	m = callmatch_alloc("DisallowSourceCall");
+	callmatch_add_list(m, disallow_srccalls, CALLMATCH_LITERAL | CALLMATCH_PREFIX);
+	if (disallow_srccall_glob)
+		callmatch_add_list(m, (const char **)disallow_srccall_glob, CALLMATCH_CASEFOLD);
+	callmatch_compile(m);
+	old_srccall_matcher = disallow_srccall_matcher;
+	disallow_srccall_matcher = m;
+	
+	m = callmatch_alloc("DisallowLoginCall");
+	callmatch_add_list(m, disallow_login_usernames, CALLMATCH_LITERAL | CALLMATCH_CASEFOLD);
+	if (disallow_login_glob)
+		callmatch_add_list(m, (const char **)disallow_login_glob, CALLMATCH_CASEFOLD);
+	callmatch_compile(m);
+	old_login_matcher = disallow_login_matcher;
+	disallow_login_matcher = m;
+	
+	/* the message recipient list is static */
+	if (!disallow_msg_dst_matcher) {
+		m = callmatch_alloc("Disallowed message recipients");
+		callmatch_add_list(m, disallow_msg_recipients, CALLMATCH_LITERAL);
+		callmatch_compile(m);
+		disallow_msg_dst_matcher = m;
+	}
+}
+
 /*
  *	Read configuration files, should add checks for this program's
  *	specific needs and obvious misconfigurations!
@@ -1419,6 +1609,8 @@ int read_config(void)
 		free_string_array(o);
 	}
 	
+	compile_callmatchers();
+	
 	/* validate uplink config: if there is a single 'multiro' connection
 	 * configured, all of the uplinks must be 'multiro'
 	 */
@@ -1444,11 +1636,28 @@ int read_config(void)
 	if (uplink_config_failed)
 		free_uplink_config(&new_uplink_config);
 	
+	/* the threads pick up the new affinity configuration themselves */
+	affinity_install(new_cpu_affinity);
+	memset(new_cpu_affinity, 0, sizeof(new_cpu_affinity));
+	
 	if (workers_configured < 1) {
 		hlog(LOG_WARNING, "Configured less than 1 worker threads. Using 1.");
-	} else if (workers_configured > 32) {
-		hlog(LOG_WARNING, "Configured more than 32 worker threads. Using 32.");
-		workers_configured = 32;
+	} else if (workers_configured > WORKERS_MAX) {
+		hlog(LOG_WARNING, "Configured more than %d worker threads. Using %d.", WORKERS_MAX, WORKERS_MAX);
+		workers_configured = WORKERS_MAX;
+	}
+	
+	if (handshake_threads_configured < 0) {
+		hlog(LOG_WARNING, "Configured less than 0 TLS handshake threads. Using 0.");
+		handshake_threads_configured = 0;
+	} else if (handshake_threads_configured > HANDSHAKE_THREADS_MAX) {
+		hlog(LOG_WARNING, "Configured more than %d TLS handshake threads. Using %d.", HANDSHAKE_THREADS_MAX, HANDSHAKE_THREADS_MAX);
+		handshake_threads_configured = HANDSHAKE_THREADS_MAX;
+	}
+	
+	if (xpoll_events < 1 || xpoll_events > XP_EVENTS_MAX) {
+		hlog(LOG_WARNING, "PollEvents %d is out of range (1 to %d). Using %d.", xpoll_events, XP_EVENTS_MAX, XP_EVENTS_DEFAULT);
+		xpoll_events = XP_EVENTS_DEFAULT;
 	}
 	
 	if (!listen_config_new) {
@@ -1548,5 +1757,13 @@ void free_config(void)
 		free_string_array(disallow_login_glob);
 		disallow_login_glob = NULL;
 	}
+	callmatch_free(old_srccall_matcher);
+	callmatch_free(disallow_srccall_matcher);
+	callmatch_free(old_login_matcher);
+	callmatch_free(disallow_login_matcher);
+	callmatch_free(disallow_msg_dst_matcher);
+	old_srccall_matcher = disallow_srccall_matcher = NULL;
+	old_login_matcher = disallow_login_matcher = NULL;
+	disallow_msg_dst_matcher = NULL;
 }
 
@@ -69,6 +69,7 @@ extern int dump_requests;	/* print requests */
 extern int dump_splay;		/* print splay tree information */
 
 extern int workers_configured;	/* number of workers to run */
+extern int rebalance_interval;	/* how often to move clients between workers */
 
 extern int stats_interval;
 extern int expiry_interval;
@@ -83,6 +84,16 @@ extern int ibuf_size;
 extern int new_fileno_limit;
 extern int maxclients;
 
+struct connect_rate_t {
+	int connections;	/* max new connections... */
+	int interval;		/* ...in this many seconds, 0: unlimited */
+};
+
+extern struct connect_rate_t connect_rate_ip;
+extern struct connect_rate_t connect_rate_net;
+extern int max_logins_per_worker;
+extern int defer_accept;
+
 extern int lastposition_storetime;
 extern int dupefilter_storetime;
 extern int heard_list_storetime;
@@ -107,6 +118,10 @@ extern char *fake_version;
 extern char **disallow_srccall_glob;
 extern char **disallow_login_glob;
 
+extern struct callmatch_t *disallow_srccall_matcher;
+extern struct callmatch_t *disallow_login_matcher;
+extern struct callmatch_t *disallow_msg_dst_matcher;
+
 extern char def_cfgfile[];
 extern char *cfgfile;
 extern char *pidfile;
@@ -147,6 +162,7 @@ struct listen_config_t {
 	const char *filters[LISTEN_MAX_FILTERS];		/* up to 10 filters, NULL when not defined */
 	
 	int client_flags;	/* cflags set for clients of this socket */
+	int reuseport;		/* 1: workers accept on their own SO_REUSEPORT sockets, 2: also steer by CPU */
 	
 	/* reconfiguration support flags */
 	int   changed;		/* configuration has changed */
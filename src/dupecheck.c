@@ -34,6 +34,8 @@
 #include "historydb.h"
 #include "http.h"
 #include "accept.h"
+#include "affinity.h"
+#include "liveupgrade.h"
 
 int dupecheck_shutting_down;
 int dupecheck_running;
@@ -43,10 +45,6 @@ long dupecheck_cellgauge;
 int pbuf_global_count;
 int pbuf_global_dupe_count;
 
-int pbuf_global_count_limit      =   5000; /* Real criteria is expirer..		 */
-int pbuf_global_dupe_count_limit =   100; /* .. but we set some minimum packet counts
-					     into the global pbuf queue anyway.  */
-
 long long dupecheck_outcount;  /* 64 bit counters for statistics */
 long long dupecheck_dupecount;
 long long dupecheck_dupetypes[DTYPE_MAX+1];
@@ -88,43 +86,112 @@ static int pbuf_seqnum_lag(const uint32_t seqnum, const uint32_t pbuf_seq)
 
 
 /*
- *	Global pbuf purger cleans out pbufs that are too old..
+ *	Find the highest lag of the output workers in both of the global
+ *	queues - the slowest worker's consumption epoch, or the position
+ *	of a client being migrated. The caller holds
+ *	the read lock, so that workers_start() and workers_stop() do not
+ *	modify the worker list at the same time.
  */
-static void global_pbuf_purger(const int all, int pbuf_lag, int pbuf_dupe_lag)
+static void pbuf_worker_lags(int *pbuf_lag, int *pbuf_dupe_lag)
 {
-	struct pbuf_t *pb, *pb2;
-	struct pbuf_t *freeset[2002];
-	int n, n1, n2, lag;
-	time_t lastage1 = 0, lastage2 = 0;
+	struct worker_t *w;
+	int c;
+	
+	*pbuf_lag = *pbuf_dupe_lag = -1;
+	
+	for (w = worker_threads; (w); w = w->next) {
+		c = pbuf_seqnum_lag(dupecheck_seqnum, w->last_pbuf_seqnum);
+		if (w->last_pbuf_seqnum == 0)
+			c = 2000000000;
+		if (c > *pbuf_lag)
+			*pbuf_lag = c;
+		c = pbuf_seqnum_lag(dupecheck_dupe_seqnum, w->last_pbuf_dupe_seqnum);
+		if (c > *pbuf_dupe_lag)
+			*pbuf_dupe_lag = c;
+	}
+	
+	/* A client being migrated between workers holds the old worker's
+	 * position, the new worker may need to replay packets from there.
+	 * Read after the workers' positions: the old worker pins before
+	 * advancing.
+	 */
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	__sync_synchronize();
+	if (worker_migration_inflight) {
+		c = pbuf_seqnum_lag(dupecheck_seqnum, worker_migration_pin);
+		if (c > *pbuf_lag)
+			*pbuf_lag = c;
+	}
+#endif
+}
 
-	time_t expire2 = tick - pbuf_global_dupe_expiration;
-	time_t expire1 = tick - pbuf_global_expiration;
+/*
+ *	Safety valve: if the oldest packet in a queue has been held for
+ *	longer than the configured expiration time, some worker has not
+ *	advanced for that long. Ask the lagging workers to skip ahead to
+ *	the tail of the queues, so that they don't hold on to the memory
+ *	forever. The worker does the skip itself, in process_outgoing().
+ *	The caller holds the read lock.
+ */
+static void pbuf_expire_lagging_workers(struct pbuf_t *oldest, const uint32_t seqnum, const int dupes)
+{
+	struct worker_t *w;
+	int lag;
+	
+	if (!oldest || oldest->t >= tick - ((dupes) ? pbuf_global_dupe_expiration : pbuf_global_expiration))
+		return;
+	
+	lag = pbuf_seqnum_lag(seqnum, oldest->seqnum);
+	
+	for (w = worker_threads; (w); w = w->next) {
+		if (w->pbuf_resync)
+			continue;
+		if (pbuf_seqnum_lag(seqnum, (dupes) ? w->last_pbuf_dupe_seqnum : w->last_pbuf_seqnum) >= lag) {
+			hlog(LOG_ERR, "global_pbuf_purger: worker %d has not processed %s for %d seconds, skipping it ahead",
+				w->id, (dupes) ? "dupes" : "packets", (int)(tick - oldest->t));
+			w->pbuf_resync = 1;
+		}
+	}
+}
 
-	if (all) {
-		pbuf_global_count_limit       = 0;
-		pbuf_global_dupe_count_limit  = 0;
-		expire1  = expire2       = tick+10;
+/*
+ *	Global pbuf purger frees the pbufs which all workers have already
+ *	processed. Each worker publishes the seqnum of the last pbuf it has
+ *	consumed (its consumption epoch), and everything before the slowest
+ *	worker's epoch can be freed right away. The last consumed pbuf is
+ *	kept, since the worker's queue cursor points to its next pointer,
+ *	and so is the tail of the queue, since the dupecheck thread appends
+ *	to it. Called on every round of the dupecheck thread, so the queues only
+ *	contain the packets which are still in flight.
+ *
+ *	The read lock is held for the whole purge: it keeps the worker list
+ *	stable while the lags are computed and while pbuf_free_many() hands
+ *	the pbufs back to the return queues of the workers which allocated
+ *	them.
+ */
+static void global_pbuf_purger(const int all)
+{
+	struct pbuf_t *pb, *pb2;
+	struct pbuf_t *freeset[2002];
+	int n, lag, e;
+	int pbuf_lag = -1, pbuf_dupe_lag = -1;
+	
+	if ((e = rwl_rdlock(&pbuf_global_rwlock))) {
+		hlog(LOG_CRIT, "dupecheck: Failed to rdlock pbuf_global_rwlock!");
+		exit(1);
 	}
+	
+	if (!all)
+		pbuf_worker_lags(&pbuf_lag, &pbuf_dupe_lag);
 
 	pb = pbuf_global;
-	if (pb)
-		lastage1 = pb->t;
 	n = 0;
-	n1 = 0;
-	while ( pbuf_global_count > pbuf_global_count_limit && pb ) {
-
-		lastage1 = pb->t;
-		if (pb->t >= expire1)
-			break; // stop at newer than expire1
-			
+	while (pb && (all || pb->next)) {
 		lag = pbuf_seqnum_lag(dupecheck_seqnum, pb->seqnum);
-		if (pbuf_lag >= lag) {
-			hlog(LOG_DEBUG, "global_pbuf_purger: stop at lag %d, dupecheck at %d, pb %d", lag, dupecheck_seqnum, pb->seqnum);
-			break; // some output-worker is lagging behind this item!
-		}
+		if (!all && pbuf_lag >= lag)
+			break; // some output-worker has not passed this item yet
 		
 		freeset[n++] = pb;
-		++n1;
 		--pbuf_global_count;
 		// dissociate the pbuf from the chain
 		pb2 = pb->next; pb->next = NULL; pb = pb2;
@@ -139,23 +206,13 @@ static void global_pbuf_purger(const int all, int pbuf_lag, int pbuf_dupe_lag)
 	}
 
 	pb = pbuf_global_dupe;
-	if (pb)
-		lastage2 = pb->t;
 	n = 0;
-	n2 = 0;
-	while ( pbuf_global_dupe_count > pbuf_global_dupe_count_limit && pb ) {
-
-		lastage2 = pb->t;
-		if (pb->t >= expire2)
-			break; // stop at newer than expire2
+	while (pb && (all || pb->next)) {
 		lag = pbuf_seqnum_lag(dupecheck_dupe_seqnum, pb->seqnum);
-		if (pbuf_dupe_lag >= lag) {
-			hlog(LOG_DEBUG, "global_pbuf_purger: dupe stop at lag %d, dupecheck at %d, pb %d", lag, dupecheck_seqnum, pb->seqnum);
-			break; // some output-worker is lagging behind this item!
-		}
+		if (!all && pbuf_dupe_lag >= lag)
+			break; // some output-worker has not passed this item yet
 		
 		freeset[n++] = pb;
-		++n2;
 		--pbuf_global_dupe_count;
 		// dissociate the pbuf from the chain
 		pb2 = pb->next; pb->next = NULL; pb = pb2;
@@ -168,37 +225,18 @@ static void global_pbuf_purger(const int all, int pbuf_lag, int pbuf_dupe_lag)
 	if (n > 0) {
 		pbuf_free_many(freeset, n);
 	}
-
-	// debug printout time...  map "undefined" lag values to zero.
-
-	//if (pbuf_lag      == 2000000000) pbuf_lag      = 0;
-	//if (pbuf_dupe_lag == 2000000000) pbuf_dupe_lag = 0;
-
-	if (lastage1 == 0) lastage1 = tick+2; // makes printout of "-2" (or "-1")
-	if (lastage2 == 0) lastage2 = tick+2;
 	
-	/*
-
-	static int show_zeros = 1;
-
-	if (show_zeros || n1 || n2 || pbuf_lag  || pbuf_dupe_lag) {
-		// report only when there is something to report...
-		hlog( LOG_DEBUG,
-		      "global_pbuf_purger()  freed %d/%d main pbufs, %d/%d dupe bufs, lags: %d/%d  Ages: %d/%d",
-		      n1, pbuf_global_count, n2, pbuf_global_dupe_count,
-		      pbuf_lag, pbuf_dupe_lag,
-		      (int)(tick-lastage1), (int)(tick-lastage2) );
-
-		if (!(n1 || n2 || pbuf_lag || pbuf_dupe_lag))
-			show_zeros = 0;
-		else
-			show_zeros = 1;
+	if (!all) {
+		pbuf_expire_lagging_workers(pbuf_global, dupecheck_seqnum, 0);
+		pbuf_expire_lagging_workers(pbuf_global_dupe, dupecheck_dupe_seqnum, 1);
+	}
+	
+	if ((e = rwl_rdunlock(&pbuf_global_rwlock))) {
+		hlog(LOG_CRIT, "dupecheck: Failed to rdunlock pbuf_global_rwlock!");
+		exit(1);
 	}
-	*/
 }
 
-
-
 /*
  *	The cellmalloc does not need internal MUTEX, it is being used in single thread..
  */
@@ -209,7 +247,7 @@ void dupecheck_init(void)
 	dupecheck_cells = cellinit( "dupecheck",
 				    sizeof(struct dupe_record_t),
 				    __alignof__(struct dupe_record_t),
-				    CELLMALLOC_POLICY_LIFO | CELLMALLOC_POLICY_NOMUTEX,
+				    CELLMALLOC_POLICY_LIFO | CELLMALLOC_POLICY_NOMUTEX | CELLMALLOC_POLICY_HUGEPAGES | CELLMALLOC_POLICY_COMPACT,
 				    2048 /* 2 MB at the time */,
 				    0 /* minfree */);
 #endif
@@ -268,6 +306,25 @@ static void dupecheck_db_free(struct dupe_record_t *dp)
 	--dupecheck_cellgauge;
 }
 
+/*
+ *	Return the local free chain to the cell arena, and let it
+ *	release completely free blocks back to the OS. The arena has no
+ *	mutex, so this must be done in the dupecheck thread.
+ */
+static void dupecheck_compact(void)
+{
+#ifndef _FOR_VALGRIND_
+	struct dupe_record_t *dp;
+	
+	while ((dp = dupecheck_free)) {
+		dupecheck_free = dp->next;
+		cellfree(dupecheck_cells, dp);
+	}
+	
+	cellcompact(dupecheck_cells);
+#endif
+}
+
 /*	The  dupecheck_cleanup() is for regular database cleanups,
  *	Call this about once a minute.
  *
@@ -692,9 +749,11 @@ static void dupecheck_thread(void)
 	struct pbuf_t *pb_out_dupe, **pb_out_dupe_prevp, *pb_out_dupe_last;
 	int n;
 	int e;
-	int c, d;
+	int d;
 	int pb_out_count, pb_out_dupe_count;
 	time_t cleanup_tick = tick;
+	time_t compact_tick = tick + 60;
+	int affinity_generation = 0;
 
 #ifndef USE_EVENTFD
 	struct timespec sleepspec;
@@ -703,6 +762,7 @@ static void dupecheck_thread(void)
 #endif
 	
 	pthreads_profiling_reset("dupecheck");
+	thread_affinity_update(&affinity_generation, AFFINITY_DUPECHECK, 0);
 
 	sigemptyset(&sigs_to_block);
 	sigaddset(&sigs_to_block, SIGALRM);
@@ -767,12 +827,14 @@ static void dupecheck_thread(void)
 			if (pb_out) {
 				*pbuf_global_prevp = pb_out;
 				pbuf_global_prevp  = pb_out_prevp;
+				pbuf_global_last_seqnum = pb_out_last->seqnum;
 				pbuf_global_count += pb_out_count;
 			}
 
 			if (pb_out_dupe) {
 				*pbuf_global_dupe_prevp = pb_out_dupe;
 				pbuf_global_dupe_prevp  = pb_out_dupe_prevp;
+				pbuf_global_dupe_last_seqnum = pb_out_dupe_last->seqnum;
 				pbuf_global_dupe_count += pb_out_dupe_count;
 			}
 			
@@ -785,44 +847,19 @@ static void dupecheck_thread(void)
 		dupecheck_outcount  += pb_out_count;
 		dupecheck_dupecount += pb_out_dupe_count;
 
+		/* free the packets which all workers have processed */
+		global_pbuf_purger(0);
+		
 		if (cleanup_tick <= tick) { // once in a (simulated) minute or so..
 			cleanup_tick = tick + 10;
 			
-			/*
-			if ((e = rwl_wrlock(&pbuf_global_rwlock))) {
-				hlog(LOG_CRIT, "dupecheck: Failed to wrlock pbuf_global_rwlock!");
-				exit(1);
-			}
-			*/
-			
-			/* walk through worker threads */
-			int worker_pbuf_lag;
-			int worker_pbuf_dupe_lag;
-			worker_pbuf_lag = worker_pbuf_dupe_lag = -1;
-			for (w = worker_threads; (w); w = w->next) {
-				/* Find the highest worker lag count after we have appended
-				 * the packets in the buffer.
-				 */
-				c = pbuf_seqnum_lag(dupecheck_seqnum, w->last_pbuf_seqnum);
-				if (w->last_pbuf_seqnum == 0)
-					c = 2000000000;
-				if (c > worker_pbuf_lag)
-					worker_pbuf_lag = c;
-				c = pbuf_seqnum_lag(dupecheck_dupe_seqnum, w->last_pbuf_dupe_seqnum);
-				if (c > worker_pbuf_dupe_lag)
-					worker_pbuf_dupe_lag = c;
-			}
-			
-			global_pbuf_purger(0, worker_pbuf_lag, worker_pbuf_dupe_lag);
+			dupecheck_cleanup();
+			thread_affinity_update(&affinity_generation, AFFINITY_DUPECHECK, 0);
 			
-			/*
-			if ((e = rwl_wrunlock(&pbuf_global_rwlock))) {
-				hlog(LOG_CRIT, "dupecheck: Failed to wrunlock pbuf_global_rwlock!");
-				exit(1);
+			if (compact_tick <= tick) {
+				compact_tick = tick + 60;
+				dupecheck_compact();
 			}
-			*/
-			
-			dupecheck_cleanup();
 		}
 
 		// if (n > 0)
@@ -914,7 +951,92 @@ void dupecheck_atend(void)
 		cellfree(dupecheck_cells, dp);
 	}
 #endif
-	global_pbuf_purger(1, -1, -1); // purge everything..
+	global_pbuf_purger(1); // purge everything..
+}
+
+/*
+ *	Hand over the dupecheck database to the new process in a live
+ *	upgrade. Called after the dupecheck thread has been stopped.
+ */
+
+void dupecheck_dump_liveupgrade(void)
+{
+	struct liveupgrade_batch_t b;
+	struct liveupgrade_dupe_t e;
+	struct dupe_record_t *dp;
+	time_t expiretime = tick - dupefilter_storetime;
+	int i;
+
+	liveupgrade_batch_start(&b, LIVEUPGRADE_REC_DUPECHECK);
+
+	memset(&e, 0, sizeof(e));
+	for (i = 0; i < DUPECHECK_DB_SIZE; ++i) {
+		for (dp = dupecheck_db[i]; (dp); dp = dp->next) {
+			if (dp->t < expiretime)
+				continue;
+			e.t = dp->t;
+			e.dtype = dp->dtype;
+			liveupgrade_batch_add(&b, &e, sizeof(e), dp->packet, dp->len);
+		}
+	}
+
+	hlog(LOG_INFO, "Live upgrade: Handing over %u dupecheck records", b.count);
+
+	liveupgrade_batch_finish(&b);
+}
+
+/*
+ *	Load the dupecheck database handed over by the old process, before
+ *	the dupecheck thread is started. The hashes are calculated again,
+ *	so that the hash function may change between versions. The records
+ *	are appended in their original order.
+ */
+
+void dupecheck_load_liveupgrade(void)
+{
+	struct liveupgrade_batch_reader_t r;
+	struct liveupgrade_dupe_t e;
+	struct dupe_record_t *dp, ***tails;
+	const char *data;
+	time_t expiretime = tick - dupefilter_storetime;
+	uint32_t hash, idx;
+	int i, len, count = 0;
+
+	tails = hmalloc(sizeof(*tails) * DUPECHECK_DB_SIZE);
+	for (i = 0; i < DUPECHECK_DB_SIZE; ++i) {
+		tails[i] = &dupecheck_db[i];
+		while (*tails[i])
+			tails[i] = &(*tails[i])->next;
+	}
+
+	liveupgrade_batch_open(&r, LIVEUPGRADE_REC_DUPECHECK);
+	while (liveupgrade_batch_next(&r, &e, sizeof(e), &data, &len)) {
+		if (e.t < expiretime || e.t > tick || len < 1)
+			continue;
+
+		hash = keyhash(data, len, 0);
+		idx  = hash;
+		idx ^= (idx >> 13); /* fold the hash bits.. */
+		idx ^= (idx >> 26); /* fold the hash bits.. */
+		idx = idx % DUPECHECK_DB_SIZE;
+
+		dp = dupecheck_db_alloc(len);
+		if (!dp)
+			break;
+
+		memcpy(dp->packet, data, len);
+		dp->hash = hash;
+		dp->t = e.t;
+		dp->dtype = e.dtype;
+
+		*tails[idx] = dp;
+		tails[idx] = &dp->next;
+		count++;
+	}
+
+	hfree(tails);
+
+	hlog(LOG_INFO, "Live upgrade: Loaded %d dupecheck records", count);
 }
 
 /*
@@ -50,6 +50,9 @@ extern void dupecheck_start(void);
 extern void dupecheck_stop(void);
 extern void dupecheck_atend(void);
 
+extern void dupecheck_dump_liveupgrade(void);
+extern void dupecheck_load_liveupgrade(void);
+
 /* cellmalloc status */
 #ifndef _FOR_VALGRIND_
 extern void dupecheck_cell_stats(struct cellstatus_t *cellst);
@@ -266,7 +266,7 @@ void filter_init(void)
 	filter_cells = cellinit( "filter",
 				 sizeof(struct filter_t),
 				 __alignof__(struct filter_t),
-				 CELLMALLOC_POLICY_LIFO,
+				 CELLMALLOC_POLICY_LIFO | CELLMALLOC_POLICY_MAGAZINE,
 				 512 /* 512 kB at the time,
 					should be enough forever.. */,
 				 0 /* minfree */ );
@@ -279,7 +279,7 @@ void filter_init(void)
 	filter_entrycall_cells = cellinit( "entrycall",
 					   sizeof(struct filter_entrycall_t),
 					   __alignof__(struct filter_entrycall_t),
-					   CELLMALLOC_POLICY_FIFO,
+					   CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_MAGAZINE,
 					   32 /* 32 kB at the time */,
 					   0 /* minfree */ );
 
@@ -288,7 +288,7 @@ void filter_init(void)
 	filter_wx_cells = cellinit( "wxcalls",
 				    sizeof(struct filter_wx_t),
 				    __alignof__(struct filter_wx_t),
-				    CELLMALLOC_POLICY_FIFO,
+				    CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_MAGAZINE,
 				    32 /* 32 kB at the time */,
 				    0 /* minfree */ );
 #endif
@@ -739,58 +739,9 @@ void filter_wx_dump(FILE *fp)
 
 /* ================================================================ */
 
-const char *aprsc_strnstr(const char *s1, const char *s2, size_t len)
-{
-	char  c1, c2;
-	size_t  n;
-	
-	c2 = *(char *) s2++;
-	
-	n = strlen(s2);
-	
-	do {
-		do {
-			/* if we're going too far */
-			if (len-- == 0)
-				return NULL;
-			
-			/* pick first char and advance */
-			c1 = *s1++;
-			
-			/* end of string? */
-			if (c1 == 0)
-				return NULL;
-		} while (c1 != c2);
-		
-		/* at least the first character matches... if the needle is longer than
-		 * what we have left in the haystack, we won't find a match.
-		 */
-		
-		if (n > len)
-			return NULL;
-		
-	} while (strncmp(s1, s2, n) != 0);
-	
-	return s1;
-}
-
-
-/*
- *	Check if there is a TCPIP* component in the path.
- *	OPTIMIZE: The flag could be set when TCPIP is inserted, or when the path
- *	is analyzed on input.
- */
-
-static void filter_check_tcpip(struct pbuf_t *pbuf)
-{
-	if (aprsc_strnstr(pbuf->dstcall_end, ",TCPIP*,", pbuf->qconst_start - pbuf->dstcall_end))
-		pbuf->flags |= F_HAS_TCPIP;
-}
-
 static void filter_keyhashes(struct pbuf_t *pb)
 {
-	pb->srccall_hash = keyhashuc(pb->data, pb->srccall_end - pb->data, 0);
-	
+	/* srccall_hash is set by incoming_parse() from the header tokens */
 	if (pb->srcname == pb->data)
 		pb->srcname_hash = pb->srccall_hash;
 	else
@@ -802,8 +753,7 @@ static void filter_keyhashes(struct pbuf_t *pb)
 
 void filter_preprocess_dupefilter(struct pbuf_t *pbuf)
 {
-	// TODO: could probably skip filter_check_tcpip, and possibly filter_keyhashes too if no filtered listeners
-	filter_check_tcpip(pbuf);
+	// TODO: could probably skip filter_keyhashes too if no filtered listeners
 	if (have_filtered_listeners) {
 		filter_entrycall_insert(pbuf);
 		filter_wx_insert(pbuf);
@@ -1407,7 +1357,7 @@ int filter_parse(struct client_t *c, const char *filt, int is_user_filter)
 		f0.h.f_latN = filter_lat2rad(f0.h.f_latN);
 		f0.h.f_lonE = filter_lon2rad(f0.h.f_lonE);
 
-		f0.h.f_coslat = cosf( f0.h.f_latN ); /* Store pre-calculated COS of LAT */
+		f0.h.f_coslat = filter_coslat( f0.h.f_latN ); /* Store pre-calculated COS of LAT */
 		break;
 
 	case 's':
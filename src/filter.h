@@ -40,6 +40,23 @@ extern int have_filtered_listeners;
 extern float filter_lat2rad(float lat);
 extern float filter_lon2rad(float lon);
 
+/*
+ *	cos() of a latitude given in radians, for the range filters.
+ *	Latitudes are within +-pi/2, so an even Taylor polynomial
+ *	evaluated in double precision does it without the argument
+ *	reduction of cosf(). The result is within 1 ulp of cosf().
+ */
+
+static inline float filter_coslat(float lat)
+{
+	double x2 = (double)lat * lat;
+
+	return 1.0 + x2 * (-1.0/2 + x2 * (1.0/24 + x2 * (-1.0/720 + x2 * (1.0/40320
+		+ x2 * (-1.0/3628800 + x2 * (1.0/479001600 + x2 * (-1.0/87178291200.0
+		+ x2 * (1.0/20922789888000.0 + x2 * (-1.0/6402373705728000.0
+		+ x2 * (1.0/2432902008176640000.0))))))))));
+}
+
 #ifndef _FOR_VALGRIND_
 extern void filter_cell_stats(struct cellstatus_t *filter_cellst,
 	struct cellstatus_t *filter_entrycall_cellst,
@@ -0,0 +1,405 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	TLS handshake threads.
+ *
+ *	The public key operations of a TLS handshake take a lot more CPU
+ *	time than anything else a worker does for a client. When a number
+ *	of SSL clients reconnect at the same time, doing the handshakes in
+ *	the workers would stall the packet flow for all of the other clients
+ *	of those workers.
+ *
+ *	New SSL clients are passed to a small pool of handshake threads
+ *	instead, and each thread runs the handshakes of its clients in its
+ *	own polling set. The client certificate chain is verified by
+ *	OpenSSL during the handshake. After the handshake is done, the
+ *	client is passed to the worker which was picked for it at accept
+ *	time. Clients which do not finish the handshake within the login
+ *	timeout are disconnected.
+ *
+ *	With no handshake threads configured, the workers do the handshakes
+ *	themselves, as before.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "handshake.h"
+#include "config.h"
+#include "hlog.h"
+#include "hmalloc.h"
+#include "ssl.h"
+#include "incoming.h"
+#include "xpoll.h"
+
+int handshake_threads_configured = 1;	/* number of handshake threads to run */
+
+#ifdef USE_SSL
+
+struct handshake_thread_t {
+	struct handshake_thread_t *next;
+
+	int id;
+	pthread_t th;
+	volatile int shutting_down;
+
+	struct xpoll_t xp;
+
+	struct client_t *new_clients;	/* queued by handshake_submit(), under handshake_mutex */
+	struct client_t *clients;	/* handshakes in progress, thread-local */
+	int client_count;		/* handshakes queued or in progress */
+
+	/* statistics, read by handshake_status() without locking */
+	long long handshakes;
+	long long resumed;
+	long long failed;
+};
+
+static pthread_mutex_t handshake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct handshake_thread_t *handshake_threads;
+static int handshake_threads_running;
+
+/* statistics of threads which have been stopped */
+static long long handshakes_old, resumed_old, failed_old;
+
+/*
+ *	Remove a client from the polling set and the list of handshakes
+ *	in progress
+ */
+
+static void handshake_client_unlink(struct handshake_thread_t *self, struct client_t *c)
+{
+	if (c->xfd) {
+		xpoll_remove(&self->xp, c->xfd);
+		c->xfd = NULL;
+	}
+
+	if (c->next)
+		c->next->prevp = c->prevp;
+	*c->prevp = c->next;
+
+	c->next = NULL;
+	c->prevp = NULL;
+
+	pthread_mutex_lock(&handshake_mutex);
+	self->client_count--;
+	pthread_mutex_unlock(&handshake_mutex);
+
+	/* pass_client_to_worker() counts the client again, if it gets there */
+	worker_logins_pending_add(c->handshake_worker, -1);
+}
+
+/*
+ *	Close a client which did not make it through the handshake
+ */
+
+static void handshake_client_close(struct handshake_thread_t *self, struct client_t *c, const char *reason)
+{
+	hlog(LOG_INFO, "%s - Closing SSL client on fd %d from %s: %s",
+		c->addr_loc, c->fd, c->addr_rem, reason);
+
+	handshake_client_unlink(self, c);
+	inbound_connects_account(0, c->portaccount);
+	client_free(c);
+}
+
+/*
+ *	Drive the handshake of a client forward, and pass it on to the
+ *	worker once it is done
+ */
+
+static void handshake_client_run(struct handshake_thread_t *self, struct client_t *c)
+{
+	int r = ssl_handshake(&self->xp, c);
+
+	if (r == SSL_HANDSHAKE_WANT_IO)
+		return;
+
+	if (r == SSL_HANDSHAKE_FAILED) {
+		self->failed++;
+		handshake_client_close(self, c, "SSL handshake failed");
+		return;
+	}
+
+	self->handshakes++;
+	if (r == SSL_HANDSHAKE_RESUMED) {
+		self->resumed++;
+		hlog(LOG_DEBUG, "%s/%d: SSL session resumed", c->addr_rem, c->fd);
+	}
+
+	handshake_client_unlink(self, c);
+
+	if (pass_client_to_worker(c->handshake_worker, c)) {
+		inbound_connects_account(0, c->portaccount);
+		client_free(c);
+	}
+}
+
+static int handshake_client_event(struct xpoll_t *xp, struct xpoll_fd_t *xfd)
+{
+	struct handshake_thread_t *self = (struct handshake_thread_t *)xp->tp;
+	struct client_t *c = (struct client_t *)xfd->p;
+
+	handshake_client_run(self, c);
+
+	return 0;
+}
+
+/*
+ *	Pick up clients queued for this thread, and start their handshakes
+ */
+
+static void handshake_collect_new(struct handshake_thread_t *self)
+{
+	struct client_t *new_clients, *c;
+
+	pthread_mutex_lock(&handshake_mutex);
+	new_clients = self->new_clients;
+	self->new_clients = NULL;
+	pthread_mutex_unlock(&handshake_mutex);
+
+	while ((c = new_clients)) {
+		new_clients = c->next;
+
+		c->next = self->clients;
+		if (c->next)
+			c->next->prevp = &c->next;
+		self->clients = c;
+		c->prevp = &self->clients;
+
+		c->xfd = xpoll_add(&self->xp, c->fd, (void *)c);
+		if (!c->xfd) {
+			handshake_client_close(self, c, "out of polling slots");
+			continue;
+		}
+
+		/* the ClientHello has usually arrived already */
+		handshake_client_run(self, c);
+	}
+}
+
+/*
+ *	Disconnect clients which take too long to do the handshake
+ */
+
+static void handshake_expire(struct handshake_thread_t *self)
+{
+	struct client_t *c, *cnext;
+
+	for (c = self->clients; (c); c = cnext) {
+		cnext = c->next;
+		if (c->connect_tick + client_login_timeout < tick)
+			handshake_client_close(self, c, "SSL handshake timeout");
+	}
+}
+
+static void handshake_thread(void *asdf)
+{
+	struct handshake_thread_t *self = (struct handshake_thread_t *)asdf;
+	sigset_t sigs_to_block;
+	time_t next_expire = tick + 1;
+	char myname[20];
+
+	sprintf(myname, "handshake %d", self->id);
+	pthreads_profiling_reset(myname);
+
+	sigemptyset(&sigs_to_block);
+	sigaddset(&sigs_to_block, SIGALRM);
+	sigaddset(&sigs_to_block, SIGINT);
+	sigaddset(&sigs_to_block, SIGTERM);
+	sigaddset(&sigs_to_block, SIGQUIT);
+	sigaddset(&sigs_to_block, SIGHUP);
+	sigaddset(&sigs_to_block, SIGURG);
+	sigaddset(&sigs_to_block, SIGPIPE);
+	sigaddset(&sigs_to_block, SIGUSR1);
+	sigaddset(&sigs_to_block, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
+
+	hlog(LOG_DEBUG, "Handshake thread %d started.", self->id);
+
+	while (!self->shutting_down) {
+		handshake_collect_new(self);
+
+		xpoll(&self->xp, 30);
+
+		if (tick >= next_expire || next_expire > tick + 1) {
+			next_expire = tick + 1;
+			handshake_expire(self);
+		}
+	}
+
+	/* the workers may be going away, close the handshakes in progress */
+	handshake_collect_new(self);
+	while (self->clients)
+		handshake_client_close(self, self->clients, "shutting down");
+
+	xpoll_free(&self->xp);
+
+	hlog(LOG_DEBUG, "Handshake thread %d shut down.", self->id);
+}
+
+/*
+ *	Queue a new SSL client for the handshake, to be passed on to worker w
+ *	afterwards. Returns -1 if there are no handshake threads running,
+ *	and the worker should do the handshake.
+ */
+
+int handshake_submit(struct client_t *c, struct worker_t *w)
+{
+	struct handshake_thread_t *t, *best = NULL;
+
+	pthread_mutex_lock(&handshake_mutex);
+
+	for (t = handshake_threads; (t); t = t->next)
+		if (!best || t->client_count < best->client_count)
+			best = t;
+
+	if (!best) {
+		pthread_mutex_unlock(&handshake_mutex);
+		return -1;
+	}
+
+	c->handshake_worker = w;
+	c->next = best->new_clients;
+	best->new_clients = c;
+	best->client_count++;
+
+	/* count it as a pending login for the worker, so that
+	 * admission control sees it
+	 */
+	worker_logins_pending_add(w, 1);
+
+	pthread_mutex_unlock(&handshake_mutex);
+
+	return 0;
+}
+
+/*
+ *	Stop the handshake threads
+ */
+
+void handshake_stop(void)
+{
+	struct handshake_thread_t *list, *t;
+	int e;
+
+	/* unhook the threads first, so that no new clients are queued */
+	pthread_mutex_lock(&handshake_mutex);
+	list = handshake_threads;
+	handshake_threads = NULL;
+	handshake_threads_running = 0;
+	pthread_mutex_unlock(&handshake_mutex);
+
+	if (!list)
+		return;
+
+	for (t = list; (t); t = t->next)
+		t->shutting_down = 1;
+
+	while ((t = list)) {
+		list = t->next;
+
+		if ((e = pthread_join(t->th, NULL)))
+			hlog(LOG_ERR, "Could not pthread_join handshake thread %d: %s", t->id, strerror(e));
+
+		handshakes_old += t->handshakes;
+		resumed_old += t->resumed;
+		failed_old += t->failed;
+
+		hfree(t);
+	}
+
+	hlog(LOG_INFO, "Handshake threads have terminated.");
+}
+
+/*
+ *	Start the configured amount of handshake threads, restarting them
+ *	if the amount has changed
+ */
+
+void handshake_start(void)
+{
+	struct handshake_thread_t *t, **prevp;
+	int i;
+
+	if (handshake_threads_running == handshake_threads_configured)
+		return;
+
+	handshake_stop();
+
+	if (handshake_threads_configured < 1)
+		return;
+
+	hlog(LOG_INFO, "Starting %d SSL handshake threads", handshake_threads_configured);
+
+	pthread_mutex_lock(&handshake_mutex);
+
+	prevp = &handshake_threads;
+	for (i = 0; i < handshake_threads_configured; i++) {
+		t = hmalloc(sizeof(*t));
+		memset(t, 0, sizeof(*t));
+		t->id = i;
+
+		xpoll_initialize(&t->xp, (void *)t, &handshake_client_event);
+
+		if (pthread_create(&t->th, &pthr_attrs, (void *)handshake_thread, t)) {
+			perror("pthread_create failed for handshake_thread");
+			xpoll_free(&t->xp);
+			hfree(t);
+			continue;
+		}
+
+		*prevp = t;
+		prevp = &t->next;
+	}
+
+	handshake_threads_running = handshake_threads_configured;
+
+	pthread_mutex_unlock(&handshake_mutex);
+}
+
+/*
+ *	Handshake statistics for status.json
+ */
+
+void handshake_status(cJSON *totals)
+{
+	struct handshake_thread_t *t;
+	long long handshakes, resumed, failed;
+	int pending = 0;
+
+	pthread_mutex_lock(&handshake_mutex);
+
+	handshakes = handshakes_old;
+	resumed = resumed_old;
+	failed = failed_old;
+
+	for (t = handshake_threads; (t); t = t->next) {
+		handshakes += t->handshakes;
+		resumed += t->resumed;
+		failed += t->failed;
+		pending += t->client_count;
+	}
+
+	pthread_mutex_unlock(&handshake_mutex);
+
+	cJSON_AddNumberToObject(totals, "tls_handshake_threads", handshake_threads_running);
+	cJSON_AddNumberToObject(totals, "tls_handshakes", handshakes);
+	cJSON_AddNumberToObject(totals, "tls_handshakes_resumed", resumed);
+	cJSON_AddNumberToObject(totals, "tls_handshakes_failed", failed);
+	cJSON_AddNumberToObject(totals, "tls_handshakes_pending", pending);
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+#include "worker.h"
+#include "cJSON.h"
+
+#define HANDSHAKE_THREADS_MAX	16
+
+extern int handshake_threads_configured;
+
+#ifdef USE_SSL
+
+extern void handshake_start(void);
+extern void handshake_stop(void);
+
+extern int handshake_submit(struct client_t *c, struct worker_t *w);
+extern void handshake_status(cJSON *totals);
+
+#endif
+#endif
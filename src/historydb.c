@@ -19,9 +19,11 @@
 #include "config.h"
 #include "cellmalloc.h"
 #include "historydb.h"
+#include "filter.h"
 #include "hmalloc.h"
 #include "keyhash.h"
 #include "cJSON.h"
+#include "liveupgrade.h"
 
 #ifndef _FOR_VALGRIND_
 cellarena_t *historydb_cells;
@@ -66,7 +68,7 @@ void historydb_init(void)
 	historydb_cells = cellinit( "historydb",
 				    sizeof(struct history_cell_t),
 				    __alignof__(struct history_cell_t), 
-				    CELLMALLOC_POLICY_FIFO,
+				    CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_MAGAZINE | CELLMALLOC_POLICY_COMPACT,
 				    2048 /* 2 MB */,
 				    0 /* minfree */ );
 #endif
@@ -204,7 +206,7 @@ static int historydb_load_entry(char *s)
 	cp->hash1 = h1;
 	
 	cp->lat         = lat->valuedouble;
-	cp->coslat      = cosf(cp->lat);
+	cp->coslat      = filter_coslat(cp->lat);
 	cp->lon         = lon->valuedouble;
 	cp->arrivaltime = arrivaltime->valueint;
 	cp->packettype  = packettype->valueint;
@@ -276,6 +278,99 @@ int historydb_load(FILE *fp)
 	return 0;
 }
 
+/*
+ *	Hand over the historydb to the new process in a live upgrade
+ */
+
+void historydb_dump_liveupgrade(void)
+{
+	struct liveupgrade_batch_t b;
+	struct liveupgrade_history_t e;
+	struct history_cell_t *hp;
+	time_t expirytime = tick - lastposition_storetime;
+	int i;
+
+	liveupgrade_batch_start(&b, LIVEUPGRADE_REC_HISTORYDB);
+
+	memset(&e, 0, sizeof(e));
+	rwl_rdlock(&historydb_rwlock);
+
+	for (i = 0; i < HISTORYDB_HASH_MODULO; ++i) {
+		for (hp = historydb_hash[i]; (hp); hp = hp->next) {
+			if (hp->arrivaltime <= expirytime)
+				continue;
+			e.arrivaltime = hp->arrivaltime;
+			e.lat = hp->lat;
+			e.lon = hp->lon;
+			e.packettype = hp->packettype;
+			e.flags = hp->flags;
+			liveupgrade_batch_add(&b, &e, sizeof(e), hp->key, hp->keylen);
+		}
+	}
+
+	rwl_rdunlock(&historydb_rwlock);
+
+	hlog(LOG_INFO, "Live upgrade: Handing over %u historydb entries", b.count);
+
+	liveupgrade_batch_finish(&b);
+}
+
+/*
+ *	Load the historydb handed over by the old process
+ */
+
+void historydb_load_liveupgrade(void)
+{
+	struct liveupgrade_batch_reader_t r;
+	struct liveupgrade_history_t e;
+	struct history_cell_t *cp;
+	const char *key;
+	time_t expirytime = tick - lastposition_storetime;
+	uint32_t h1, h2;
+	int i, keylen, n = 0, ok = 0;
+
+	rwl_wrlock(&historydb_rwlock);
+
+	liveupgrade_batch_open(&r, LIVEUPGRADE_REC_HISTORYDB);
+	while (liveupgrade_batch_next(&r, &e, sizeof(e), &key, &keylen)) {
+		n++;
+		if (e.arrivaltime <= expirytime || keylen < 1 || keylen > CALLSIGNLEN_MAX)
+			continue;
+
+		cp = historydb_alloc();
+		if (!cp) {
+			hlog(LOG_ERR, "historydb_load_liveupgrade: cellmalloc failed");
+			break;
+		}
+
+		/* calculate hash */
+		h1 = keyhash(key, keylen, 0);
+		h2 = h1 ^ (h1 >> 13) ^ (h1 >> 26); /* fold hash bits.. */
+		i = h2 % HISTORYDB_HASH_MODULO;
+
+		memcpy(cp->key, key, keylen);
+		cp->key[keylen] = 0; /* zero terminate */
+		cp->keylen = keylen;
+		cp->hash1 = h1;
+
+		cp->lat         = e.lat;
+		cp->coslat      = filter_coslat(cp->lat);
+		cp->lon         = e.lon;
+		cp->arrivaltime = e.arrivaltime;
+		cp->packettype  = e.packettype;
+		cp->flags       = e.flags;
+
+		/* ok, insert it in the hash table */
+		cp->next = historydb_hash[i];
+		historydb_hash[i] = cp;
+		ok++;
+	}
+
+	rwl_wrunlock(&historydb_rwlock);
+
+	hlog(LOG_INFO, "Live upgrade: Loaded %d of %d historydb entries.", ok, n);
+}
+
 /* insert... */
 
 int historydb_insert(struct pbuf_t *pb)
@@ -287,8 +382,7 @@ int historydb_insert(struct pbuf_t *pb)
 
 	time_t expirytime   = tick - lastposition_storetime;
 
-	char keybuf[CALLSIGNLEN_MAX+2];
-	char *s;
+	const char *key;
 
 	if (!(pb->flags & F_HASPOS)) {
 		++historydb_noposcount;
@@ -303,57 +397,28 @@ int historydb_insert(struct pbuf_t *pb)
 	**       have previous entry with data.
 	*/
 
-	/* NOTE2: We could use pb->srcname, and pb->srcname_len here,
-	**        but then we would not know if this is a "kill-item"
-	*/
-
-	keybuf[CALLSIGNLEN_MAX] = 0;
-	if (pb->packettype & T_OBJECT) {
-		/* Pick object name  ";item  *" */
-		memcpy( keybuf, pb->info_start+1, CALLSIGNLEN_MAX+1);
-		keybuf[CALLSIGNLEN_MAX+1] = 0;
-		s = strchr(keybuf, '*');
-		if (s) *s = 0;
-		else {
-			s = strchr(keybuf, '_'); // kill an object!
-			if (s) {
-				*s = 0;
-				isdead = 1;
-			}
-		}
-		s = keybuf + strlen(keybuf);
-		for ( ; s > keybuf; --s ) {  // tail space padded..
-			if (*s == ' ') *s = ' ';
-			else break;
-		}
-
-	} else if (pb->packettype & T_ITEM) {
-		// Pick item name  ") . . . !"  or ") . . . _"
-		memcpy( keybuf, pb->info_start+1, CALLSIGNLEN_MAX+1);
-		keybuf[CALLSIGNLEN_MAX+1] = 0;
-		s = strchr(keybuf, '!');
-		if (s) *s = 0;
-		else {
-			s = strchr(keybuf, '_'); // kill an item!
-			if (s) {
-				*s = 0;
-				isdead = 1;
-			}
-		}
+	if (pb->packettype & (T_OBJECT|T_ITEM)) {
+		/* parse_aprs() picked the object or item name,
+		 * and checked if it is being killed
+		 */
+		key = pb->srcname;
+		keylen = pb->srcname_len;
+		isdead = (pb->flags & F_KILLED) ? 1 : 0;
 	} else if (pb->packettype & T_POSITION) {
 		// Pick originator callsign
-		memcpy( keybuf, pb->data, CALLSIGNLEN_MAX) ;
-		s = strchr(keybuf, '>');
-		if (s) *s = 0;
+		key = pb->data;
+		keylen = pb->srccall_end - pb->data;
 	} else {
 		historydb_nointerest(); // debug thing -- a profiling counter
 		return -1; // Not a packet with positional data, not interested in...
 	}
-	keylen = strlen(keybuf);
+	
+	if (keylen < 1 || keylen > CALLSIGNLEN_MAX)
+		return -1;
 
 	++historydb_inserts;
 
-	h1 = keyhash(keybuf, keylen, 0);
+	h1 = keyhash(key, keylen, 0);
 	h2 = h1 ^ (h1 >> 13) ^ (h1 >> 26); /* fold hash bits.. */
 	i = h2 % HISTORYDB_HASH_MODULO;
 
@@ -377,7 +442,7 @@ int historydb_insert(struct pbuf_t *pb)
 		    historydb_hashmatch(); // debug thing -- a profiling counter
 		    ++historydb_hashmatches;
 		    if ( cp->keylen == keylen &&
-			 (memcmp(cp->key, keybuf, keylen) == 0) ) {
+			 (memcmp(cp->key, key, keylen) == 0) ) {
 		  	// Key match!
 		    	historydb_keymatch(); // debug thing -- a profiling counter
 			++historydb_keymatches;
@@ -412,7 +477,7 @@ int historydb_insert(struct pbuf_t *pb)
 			return 1;
 		}
 		cp->next = NULL;
-		memcpy(cp->key, keybuf, keylen);
+		memcpy(cp->key, key, keylen);
 		cp->key[keylen] = 0; /* zero terminate */
 		cp->keylen = keylen;
 		cp->hash1 = h1;
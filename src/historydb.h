@@ -62,6 +62,8 @@ extern void historydb_init(void);
 
 extern int historydb_dump(FILE *fp);
 extern int historydb_load(FILE *fp);
+extern void historydb_dump_liveupgrade(void);
+extern void historydb_load_liveupgrade(void);
 
 extern void historydb_cleanup(void);
 extern void historydb_atend(void);
@@ -13,10 +13,22 @@
  *
  *	logging facility with configurable log levels and
  *	logging destinations
+ *
+ *	Once the logger thread is running, log lines are formatted by the
+ *	calling thread into a ring buffer of its own, and written out by
+ *	the logger thread in batches. A thread never waits for the log
+ *	file: if its ring is full, the line is dropped and counted. Lines
+ *	of LOG_ERR and above are written right away, since the process
+ *	may be exiting right after logging them. The thread's own ring is
+ *	written out first, to keep its lines in order, and all of the
+ *	rings are written out at exit() and before abort().
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <time.h>
@@ -28,6 +40,10 @@
 #include <sys/file.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <stddef.h>
 
 #include "hlog.h"
 #include "hmalloc.h"
@@ -52,6 +68,59 @@ rwlock_t accesslog_lock = RWL_INITIALIZER;
 
 int log_rotate_size = 0;	/* Rotate log when it reaches a given size */
 int log_rotate_num = 5;		/* How many logs to keep around */
+static long long log_file_size;	/* bytes in the current log file */
+
+/*
+ *	Per-thread log rings. The owning thread appends records at head,
+ *	and the logger thread consumes them from tail, so no locking is
+ *	needed between the two.
+ */
+
+#define HLOG_RING_SIZE	(256*1024)	/* power of two */
+#define HLOG_RING_MASK	(HLOG_RING_SIZE-1)
+#define HLOG_IOV_MAX	128		/* lines per writev() */
+#define HLOG_IDLE_MS	20		/* logger sleep when there was nothing to write */
+
+#define HLOG_DEST_ACCESS	(1 << 3)	/* record goes to the access log */
+
+struct hlog_rec_t {
+	unsigned short len;		/* length of the line, 0: skip to start of ring */
+	unsigned short msg_off;		/* start of the part which goes to syslog */
+	unsigned char priority;
+	unsigned char dest;		/* L_* destinations, or HLOG_DEST_ACCESS */
+	unsigned short pad;
+};
+
+#define HLOG_REC_ALIGN(x)	(((x) + 7) & ~7)
+
+struct hlog_ring_t {
+	struct hlog_ring_t *next;
+	
+	volatile unsigned int head;	/* bytes appended, by the owner */
+	volatile unsigned int tail;	/* bytes consumed, by the logger thread */
+	volatile unsigned long dropped;	/* lines which did not fit, by the owner */
+	unsigned long dropped_seen;	/* by the logger thread */
+	volatile int orphaned;		/* the owner has exited */
+	
+	int pid;
+	unsigned long thread;
+	time_t ts_sec;			/* second of the cached timestamp */
+	char ts[72];			/* "YYYY/MM/DD HH:MM:SS", with room for bogus dates */
+	
+	char buf[HLOG_RING_SIZE];
+};
+
+static struct hlog_ring_t *hlog_rings;
+static pthread_mutex_t hlog_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hlog_drain_mutex;	/* one thread writes out rings at a time, recursive */
+static int hlog_draining;		/* a ring is being written out, protected by hlog_drain_mutex */
+static int hlog_atexit_set;
+static pthread_key_t hlog_ring_key;
+static pthread_t hlog_th;
+static volatile int hlog_async_running;
+static volatile int hlog_shutting_down;
+
+unsigned long hlog_lines_dropped;	/* lines dropped due to full rings */
 
 char *log_levelnames[] = {
 	"EMERG",
@@ -190,6 +259,7 @@ int open_log(char *name, int reopen)
 			fprintf(stderr, "aprsc logger: Could not open %s: %s\n", log_fname, strerror(errno));
 			exit(1);
 		}
+		log_file_size = lseek(log_file, 0, SEEK_END);
 	}
 	
 	rwl_wrunlock(&log_file_lock);
@@ -284,6 +354,7 @@ int rotate_log(void)
 		fprintf(stderr, "aprsc logger: Could not open %s: %s\n", log_fname, strerror(errno));
 		log_file = -1;
 	}
+	log_file_size = 0;
 	
 	rwl_wrunlock(&log_file_lock);
 	
@@ -310,6 +381,442 @@ int rotate_log(void)
 	return 0;
 }
 
+/*
+ *	Get the calling thread's log ring, setting one up if needed
+ */
+
+static struct hlog_ring_t *hlog_ring_get(void)
+{
+	struct hlog_ring_t *r;
+	
+	if ((r = pthread_getspecific(hlog_ring_key)))
+		return r;
+	
+	if (!(r = malloc(sizeof(*r))))
+		return NULL;
+	
+	memset(r, 0, offsetof(struct hlog_ring_t, buf));
+	r->pid = getpid();
+	r->thread = (unsigned long int)pthread_self();
+	r->ts_sec = -1;
+	
+	if (pthread_setspecific(hlog_ring_key, r)) {
+		free(r);
+		return NULL;
+	}
+	
+	/* the logger thread walks the list without locking, so the ring
+	 * must be complete before it is linked in
+	 */
+	pthread_mutex_lock(&hlog_rings_mutex);
+	r->next = hlog_rings;
+	__sync_synchronize();
+	hlog_rings = r;
+	pthread_mutex_unlock(&hlog_rings_mutex);
+	
+	return r;
+}
+
+/*
+ *	A thread is exiting, let the logger free the ring when it has
+ *	written out what is left in it
+ */
+
+static void hlog_ring_orphan(void *p)
+{
+	struct hlog_ring_t *r = p;
+	
+	__sync_synchronize();
+	r->orphaned = 1;
+}
+
+/*
+ *	Append a record to a ring. If it does not fit, the line is dropped.
+ */
+
+static void hlog_ring_put(struct hlog_ring_t *r, int priority, int dest, const char *line, int len, int msg_off)
+{
+	struct hlog_rec_t *rec;
+	unsigned int head = r->head;
+	unsigned int need = HLOG_REC_ALIGN(sizeof(*rec) + len);
+	unsigned int contig = HLOG_RING_SIZE - (head & HLOG_RING_MASK);
+	unsigned int total = (contig < need) ? contig + need : need;
+	
+	if (HLOG_RING_SIZE - (head - r->tail) < total) {
+		r->dropped++;
+		return;
+	}
+	
+	/* records are not split at the end of the ring, there's a
+	 * skip marker instead
+	 */
+	if (contig < need) {
+		rec = (struct hlog_rec_t *)(r->buf + (head & HLOG_RING_MASK));
+		rec->len = 0;
+		head += contig;
+	}
+	
+	rec = (struct hlog_rec_t *)(r->buf + (head & HLOG_RING_MASK));
+	rec->len = len;
+	rec->msg_off = msg_off;
+	rec->priority = priority;
+	rec->dest = dest;
+	memcpy((char *)(rec + 1), line, len);
+	
+	/* the record must be in place before the logger sees the new head */
+	__sync_synchronize();
+	r->head = head + need;
+}
+
+/*
+ *	Format a log line into the calling thread's ring. Returns -1 if
+ *	the thread has no ring, and the line should be written directly.
+ */
+
+static int hlog_enqueue(int priority, const char *s)
+{
+	struct hlog_ring_t *r;
+	struct timeval tv;
+	struct tm lt;
+	char wb[LOG_LEN];
+	int len, msg_off;
+	
+	if (!(r = hlog_ring_get()))
+		return -1;
+	
+	gettimeofday(&tv, NULL);
+	
+	/* the date only needs to be formatted once a second */
+	if (tv.tv_sec != r->ts_sec) {
+		gmtime_r(&tv.tv_sec, &lt);
+		snprintf(r->ts, sizeof(r->ts), "%4d/%02d/%02d %02d:%02d:%02d",
+			lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec);
+		r->ts_sec = tv.tv_sec;
+	}
+	
+	msg_off = snprintf(wb, LOG_LEN, "%s.%06d %s[%d:%lx] ",
+		r->ts, (int)tv.tv_usec, (log_name) ? log_name : "aprsc", r->pid, r->thread);
+	len = msg_off + snprintf(wb + msg_off, LOG_LEN - msg_off, "%s: %s\n", log_levelnames[priority], s);
+	if (len >= LOG_LEN) {
+		len = LOG_LEN-1;
+		wb[LOG_LEN-2] = '\n';
+	}
+	
+	hlog_ring_put(r, priority, log_dest & (L_STDERR|L_SYSLOG|L_FILE), wb, len, msg_off);
+	
+	return 0;
+}
+
+/*
+ *	Write out a batch of lines
+ */
+
+static void hlog_writev(int dest, struct iovec *iov, int n)
+{
+	ssize_t w, total = 0;
+	int i;
+	
+	if (n == 0)
+		return;
+	
+	for (i = 0; i < n; i++)
+		total += iov[i].iov_len;
+	
+	if (dest == L_STDERR) {
+		w = writev(STDERR_FILENO, iov, n);
+	} else if (dest == L_FILE) {
+		rwl_rdlock(&log_file_lock);
+		if (log_file < 0) {
+			rwl_rdunlock(&log_file_lock);
+			return;
+		}
+		if ((w = writev(log_file, iov, n)) != total)
+			fprintf(stderr, "aprsc logger: Could not write to %s (fd %d): %s\n", log_fname, log_file, strerror(errno));
+		if (w > 0)
+			__sync_fetch_and_add(&log_file_size, w);
+		rwl_rdunlock(&log_file_lock);
+		
+		if (log_rotate_size && log_file_size >= log_rotate_size)
+			rotate_log();
+	} else {
+		rwl_rdlock(&accesslog_lock);
+		if (accesslog_file >= 0) {
+			if ((w = writev(accesslog_file, iov, n)) != total)
+				fprintf(stderr, "aprsc logger: Could not write to %s (fd %d): %s\n", accesslog_fname, accesslog_file, strerror(errno));
+		} else if (accesslog_file != -666) {
+			accesslog_file = -666;
+			rwl_rdunlock(&accesslog_lock);
+			hlog(LOG_ERR, "Access log not open, log lines are lost!");
+			return;
+		}
+		rwl_rdunlock(&accesslog_lock);
+	}
+}
+
+/*
+ *	Write out everything in a ring. Returns the number of lines written.
+ */
+
+static int hlog_ring_drain(struct hlog_ring_t *r)
+{
+	struct iovec iov_file[HLOG_IOV_MAX], iov_err[HLOG_IOV_MAX], iov_acc[HLOG_IOV_MAX];
+	int n_file = 0, n_err = 0, n_acc = 0;
+	struct hlog_rec_t *rec;
+	unsigned int tail = r->tail;
+	unsigned int head = r->head;
+	char *line;
+	int lines = 0;
+	
+	/* see the records up to head */
+	__sync_synchronize();
+	
+	hlog_draining = 1;
+	
+	while (tail != head) {
+		rec = (struct hlog_rec_t *)(r->buf + (tail & HLOG_RING_MASK));
+		if (rec->len == 0) {
+			tail += HLOG_RING_SIZE - (tail & HLOG_RING_MASK);
+			continue;
+		}
+		
+		line = (char *)(rec + 1);
+		lines++;
+		
+		if (rec->dest & HLOG_DEST_ACCESS) {
+			iov_acc[n_acc].iov_base = line;
+			iov_acc[n_acc++].iov_len = rec->len;
+		} else {
+			if (rec->dest & L_FILE) {
+				iov_file[n_file].iov_base = line;
+				iov_file[n_file++].iov_len = rec->len;
+			}
+			if (rec->dest & L_STDERR) {
+				iov_err[n_err].iov_base = line;
+				iov_err[n_err++].iov_len = rec->len;
+			}
+			if (rec->dest & L_SYSLOG) {
+				rwl_rdlock(&log_file_lock);
+				syslog(rec->priority, "%.*s", rec->len - rec->msg_off - 1, line + rec->msg_off);
+				rwl_rdunlock(&log_file_lock);
+			}
+		}
+		
+		tail += HLOG_REC_ALIGN(sizeof(*rec) + rec->len);
+		
+		if (n_file == HLOG_IOV_MAX || n_err == HLOG_IOV_MAX || n_acc == HLOG_IOV_MAX) {
+			hlog_writev(L_FILE, iov_file, n_file);
+			hlog_writev(L_STDERR, iov_err, n_err);
+			hlog_writev(HLOG_DEST_ACCESS, iov_acc, n_acc);
+			n_file = n_err = n_acc = 0;
+			
+			/* the lines have been written, give the space back */
+			__sync_synchronize();
+			r->tail = tail;
+		}
+	}
+	
+	hlog_writev(L_FILE, iov_file, n_file);
+	hlog_writev(L_STDERR, iov_err, n_err);
+	hlog_writev(HLOG_DEST_ACCESS, iov_acc, n_acc);
+	
+	__sync_synchronize();
+	r->tail = tail;
+	
+	hlog_draining = 0;
+	
+	return lines;
+}
+
+/*
+ *	Write out all of the rings, and free the rings of threads which
+ *	have exited. Returns the number of lines written.
+ */
+
+static int hlog_drain(void)
+{
+	struct hlog_ring_t *r, **prevp;
+	unsigned long dropped;
+	int lines = 0;
+	
+	pthread_mutex_lock(&hlog_drain_mutex);
+	
+	/* a line logged while writing out a ring must not start over
+	 * with the same rings
+	 */
+	if (hlog_draining) {
+		pthread_mutex_unlock(&hlog_drain_mutex);
+		return 0;
+	}
+	
+	prevp = &hlog_rings;
+	while ((r = *prevp)) {
+		lines += hlog_ring_drain(r);
+		
+		if ((dropped = r->dropped - r->dropped_seen)) {
+			r->dropped_seen += dropped;
+			hlog_lines_dropped += dropped;
+		}
+		
+		if (r->orphaned && r->tail == r->head) {
+			/* new rings may have been linked in at the head of
+			 * the list, find the predecessor again with the lock held
+			 */
+			pthread_mutex_lock(&hlog_rings_mutex);
+			for (prevp = &hlog_rings; *prevp != r; prevp = &(*prevp)->next)
+				;
+			*prevp = r->next;
+			pthread_mutex_unlock(&hlog_rings_mutex);
+			free(r);
+			continue;
+		}
+		
+		prevp = &r->next;
+	}
+	
+	pthread_mutex_unlock(&hlog_drain_mutex);
+	
+	return lines;
+}
+
+/*
+ *	Write out the calling thread's own ring, before a line is written
+ *	directly, so that the thread's lines stay in order
+ */
+
+static void hlog_drain_own(void)
+{
+	struct hlog_ring_t *r;
+	
+	if (!(r = pthread_getspecific(hlog_ring_key)))
+		return;
+	
+	pthread_mutex_lock(&hlog_drain_mutex);
+	if (!hlog_draining)
+		hlog_ring_drain(r);
+	pthread_mutex_unlock(&hlog_drain_mutex);
+}
+
+/*
+ *	Write out all of the rings right away, as the process is going
+ *	down: at exit(), and before abort()
+ */
+
+void hlog_flush(void)
+{
+	if (hlog_async_running)
+		hlog_drain();
+}
+
+static void hlog_thread(void *asdf)
+{
+	sigset_t sigs_to_block;
+	unsigned long dropped_reported = 0;
+	time_t next_report = 0, now;
+	
+	sigemptyset(&sigs_to_block);
+	sigaddset(&sigs_to_block, SIGALRM);
+	sigaddset(&sigs_to_block, SIGINT);
+	sigaddset(&sigs_to_block, SIGTERM);
+	sigaddset(&sigs_to_block, SIGQUIT);
+	sigaddset(&sigs_to_block, SIGHUP);
+	sigaddset(&sigs_to_block, SIGURG);
+	sigaddset(&sigs_to_block, SIGPIPE);
+	sigaddset(&sigs_to_block, SIGUSR1);
+	sigaddset(&sigs_to_block, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
+	
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 12))
+	pthread_setname_np(pthread_self(), "logger");
+#endif
+	
+	while (!hlog_shutting_down) {
+		if (hlog_drain() == 0)
+			poll(NULL, 0, HLOG_IDLE_MS);
+		
+		/* tell about the lost lines, every now and then */
+		if (hlog_lines_dropped != dropped_reported && (now = time(NULL)) >= next_report) {
+			next_report = now + 10;
+			hlog(LOG_WARNING, "Logger: %lu log lines dropped, threads are logging faster than they can be written",
+				hlog_lines_dropped - dropped_reported);
+			dropped_reported = hlog_lines_dropped;
+		}
+	}
+	
+	while (hlog_drain() > 0)
+		;
+}
+
+/*
+ *	Start the logger thread
+ */
+
+int hlog_async_start(pthread_attr_t *attr)
+{
+	int e;
+	
+	pthread_mutexattr_t mut_recursive;
+	
+	if (hlog_async_running)
+		return 0;
+	
+	pthread_mutexattr_init(&mut_recursive);
+	pthread_mutexattr_settype(&mut_recursive, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&hlog_drain_mutex, &mut_recursive);
+	pthread_mutexattr_destroy(&mut_recursive);
+	
+	if (!hlog_atexit_set) {
+		atexit(hlog_flush);
+		hlog_atexit_set = 1;
+	}
+	
+	if ((e = pthread_key_create(&hlog_ring_key, hlog_ring_orphan))) {
+		hlog(LOG_ERR, "hlog_async_start: pthread_key_create failed: %s", strerror(e));
+		return -1;
+	}
+	
+	hlog_shutting_down = 0;
+	
+	if ((e = pthread_create(&hlog_th, attr, (void *)hlog_thread, NULL))) {
+		hlog(LOG_ERR, "hlog_async_start: pthread_create failed: %s", strerror(e));
+		pthread_key_delete(hlog_ring_key);
+		return -1;
+	}
+	
+	hlog_async_running = 1;
+	
+	return 0;
+}
+
+/*
+ *	Stop the logger thread after it has written everything out. This
+ *	is called when the other threads are gone, and the lines logged
+ *	after this are written directly.
+ */
+
+void hlog_async_stop(void)
+{
+	struct hlog_ring_t *r;
+	int e;
+	
+	if (!hlog_async_running)
+		return;
+	
+	hlog_async_running = 0;
+	__sync_synchronize();
+	hlog_shutting_down = 1;
+	
+	if ((e = pthread_join(hlog_th, NULL)))
+		hlog(LOG_ERR, "Could not pthread_join logger thread: %s", strerror(e));
+	
+	pthread_setspecific(hlog_ring_key, NULL);
+	while ((r = hlog_rings)) {
+		hlog_rings = r->next;
+		free(r);
+	}
+	
+	pthread_key_delete(hlog_ring_key);
+}
+
 static int hlog_write(int priority, const char *s)
 {
 	struct tm lt;
@@ -317,6 +824,12 @@ static int hlog_write(int priority, const char *s)
 	char wb[LOG_LEN];
 	int len, w;
 	
+	if (hlog_async_running) {
+		if (priority > LOG_ERR && hlog_enqueue(priority, s) == 0)
+			return 1;
+		hlog_drain_own();
+	}
+	
 	gettimeofday(&tv, NULL);
 	gmtime_r(&tv.tv_sec, &lt);
 	
@@ -342,15 +855,12 @@ static int hlog_write(int priority, const char *s)
 		rwl_rdlock(&log_file_lock);
 		if ((w = write(log_file, wb, len)) != len)
 			fprintf(stderr, "aprsc logger: Could not write to %s (fd %d): %s\n", log_fname, log_file, strerror(errno));
+		if (w > 0)
+			__sync_fetch_and_add(&log_file_size, w);
 		rwl_rdunlock(&log_file_lock);
 		
-		if (log_rotate_size) {
-			off_t l = lseek(log_file, 0, SEEK_CUR);
-			if (l >= log_rotate_size) {
-				rotate_log();
-			}
-		}
-		
+		if (log_rotate_size && log_file_size >= log_rotate_size)
+			rotate_log();
 	}
 	
 	if (log_dest & L_SYSLOG) {
@@ -492,6 +1002,19 @@ int accesslog(const char *fmt, ...)
 	len = snprintf(wb, LOG_LEN, "[%4.4d/%2.2d/%2.2d %2.2d:%2.2d:%2.2d] %s\n",
 		lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec, s);
 	wb[LOG_LEN-1] = 0;
+	if (len >= LOG_LEN) {
+		len = LOG_LEN-1;
+		wb[LOG_LEN-2] = '\n';
+	}
+	
+	if (hlog_async_running) {
+		struct hlog_ring_t *r = hlog_ring_get();
+		
+		if (r) {
+			hlog_ring_put(r, LOG_INFO, HLOG_DEST_ACCESS, wb, len, 0);
+			return 1;
+		}
+	}
 	
 	rwl_rdlock(&accesslog_lock);
 	if (accesslog_file >= 0) {
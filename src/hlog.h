@@ -27,6 +27,7 @@
 #define LOG_DESTS "syslog stderr file"
 
 #include <syslog.h>
+#include <pthread.h>
 
 extern char *log_levelnames[];
 extern char *log_destnames[];
@@ -51,6 +52,11 @@ extern int accesslog_open(char *logd, int reopen);
 extern int accesslog_close(char *reopenpath);
 extern int accesslog(const char *fmt, ...);
 
+extern unsigned long hlog_lines_dropped;
+extern int hlog_async_start(pthread_attr_t *attr);
+extern void hlog_async_stop(void);
+extern void hlog_flush(void);
+
 extern int writepid(char *name);
 extern int closepid(void);
 
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include <event2/event.h>  
 #include <event2/http.h>  
@@ -42,10 +44,13 @@
 #include "hmalloc.h"
 #include "worker.h"
 #include "status.h"
+#include "metrics.h"
+#include "accept.h"
 #include "passcode.h"
 #include "incoming.h"
 #include "login.h"
 #include "counterdata.h"
+#include "affinity.h"
 
 #ifdef HAVE_LIBZ
 #include <zlib.h>
@@ -503,22 +508,248 @@ static void http_send_reply_ok(struct evhttp_request *r, struct evkeyvalq *heade
 }
 
 
+/*
+ *	Streamed responses: the data is added to the reply buffer in
+ *	pieces as it is generated, and compressed on the way if the
+ *	client supports it, so that it needs not be collected into a
+ *	single string first.
+ */
+
+struct http_stream_t {
+	struct evbuffer *buffer;
+#ifdef HAVE_LIBZ
+	int compress;
+	z_stream ctx;
+#endif
+};
+
+#ifdef HAVE_LIBZ
+static int http_stream_deflate(struct http_stream_t *st, const char *data, int len, int flush)
+{
+	char out[16384];
+	int ret;
+	
+	st->ctx.next_in = (unsigned char *)data;
+	st->ctx.avail_in = len;
+	
+	do {
+		st->ctx.next_out = (unsigned char *)out;
+		st->ctx.avail_out = sizeof(out);
+		ret = deflate(&st->ctx, flush);
+		if (ret == Z_STREAM_ERROR) {
+			hlog(LOG_ERR, "http_stream_deflate: deflate failed");
+			return -1;
+		}
+		if (evbuffer_add(st->buffer, out, sizeof(out) - st->ctx.avail_out))
+			return -1;
+	} while (st->ctx.avail_out == 0);
+	
+	return 0;
+}
+#endif
+
+static int http_stream_write(void *arg, const char *data, int len)
+{
+	struct http_stream_t *st = arg;
+	
+#ifdef HAVE_LIBZ
+	if (st->compress)
+		return http_stream_deflate(st, data, len, Z_NO_FLUSH);
+#endif
+	
+	return evbuffer_add(st->buffer, data, len);
+}
+
+static void http_stream_start(struct evhttp_request *r, struct evkeyvalq *headers, struct http_stream_t *st, int allow_compress)
+{
+	st->buffer = evbuffer_new();
+	
+#ifdef HAVE_LIBZ
+	st->compress = 0;
+	
+	if (allow_compress && http_check_req_compressed(r) == HTTP_COMPR_GZIP) {
+		st->ctx.zalloc = Z_NULL;
+		st->ctx.zfree = Z_NULL;
+		st->ctx.opaque = Z_NULL;
+		
+		/* magic 15 bits + 16 enables gzip header generation */
+		if (deflateInit2(&st->ctx, 7, Z_DEFLATED, (15+16), MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+			hlog(LOG_ERR, "http_stream_start: deflateInit2 failed");
+		} else {
+			st->compress = 1;
+			evhttp_add_header(headers, "Content-Encoding", "gzip");
+		}
+	}
+#endif
+}
+
+static void http_stream_finish(struct evhttp_request *r, struct http_stream_t *st, int failed)
+{
+#ifdef HAVE_LIBZ
+	if (st->compress) {
+		if (!failed && http_stream_deflate(st, NULL, 0, Z_FINISH))
+			failed = 1;
+		(void)deflateEnd(&st->ctx);
+	}
+#endif
+	
+	if (failed) {
+		evhttp_remove_header(evhttp_request_get_output_headers(r), "Content-Encoding");
+		evhttp_send_error(r, HTTP_INTERNAL, "Internal error");
+	} else {
+		evhttp_send_reply(r, HTTP_OK, "OK", st->buffer);
+	}
+	
+	evbuffer_free(st->buffer);
+}
+
 /*
  *	Generate a status JSON response
  */
 
 static void http_status(struct evhttp_request *r)
 {
-	char *json;
+	struct http_stream_t st;
+	int failed;
 	
 	struct evkeyvalq *headers = evhttp_request_get_output_headers(r);
 	http_header_base(headers, tick);
 	evhttp_add_header(headers, "Content-Type", "application/json; charset=UTF-8");
 	evhttp_add_header(headers, "Cache-Control", "max-age=9");
 	
-	json = status_json_string(0, 0);
-	http_send_reply_ok(r, headers, json, strlen(json), 1);
-	free(json);
+	worker_snapshots_refresh();
+	
+	http_stream_start(r, headers, &st, 1);
+	failed = status_json_write(http_stream_write, &st, 0);
+	http_stream_finish(r, &st, failed);
+}
+
+/*
+ *	Generate the Prometheus metrics
+ */
+
+static void http_metrics(struct evhttp_request *r)
+{
+	struct http_stream_t st;
+	int failed;
+	
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(r);
+	http_header_base(headers, tick);
+	evhttp_add_header(headers, "Content-Type", METRICS_CONTENT_TYPE);
+	evhttp_add_header(headers, "Cache-Control", "no-cache");
+	
+	http_stream_start(r, headers, &st, 1);
+	failed = metrics_write(http_stream_write, &st);
+	http_stream_finish(r, &st, failed);
+}
+
+/*
+ *	Parse a numeric query parameter. The value is left untouched if
+ *	the parameter is not given, returns -1 if it is not a valid number.
+ */
+
+static int http_query_number(struct evkeyvalq *args, const char *name, long long *v, long long min, long long max)
+{
+	const char *s = evhttp_find_header(args, name);
+	char *end;
+	long long l;
+	
+	if (!s)
+		return 0;
+	
+	errno = 0;
+	l = strtoll(s, &end, 10);
+	if (end == s || *end || errno || l < min || l > max)
+		return -1;
+	
+	*v = l;
+	
+	return 0;
+}
+
+/*
+ *	Client list API: a page of the clients, uplinks or peers,
+ *	filtered and sorted as requested
+ */
+
+#define HTTP_CLIENTS_LIMIT_DEFAULT	100
+#define HTTP_CLIENTS_LIMIT_MAX		1000
+
+static void http_clients(struct evhttp_request *r, int type)
+{
+	struct status_client_query_t q;
+	struct evkeyvalq args;
+	struct http_stream_t st;
+	const char *query, *s;
+	long long offset = 0, limit = HTTP_CLIENTS_LIMIT_DEFAULT, worker = -1, listener = -1;
+	int failed;
+	
+	memset(&q, 0, sizeof(q));
+	q.type = type;
+	q.sort = STATUS_SORT_USERNAME;
+	
+	query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(r));
+	if (evhttp_parse_query_str((query) ? query : "", &args) != 0) {
+		evhttp_send_error(r, HTTP_BADREQUEST, "Bad request, could not parse query");
+		return;
+	}
+	
+	if (http_query_number(&args, "offset", &offset, 0, INT_MAX)
+	    || http_query_number(&args, "limit", &limit, 0, HTTP_CLIENTS_LIMIT_MAX)
+	    || http_query_number(&args, "worker", &worker, 0, INT_MAX)
+	    || http_query_number(&args, "listener", &listener, INT_MIN, INT_MAX)
+	    || http_query_number(&args, "min_bytes_rx", &q.min_bytes_rx, 0, LLONG_MAX)
+	    || http_query_number(&args, "min_bytes_tx", &q.min_bytes_tx, 0, LLONG_MAX)
+	    || http_query_number(&args, "min_pkts_rx", &q.min_pkts_rx, 0, LLONG_MAX)
+	    || http_query_number(&args, "min_pkts_tx", &q.min_pkts_tx, 0, LLONG_MAX)) {
+		evhttp_send_error(r, HTTP_BADREQUEST, "Bad request, invalid number");
+		goto out;
+	}
+	
+	q.offset = offset;
+	q.limit = limit;
+	q.worker = worker;
+	
+	if (evhttp_find_header(&args, "listener")) {
+		if (accept_listener_hash_id(listener, &q.listener_id)) {
+			evhttp_send_error(r, HTTP_BADREQUEST, "Bad request, no such listener");
+			goto out;
+		}
+		q.listener_set = 1;
+	}
+	
+	if ((s = evhttp_find_header(&args, "sort")) && (q.sort = status_client_sort_key(s)) < 0) {
+		evhttp_send_error(r, HTTP_BADREQUEST, "Bad request, unknown sort key");
+		goto out;
+	}
+	
+	if ((s = evhttp_find_header(&args, "order"))) {
+		if (strcmp(s, "desc") == 0) {
+			q.desc = 1;
+		} else if (strcmp(s, "asc") != 0) {
+			evhttp_send_error(r, HTTP_BADREQUEST, "Bad request, order must be asc or desc");
+			goto out;
+		}
+	}
+	
+	if ((s = evhttp_find_header(&args, "username")) && *s)
+		q.username = s;
+	if ((s = evhttp_find_header(&args, "app")) && *s)
+		q.app_name = s;
+	
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(r);
+	http_header_base(headers, tick);
+	evhttp_add_header(headers, "Content-Type", "application/json; charset=UTF-8");
+	evhttp_add_header(headers, "Cache-Control", "max-age=1");
+	
+	worker_snapshots_refresh();
+	
+	http_stream_start(r, headers, &st, 1);
+	failed = status_clients_write(http_stream_write, &st, &q);
+	http_stream_finish(r, &st, failed);
+	
+out:
+	evhttp_clear_headers(&args);
 }
 
 /*
@@ -725,6 +956,26 @@ static void http_router(struct evhttp_request *r, void *which_server)
 			return;
 		}
 		
+		if (strcmp(uri, "/metrics") == 0 || strncmp(uri, "/metrics?", 9) == 0) {
+			http_metrics(r);
+			return;
+		}
+		
+		if (strncmp(uri, "/clients.json", 13) == 0) {
+			http_clients(r, SNAPSHOT_CLIENT);
+			return;
+		}
+		
+		if (strncmp(uri, "/uplinks.json", 13) == 0) {
+			http_clients(r, SNAPSHOT_UPLINK);
+			return;
+		}
+		
+		if (strncmp(uri, "/peers.json", 11) == 0) {
+			http_clients(r, SNAPSHOT_PEER);
+			return;
+		}
+		
 		if (strncmp(uri, "/counterdata?", 13) == 0) {
 			http_counterdata(r, uri);
 			return;
@@ -763,9 +1014,12 @@ struct evhttp *srvr_upload = NULL;
 struct event_base *libbase = NULL;
 
 /*
- *	HTTP timer event, mainly to catch the shutdown signal
+ *	HTTP timer event, mainly to catch the shutdown signal, and to
+ *	pick up a changed CPU affinity configuration
  */
 
+static int http_affinity_generation;
+
 static void http_timer(evutil_socket_t fd, short events, void *arg)
 {
 	struct timeval http_timer_tv;
@@ -774,6 +1028,8 @@ static void http_timer(evutil_socket_t fd, short events, void *arg)
 	
 	//hlog(LOG_DEBUG, "http_timer fired");
 	
+	thread_affinity_update(&http_affinity_generation, AFFINITY_HTTP, 0);
+	
 	if (http_shutting_down || http_reconfiguring) {
 		http_timer_tv.tv_usec = 1000;
 		event_base_loopexit(libbase, &http_timer_tv);
@@ -924,6 +1180,7 @@ void http_thread(void *asdf)
 	http_timer_tv.tv_usec = 200000;
 	
 	pthreads_profiling_reset("http");
+	thread_affinity_update(&http_affinity_generation, AFFINITY_HTTP, 0);
 	
 	sigemptyset(&sigs_to_block);
 	sigaddset(&sigs_to_block, SIGALRM);
@@ -21,7 +21,6 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
-#include <fnmatch.h>
 
 #ifdef HAVE_ALLOCA_H
 #include <alloca.h>
@@ -41,6 +40,9 @@
 #include "cellmalloc.h"
 #include "messaging.h"
 #include "dupecheck.h"
+#include "affinity.h"
+#include "callmatch.h"
+#include "keyhash.h"
 
 /* When adding labels here, remember to add the description strings in
  * web/aprsc.js rx_err_strings, and worker.h constants
@@ -87,8 +89,10 @@ const char *inerr_labels[] = {
 #define incoming_strerror(i) ((i <= 0 && i >= INERR_MIN) ? inerr_labels[i * -1] : inerr_labels[0])
 
 
-/* a static list of source callsigns which are dropped */
-static char *disallow_srccalls[] = {
+/* a static list of source callsigns which are dropped, compiled
+ * to disallow_srccall_matcher together with DisallowSourceCall
+ */
+const char *disallow_srccalls[] = {
 	"N0CALL", /* default in some apps */
 	"NOCALL", /* default in some apps */
 	"SERVER", /* originated by APRS-IS server */
@@ -100,37 +104,85 @@ typedef struct cellarena_t {
   int dummy;
 } cellarena_t;
 #endif
-/* global packet buffer freelists */
+/* global packet buffer freelists: the first set is the default one,
+ * the rest are bound to NUMA nodes and used by workers pinned on them
+ */
 
-cellarena_t *pbuf_cells_small;
-cellarena_t *pbuf_cells_medium;
-cellarena_t *pbuf_cells_large;
+cellarena_t *pbuf_cells_small[NUMA_NODES_MAX+1];
+cellarena_t *pbuf_cells_medium[NUMA_NODES_MAX+1];
+cellarena_t *pbuf_cells_large[NUMA_NODES_MAX+1];
+
+static pthread_mutex_t pbuf_numa_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int pbuf_cells_kb = 2048; /* 2M bunches is faster for system than 16M ! */
 
+/* purger statistics: buffers returned to the allocating worker / to the global pools */
+long long pbuf_freed_returned;
+long long pbuf_freed_global;
+
 /*
  *	Get a buffer for a packet
  *
  *	pbuf_t buffers are accumulated into each worker local buffer in small sets,
- *	and then used from there.  The buffers are returned into global pools.
+ *	and then used from there.  The purger returns freed buffers to the
+ *	worker which allocated them, or into global pools if that worker
+ *	is gone or already has plenty of them queued.
  */
 
-void pbuf_init(void)
-{
 #ifndef _FOR_VALGRIND_
-	pbuf_cells_small  = cellinit( "pbuf small",
+static void pbuf_init_pool(int pool)
+{
+	pbuf_cells_small[pool]  = cellinit( "pbuf small",
 				      sizeof(struct pbuf_t) + PACKETLEN_MAX_SMALL,
-				      __alignof__(struct pbuf_t), CELLMALLOC_POLICY_FIFO,
+				      PBUF_CACHELINE, CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_HUGEPAGES | CELLMALLOC_POLICY_COMPACT,
 				      pbuf_cells_kb /* n kB at the time */, 0 /* minfree */ );
-	pbuf_cells_medium = cellinit( "pbuf medium",
+	pbuf_cells_medium[pool] = cellinit( "pbuf medium",
 				      sizeof(struct pbuf_t) + PACKETLEN_MAX_MEDIUM,
-				      __alignof__(struct pbuf_t), CELLMALLOC_POLICY_FIFO,
+				      PBUF_CACHELINE, CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_HUGEPAGES | CELLMALLOC_POLICY_COMPACT,
 				      pbuf_cells_kb /* n kB at the time */, 0 /* minfree */ );
-	pbuf_cells_large  = cellinit( "pbuf large",
+	pbuf_cells_large[pool]  = cellinit( "pbuf large",
 				      sizeof(struct pbuf_t) + PACKETLEN_MAX_LARGE,
-				      __alignof__(struct pbuf_t), CELLMALLOC_POLICY_FIFO,
+				      PBUF_CACHELINE, CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_HUGEPAGES | CELLMALLOC_POLICY_COMPACT,
 				      pbuf_cells_kb /* n kB at the time */, 0 /* minfree */ );
+	
+	if (pool) {
+		cellnumanode(pbuf_cells_small[pool], pool - 1);
+		cellnumanode(pbuf_cells_medium[pool], pool - 1);
+		cellnumanode(pbuf_cells_large[pool], pool - 1);
+	}
+}
+#endif
+
+void pbuf_init(void)
+{
+#ifndef _FOR_VALGRIND_
+	pbuf_init_pool(0);
+#endif
+}
+
+/*
+ *	pbuf_numa_pool  returns the index of the global pools for
+ *			a NUMA node, and sets them up on first use.
+ *			Called by workers when they have been pinned.
+ */
+
+int pbuf_numa_pool(int node)
+{
+	int pool;
+	
+	if (node < 0 || node >= NUMA_NODES_MAX)
+		return 0;
+	
+	pool = node + 1;
+	
+#ifndef _FOR_VALGRIND_
+	pthread_mutex_lock(&pbuf_numa_mutex);
+	if (!pbuf_cells_small[pool])
+		pbuf_init_pool(pool);
+	pthread_mutex_unlock(&pbuf_numa_mutex);
 #endif
+	
+	return pool;
 }
 
 /*
@@ -173,13 +225,13 @@ void pbuf_free(struct worker_t *self, struct pbuf_t *p)
 
 	switch (p->buf_len) {
 	case PACKETLEN_MAX_SMALL:
-		cellfree(pbuf_cells_small, p);
+		cellfree(pbuf_cells_small[p->numa_pool], p);
 		break;
 	case PACKETLEN_MAX_MEDIUM:
-		cellfree(pbuf_cells_medium, p);
+		cellfree(pbuf_cells_medium[p->numa_pool], p);
 		break;
 	case PACKETLEN_MAX_LARGE:
-		cellfree(pbuf_cells_large, p);
+		cellfree(pbuf_cells_large[p->numa_pool], p);
 		break;
 	default:
 		hlog(LOG_ERR, "pbuf_free(%p) - packet length not known: %d", p, p->buf_len);
@@ -193,9 +245,69 @@ void pbuf_free(struct worker_t *self, struct pbuf_t *p)
 }
 
 /*
- *	pbuf_free_many  sends buffers back to the global pool in groups
+ *	pbuf_return_push  pushes a chain of freed buffers to the return
+ *			queue of the worker which allocated them. Lock-free,
+ *			the worker grabs the whole queue with an atomic swap.
+ */
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+static void pbuf_return_push(struct worker_t *w, struct pbuf_t *first, struct pbuf_t *last, int count)
+{
+	struct pbuf_t *head;
+	
+	do {
+		head = w->pbuf_return;
+		last->next = head;
+	} while (!__sync_bool_compare_and_swap(&w->pbuf_return, head, first));
+	
+	__sync_fetch_and_add(&w->pbuf_return_count, count);
+}
+
+/*
+ *	pbuf_return_collect  grabs the buffers returned to this worker
+ *			and sorts them to the thread-local freelists.
+ */
+
+static void pbuf_return_collect(struct worker_t *self)
+{
+	struct pbuf_t *pb, *pn;
+	int n = 0;
+	
+	pb = __sync_lock_test_and_set(&self->pbuf_return, NULL);
+	
+	for (; (pb); pb = pn) {
+		pn = pb->next;
+		switch (pb->buf_len) {
+		case PACKETLEN_MAX_SMALL:
+			pb->next = self->pbuf_free_small;
+			self->pbuf_free_small = pb;
+			break;
+		case PACKETLEN_MAX_MEDIUM:
+			pb->next = self->pbuf_free_medium;
+			self->pbuf_free_medium = pb;
+			break;
+		default:
+			pb->next = self->pbuf_free_large;
+			self->pbuf_free_large = pb;
+			break;
+		}
+		n++;
+	}
+	
+	if (n) {
+		__sync_fetch_and_sub(&self->pbuf_return_count, n);
+		self->pbuf_recycled_local += n;
+	}
+}
+#endif
+
+/*
+ *	pbuf_free_many  sends buffers back to the workers which allocated
+ *			them, and the rest to the global pool in groups
  *                      after size sorting them...  
  *			Multiple cells are returned with single mutex.
+ *			The caller must hold pbuf_global_rwlock, so that
+ *			the worker list does not change under us.
  */
 
 void pbuf_free_many(struct pbuf_t **array, int numbufs)
@@ -204,41 +316,108 @@ void pbuf_free_many(struct pbuf_t **array, int numbufs)
 	void **arraysmall   = alloca(sizeof(void*)*numbufs);
 	void **arraymedium  = alloca(sizeof(void*)*numbufs);
 	void **arraylarge   = alloca(sizeof(void*)*numbufs);
-	int smallcnt = 0, mediumcnt = 0, largecnt = 0;
+	struct pbuf_t **rest = alloca(sizeof(void*)*numbufs);
+	int smallcnt, mediumcnt, largecnt;
+	int restcnt = 0, pool, k;
+#if defined(HAVE_SYNC_FETCH_AND_ADD) && !defined(_FOR_VALGRIND_)
+	struct worker_t *w;
+	struct worker_t **owners;
+	struct pbuf_t **first, **last;
+	int *counts;
+	int nworkers = 0, j;
+	
+	for (w = worker_threads; (w); w = w->next)
+		nworkers++;
+	
+	owners = alloca(sizeof(*owners) * (nworkers + 1));
+	first  = alloca(sizeof(*first) * (nworkers + 1));
+	last   = alloca(sizeof(*last) * (nworkers + 1));
+	counts = alloca(sizeof(*counts) * (nworkers + 1));
+	
+	for (w = worker_threads, j = 0; (w); w = w->next, j++) {
+		owners[j] = w;
+		first[j] = last[j] = NULL;
+		counts[j] = 0;
+	}
+#endif
 
 	for (i = 0; i < numbufs; ++i) {
 		array[i]->is_free = 1;
 		//__sync_synchronize();
-		switch (array[i]->buf_len) {
-		case PACKETLEN_MAX_SMALL:
-			arraysmall [smallcnt++]  = array[i];
-			break;
-		case PACKETLEN_MAX_MEDIUM:
-			arraymedium[mediumcnt++] = array[i];
-			break;
-		case PACKETLEN_MAX_LARGE:
-			arraylarge [largecnt++]  = array[i];
-			break;
-		default:
-		  hlog( LOG_ERR, "pbuf_free_many(%p) - packet length not known: %d :%d",
-			array[i], array[i]->buf_len, array[i]->packet_len );
-			break;
+#if defined(HAVE_SYNC_FETCH_AND_ADD) && !defined(_FOR_VALGRIND_)
+		/* Give it back to the worker which allocated it, if that
+		 * worker is still running. http and udp workers are not
+		 * on the list, their buffers go to the global pool.
+		 */
+		for (j = 0; j < nworkers; j++)
+			if (owners[j] == array[i]->owner)
+				break;
+		
+		if (j < nworkers && owners[j]->pbuf_return_count + counts[j] < PBUF_RETURN_MAX) {
+			array[i]->next = first[j];
+			if (!first[j])
+				last[j] = array[i];
+			first[j] = array[i];
+			counts[j]++;
+			continue;
 		}
+#endif
+		rest[restcnt++] = array[i];
 	}
 
 	// hlog( LOG_DEBUG, "pbuf_free_many(); counts: small %d large %d huge %d", smallcnt, mediumcnt, largecnt );
 
+#if defined(HAVE_SYNC_FETCH_AND_ADD) && !defined(_FOR_VALGRIND_)
+	for (j = 0; j < nworkers; j++) {
+		if (counts[j]) {
+			pbuf_return_push(owners[j], first[j], last[j], counts[j]);
+			pbuf_freed_returned += counts[j];
+		}
+	}
+#endif
+
 #ifndef _FOR_VALGRIND_
-	if (smallcnt > 0)
-		cellfreemany(pbuf_cells_small,  arraysmall,  smallcnt);
-	if (mediumcnt > 0)
-		cellfreemany(pbuf_cells_medium, arraymedium, mediumcnt);
-	if (largecnt > 0)
-		cellfreemany(pbuf_cells_large,  arraylarge,  largecnt);
+	pbuf_freed_global += restcnt;
+	
+	/* The rest go to the global pools, sorted by size, one pool set
+	 * at a time. Without NUMA pinning there's just the default set.
+	 */
+	for (pool = 0; restcnt > 0 && pool <= NUMA_NODES_MAX; pool++) {
+		smallcnt = mediumcnt = largecnt = 0;
+		for (i = 0, k = 0; i < restcnt; i++) {
+			if (rest[i]->numa_pool != pool) {
+				rest[k++] = rest[i];
+				continue;
+			}
+			switch (rest[i]->buf_len) {
+			case PACKETLEN_MAX_SMALL:
+				arraysmall [smallcnt++]  = rest[i];
+				break;
+			case PACKETLEN_MAX_MEDIUM:
+				arraymedium[mediumcnt++] = rest[i];
+				break;
+			case PACKETLEN_MAX_LARGE:
+				arraylarge [largecnt++]  = rest[i];
+				break;
+			default:
+			  hlog( LOG_ERR, "pbuf_free_many(%p) - packet length not known: %d :%d",
+				rest[i], rest[i]->buf_len, rest[i]->packet_len );
+				break;
+			}
+		}
+		restcnt = k;
+		
+		if (smallcnt > 0)
+			cellfreemany(pbuf_cells_small[pool],  arraysmall,  smallcnt);
+		if (mediumcnt > 0)
+			cellfreemany(pbuf_cells_medium[pool], arraymedium, mediumcnt);
+		if (largecnt > 0)
+			cellfreemany(pbuf_cells_large[pool],  arraylarge,  largecnt);
+	}
 
 #else
-	for (i = 0; i < numbufs; ++i) {
-		hfree(array[i]);
+	for (i = 0; i < restcnt; ++i) {
+		hfree(rest[i]);
 	}
 #endif
 }
@@ -279,6 +458,22 @@ void pbuf_dupe_dump(FILE *fp)
 	}
 }
 
+/*
+ *	Initialize the header of a fresh buffer. Only the hot cache line is
+ *	zeroed; of the cold section, incoming_parse() always sets the
+ *	timestamp and the callsign / info pointers, so only the fields
+ *	which the parser may leave untouched are written here.
+ */
+
+static inline void pbuf_init_header(struct pbuf_t *pb, struct worker_t *self, int len)
+{
+	memset(pb, 0, PBUF_HOT_SIZE);
+	pb->owner = self;
+	pb->buf_len = len;
+	pb->dstname = NULL;
+	pb->msgid = NULL;
+}
+
 /*
  *	get a buffer for an incoming packet, from either a thread-local
  *	freelist of preallocated buffers, or from the global cellmalloc
@@ -298,19 +493,19 @@ static struct pbuf_t *pbuf_get(struct worker_t *self, int len)
 	if (len <= PACKETLEN_MAX_SMALL) {
 		//hlog(LOG_DEBUG, "pbuf_get: Allocating small buffer for a packet of %d bytes", len);
 		pool        = &self->pbuf_free_small;
-		global_pool = pbuf_cells_small;
+		global_pool = pbuf_cells_small[self->numa_pool];
 		len         = PACKETLEN_MAX_SMALL;
 		bunchlen    = PBUF_ALLOCATE_BUNCH_SMALL;
 	} else if (len <= PACKETLEN_MAX_MEDIUM) {
 		//hlog(LOG_DEBUG, "pbuf_get: Allocating large buffer for a packet of %d bytes", len);
 		pool        = &self->pbuf_free_medium;
-		global_pool = pbuf_cells_medium;
+		global_pool = pbuf_cells_medium[self->numa_pool];
 		len         = PACKETLEN_MAX_MEDIUM;
 		bunchlen    = PBUF_ALLOCATE_BUNCH_MEDIUM;
 	} else if (len <= PACKETLEN_MAX_LARGE) {
 		//hlog(LOG_DEBUG, "pbuf_get: Allocating huge buffer for a packet of %d bytes", len);
 		pool        = &self->pbuf_free_large;
-		global_pool = pbuf_cells_large;
+		global_pool = pbuf_cells_large[self->numa_pool];
 		len         = PACKETLEN_MAX_LARGE;
 		bunchlen    = PBUF_ALLOCATE_BUNCH_LARGE;
 	} else { /* too large! */
@@ -320,6 +515,14 @@ static struct pbuf_t *pbuf_get(struct worker_t *self, int len)
 
 	allocarray = alloca(bunchlen * sizeof(void*));
 
+#if defined(HAVE_SYNC_FETCH_AND_ADD) && !defined(_FOR_VALGRIND_)
+	/* The local list is empty... see if the purger has given us
+	 * some buffers back, before going for the global pool.
+	 */
+	if (!*pool && self->pbuf_return)
+		pbuf_return_collect(self);
+#endif
+
 	if (*pool) {
 		/* fine, just get the first buffer from the freelist pool...
 		 * the pool is not doubly linked (not necessary)
@@ -327,11 +530,8 @@ static struct pbuf_t *pbuf_get(struct worker_t *self, int len)
 		pb = *pool;
 		*pool = pb->next;
 
-		/* zero all header fields */
-		memset(pb, 0, sizeof(*pb));
-
 		/* we know the length in this sub-pool, set it */
-		pb->buf_len = len;
+		pbuf_init_header(pb, self, len);
 
 		// hlog(LOG_DEBUG, "pbuf_get(%d): got one buf from local pool: %p", len, pb);
 
@@ -346,26 +546,27 @@ static struct pbuf_t *pbuf_get(struct worker_t *self, int len)
 		hlog(LOG_CRIT, "aprsc: Out of memory: Could not allocate packet buffers!");
 		return NULL;
 	}
+	
+	self->pbuf_alloc_global += bunchlen;
 
 	for ( i = 1;  i < bunchlen; ++i ) {
 		pb = allocarray[i];
 		pb->is_free = 0;
 		pb->next    = *pool;
 		pb->buf_len = len; // this is necessary for worker local pool discard at worker shutdown
+		pb->numa_pool = self->numa_pool;
 		*pool = pb;
 	}
 
 	pb = allocarray[0];
+	pb->numa_pool = self->numa_pool;
 
 	// hlog(LOG_DEBUG, "pbuf_get(%d): got %d bufs from global pool %p", len, bunchlen, pool);
 
 	/* ok, return the first buffer from the pool */
 
-	/* zero all header fields */
-	memset(pb, 0, sizeof(*pb));
-
 	/* we know the length in this sub-pool, set it */
-	pb->buf_len = len;
+	pbuf_init_header(pb, self, len);
 	
 	return pb;
 
@@ -471,22 +672,6 @@ static char *memcasestr(char *needle, char *haystack, char *haystack_end)
 	return NULL;
 }
 
-/*
- *	Check if the digipeater path includes elements indicating that the
- *	packet should be dropped.
- */
-
-static int digi_path_drop(char *via_start, int via_len)
-{
-	if (memmem(via_start, via_len, ",NOGATE", 7))
-		return 1;
-		
-	if (memmem(via_start, via_len, ",RFONLY", 7))
-		return 1;
-		
-	return 0;
-}
-
 /*
  *	Check if a callsign is good for srccall/dstcall
  *	(valid APRS-IS callsign, * not allowed)
@@ -541,56 +726,6 @@ int check_invalid_src_dst(const char *call, int len)
 	return 0;
 }
 
-/*
- *	Check callsign against a list to see if it matches
- */
- 
-int check_call_match(const char **set, const char *call, int len)
-{
-	int i;
-	
-	for (i = 0; (set[i]); i++) {
-		if (strncmp(call, set[i], len) == 0 && strlen(set[i]) == len)
-			return -1;
-	}
-	
-	return 0;
-}
-
-static int check_call_prefix_match(char **set, const char *call, int len)
-{
-	int i, l;
-	
-	for (i = 0; (set[i]); i++) {
-		l = strlen(set[i]);
-		if (len >= l && strncmp(call, set[i], l) == 0)
-			return -1;
-	}
-	
-	return 0;
-}
-
-#define MAX_TEST_CALL_LEN 32
-int check_call_glob_match(char **set, const char *call, int len)
-{
-	int i;
-	char ts[MAX_TEST_CALL_LEN+1];
-	
-	if (len > MAX_TEST_CALL_LEN)
-		return 0; /* no match */
-	
-	/* glob match requires having a null-terminated string */
-	memcpy(ts, call, len);
-	ts[len] = 0;
-	
-	for (i = 0; (set[i]); i++) {
-		if (fnmatch(set[i], ts, FNM_CASEFOLD) == 0)
-			return -1;
-	}
-	
-	return 0;
-}
-
 /*
  *	Check if a callsign is good for a digi path entry
  *	(valid APRS-IS callsign, * allowed in end)
@@ -683,6 +818,106 @@ int check_path_calls(const char *via_start, const char *path_end)
 	return calls;
 }
 
+/*
+ *	Split the header of a packet to elements in a single pass, and
+ *	check the path callsigns on the way. The Q construct code and the
+ *	filters use the offsets, hashes and flags recorded, instead of
+ *	scanning the header again.
+ */
+
+int header_tokenize(struct header_tokens_t *ht, const char *s, int len)
+{
+	const char *packet_end = s + len;
+	const char *src_max = s + ((len < CALLSIGNLEN_MAX+1) ? len : CALLSIGNLEN_MAX+1);
+	const char *p = s;
+	const char *e;
+	struct header_elem_t *el;
+	uint32_t hash;
+	int after_q = 0;
+	
+	ht->flags = 0;
+	ht->q_elem = -1;
+	ht->elem_count = 0;
+	
+	/* look for the '>' after the srccall */
+	hash = KEYHASH_INIT;
+	while (p < src_max && *p != '>' && *p != ':')
+		hash = keyhashuc_add(hash, (uint8_t)*p++);
+	
+	if (p == src_max || *p == ':') {
+		if (memchr(p, ':', packet_end - p))
+			return INERR_NO_DST; // No ">" in packet start..
+		return INERR_NO_COLON; // No ":" in the packet
+	}
+	
+	ht->src_len = p - s;
+	ht->src_hash = hash;
+	p++;
+	
+	/* dstcall and the path elements, up to the ':' */
+	while (1) {
+		hash = KEYHASH_INIT;
+		for (e = p; e < packet_end && *e != ',' && *e != ':'; e++)
+			hash = keyhashuc_add(hash, (uint8_t)*e);
+		
+		if (e == packet_end)
+			return INERR_NO_COLON;
+		
+		/* a comma right before the ':' does not make an element */
+		if (e == p && *e == ':' && ht->elem_count > 0)
+			break;
+		
+		if (ht->elem_count == HEADER_ELEMS_MAX)
+			return INERR_INV_PATH_CALL;
+		
+		el = &ht->elem[ht->elem_count];
+		el->off = p - s;
+		el->len = e - p;
+		el->flags = 0;
+		el->hash = hash;
+		
+		if (ht->elem_count == 0) {
+			/* dstcall, the SSID is not included in the dupecheck */
+			const char *ssid = memchr(p, '-', e - p);
+			ht->dst_ssid = (ssid) ? ssid - p : e - p;
+		} else {
+			if (*p == 'q') {
+				if (ht->q_elem < 0)
+					ht->q_elem = ht->elem_count;
+				if (e - p == 3) {
+					el->flags |= HEADER_ELEM_Q;
+					after_q = 1;
+				}
+			} else if (e - p >= 5) {
+				if (e - p == 6 && memcmp(p, "TCPIP*", 6) == 0) {
+					el->flags |= HEADER_ELEM_TCPIP;
+					ht->flags |= HEADER_TCPIP;
+				} else if (memcmp(p, "TCPXX", 5) == 0) {
+					el->flags |= HEADER_ELEM_TCPXX;
+					ht->flags |= HEADER_TCPXX;
+				} else if (e - p >= 6 && memcmp(p, "NOGATE", 6) == 0) {
+					ht->flags |= HEADER_NOGATE;
+				} else if (e - p >= 6 && memcmp(p, "RFONLY", 6) == 0) {
+					ht->flags |= HEADER_RFONLY;
+				}
+			}
+			
+			if (!(el->flags & HEADER_ELEM_Q) && check_invalid_path_callsign(p, e - p, after_q) != 0)
+				ht->flags |= HEADER_INVALID_PATH;
+		}
+		
+		ht->elem_count++;
+		p = e + 1;
+		
+		if (*e == ':')
+			break;
+	}
+	
+	ht->path_end = e - s;
+	
+	return 0;
+}
+
 /*
  *	Handle incoming messages to SERVER
  */
@@ -776,6 +1011,9 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	int originated_by_client = 0;
 	char *p;
 	char quirked[PACKETLEN_MAX+2]; /* rewritten packet */
+	struct header_tokens_t ht; /* the header, split to elements */
+	char *tcpip_limit;
+	int i;
 	
 	/* for quirky clients, do some special treatment: build a new copy of
 	 * the packet with extra spaces removed from packets
@@ -856,20 +1094,18 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	 * SRCCALL>DSTCALL,PATH,PATH:INFO\r\n
 	 * (we have normalized the \r\n by now)
 	 */
-
-	path_end = memchr(s, ':', len);
-	if (!path_end)
-		return INERR_NO_COLON; // No ":" in the packet
+	rc = header_tokenize(&ht, s, len);
+	if (rc < 0)
+		return rc;
+	
+	path_end = s + ht.path_end;
 	pathlen = path_end - s;
 
 	data = path_end;            // Begins with ":"
 	datalen = len - pathlen;    // Not including line end \r\n
 
-	/* look for the '>' */
-	src_end = memchr(s, '>', pathlen < CALLSIGNLEN_MAX+1 ? pathlen : CALLSIGNLEN_MAX+1);
-	if (!src_end)
-		return INERR_NO_DST;	// No ">" in packet start..
-	src_len = src_end - s;
+	src_len = ht.src_len;
+	src_end = s + src_len;
 	
 	path_start = src_end+1;
 	if (path_start >= packet_end)	// We're already at the path end
@@ -878,10 +1114,7 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	if (check_invalid_src_dst(s, src_len) != 0)
 		return INERR_INV_SRCCALL; /* invalid or too long for source callsign */
 	
-	if (check_call_prefix_match(disallow_srccalls, s, src_len))
-		return INERR_DIS_SRCCALL; /* disallowed srccall */
-	
-	if (disallow_srccall_glob && check_call_glob_match(disallow_srccall_glob, s, src_len))
+	if (callmatch_match(disallow_srccall_matcher, s, src_len))
 		return INERR_DIS_SRCCALL; /* disallowed srccall */
 	
 	info_start = path_end+1;	// @":"+1 - first char of the payload
@@ -897,12 +1130,8 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	 * mic-e parser wants it)
 	 */
 
-	dstcall_end = path_start;
-	while (dstcall_end < path_end && *dstcall_end != '-' && *dstcall_end != ',' && *dstcall_end != ':')
-		dstcall_end++;
-	dstcall_end_or_ssid = dstcall_end; // OK, SSID is here (or the dstcall end), go for the real end
-	while (dstcall_end < path_end && *dstcall_end != ',' && *dstcall_end != ':')
-		dstcall_end++;
+	dstcall_end_or_ssid = path_start + ht.dst_ssid;
+	dstcall_end = path_start + ht.elem[0].len;
 	
 	if (check_invalid_src_dst(path_start, dstcall_end - path_start))
 		return INERR_INV_DSTCALL; /* invalid or too long for destination callsign */
@@ -917,12 +1146,11 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	/* check if the path contains NOGATE or other signs which tell the
 	 * packet should be dropped
 	 */
-	int via_len = path_end - via_start;
-	if (digi_path_drop(via_start, via_len))
+	if (ht.flags & (HEADER_NOGATE | HEADER_RFONLY))
 		return INERR_NOGATE;
 	
-	/* check if there are invalid callsigns in the digipeater path before Q */
-	if (check_path_calls(via_start, path_end) == -1)
+	/* check if there are invalid callsigns in the digipeater path */
+	if (ht.flags & HEADER_INVALID_PATH)
 		return INERR_INV_PATH_CALL;
 	
 	/* check for 3rd party packets */
@@ -942,7 +1170,7 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	/* process Q construct, path_append_len of path_append will be copied
 	 * to the end of the path later
 	 */
-	path_append_len = q_process( c, s, path_append, sizeof(path_append),
+	path_append_len = q_process( c, s, &ht, path_append, sizeof(path_append),
 					via_start, &path_end, pathlen, &q_start,
 					&q_replace, originated_by_client );
 	
@@ -1058,11 +1286,29 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 	pb->srcname = pb->data;
 	pb->srcname_len = src_len;
 	pb->srccall_end = pb->data + src_len;
+	pb->srccall_hash = ht.src_hash;
 	pb->dstcall_end_or_ssid = pb->data + (dstcall_end_or_ssid - s);
 	pb->dstcall_end = pb->data + (dstcall_end - s);
 	pb->dstcall_len = via_start - src_end - 1;
 	pb->info_start  = info_start;
 	
+	/* Is there a TCPIP* in the path before the Q construct? Only the
+	 * part of the original path which was copied over counts, a
+	 * TCPIP* in a Q construct generated here does not.
+	 */
+	tcpip_limit = (q_replace) ? q_replace : path_end;
+	if (q_start && q_start - 1 < tcpip_limit)
+		tcpip_limit = q_start - 1;
+	
+	if (ht.flags & HEADER_TCPIP) {
+		for (i = 1; i < ht.elem_count; i++) {
+			if ((ht.elem[i].flags & HEADER_ELEM_TCPIP) && s + ht.elem[i].off + ht.elem[i].len <= tcpip_limit) {
+				pb->flags |= F_HAS_TCPIP;
+				break;
+			}
+		}
+	}
+	
 	//hlog_packet(LOG_DEBUG, pb->data, pb->packet_len-2, "After parsing and Qc algorithm: ");
 	
 	/* just try APRS parsing */
@@ -1112,7 +1358,7 @@ int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len)
 			rc = INERR_DISALLOW_UNVERIFIED;
 			goto free_pb_ret;
 		}
-		if (memmem(via_start, via_len, ",TCPXX", 6)) {
+		if (ht.flags & HEADER_TCPXX) {
 			rc = INERR_DISALLOW_UNVERIFIED_PATH;
 			goto free_pb_ret;
 		}
@@ -1140,6 +1386,72 @@ free_pb_ret:
 	return rc;
 }
 
+/*
+ *	Put a packet handed over in a live upgrade back in the incoming
+ *	queue. The packet has been checked and the Q construct processed
+ *	by the old process already, so it only needs to be parsed again.
+ */
+
+int incoming_restore(struct worker_t *self, struct client_t *origin, const char *s, int len, int flags)
+{
+	struct pbuf_t *pb;
+	struct header_tokens_t ht;
+	int rc;
+	
+	/* the packet ends with CRLF */
+	if (len < PACKETLEN_MIN || len > PACKETLEN_MAX_LARGE - 1 || memcmp(s + len - 2, "\r\n", 2) != 0)
+		return INERR_SHORT_PACKET;
+	
+	rc = header_tokenize(&ht, s, len - 2);
+	if (rc < 0)
+		return rc;
+	
+	if (ht.path_end + 1 >= len - 2)
+		return INERR_NO_BODY;
+	
+	/* the filters expect to find a Q construct */
+	if (ht.q_elem < 0)
+		return INERR_Q_BUG;
+	
+	pb = pbuf_get(self, len + 1);
+	if (!pb)
+		return INERR_OUT_OF_PBUFS;
+	
+	pb->next = NULL;
+	pb->flags = flags & (F_DUPE | F_HAS_TCPIP | F_FROM_UPSTR | F_FROM_DOWNSTR);
+	pb->origin = origin;
+	pb->t = tick;
+	
+	memcpy(pb->data, s, len);
+	pb->data[len] = 0;
+	pb->packet_len = len;
+	
+	pb->srcname = pb->data;
+	pb->srcname_len = ht.src_len;
+	pb->srccall_end = pb->data + ht.src_len;
+	pb->srccall_hash = ht.src_hash;
+	pb->dstcall_end_or_ssid = pb->data + ht.src_len + 1 + ht.dst_ssid;
+	pb->dstcall_end = pb->data + ht.src_len + 1 + ht.elem[0].len;
+	pb->dstcall_len = ht.elem[0].len;
+	pb->info_start = pb->data + ht.path_end + 1;
+	pb->qconst_start = pb->data + ht.elem[ht.q_elem].off;
+	
+	rc = parse_aprs(pb);
+	if (rc < 0) {
+		pbuf_free(self, pb);
+		return rc;
+	}
+	
+	filter_preprocess_dupefilter(pb);
+	
+	/* put the buffer in the thread's incoming queue */
+	*self->pbuf_incoming_local_last = pb;
+	self->pbuf_incoming_local_last = &pb->next;
+	self->pbuf_incoming_local_count++;
+	
+	return 0;
+}
+
 /*
  *	Handler called once for each input APRS-IS line by the socket reading function
  *	for normal APRS-IS traffic.
@@ -1176,6 +1488,8 @@ int incoming_handler(struct worker_t *self, struct client_t *c, int l4proto, cha
 		return 0;
 	}
 	
+	worker_rxlen_account(self, len);
+	
 	/* parse and process the packet */
 	e = incoming_parse(self, c, s, len);
 
@@ -1195,12 +1509,34 @@ in_drop:
 }
 
 #ifndef _FOR_VALGRIND_
+/* status of the default pool, with the NUMA node pools summed in */
+static void pbuf_cell_stats(cellarena_t **pools, struct cellstatus_t *st)
+{
+	struct cellstatus_t pst;
+	int pool;
+	
+	cellstatus(pools[0], st);
+	
+	for (pool = 1; pool <= NUMA_NODES_MAX; pool++) {
+		if (!pools[pool])
+			continue;
+		cellstatus(pools[pool], &pst);
+		st->cellcount += pst.cellcount;
+		st->freecount += pst.freecount;
+		st->blocks += pst.blocks;
+		st->blocks_max += pst.blocks_max;
+		st->blocks_released += pst.blocks_released;
+		st->blocks_freed += pst.blocks_freed;
+		st->blocks_reused += pst.blocks_reused;
+	}
+}
+
 void incoming_cell_stats(struct cellstatus_t *cellst_pbuf_small,
 	struct cellstatus_t *cellst_pbuf_medium,
 	struct cellstatus_t *cellst_pbuf_large)
 {
-	cellstatus(pbuf_cells_small, cellst_pbuf_small);
-	cellstatus(pbuf_cells_medium, cellst_pbuf_medium);
-	cellstatus(pbuf_cells_large, cellst_pbuf_large);
+	pbuf_cell_stats(pbuf_cells_small, cellst_pbuf_small);
+	pbuf_cell_stats(pbuf_cells_medium, cellst_pbuf_medium);
+	pbuf_cell_stats(pbuf_cells_large, cellst_pbuf_large);
 }
 #endif
@@ -15,15 +15,57 @@
 #include "cellmalloc.h"
 
 extern const char *inerr_labels[];
+extern const char *disallow_srccalls[];
+
+/*
+ *	A packet header split to elements by header_tokenize():
+ *	SRCCALL>DSTCALL,PATH1,PATH2,...:
+ *	elem[0] is the destination callsign, the rest are the path.
+ *	Offsets are from the start of the packet.
+ */
+
+/* elements are at least one character long, separated by commas */
+#define HEADER_ELEMS_MAX	(PACKETLEN_MAX/2+1)
+
+/* element flags */
+#define HEADER_ELEM_Q		1	/* qXX, a Q construct */
+#define HEADER_ELEM_TCPIP	2	/* TCPIP* */
+#define HEADER_ELEM_TCPXX	4	/* TCPXX, TCPXX* */
+
+/* header flags */
+#define HEADER_TCPIP		1	/* a TCPIP* element in the path */
+#define HEADER_TCPXX		2	/* a TCPXX* element in the path */
+#define HEADER_NOGATE		4	/* an element starting with NOGATE */
+#define HEADER_RFONLY		8	/* an element starting with RFONLY */
+#define HEADER_INVALID_PATH	16	/* invalid callsign in the path */
+
+struct header_elem_t {
+	uint16_t off;		/* offset of the element */
+	uint16_t len;		/* length of the element */
+	uint16_t flags;		/* HEADER_ELEM_* */
+	uint32_t hash;		/* keyhashuc() of the element */
+};
+
+struct header_tokens_t {
+	int src_len;		/* length of the source callsign, the '>' follows */
+	uint32_t src_hash;	/* keyhashuc() of the source callsign */
+	int path_end;		/* offset of the ':' after the path */
+	int dst_ssid;		/* length of the destination callsign without SSID */
+	int flags;		/* HEADER_* */
+	int q_elem;		/* first element starting with a 'q', or -1 */
+	int elem_count;
+	struct header_elem_t elem[HEADER_ELEMS_MAX];
+};
+
+extern int header_tokenize(struct header_tokens_t *ht, const char *s, int len);
 
 extern int check_invalid_src_dst(const char *call, int len);
-extern int check_call_match(const char **set, const char *call, int len);
-extern int check_call_glob_match(char **set, const char *call, int len);
 extern int check_path_calls(const char *via_start, const char *path_end);
 
 extern void incoming_flush(struct worker_t *self);
 extern int incoming_handler(struct worker_t *self, struct client_t *c, int l4proto, char *s, int len);
 extern int incoming_parse(struct worker_t *self, struct client_t *c, char *s, int len);
+extern int incoming_restore(struct worker_t *self, struct client_t *origin, const char *s, int len, int flags);
 
 #ifndef _FOR_VALGRIND_
 extern void incoming_cell_stats(struct cellstatus_t *cellst_pbuf_small,
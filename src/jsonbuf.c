@@ -0,0 +1,234 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	JSON text writer.
+ *
+ *	cJSON allocates a node for every value and then walks the tree to
+ *	print it, which is a lot of work for large documents which are
+ *	printed once and thrown away, such as the client list of the status
+ *	page. This writes the text out directly to a growing buffer. The
+ *	output is compatible with cJSON_PrintUnformatted(), so that the
+ *	two can be mixed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "jsonbuf.h"
+#include "hmalloc.h"
+
+void jsonbuf_init(struct jsonbuf_t *b, int size)
+{
+	if (size < 16)
+		size = 16;
+
+	b->buf = hmalloc(size);
+	b->buf[0] = 0;
+	b->len = 0;
+	b->size = size;
+}
+
+void jsonbuf_free(struct jsonbuf_t *b)
+{
+	if (b->buf)
+		hfree(b->buf);
+	b->buf = NULL;
+	b->len = b->size = 0;
+}
+
+void jsonbuf_reset(struct jsonbuf_t *b)
+{
+	b->len = 0;
+	b->buf[0] = 0;
+}
+
+/*
+ *	Make room for len more bytes and the terminating NUL
+ */
+
+static inline void jsonbuf_reserve(struct jsonbuf_t *b, int len)
+{
+	if (b->len + len + 1 <= b->size)
+		return;
+
+	while (b->len + len + 1 > b->size)
+		b->size *= 2;
+
+	b->buf = hrealloc(b->buf, b->size);
+}
+
+void jsonbuf_append(struct jsonbuf_t *b, const char *s, int len)
+{
+	jsonbuf_reserve(b, len);
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+	b->buf[b->len] = 0;
+}
+
+static inline void jsonbuf_char(struct jsonbuf_t *b, char c)
+{
+	jsonbuf_reserve(b, 1);
+	b->buf[b->len++] = c;
+	b->buf[b->len] = 0;
+}
+
+/*
+ *	Write a quoted and escaped string. Bytes above 127 are passed
+ *	through as they are, like cJSON does.
+ */
+
+static void jsonbuf_quote(struct jsonbuf_t *b, const char *s, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)s;
+	const unsigned char *end = p + len;
+	char *o;
+
+	/* the worst case is 6 bytes per input byte, plus the quotes */
+	jsonbuf_reserve(b, len * 6 + 2);
+	o = b->buf + b->len;
+	*o++ = '"';
+
+	for (; p < end; p++) {
+		if (*p >= 32 && *p != '"' && *p != '\\') {
+			*o++ = *p;
+			continue;
+		}
+
+		*o++ = '\\';
+		switch (*p) {
+		case '"':
+		case '\\':
+			*o++ = *p;
+			break;
+		case '\b':
+			*o++ = 'b';
+			break;
+		case '\f':
+			*o++ = 'f';
+			break;
+		case '\n':
+			*o++ = 'n';
+			break;
+		case '\r':
+			*o++ = 'r';
+			break;
+		case '\t':
+			*o++ = 't';
+			break;
+		default:
+			*o++ = 'u';
+			*o++ = '0';
+			*o++ = '0';
+			*o++ = hex[*p >> 4];
+			*o++ = hex[*p & 15];
+		}
+	}
+
+	*o++ = '"';
+	*o = 0;
+	b->len = o - b->buf;
+}
+
+/*
+ *	Start a new value: add a comma if there is a previous value
+ *	on the same level, and the key if one is given.
+ */
+
+static void jsonbuf_key(struct jsonbuf_t *b, const char *key)
+{
+	if (b->len) {
+		char last = b->buf[b->len-1];
+		if (last != '{' && last != '[')
+			jsonbuf_char(b, ',');
+	}
+
+	if (key) {
+		jsonbuf_quote(b, key, strlen(key));
+		jsonbuf_char(b, ':');
+	}
+}
+
+void jsonbuf_start_object(struct jsonbuf_t *b, const char *key)
+{
+	jsonbuf_key(b, key);
+	jsonbuf_char(b, '{');
+}
+
+void jsonbuf_end_object(struct jsonbuf_t *b)
+{
+	jsonbuf_char(b, '}');
+}
+
+void jsonbuf_start_array(struct jsonbuf_t *b, const char *key)
+{
+	jsonbuf_key(b, key);
+	jsonbuf_char(b, '[');
+}
+
+void jsonbuf_end_array(struct jsonbuf_t *b)
+{
+	jsonbuf_char(b, ']');
+}
+
+void jsonbuf_add_int(struct jsonbuf_t *b, const char *key, long long v)
+{
+	jsonbuf_key(b, key);
+	jsonbuf_reserve(b, 24);
+	b->len += snprintf(b->buf + b->len, 24, "%lld", v);
+}
+
+void jsonbuf_add_double(struct jsonbuf_t *b, const char *key, double v)
+{
+	jsonbuf_key(b, key);
+
+	/* JSON has no representation for these */
+	if (isnan(v) || isinf(v)) {
+		jsonbuf_append(b, "null", 4);
+		return;
+	}
+
+	jsonbuf_reserve(b, 64);
+	if (fabs(floor(v) - v) <= 1e-12 && fabs(v) < 1e15)
+		b->len += snprintf(b->buf + b->len, 64, "%.0f", v);
+	else if (fabs(v) < 1.0e-6 || fabs(v) > 1.0e9)
+		b->len += snprintf(b->buf + b->len, 64, "%e", v);
+	else
+		b->len += snprintf(b->buf + b->len, 64, "%f", v);
+}
+
+void jsonbuf_add_string_len(struct jsonbuf_t *b, const char *key, const char *s, int len)
+{
+	jsonbuf_key(b, key);
+	jsonbuf_quote(b, s, len);
+}
+
+void jsonbuf_add_string(struct jsonbuf_t *b, const char *key, const char *s)
+{
+	if (!s) {
+		jsonbuf_key(b, key);
+		jsonbuf_append(b, "null", 4);
+		return;
+	}
+
+	jsonbuf_add_string_len(b, key, s, strlen(s));
+}
+
+void jsonbuf_add_int_array(struct jsonbuf_t *b, const char *key, const long long *v, int n)
+{
+	int i;
+
+	jsonbuf_start_array(b, key);
+	for (i = 0; i < n; i++)
+		jsonbuf_add_int(b, NULL, v[i]);
+	jsonbuf_end_array(b);
+}
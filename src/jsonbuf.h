@@ -0,0 +1,42 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef JSONBUF_H
+#define JSONBUF_H
+
+/* A growing buffer for writing out JSON text directly, without
+ * building a cJSON tree first. The separating commas are added
+ * automatically.
+ */
+struct jsonbuf_t {
+	char *buf;		/* always NUL-terminated */
+	int len;
+	int size;
+};
+
+extern void jsonbuf_init(struct jsonbuf_t *b, int size);
+extern void jsonbuf_free(struct jsonbuf_t *b);
+extern void jsonbuf_reset(struct jsonbuf_t *b);
+
+extern void jsonbuf_append(struct jsonbuf_t *b, const char *s, int len);
+
+/* key may be NULL for array members and top-level values */
+extern void jsonbuf_start_object(struct jsonbuf_t *b, const char *key);
+extern void jsonbuf_end_object(struct jsonbuf_t *b);
+extern void jsonbuf_start_array(struct jsonbuf_t *b, const char *key);
+extern void jsonbuf_end_array(struct jsonbuf_t *b);
+
+extern void jsonbuf_add_int(struct jsonbuf_t *b, const char *key, long long v);
+extern void jsonbuf_add_double(struct jsonbuf_t *b, const char *key, double v);
+extern void jsonbuf_add_string(struct jsonbuf_t *b, const char *key, const char *s);
+extern void jsonbuf_add_string_len(struct jsonbuf_t *b, const char *key, const char *s, int len);
+extern void jsonbuf_add_int_array(struct jsonbuf_t *b, const char *key, const long long *v, int n);
+
+#endif
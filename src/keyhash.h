@@ -15,4 +15,17 @@ extern void     keyhash_init(void);
 extern uint32_t keyhash(const void *s, int slen, uint32_t hash0);
 extern uint32_t keyhashuc(const void *s, int slen, uint32_t hash0);
 
+/* keyhashuc() one character at a time, for hashing while scanning:
+ * start with KEYHASH_INIT, and feed in all of the characters
+ */
+#define KEYHASH_INIT	2166136261U
+
+static inline uint32_t keyhashuc_add(uint32_t hash, uint32_t c)
+{
+	if ('a' <= c && c <= 'z')
+		c -= ('a' - 'A');
+	
+	return (hash * 16777619U) ^ c;
+}
+
 #endif
@@ -0,0 +1,908 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	Live upgrade client state handover.
+ *
+ *	When shutting down for a live upgrade, each worker appends the
+ *	state of its clients to a handover buffer in a simple binary
+ *	format: the fixed client fields, the contents of the input and
+ *	output buffers, the filters, the heard list and the accounting.
+ *	The buffer is then written to an anonymous memory file (memfd)
+ *	which is inherited over exec() by the new executable. The number
+ *	of the file descriptor is passed in the APRSC_LIVE_UPGRADE_FD
+ *	environment variable. Where memfd_create() is not available, the
+ *	data is written to liveupgrade.bin in the run directory instead.
+ *
+ *	The new process maps the data, and the accept thread recreates
+ *	the clients from it and passes them to the workers. Each worker
+ *	then parses the filters and loads the heard list of its own
+ *	clients, in parallel with the other workers.
+ *
+ *	The same handover carries the packets which the workers had
+ *	received but which had not been through the dupecheck yet, the
+ *	dupecheck database and the historydb, in batch records. Before
+ *	handing over their clients, the workers pass the packets which had
+ *	already been through the dupecheck to the clients, so that they
+ *	end up in the output buffers. Packets are not lost, and duplicates
+ *	are not passed, over the upgrade.
+ *
+ *	The data starts with a header and the rx error counter labels,
+ *	followed by the records. The layout contains no pointers, only
+ *	lengths. Integers are in host byte order, the handover happens on
+ *	the same host. New fields may only be added to the end of the
+ *	fixed part of a record or an entry, or after the variable-length
+ *	data, and records of unknown types are skipped, so that the data
+ *	stays readable for the previous versions. Upgrades from versions
+ *	which still wrote liveupgrade.json are handled by accept.c.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "liveupgrade.h"
+#include "config.h"
+#include "cfgfile.h"
+#include "hlog.h"
+#include "hmalloc.h"
+#include "incoming.h"
+#include "filter.h"
+#include "client_heard.h"
+
+#define PATHLEN 500
+
+/* the oldest handover data format which can be read */
+#define LIVEUPGRADE_VERSION_MIN 2
+
+#define ALIGN8(x) (((x) + 7) & ~7)
+
+int liveupgrade_count;	/* live upgrades done since a cold start */
+
+/* the old process: handover buffer, appended to by the workers */
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *dump_buf;
+static size_t dump_len, dump_size;
+static int dump_clients;
+static struct timeval dump_start_tv;
+
+/* the new process: the mapped handover data */
+static char *load_buf;
+static size_t load_len;
+static int load_clients;
+static int *load_rxerr_map;
+static int load_rxerr_count;
+static struct timeval load_start_tv;
+
+static long tv_elapsed_us(struct timeval *start)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec - start->tv_sec) * 1000000 + (tv.tv_usec - start->tv_usec);
+}
+
+/*
+ *	Reserve space in the end of the handover buffer, zeroed.
+ *	Called with dump_mutex held.
+ */
+
+static char *dump_reserve(size_t len)
+{
+	char *p;
+
+	if (dump_len + len > dump_size) {
+		while (dump_len + len > dump_size)
+			dump_size = (dump_size) ? dump_size * 2 : 256 * 1024;
+		dump_buf = hrealloc(dump_buf, dump_size);
+	}
+
+	p = dump_buf + dump_len;
+	memset(p, 0, len);
+	dump_len += len;
+
+	return p;
+}
+
+/*
+ *	Start collecting client state, before the workers are stopped
+ */
+
+void liveupgrade_dump_start(void)
+{
+	struct liveupgrade_header_t *h;
+	char *p;
+	int i, l;
+
+	pthread_mutex_lock(&dump_mutex);
+
+	gettimeofday(&dump_start_tv, NULL);
+
+	dump_len = 0;
+	dump_clients = 0;
+	dump_reserve(sizeof(*h));
+
+	/* rx error labels, so that the counters can be mapped right
+	 * even if new ones are added in the middle
+	 */
+	for (i = 0; i < INERR_BUCKETS; i++) {
+		l = strlen(inerr_labels[i]);
+		if (l > 255)
+			l = 255;
+		p = dump_reserve(1 + l);
+		*p = l;
+		memcpy(p + 1, inerr_labels[i], l);
+	}
+	dump_reserve(ALIGN8(dump_len) - dump_len);
+
+	pthread_mutex_unlock(&dump_mutex);
+}
+
+/*
+ *	Append the state of a client, called by the worker when it is
+ *	shutting down for a live upgrade
+ */
+
+void liveupgrade_dump_client(struct client_t *c)
+{
+	struct liveupgrade_client_t *rec;
+	struct liveupgrade_heard_t *hp;
+	struct client_heard_t *h;
+	char *p;
+	int64_t v;
+	size_t len;
+	int i, heard_count = 0, filter_len = 0;
+	int obuf_len = c->obuf_end - c->obuf_start;
+
+	if (!dump_buf || c->fd < 0)
+		return;
+
+	/* the heard list is only needed for message routing on igate ports.
+	 * Count the entries which will be written, the list can be shorter
+	 * than client_heard_count and may have bad calls in it.
+	 */
+	if (c->flags & CLFLAGS_IGATE) {
+		for (i = 0; i < CLIENT_HEARD_BUCKETS; i++)
+			for (h = c->client_heard[i]; (h); h = h->next)
+				if (h->call_len >= 1 && h->call_len <= CALLSIGNLEN_MAX)
+					heard_count++;
+	}
+
+	if (c->flags & CLFLAGS_INPORT)
+		filter_len = strlen(c->filter_s);
+
+	if (obuf_len < 0)
+		obuf_len = 0;
+
+	len = sizeof(*rec)
+		+ INERR_BUCKETS * sizeof(int64_t)
+		+ heard_count * sizeof(*hp)
+		+ c->username_len + strlen(c->app_name) + strlen(c->app_version)
+		+ filter_len + c->ibuf_end + obuf_len;
+	len = ALIGN8(len);
+
+	pthread_mutex_lock(&dump_mutex);
+
+	rec = (struct liveupgrade_client_t *)dump_reserve(len);
+	rec->len = len;
+	rec->fixed_len = sizeof(*rec);
+	rec->type = LIVEUPGRADE_REC_CLIENT;
+	/* clients in other states are closed by the new process */
+	if (c->state == CSTATE_CONNECTED)
+		rec->state = LIVEUPGRADE_STATE_CONNECTED;
+	else if (c->state == CSTATE_LOGIN)
+		rec->state = LIVEUPGRADE_STATE_LOGIN;
+	rec->validated = c->validated;
+	rec->fd = c->fd;
+	rec->listener_id = c->listener_id;
+	rec->udp_port = (c->udp_port && c->udpclient) ? c->udp_port : 0;
+	rec->loc_known = c->loc_known;
+	rec->username_len = c->username_len;
+	rec->app_name_len = strlen(c->app_name);
+	rec->app_version_len = strlen(c->app_version);
+	rec->connect_time = c->connect_time;
+	rec->connect_tick = c->connect_tick;
+	rec->rxbytes = c->localaccount.rxbytes;
+	rec->txbytes = c->localaccount.txbytes;
+	rec->rxpackets = c->localaccount.rxpackets;
+	rec->txpackets = c->localaccount.txpackets;
+	rec->rxdrops = c->localaccount.rxdrops;
+	rec->rxdupes = c->localaccount.rxdupes;
+	rec->lat = c->lat;
+	rec->lng = c->lng;
+	rec->filter_len = filter_len;
+	rec->rxerr_count = INERR_BUCKETS;
+	rec->ibuf_len = c->ibuf_end;
+	rec->obuf_len = obuf_len;
+
+	p = (char *)rec + sizeof(*rec);
+
+	for (i = 0; i < INERR_BUCKETS; i++) {
+		v = c->localaccount.rxerrs[i];
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+	}
+
+	hp = (struct liveupgrade_heard_t *)p;
+	for (i = 0; i < CLIENT_HEARD_BUCKETS && rec->heard_count < heard_count; i++) {
+		for (h = c->client_heard[i]; (h) && rec->heard_count < heard_count; h = h->next) {
+			if (h->call_len < 1 || h->call_len > CALLSIGNLEN_MAX)
+				continue;
+			hp->last_heard = h->last_heard;
+			hp->call_len = h->call_len;
+			memcpy(hp->callsign, h->callsign, h->call_len);
+			hp++;
+			rec->heard_count++;
+		}
+	}
+	p = (char *)hp;
+
+	memcpy(p, c->username, rec->username_len);
+	p += rec->username_len;
+	memcpy(p, c->app_name, rec->app_name_len);
+	p += rec->app_name_len;
+	memcpy(p, c->app_version, rec->app_version_len);
+	p += rec->app_version_len;
+	memcpy(p, c->filter_s, filter_len);
+	p += filter_len;
+	memcpy(p, c->ibuf, c->ibuf_end);
+	p += c->ibuf_end;
+	memcpy(p, c->obuf + c->obuf_start, obuf_len);
+
+	dump_clients++;
+
+	pthread_mutex_unlock(&dump_mutex);
+}
+
+/*
+ *	Collect entries of a database in a batch record. The records are
+ *	kept reasonably small, and appended to the handover one at a time.
+ */
+
+#define LIVEUPGRADE_BATCH_MAX (1024 * 1024)
+
+static void batch_reserve(struct liveupgrade_batch_t *b, size_t len)
+{
+	if (b->len + len > b->size) {
+		while (b->len + len > b->size)
+			b->size = (b->size) ? b->size * 2 : 64 * 1024;
+		b->buf = hrealloc(b->buf, b->size);
+	}
+}
+
+static void batch_flush(struct liveupgrade_batch_t *b)
+{
+	struct liveupgrade_batch_header_t *h;
+
+	if (b->count == 0)
+		return;
+
+	h = (struct liveupgrade_batch_header_t *)b->buf;
+	h->len = b->len;
+	h->fixed_len = sizeof(*h);
+	h->type = b->type;
+	h->count = b->count;
+
+	pthread_mutex_lock(&dump_mutex);
+	if (dump_buf)
+		memcpy(dump_reserve(b->len), b->buf, b->len);
+	pthread_mutex_unlock(&dump_mutex);
+
+	b->len = sizeof(*h);
+	b->count = 0;
+}
+
+void liveupgrade_batch_start(struct liveupgrade_batch_t *b, int type)
+{
+	memset(b, 0, sizeof(*b));
+	b->type = type;
+	batch_reserve(b, sizeof(struct liveupgrade_batch_header_t));
+	memset(b->buf, 0, sizeof(struct liveupgrade_batch_header_t));
+	b->len = sizeof(struct liveupgrade_batch_header_t);
+}
+
+void liveupgrade_batch_add(struct liveupgrade_batch_t *b, const void *entry, int entry_len, const char *data, int data_len)
+{
+	struct liveupgrade_entry_header_t eh;
+	size_t len = ALIGN8(sizeof(eh) + entry_len + data_len);
+
+	if (b->len + len > LIVEUPGRADE_BATCH_MAX)
+		batch_flush(b);
+
+	batch_reserve(b, len);
+	memset(b->buf + b->len, 0, len);
+
+	eh.fixed_len = entry_len;
+	eh.data_len = data_len;
+	eh.pad = 0;
+	memcpy(b->buf + b->len, &eh, sizeof(eh));
+	memcpy(b->buf + b->len + sizeof(eh), entry, entry_len);
+	memcpy(b->buf + b->len + sizeof(eh) + entry_len, data, data_len);
+
+	b->len += len;
+	b->count++;
+}
+
+void liveupgrade_batch_finish(struct liveupgrade_batch_t *b)
+{
+	batch_flush(b);
+	hfree(b->buf);
+	b->buf = NULL;
+}
+
+/*
+ *	Append the packets in the incoming queues of a worker, which the
+ *	dupecheck did not pick up before it was stopped. Called by the
+ *	worker when it is shutting down for a live upgrade, after the
+ *	clients have been handed over.
+ */
+
+void liveupgrade_dump_pbufs(struct worker_t *self)
+{
+	struct liveupgrade_batch_t b;
+	struct liveupgrade_pbuf_t e;
+	struct pbuf_t *lists[2] = { self->pbuf_incoming, self->pbuf_incoming_local };
+	struct pbuf_t *pb;
+	struct client_t *c;
+	int i;
+
+	if (!dump_buf || !(lists[0] || lists[1]))
+		return;
+
+	liveupgrade_batch_start(&b, LIVEUPGRADE_REC_PBUFS);
+
+	for (i = 0; i < 2; i++) {
+		for (pb = lists[i]; (pb); pb = pb->next) {
+			/* the originating client may have gone away, so only
+			 * look at the pointer if it is one of ours
+			 */
+			e.origin_fd = -1;
+			for (c = self->clients; (c); c = c->next) {
+				if (c == pb->origin) {
+					e.origin_fd = c->fd;
+					break;
+				}
+			}
+			e.flags = pb->flags;
+			liveupgrade_batch_add(&b, &e, sizeof(e), pb->data, pb->packet_len);
+		}
+	}
+
+	if (b.count)
+		hlog(LOG_DEBUG, "Live upgrade: worker %d: handing over %u incoming packets", self->id, b.count);
+
+	liveupgrade_batch_finish(&b);
+}
+
+/*
+ *	Write the handover data to a file in the run directory, when
+ *	memfd is not available
+ */
+
+static int liveupgrade_dump_file(void)
+{
+	char path[PATHLEN+1];
+	char tmppath[PATHLEN+1];
+	size_t l;
+	ssize_t w;
+	int fd;
+
+	snprintf(path, PATHLEN, "%s/liveupgrade.bin", rundir);
+	snprintf(tmppath, PATHLEN, "%s/liveupgrade.bin.tmp", rundir);
+
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0) {
+		hlog(LOG_CRIT, "Live upgrade: Could not open %s for writing: %s", tmppath, strerror(errno));
+		return -1;
+	}
+
+	for (l = 0; l < dump_len; l += w) {
+		w = write(fd, dump_buf + l, dump_len - l);
+		if (w <= 0) {
+			hlog(LOG_CRIT, "Live upgrade: Write to %s failed: %s", tmppath, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (close(fd)) {
+		hlog(LOG_CRIT, "Live upgrade: close(%s) failed: %s", tmppath, strerror(errno));
+		return -1;
+	}
+
+	if (rename(tmppath, path)) {
+		hlog(LOG_CRIT, "Live upgrade: Could not rename %s to %s: %s", tmppath, path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	The workers are gone, write out the handover data
+ */
+
+int liveupgrade_dump_finish(void)
+{
+	struct liveupgrade_header_t *h;
+	const char *where = "liveupgrade.bin";
+	int fd = -1;
+	int ret = 0;
+
+	pthread_mutex_lock(&dump_mutex);
+
+	if (!dump_buf) {
+		pthread_mutex_unlock(&dump_mutex);
+		return 0;
+	}
+
+	h = (struct liveupgrade_header_t *)dump_buf;
+	memcpy(h->magic, LIVEUPGRADE_MAGIC, sizeof(h->magic));
+	h->version = LIVEUPGRADE_VERSION;
+	h->header_len = sizeof(*h);
+	h->len = dump_len;
+	h->client_count = dump_clients;
+	h->rxerr_count = INERR_BUCKETS;
+	h->upgrades = liveupgrade_count + 1;
+
+#if defined(MFD_CLOEXEC) && defined(HAVE_SETENV)
+	/* not close-on-exec, the new process inherits it */
+	fd = memfd_create("aprsc-liveupgrade", 0);
+	if (fd < 0) {
+		hlog(LOG_ERR, "Live upgrade: memfd_create failed: %s", strerror(errno));
+	} else {
+		char fd_s[16];
+		size_t l;
+		ssize_t w;
+
+		for (l = 0; l < dump_len; l += w) {
+			w = write(fd, dump_buf + l, dump_len - l);
+			if (w <= 0)
+				break;
+		}
+
+		snprintf(fd_s, sizeof(fd_s), "%d", fd);
+
+		if (l < dump_len) {
+			hlog(LOG_ERR, "Live upgrade: Write to memfd failed: %s", strerror(errno));
+			close(fd);
+			fd = -1;
+		} else if (setenv(LIVEUPGRADE_FD_ENV, fd_s, 1) != 0) {
+			hlog(LOG_ERR, "Live upgrade: setenv(%s) failed: %s", LIVEUPGRADE_FD_ENV, strerror(errno));
+			close(fd);
+			fd = -1;
+		} else {
+			where = "memfd";
+		}
+	}
+#endif
+
+	if (fd < 0)
+		ret = liveupgrade_dump_file();
+
+	if (ret == 0)
+		hlog(LOG_INFO, "Live upgrade: Handed over %d clients, %lu bytes in %s, in %ld us",
+			dump_clients, (unsigned long)dump_len, where, tv_elapsed_us(&dump_start_tv));
+
+	hfree(dump_buf);
+	dump_buf = NULL;
+	dump_len = dump_size = 0;
+
+	pthread_mutex_unlock(&dump_mutex);
+
+	return ret;
+}
+
+/*
+ *	Map the old rx error counter indexes to the current ones, using
+ *	the labels
+ */
+
+static int liveupgrade_load_rxerr_labels(const char *p, const char *end, int count)
+{
+	int i, j, l;
+
+	load_rxerr_count = count;
+	load_rxerr_map = hmalloc(sizeof(*load_rxerr_map) * (count + 1));
+
+	for (i = 0; i < count; i++) {
+		load_rxerr_map[i] = -1; /* default: no mapping */
+
+		if (p >= end)
+			return -1;
+		l = (unsigned char)*p++;
+		if (p + l > end)
+			return -1;
+
+		for (j = 0; j < INERR_BUCKETS; j++) {
+			if (strlen(inerr_labels[j]) == l && memcmp(inerr_labels[j], p, l) == 0) {
+				load_rxerr_map[i] = j;
+				break;
+			}
+		}
+
+		p += l;
+	}
+
+	return 0;
+}
+
+/*
+ *	Check and map the handover data passed by the old process
+ */
+
+static int liveupgrade_map(int fd, const char *from)
+{
+	struct liveupgrade_header_t *h;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0) {
+		hlog(LOG_ERR, "Live upgrade: fstat(%s) failed: %s", from, strerror(errno));
+		return -1;
+	}
+
+	if (st.st_size < sizeof(*h)) {
+		hlog(LOG_ERR, "Live upgrade: %s is too short (%ld bytes)", from, (long)st.st_size);
+		return -1;
+	}
+
+	load_buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (load_buf == MAP_FAILED) {
+		hlog(LOG_ERR, "Live upgrade: mmap(%s) failed: %s", from, strerror(errno));
+		load_buf = NULL;
+		return -1;
+	}
+	load_len = st.st_size;
+
+	h = (struct liveupgrade_header_t *)load_buf;
+	if (memcmp(h->magic, LIVEUPGRADE_MAGIC, sizeof(h->magic)) != 0
+	    || h->header_len < sizeof(*h) || h->header_len > load_len
+	    || h->len != load_len || h->version < LIVEUPGRADE_VERSION_MIN) {
+		hlog(LOG_ERR, "Live upgrade: %s does not contain valid handover data", from);
+		goto err;
+	}
+
+	if (liveupgrade_load_rxerr_labels(load_buf + h->header_len, load_buf + load_len, h->rxerr_count)) {
+		hlog(LOG_ERR, "Live upgrade: %s: invalid rx error labels", from);
+		goto err;
+	}
+
+	load_clients = h->client_count;
+	liveupgrade_count = h->upgrades;
+
+	hlog(LOG_INFO, "Live upgrade: Loading %d clients from %s, version %u, %lu bytes",
+		load_clients, from, h->version, (unsigned long)load_len);
+
+	return 0;
+
+err:
+	munmap(load_buf, load_len);
+	load_buf = NULL;
+	load_len = 0;
+	if (load_rxerr_map) {
+		hfree(load_rxerr_map);
+		load_rxerr_map = NULL;
+	}
+	return -1;
+}
+
+/*
+ *	Load the handover data, at startup. Returns -1 if there was none
+ *	(the old process might have been a version writing liveupgrade.json).
+ */
+
+int liveupgrade_load(void)
+{
+	char path[PATHLEN+1];
+	char path_renamed[PATHLEN+1];
+	const char *fd_s;
+	int fd, r;
+
+	gettimeofday(&load_start_tv, NULL);
+
+	fd_s = getenv(LIVEUPGRADE_FD_ENV);
+	if (fd_s) {
+		fd = atoi(fd_s);
+#ifdef HAVE_SETENV
+		/* not to be passed on to the next upgrade */
+		unsetenv(LIVEUPGRADE_FD_ENV);
+#endif
+		if (fd < 3) {
+			hlog(LOG_ERR, "Live upgrade: invalid %s: %s", LIVEUPGRADE_FD_ENV, fd_s);
+			return -1;
+		}
+
+		r = liveupgrade_map(fd, "memfd");
+		close(fd);
+		return r;
+	}
+
+	snprintf(path, PATHLEN, "%s/liveupgrade.bin", rundir);
+	snprintf(path_renamed, PATHLEN, "%s/liveupgrade.bin.old", rundir);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			hlog(LOG_ERR, "Live upgrade: Could not open %s for reading: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (rename(path, path_renamed) < 0) {
+		hlog(LOG_ERR, "Failed to rename liveupgrade dump file %s to %s: %s",
+			path, path_renamed, strerror(errno));
+		unlink(path);
+	}
+
+	r = liveupgrade_map(fd, path);
+	close(fd);
+
+	return r;
+}
+
+int liveupgrade_loaded(void)
+{
+	return (load_buf != NULL);
+}
+
+/*
+ *	Iterate over the records, starting with prev == NULL
+ */
+
+static const struct liveupgrade_record_t *liveupgrade_next_record(const struct liveupgrade_record_t *prev)
+{
+	struct liveupgrade_header_t *h = (struct liveupgrade_header_t *)load_buf;
+	const struct liveupgrade_record_t *rec;
+	const char *p;
+	int i, l;
+
+	if (!load_buf)
+		return NULL;
+
+	if (prev) {
+		p = (const char *)prev + prev->len;
+	} else {
+		/* skip the header and the rx error labels */
+		p = load_buf + h->header_len;
+		for (i = 0; i < load_rxerr_count; i++) {
+			l = (unsigned char)*p;
+			p += 1 + l;
+		}
+		p = load_buf + ALIGN8(p - load_buf);
+	}
+
+	if (p + sizeof(*rec) > load_buf + load_len)
+		return NULL;
+
+	rec = (const struct liveupgrade_record_t *)p;
+	if (rec->len < sizeof(*rec) || rec->len % 8 || rec->fixed_len < sizeof(*rec)
+	    || rec->fixed_len > rec->len || p + rec->len > load_buf + load_len) {
+		hlog(LOG_ERR, "Live upgrade: invalid record at offset %ld, skipping the rest",
+			(long)(p - load_buf));
+		return NULL;
+	}
+
+	return rec;
+}
+
+/*
+ *	Iterate over the client records, starting with prev == NULL
+ */
+
+const struct liveupgrade_client_t *liveupgrade_next_client(const struct liveupgrade_client_t *prev)
+{
+	const struct liveupgrade_record_t *rec = (const struct liveupgrade_record_t *)prev;
+
+	while ((rec = liveupgrade_next_record(rec))) {
+		if (rec->type != LIVEUPGRADE_REC_CLIENT)
+			continue;
+		if (rec->fixed_len < sizeof(struct liveupgrade_client_t)) {
+			hlog(LOG_ERR, "Live upgrade: client record too short (%d bytes), skipping", rec->fixed_len);
+			continue;
+		}
+		return (const struct liveupgrade_client_t *)rec;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Iterate over the entries of the batch records of a type
+ */
+
+void liveupgrade_batch_open(struct liveupgrade_batch_reader_t *r, int type)
+{
+	memset(r, 0, sizeof(*r));
+	r->type = type;
+}
+
+int liveupgrade_batch_next(struct liveupgrade_batch_reader_t *r, void *entry, int entry_len, const char **data, int *data_len)
+{
+	struct liveupgrade_entry_header_t eh;
+	size_t len;
+
+	while (!r->p || r->p + sizeof(eh) > r->end) {
+		/* on to the next batch of the right type */
+		while ((r->rec = liveupgrade_next_record(r->rec))) {
+			if (r->rec->type == r->type)
+				break;
+		}
+		if (!r->rec)
+			return 0;
+		r->p = (const char *)r->rec + r->rec->fixed_len;
+		r->end = (const char *)r->rec + r->rec->len;
+	}
+
+	memcpy(&eh, r->p, sizeof(eh));
+	len = ALIGN8(sizeof(eh) + eh.fixed_len + eh.data_len);
+	if (r->p + len > r->end) {
+		hlog(LOG_ERR, "Live upgrade: invalid entry in a record of type %d, skipping the rest of it", r->type);
+		r->p = r->end;
+		return liveupgrade_batch_next(r, entry, entry_len, data, data_len);
+	}
+
+	/* entries written by another version may be shorter or longer */
+	memset(entry, 0, entry_len);
+	memcpy(entry, r->p + sizeof(eh), (eh.fixed_len < entry_len) ? eh.fixed_len : entry_len);
+	*data = r->p + sizeof(eh) + eh.fixed_len;
+	*data_len = eh.data_len;
+
+	r->p += len;
+
+	return 1;
+}
+
+/*
+ *	Locate the variable-length fields of a client record.
+ *	Returns -1 if they do not fit in the record.
+ */
+
+int liveupgrade_client_fields(const struct liveupgrade_client_t *rec, struct liveupgrade_fields_t *f)
+{
+	const char *p = (const char *)rec + rec->fixed_len;
+	size_t need;
+
+	need = (size_t)rec->fixed_len
+		+ rec->rxerr_count * sizeof(int64_t)
+		+ rec->heard_count * sizeof(struct liveupgrade_heard_t)
+		+ rec->username_len + rec->app_name_len + rec->app_version_len
+		+ rec->filter_len + rec->ibuf_len + rec->obuf_len;
+
+	if (need > rec->len)
+		return -1;
+
+	f->rxerrs = p;
+	p += rec->rxerr_count * sizeof(int64_t);
+	f->heard = p;
+	p += rec->heard_count * sizeof(struct liveupgrade_heard_t);
+	f->username = p;
+	p += rec->username_len;
+	f->app_name = p;
+	p += rec->app_name_len;
+	f->app_version = p;
+	p += rec->app_version_len;
+	f->filter = p;
+	p += rec->filter_len;
+	f->ibuf = p;
+	p += rec->ibuf_len;
+	f->obuf = p;
+
+	return 0;
+}
+
+/*
+ *	Load the rx error counters of a client, mapping them by label
+ */
+
+void liveupgrade_client_rxerrs(struct client_t *c, const struct liveupgrade_client_t *rec, const struct liveupgrade_fields_t *f)
+{
+	int64_t v;
+	int i;
+
+	for (i = 0; i < rec->rxerr_count && i < load_rxerr_count; i++) {
+		if (load_rxerr_map[i] < 0)
+			continue;
+		memcpy(&v, f->rxerrs + i * sizeof(v), sizeof(v));
+		if (v > 0)
+			c->localaccount.rxerrs[load_rxerr_map[i]] = v;
+	}
+}
+
+/*
+ *	Attach a copy of the record to the client, for the worker to
+ *	restore the filters and the heard list from
+ */
+
+void liveupgrade_client_attach(struct client_t *c, const struct liveupgrade_client_t *rec)
+{
+	if (rec->filter_len == 0 && rec->heard_count == 0)
+		return;
+
+	c->liveupgrade = hmalloc(rec->len);
+	memcpy(c->liveupgrade, rec, rec->len);
+}
+
+/*
+ *	Restore the filters and the heard list of a client, in the worker
+ *	thread which picked it up
+ */
+
+void liveupgrade_client_restore(struct client_t *c)
+{
+	const struct liveupgrade_client_t *rec = c->liveupgrade;
+	const struct liveupgrade_heard_t *hp;
+	struct liveupgrade_fields_t f;
+	char *argv[256];
+	char *s;
+	int i, argc;
+
+	c->liveupgrade = NULL;
+
+	if (liveupgrade_client_fields(rec, &f) != 0)
+		goto done;
+
+	// handle client's filter setting
+	if (c->flags & CLFLAGS_USERFILTEROK && rec->filter_len > 0 && rec->filter_len < FILTER_S_SIZE) {
+		// archive a copy of the filters, for status display
+		memcpy(c->filter_s, f.filter, rec->filter_len);
+		c->filter_s[rec->filter_len] = 0;
+		sanitize_ascii_string(c->filter_s);
+
+		s = hmalloc(rec->filter_len + 1);
+		memcpy(s, f.filter, rec->filter_len);
+		s[rec->filter_len] = 0;
+		argc = parse_args(argv, s);
+		for (i = 0; i < argc; ++i)
+			filter_parse(c, argv[i], 1);
+		hfree(s);
+	}
+
+	/* load list of stations heard by this client, to immediately support
+	 * messaging
+	 */
+	hp = (const struct liveupgrade_heard_t *)f.heard;
+	for (i = 0; i < rec->heard_count; i++, hp++)
+		if (hp->call_len > 0 && hp->call_len <= CALLSIGNLEN_MAX)
+			client_heard_load(c, hp->callsign, hp->call_len, hp->last_heard);
+
+done:
+	hfree((void *)rec);
+}
+
+/*
+ *	All clients have been recreated, release the handover data
+ */
+
+void liveupgrade_load_done(int accepted)
+{
+	if (!load_buf)
+		return;
+
+	hlog(LOG_INFO, "Live upgrade: Accepted %d of %d old clients, %lu bytes, in %ld us",
+		accepted, load_clients, (unsigned long)load_len, tv_elapsed_us(&load_start_tv));
+	if (accepted != load_clients)
+		hlog(LOG_ERR, "Live upgrade: Failed to accept %d old clients, see above for reasons", load_clients - accepted);
+
+	munmap(load_buf, load_len);
+	load_buf = NULL;
+	load_len = 0;
+	hfree(load_rxerr_map);
+	load_rxerr_map = NULL;
+}
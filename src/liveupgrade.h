@@ -0,0 +1,187 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef LIVEUPGRADE_H
+#define LIVEUPGRADE_H
+
+#include <stdint.h>
+
+#include "worker.h"
+
+#define LIVEUPGRADE_FD_ENV	"APRSC_LIVE_UPGRADE_FD"
+
+#define LIVEUPGRADE_MAGIC	"aprscLU"
+#define LIVEUPGRADE_VERSION	2
+
+struct liveupgrade_header_t {
+	char magic[8];			/* LIVEUPGRADE_MAGIC */
+	uint32_t version;		/* LIVEUPGRADE_VERSION of the writer */
+	uint32_t header_len;		/* length of this header */
+	uint64_t len;			/* length of the whole handover data */
+	uint32_t client_count;
+	uint32_t rxerr_count;		/* rx error labels following the header */
+	uint32_t upgrades;		/* live upgrades done since a cold start */
+	uint32_t pad;
+};
+
+/* record types */
+#define LIVEUPGRADE_REC_CLIENT		1
+#define LIVEUPGRADE_REC_PBUFS		2
+#define LIVEUPGRADE_REC_DUPECHECK	3
+#define LIVEUPGRADE_REC_HISTORYDB	4
+
+/* the beginning of every record, records of unknown types are skipped */
+struct liveupgrade_record_t {
+	uint32_t len;			/* length of the whole record */
+	uint16_t fixed_len;		/* length of the fixed part */
+	uint8_t type;			/* LIVEUPGRADE_REC_* */
+	uint8_t pad;
+};
+
+#define LIVEUPGRADE_STATE_LOGIN		1
+#define LIVEUPGRADE_STATE_CONNECTED	2
+
+/* Fixed part of a client record, followed by the variable-length data:
+ * rx error counters (int64), heard list entries, username, application
+ * name and version, filter, ibuf and obuf contents. The lengths are
+ * multiples of 8, so that the records and the counters stay aligned.
+ */
+struct liveupgrade_client_t {
+	uint32_t len;			/* length of the whole record */
+	uint16_t fixed_len;		/* length of this fixed part */
+	uint8_t type;			/* LIVEUPGRADE_REC_CLIENT */
+	uint8_t state;			/* LIVEUPGRADE_STATE_* */
+
+	int32_t fd;
+	int32_t listener_id;
+	int32_t udp_port;
+	uint8_t validated;
+	uint8_t loc_known;
+	uint8_t username_len;
+	uint8_t app_name_len;
+	uint8_t app_version_len;
+	uint8_t pad[7];
+
+	int64_t connect_time;
+	int64_t connect_tick;
+
+	int64_t rxbytes, txbytes;
+	int64_t rxpackets, txpackets;
+	int64_t rxdrops, rxdupes;
+
+	float lat, lng;
+
+	uint16_t filter_len;
+	uint16_t heard_count;
+	uint16_t rxerr_count;
+	uint16_t pad2;
+	uint32_t ibuf_len;
+	uint32_t obuf_len;
+};
+
+struct liveupgrade_heard_t {
+	int64_t last_heard;
+	uint8_t call_len;
+	char callsign[CALLSIGNLEN_MAX+1];
+	char pad[4];
+};
+
+/* pointers to the variable-length data of a client record */
+struct liveupgrade_fields_t {
+	const char *rxerrs;		/* int64_t[rxerr_count], may be unaligned */
+	const char *heard;		/* struct liveupgrade_heard_t[heard_count] */
+	const char *username;
+	const char *app_name;
+	const char *app_version;
+	const char *filter;
+	const char *ibuf;
+	const char *obuf;
+};
+
+/* A batch record contains a number of database entries. Each entry
+ * has a small header giving the lengths of the entry and its data,
+ * so that fields can be added to the entries later.
+ */
+struct liveupgrade_batch_header_t {
+	uint32_t len;			/* length of the whole record */
+	uint16_t fixed_len;		/* length of this header */
+	uint8_t type;			/* LIVEUPGRADE_REC_* */
+	uint8_t pad;
+	uint32_t count;			/* number of entries */
+	uint32_t pad2;
+};
+
+struct liveupgrade_entry_header_t {
+	uint16_t fixed_len;		/* length of the entry */
+	uint16_t data_len;		/* length of the data following the entry */
+	uint32_t pad;
+};
+
+/* a packet which had not been through the dupecheck yet */
+struct liveupgrade_pbuf_t {
+	int32_t origin_fd;		/* fd of the client which sent it, or -1 */
+	uint32_t flags;			/* F_* */
+};
+
+/* a dupecheck record, the data is the packet in its checked form */
+struct liveupgrade_dupe_t {
+	int64_t t;
+	int32_t dtype;
+	uint32_t pad;
+};
+
+/* a historydb entry, the data is the key */
+struct liveupgrade_history_t {
+	int64_t arrivaltime;
+	float lat, lon;
+	int32_t packettype;
+	int32_t flags;
+};
+
+/* batch writer and reader */
+struct liveupgrade_batch_t {
+	int type;
+	char *buf;
+	size_t len, size;
+	uint32_t count;
+};
+
+struct liveupgrade_batch_reader_t {
+	int type;
+	const struct liveupgrade_record_t *rec;
+	const char *p, *end;
+};
+
+extern int liveupgrade_count;
+
+/* the old process */
+extern void liveupgrade_dump_start(void);
+extern void liveupgrade_dump_client(struct client_t *c);
+extern void liveupgrade_dump_pbufs(struct worker_t *self);
+extern int liveupgrade_dump_finish(void);
+
+extern void liveupgrade_batch_start(struct liveupgrade_batch_t *b, int type);
+extern void liveupgrade_batch_add(struct liveupgrade_batch_t *b, const void *entry, int entry_len, const char *data, int data_len);
+extern void liveupgrade_batch_finish(struct liveupgrade_batch_t *b);
+
+/* the new process */
+extern int liveupgrade_load(void);
+extern int liveupgrade_loaded(void);
+extern const struct liveupgrade_client_t *liveupgrade_next_client(const struct liveupgrade_client_t *prev);
+extern int liveupgrade_client_fields(const struct liveupgrade_client_t *rec, struct liveupgrade_fields_t *f);
+extern void liveupgrade_client_rxerrs(struct client_t *c, const struct liveupgrade_client_t *rec, const struct liveupgrade_fields_t *f);
+extern void liveupgrade_client_attach(struct client_t *c, const struct liveupgrade_client_t *rec);
+extern void liveupgrade_client_restore(struct client_t *c);
+extern void liveupgrade_load_done(int accepted);
+
+extern void liveupgrade_batch_open(struct liveupgrade_batch_reader_t *r, int type);
+extern int liveupgrade_batch_next(struct liveupgrade_batch_reader_t *r, void *entry, int entry_len, const char **data, int *data_len);
+
+#endif
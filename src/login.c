@@ -24,9 +24,12 @@
 #include "clientlist.h"
 #include "parse_qc.h"
 #include "ssl.h"
+#include "callmatch.h"
 
-/* a static list of usernames which are not allowed to log in */
-static const char *disallow_login_usernames[] = {
+/* a static list of usernames which are not allowed to log in, compiled
+ * to disallow_login_matcher together with DisallowLoginCall
+ */
+const char *disallow_login_usernames[] = {
 	"pass", /* a sign of "user  pass -1" login with no configured username */
 	NULL
 };
@@ -78,17 +81,9 @@ int http_udp_upload_login(const char *addr_rem, char *s, char **username, const
 		return -1;
 	}
 	
-	/* check the username against a static list of disallowed usernames */
-	for (i = 0; (disallow_login_usernames[i]); i++) {
-		if (strcasecmp(*username, disallow_login_usernames[i]) == 0) {
-			hlog(LOG_WARNING, "%s: %s: Login by user '%s' not allowed", addr_rem, log_source, *username);
-			return -1;
-		}
-	}
-	
-	/* check the username against a dynamic list of disallowed usernames */
-	if (disallow_login_glob && check_call_glob_match(disallow_login_glob, *username, username_len)) {
-		hlog(LOG_WARNING, "%s: %s: Login by user '%s' not allowed due to config", addr_rem, log_source, *username);
+	/* check the username against the static and configured lists of disallowed usernames */
+	if (callmatch_match(disallow_login_matcher, *username, username_len)) {
+		hlog(LOG_WARNING, "%s: %s: Login by user '%s' not allowed", addr_rem, log_source, *username);
 		return -1;
 	}
 	
@@ -253,18 +248,9 @@ int login_handler(struct worker_t *self, struct client_t *c, int l4proto, char *
 	c->username[sizeof(c->username)-1] = 0;
 	c->username_len = strlen(c->username);
 	
-	/* check the username against a static list of disallowed usernames */
-	for (i = 0; (disallow_login_usernames[i]); i++) {
-		if (strcasecmp(c->username, disallow_login_usernames[i]) == 0) {
-			hlog(LOG_WARNING, "%s: Login by user '%s' not allowed", c->addr_rem, c->username);
-			rc = client_printf(self, c, "# Login by user not allowed\r\n");
-			goto failed_login;
-		}
-	}
-	
-	/* check the username against a dynamic list of disallowed usernames */
-	if (disallow_login_glob && check_call_glob_match(disallow_login_glob, c->username, c->username_len)) {
-		hlog(LOG_WARNING, "%s: Login by user '%s' not allowed due to config", c->addr_rem, c->username);
+	/* check the username against the static and configured lists of disallowed usernames */
+	if (callmatch_match(disallow_login_matcher, c->username, c->username_len)) {
+		hlog(LOG_WARNING, "%s: Login by user '%s' not allowed", c->addr_rem, c->username);
 		rc = client_printf(self, c, "# Login by user not allowed\r\n");
 		goto failed_login;
 	}
@@ -0,0 +1,321 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+/*
+ *	Prometheus metrics.
+ *
+ *	Generates the counters in the Prometheus text exposition format
+ *	for the /metrics URL of the status port. The values are read
+ *	directly from the counters where they are kept (the per-listener
+ *	and per-protocol accounters, the workers and the databases), and
+ *	the text is written out in pieces through a status_write_t
+ *	function, so that no cJSON tree is built.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "metrics.h"
+#include "status.h"
+#include "worker.h"
+#include "accept.h"
+#include "config.h"
+#include "version.h"
+#include "hlog.h"
+#include "hmalloc.h"
+#include "http.h"
+#include "incoming.h"
+#include "historydb.h"
+#include "dupecheck.h"
+#include "filter.h"
+#include "client_heard.h"
+#include "cellmalloc.h"
+#include "liveupgrade.h"
+
+static void metrics_flush(struct metrics_t *m)
+{
+	if (m->len && !m->failed && m->write(m->arg, m->buf, m->len))
+		m->failed = 1;
+
+	m->len = 0;
+}
+
+static void metrics_printf(struct metrics_t *m, const char *fmt, ...)
+{
+	va_list args;
+	int l;
+
+	va_start(args, fmt);
+	l = vsnprintf(m->buf + m->len, sizeof(m->buf) - m->len, fmt, args);
+	va_end(args);
+
+	if (l >= (int)sizeof(m->buf) - m->len) {
+		/* did not fit, flush and try again */
+		metrics_flush(m);
+		va_start(args, fmt);
+		l = vsnprintf(m->buf, sizeof(m->buf), fmt, args);
+		va_end(args);
+		if (l >= (int)sizeof(m->buf))
+			l = sizeof(m->buf) - 1;
+	}
+
+	m->len += l;
+}
+
+/*
+ *	Start a metric family: the HELP and TYPE lines
+ */
+
+void metrics_family(struct metrics_t *m, const char *name, const char *type, const char *help)
+{
+	metrics_printf(m, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(struct metrics_t *m, const char *name, const char *labels, long long v)
+{
+	if (labels && *labels)
+		metrics_printf(m, "%s{%s} %lld\n", name, labels, v);
+	else
+		metrics_printf(m, "%s %lld\n", name, v);
+}
+
+/*
+ *	Format a label, escaping the value
+ */
+
+void metrics_label(char *buf, int size, const char *name, const char *value)
+{
+	int i, l;
+
+	l = snprintf(buf, size, "%s=\"", name);
+	if (l >= size - 2) {
+		*buf = 0;
+		return;
+	}
+
+	for (i = l; *value && i < size - 3; value++) {
+		if (*value == '\\' || *value == '"' || *value == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = (*value == '\n') ? 'n' : *value;
+		} else {
+			buf[i++] = *value;
+		}
+	}
+
+	buf[i++] = '"';
+	buf[i] = 0;
+}
+
+/*
+ *	Traffic counters of the protocol accounters
+ */
+
+static const struct metrics_proto_t {
+	const char *name;
+	struct portaccount_t *pa;
+} metrics_protos[] = {
+	{ "tcp", &client_connects_tcp },
+	{ "udp", &client_connects_udp },
+#ifdef USE_SCTP
+	{ "sctp", &client_connects_sctp },
+#endif
+	{ NULL, NULL }
+};
+
+static void metrics_proto_counter(struct metrics_t *m, const char *name, const char *help, size_t offset)
+{
+	const struct metrics_proto_t *p;
+	char labels[32];
+
+	metrics_family(m, name, "counter", help);
+	for (p = metrics_protos; p->name; p++) {
+		snprintf(labels, sizeof(labels), "proto=\"%s\"", p->name);
+		metrics_sample(m, name, labels, *(long long *)((char *)p->pa + offset));
+	}
+}
+
+static void metrics_protos_write(struct metrics_t *m)
+{
+	const struct metrics_proto_t *p;
+	char labels[128];
+	int i;
+
+	metrics_proto_counter(m, "aprsc_received_bytes_total", "Bytes received from clients, uplinks and peers",
+		offsetof(struct portaccount_t, rxbytes));
+	metrics_proto_counter(m, "aprsc_sent_bytes_total", "Bytes sent to clients, uplinks and peers",
+		offsetof(struct portaccount_t, txbytes));
+	metrics_proto_counter(m, "aprsc_received_packets_total", "APRS-IS packets received",
+		offsetof(struct portaccount_t, rxpackets));
+	metrics_proto_counter(m, "aprsc_sent_packets_total", "APRS-IS packets sent",
+		offsetof(struct portaccount_t, txpackets));
+	metrics_proto_counter(m, "aprsc_dropped_packets_total", "Received APRS-IS packets dropped due to an error",
+		offsetof(struct portaccount_t, rxdrops));
+	metrics_proto_counter(m, "aprsc_duplicate_packets_total", "Received APRS-IS packets dropped as duplicates",
+		offsetof(struct portaccount_t, rxdupes));
+
+	metrics_family(m, "aprsc_rx_errors_total", "counter", "Received APRS-IS packets dropped, by reason");
+	for (p = metrics_protos; p->name; p++) {
+		for (i = 0; i < INERR_BUCKETS; i++) {
+			snprintf(labels, sizeof(labels), "proto=\"%s\",reason=\"%s\"", p->name, inerr_labels[i]);
+			metrics_sample(m, "aprsc_rx_errors_total", labels, p->pa->rxerrs[i]);
+		}
+	}
+}
+
+/*
+ *	Dupecheck and historydb
+ */
+
+static void metrics_databases_write(struct metrics_t *m)
+{
+	static const char *dupe_variations[DTYPE_MAX+1] = {
+		"exact",
+		"space_trim",
+		"8bit_strip",
+		"8bit_clear",
+		"8bit_spaced",
+		"low_strip",
+		"low_spaced",
+		"del_strip",
+		"del_spaced"
+	};
+	char labels[64];
+	int i;
+
+	metrics_family(m, "aprsc_dupecheck_uniques_total", "counter", "Unique packets passed by the duplicate check");
+	metrics_sample(m, "aprsc_dupecheck_uniques_total", NULL, dupecheck_outcount);
+	metrics_family(m, "aprsc_dupecheck_dupes_total", "counter", "Duplicate packets dropped by the duplicate check");
+	metrics_sample(m, "aprsc_dupecheck_dupes_total", NULL, dupecheck_dupecount);
+
+	metrics_family(m, "aprsc_dupecheck_variations_total", "counter", "Duplicates detected, by the variation of the packet which matched");
+	for (i = 0; i <= DTYPE_MAX; i++) {
+		metrics_label(labels, sizeof(labels), "variation", dupe_variations[i]);
+		metrics_sample(m, "aprsc_dupecheck_variations_total", labels, dupecheck_dupetypes[i]);
+	}
+
+	metrics_family(m, "aprsc_historydb_inserts_total", "counter", "Position history database inserts");
+	metrics_sample(m, "aprsc_historydb_inserts_total", NULL, historydb_inserts);
+	metrics_family(m, "aprsc_historydb_lookups_total", "counter", "Position history database lookups");
+	metrics_sample(m, "aprsc_historydb_lookups_total", NULL, historydb_lookups);
+	metrics_family(m, "aprsc_historydb_hashmatches_total", "counter", "Position history database lookups which matched a hash");
+	metrics_sample(m, "aprsc_historydb_hashmatches_total", NULL, historydb_hashmatches);
+	metrics_family(m, "aprsc_historydb_keymatches_total", "counter", "Position history database lookups which matched a key");
+	metrics_sample(m, "aprsc_historydb_keymatches_total", NULL, historydb_keymatches);
+	metrics_family(m, "aprsc_historydb_nopos_total", "counter", "Packets without a position offered to the history database");
+	metrics_sample(m, "aprsc_historydb_nopos_total", NULL, historydb_noposcount);
+	metrics_family(m, "aprsc_historydb_cleaned_total", "counter", "Expired position history database entries cleaned up");
+	metrics_sample(m, "aprsc_historydb_cleaned_total", NULL, historydb_cleanup_cleaned);
+}
+
+/*
+ *	Cell allocator pools
+ */
+
+#ifndef _FOR_VALGRIND_
+static void metrics_cells_write(struct metrics_t *m)
+{
+	struct cellstatus_t st[10];
+	static const char *names[10] = {
+		"historydb",
+		"dupecheck",
+		"filter",
+		"filter_entrycall",
+		"filter_wx",
+		"pbuf_small",
+		"pbuf_medium",
+		"pbuf_large",
+		"client_heard",
+		"client"
+	};
+	char labels[64];
+	int i;
+
+	historydb_cell_stats(&st[0]);
+	dupecheck_cell_stats(&st[1]);
+	filter_cell_stats(&st[2], &st[3], &st[4]);
+	incoming_cell_stats(&st[5], &st[6], &st[7]);
+	client_heard_cell_stats(&st[8]);
+	client_cell_stats(&st[9]);
+
+	metrics_family(m, "aprsc_cells_used", "gauge", "Cells in use in the cell allocator pool");
+	for (i = 0; i < 10; i++) {
+		metrics_label(labels, sizeof(labels), "pool", names[i]);
+		metrics_sample(m, "aprsc_cells_used", labels, st[i].cellcount - st[i].freecount);
+	}
+
+	metrics_family(m, "aprsc_cells_free", "gauge", "Free cells in the cell allocator pool");
+	for (i = 0; i < 10; i++) {
+		metrics_label(labels, sizeof(labels), "pool", names[i]);
+		metrics_sample(m, "aprsc_cells_free", labels, st[i].freecount);
+	}
+
+	metrics_family(m, "aprsc_cells_allocated_bytes", "gauge", "Memory allocated for the cell allocator pool");
+	for (i = 0; i < 10; i++) {
+		metrics_label(labels, sizeof(labels), "pool", names[i]);
+		metrics_sample(m, "aprsc_cells_allocated_bytes", labels, (long long)st[i].blocks * (long long)st[i].block_size);
+	}
+
+	metrics_family(m, "aprsc_cells_magazine_misses_total", "counter", "Cell allocations which had to refill the thread's magazine from the pool");
+	for (i = 0; i < 10; i++) {
+		metrics_label(labels, sizeof(labels), "pool", names[i]);
+		metrics_sample(m, "aprsc_cells_magazine_misses_total", labels, st[i].magazine_misses);
+	}
+}
+#endif
+
+/*
+ *	Generate the metrics and pass them to the write function
+ */
+
+int metrics_write(status_write_t write, void *arg)
+{
+	struct metrics_t *m;
+	char labels[256];
+	int n, ret;
+
+	m = hmalloc(sizeof(*m));
+	m->write = write;
+	m->arg = arg;
+	m->failed = 0;
+	m->len = 0;
+
+	n = snprintf(labels, sizeof(labels), "version=\"%s\",", version_build);
+	metrics_label(labels + n, sizeof(labels) - n, "server_id", (serverid) ? serverid : "");
+	metrics_family(m, "aprsc_build_info", "gauge", "Software version and server id");
+	metrics_sample(m, "aprsc_build_info", labels, 1);
+
+	metrics_family(m, "aprsc_start_time_seconds", "gauge", "Start time of the server since the epoch");
+	metrics_sample(m, "aprsc_start_time_seconds", NULL, startup_time);
+	metrics_family(m, "aprsc_uptime_seconds", "gauge", "Time since the server was started");
+	metrics_sample(m, "aprsc_uptime_seconds", NULL, tick - startup_tick);
+	metrics_family(m, "aprsc_live_upgrades_total", "counter", "Live upgrades done since the server was started");
+	metrics_sample(m, "aprsc_live_upgrades_total", NULL, liveupgrade_count);
+	metrics_family(m, "aprsc_log_lines_dropped_total", "counter", "Log lines dropped since the logger could not keep up");
+	metrics_sample(m, "aprsc_log_lines_dropped_total", NULL, hlog_lines_dropped);
+	metrics_family(m, "aprsc_http_requests_total", "counter", "HTTP requests served");
+	metrics_sample(m, "aprsc_http_requests_total", NULL, http_requests);
+
+	metrics_protos_write(m);
+	metrics_databases_write(m);
+#ifndef _FOR_VALGRIND_
+	metrics_cells_write(m);
+#endif
+	accept_listener_metrics(m);
+	worker_metrics(m);
+
+	metrics_flush(m);
+	ret = (m->failed) ? -1 : 0;
+	hfree(m);
+
+	return ret;
+}
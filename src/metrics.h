@@ -0,0 +1,33 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "status.h"
+
+#define METRICS_CONTENT_TYPE	"text/plain; version=0.0.4; charset=utf-8"
+
+/* output buffer, flushed to the write function as it fills up */
+struct metrics_t {
+	status_write_t write;
+	void *arg;
+	int failed;
+	int len;
+	char buf[8192];
+};
+
+extern void metrics_family(struct metrics_t *m, const char *name, const char *type, const char *help);
+extern void metrics_sample(struct metrics_t *m, const char *name, const char *labels, long long v);
+extern void metrics_label(char *buf, int size, const char *name, const char *value);
+
+extern int metrics_write(status_write_t write, void *arg);
+
+#endif
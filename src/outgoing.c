@@ -25,7 +25,7 @@
  *	should have a copy
  */
 
-static inline void send_single(struct worker_t *self, struct client_t *c, char *data, int len)
+static inline int send_single(struct worker_t *self, struct client_t *c, char *data, int len)
 {
 	/* if we're going to use the UDP sidechannel, account for UDP, otherwise
 	 * its TCP or SCTP or something.
@@ -35,7 +35,7 @@ static inline void send_single(struct worker_t *self, struct client_t *c, char *
 	else
 		clientaccount_add( c, c->ai_protocol, 0, 0, 0, 1, 0, 0);
 	
-	c->write(self, c, data, len);
+	return c->write(self, c, data, len);
 }
 
 static void process_outgoing_single(struct worker_t *self, struct pbuf_t *pb)
@@ -103,9 +103,12 @@ static void process_outgoing_single(struct worker_t *self, struct pbuf_t *pb)
 		cnext = c->class_next; // client_write() MAY destroy the client object!
 		
 		/* If not full feed, process filters to see if the packet should be sent. */
-		if (( (c->flags & CLFLAGS_FULLFEED) != CLFLAGS_FULLFEED) && filter_process(self, c, pb) < 1) {
-			//hlog(LOG_DEBUG, "fd %d: Not fullfeed or not matching filter, not sending.", c->fd);
-			continue;
+		if ((c->flags & CLFLAGS_FULLFEED) != CLFLAGS_FULLFEED) {
+			c->filter_evals++;
+			if (filter_process(self, c, pb) < 1) {
+				//hlog(LOG_DEBUG, "fd %d: Not fullfeed or not matching filter, not sending.", c->fd);
+				continue;
+			}
 		}
 		
 		/* Do not send packet back to the source client.
@@ -125,6 +128,41 @@ static void process_outgoing_single(struct worker_t *self, struct pbuf_t *pb)
 	}
 }
 
+/*
+ *	Catch up a client which has been migrated from another worker, which
+ *	was behind us in the global packet queue: send it the packets from pb
+ *	up to last_seqnum, the ones we have already processed, but the old
+ *	worker had not. Only clients of the "other" class are migrated, so
+ *	this does the same as the last loop of process_outgoing_single().
+ *	The caller holds the read lock. Returns -1 if the client was
+ *	destroyed by a failed write.
+ */
+
+int process_outgoing_replay(struct worker_t *self, struct client_t *c, struct pbuf_t *pb, uint32_t last_seqnum)
+{
+	int n = 0;
+	
+	for (; (pb) && (int32_t)(last_seqnum - pb->seqnum) >= 0; pb = pb->next) {
+		/* same checks as in process_outgoing, skip the ones it skipped */
+		if (pb->is_free || pb->t > tick + 2 || tick - pb->t > 5)
+			continue;
+		
+		if ((c->flags & CLFLAGS_FULLFEED) != CLFLAGS_FULLFEED) {
+			c->filter_evals++;
+			if (filter_process(self, c, pb) < 1)
+				continue;
+		}
+		
+		if (c == pb->origin)
+			continue;
+		
+		if (send_single(self, c, pb->data, pb->packet_len) < -2)
+			return -1; /* client destroyed */
+		n++;
+	}
+	
+	return n;
+}
 
 /*
  *	Process outgoing packets from the global packet queue, write them to clients
@@ -140,12 +178,29 @@ void process_outgoing(struct worker_t *self)
 		exit(1);
 	}
 	
+	if (self->pbuf_resync) {
+		/* We have not been here for a long time, and the purger wants
+		 * to free the packets we have not processed. Skip to the tail.
+		 */
+		hlog(LOG_ERR, "worker %d: process_outgoing stalled, skipping to the tail of the packet queues", self->id);
+		self->pbuf_global_prevp = pbuf_global_prevp;
+		self->pbuf_global_dupe_prevp = pbuf_global_dupe_prevp;
+		self->last_pbuf_seqnum = pbuf_global_last_seqnum;
+		self->last_pbuf_dupe_seqnum = pbuf_global_dupe_last_seqnum;
+		self->pbuf_resync = 0;
+		self->internal_packet_drops++;
+		if (self->migrating)
+			worker_migrate_attach(self, 1);
+		status_error(86400, "packet_drop_hang");
+	}
+	
 	while ((pb = *self->pbuf_global_prevp)) {
 		//__sync_synchronize();
 		/* Some safety checks against bugs and overload conditions */
 		if (pb->is_free) {
 			hlog(LOG_ERR, "worker %d: process_outgoing got pbuf %d marked free, age %d (now %d t %d)\n%.*s",
 				self->id, pb->seqnum, tick - pb->t, tick, pb->t, pb->packet_len-2, pb->data);
+			hlog_flush();
 			abort(); /* this would be pretty bad, so we crash immediately */
 		} else if (pb->t > tick + 2) {
 			/* 2-second offset is normal in case of one thread updating tick earlier than another
@@ -168,12 +223,17 @@ void process_outgoing(struct worker_t *self)
 		}
 		self->last_pbuf_seqnum = pb->seqnum;
 		self->pbuf_global_prevp = &pb->next;
+		
+		/* migrated clients join in when we reach the old worker's position */
+		if (self->migrating)
+			worker_migrate_attach(self, 0);
 	}
 	
 	while ((pb = *self->pbuf_global_dupe_prevp)) {
 		if (pb->is_free) {
 			hlog(LOG_ERR, "worker %d: process_outgoing got dupe %d marked free, age %d (now %d t %d)\n%.*s",
 				self->id, pb->seqnum, tick - pb->t, tick, pb->t, pb->packet_len-2, pb->data);
+			hlog_flush();
 			abort();
 		} else if (pb->t > tick + 2) {
 			hlog(LOG_ERR, "worker: process_outgoing got dupe from future %d with t %d > tick %d!\n%.*s",
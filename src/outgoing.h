@@ -13,5 +13,6 @@
 
 #include "worker.h"
 extern void process_outgoing(struct worker_t *self);
+extern int process_outgoing_replay(struct worker_t *self, struct client_t *c, struct pbuf_t *pb, uint32_t last_seqnum);
 
 #endif
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <ctype.h>
 
@@ -28,6 +29,8 @@
 #include "filter.h"
 #include "historydb.h"
 #include "incoming.h"
+#include "config.h"
+#include "callmatch.h"
 
 //#define DEBUG_PARSE_APRS 1
 #ifdef DEBUG_PARSE_APRS
@@ -37,6 +40,121 @@
 #define DEBUG_LOG(...) { }
 #endif
 
+/*
+ *	Lookup tables for the position decoders, filled in by
+ *	parse_aprs_init() at startup and read-only after that.
+ */
+
+/* minutes and hundredths of minutes to degrees, m / 60.0 and f / 6000.0 */
+static double min_to_deg[100];
+static double min_frag_to_deg[100];
+
+/* out-of-range values can only come from the sscanf() fallback */
+#define MIN_TO_DEG(m)		(((m) < 100) ? min_to_deg[(m)] : (float)(m) / 60.0)
+#define MIN_FRAG_TO_DEG(f)	(((f) < 100) ? min_frag_to_deg[(f)] : (float)(f) / 6000.0)
+
+/* Mic-E destination call characters to latitude digits, -1 if the
+ * character is not valid in that position
+ */
+#define MICE_AMBIGUOUS	10	/* K, L and Z */
+static signed char mice_lat_digit[256];		/* first 3 characters */
+static signed char mice_lat_digit_ns[256];	/* last 3, which also carry N/S, offset and E/W */
+
+/* base-91 digit multipliers of compressed positions */
+static const int base91_mul[4] = { 91 * 91 * 91, 91 * 91, 91, 1 };
+
+/* Fixed-width "DDMM.hhN/DDDMM.hhW" layout of an uncompressed position
+ * (d: digit, x: anything), checked 8 bytes at a time. The masks are set
+ * up from byte strings, so that they work on both byte orders.
+ */
+#define UNCOMPRESSED_POS_LEN	19
+#define UNCOMPRESSED_POS_WORDS	3
+static const char uncompressed_pos_layout[UNCOMPRESSED_POS_LEN+1] = "dddd.ddxxddddd.ddxx";
+static uint64_t pos_fixed_mask[UNCOMPRESSED_POS_WORDS];		/* 0xF0 on digits, 0xFF on dots */
+static uint64_t pos_fixed_value[UNCOMPRESSED_POS_WORDS];	/* 0x30 on digits, '.' on dots */
+static uint64_t pos_digit_mask[UNCOMPRESSED_POS_WORDS];		/* 0xFF on digits */
+static uint64_t pos_digit_add[UNCOMPRESSED_POS_WORDS];		/* 0x06 on digits */
+static uint64_t pos_digit_high[UNCOMPRESSED_POS_WORDS];		/* 0xF0 on digits */
+static uint64_t pos_digit_value[UNCOMPRESSED_POS_WORDS];	/* 0x30 on digits */
+
+void parse_aprs_init(void)
+{
+	unsigned char fixed_mask[UNCOMPRESSED_POS_WORDS*8], fixed_value[UNCOMPRESSED_POS_WORDS*8];
+	unsigned char digit_mask[UNCOMPRESSED_POS_WORDS*8], digit_add[UNCOMPRESSED_POS_WORDS*8];
+	int i;
+	
+	for (i = 0; i < 100; i++) {
+		min_to_deg[i] = (float)i / 60.0;
+		min_frag_to_deg[i] = (float)i / 6000.0;
+	}
+	
+	/* A-K characters are not used in the last 3 characters
+	 * and MNO are never used
+	 */
+	memset(mice_lat_digit, -1, sizeof(mice_lat_digit));
+	for (i = 0; i < 10; i++) {
+		mice_lat_digit['0' + i] = i;
+		mice_lat_digit['A' + i] = i;
+		mice_lat_digit['P' + i] = i;
+	}
+	mice_lat_digit['K'] = mice_lat_digit['L'] = mice_lat_digit['Z'] = MICE_AMBIGUOUS;
+	
+	memcpy(mice_lat_digit_ns, mice_lat_digit, sizeof(mice_lat_digit_ns));
+	for (i = 'A'; i <= 'K'; i++)
+		mice_lat_digit_ns[i] = -1;
+	
+	memset(fixed_mask, 0, sizeof(fixed_mask));
+	memset(fixed_value, 0, sizeof(fixed_value));
+	memset(digit_mask, 0, sizeof(digit_mask));
+	memset(digit_add, 0, sizeof(digit_add));
+	
+	for (i = 0; i < UNCOMPRESSED_POS_LEN; i++) {
+		if (uncompressed_pos_layout[i] == 'd') {
+			fixed_mask[i] = 0xF0;
+			fixed_value[i] = 0x30;
+			digit_mask[i] = 0xFF;
+			digit_add[i] = 0x06;
+		} else if (uncompressed_pos_layout[i] == '.') {
+			fixed_mask[i] = 0xFF;
+			fixed_value[i] = '.';
+		}
+	}
+	
+	memcpy(pos_fixed_mask, fixed_mask, sizeof(pos_fixed_mask));
+	memcpy(pos_fixed_value, fixed_value, sizeof(pos_fixed_value));
+	memcpy(pos_digit_mask, digit_mask, sizeof(pos_digit_mask));
+	memcpy(pos_digit_add, digit_add, sizeof(pos_digit_add));
+	
+	for (i = 0; i < UNCOMPRESSED_POS_WORDS; i++) {
+		pos_digit_high[i] = pos_fixed_mask[i] & pos_digit_mask[i];
+		pos_digit_value[i] = pos_fixed_value[i] & pos_digit_mask[i];
+	}
+}
+
+/*
+ *	Check that an uncompressed position has digits and dots in all the
+ *	right places. A byte is a digit if its high nibble is 3, and it
+ *	stays so when 6 is added. Adding cannot carry over to the next
+ *	byte once the high nibbles have been checked.
+ */
+
+static int uncompressed_pos_digits_ok(const char *posbuf)
+{
+	uint64_t x, bad = 0;
+	int i;
+	
+	for (i = 0; i < UNCOMPRESSED_POS_WORDS; i++) {
+		memcpy(&x, posbuf + i * 8, sizeof(x));
+		bad |= (x & pos_fixed_mask[i]) ^ pos_fixed_value[i];
+		bad |= (((x & pos_digit_mask[i]) + pos_digit_add[i]) & pos_digit_high[i]) ^ pos_digit_value[i];
+	}
+	
+	return (bad == 0);
+}
+
+#define DIGITS2(p) (((p)[0] - '0') * 10 + ((p)[1] - '0'))
+#define DIGITS3(p) (((p)[0] - '0') * 100 + ((p)[1] - '0') * 10 + ((p)[2] - '0'))
+
 /*
  *	Check if the given character is a valid symbol table identifier
  *	or an overlay character. The set is different for compressed
@@ -59,7 +177,7 @@ static int valid_sym_table_uncompressed(char c)
 /*
  *	Fill the pbuf_t structure with a parsed position and
  *	symbol table & code. Also does range checking for lat/lng
- *	and pre-calculates cosf(lat) for range filters.
+ *	and pre-calculates cos(lat) for range filters.
  */
 
 static int pbuf_fill_pos(struct pbuf_t *pb, const float lat, const float lng, const char sym_table, const char sym_code)
@@ -95,7 +213,7 @@ static int pbuf_fill_pos(struct pbuf_t *pb, const float lat, const float lng, co
 
 	/* Pre-calculations for A/R/F/M-filter tests */
 	pb->lat     = filter_lat2rad(lat);  /* deg-to-radians */
-	pb->cos_lat = cosf(pb->lat);        /* used in range filters */
+	pb->cos_lat = filter_coslat(pb->lat); /* used in range filters */
 	pb->lng     = filter_lon2rad(lng);  /* deg-to-radians */
 	
 	pb->flags |= F_HASPOS;	/* the packet has positional data */
@@ -566,8 +684,8 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 	float lat = 0.0, lng = 0.0;
 	unsigned int lat_deg = 0, lat_min = 0, lat_min_frag = 0, lng_deg = 0, lng_min = 0, lng_min_frag = 0;
 	const char *d_start;
-	char dstcall[7];
-	char *p;
+	signed char lat_digit[6];
+	signed char bad = 0;
 	char sym_table, sym_code;
 	int posambiguity = 0;
 	int i;
@@ -583,22 +701,21 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 	if (pb->dstcall_end_or_ssid - d_start != 6)
 		return 0; /* eh...? */
 	
-	/* validate destination call:
+	/* validate destination call and translate it to latitude digits:
 	 * A-K characters are not used in the last 3 characters
 	 * and MNO are never used
 	 */
+	for (i = 0; i < 3; i++) {
+		lat_digit[i] = mice_lat_digit[(unsigned char)d_start[i]];
+		bad |= lat_digit[i];
+	}
+	for (i = 3; i < 6; i++) {
+		lat_digit[i] = mice_lat_digit_ns[(unsigned char)d_start[i]];
+		bad |= lat_digit[i];
+	}
 	
-	for (i = 0; i < 3; i++)
-		if (!((d_start[i] >= '0' && d_start[i] <= '9')
-			|| (d_start[i] >= 'A' && d_start[i] <= 'L')
-			|| (d_start[i] >= 'P' && d_start[i] <= 'Z')))
-				return 0;
-	
-	for (i = 3; i < 6; i++)
-		if (!((d_start[i] >= '0' && d_start[i] <= '9')
-			|| (d_start[i] == 'L')
-			|| (d_start[i] >= 'P' && d_start[i] <= 'Z')))
-				return 0;
+	if (bad < 0)
+		return 0;
 	
 	DEBUG_LOG("\tpassed dstcall format check");
 	
@@ -620,41 +737,18 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 	
 	DEBUG_LOG("\tpassed info format check");
 	
-	/* make a local copy, we're going to modify it */
-	strncpy(dstcall, d_start, 6);
-	dstcall[6] = 0;
-	
-	/* First do the destination callsign
-	 * (latitude, message bits, N/S and W/E indicators and long. offset)
-	 *
-	 * Translate the characters to get the latitude
-	 */
-	 
-	//fprintf(stderr, "\tuntranslated dstcall: %s\n", dstcall);
-	for (p = dstcall; *p; p++) {
-		if (*p >= 'A' && *p <= 'J')
-			*p -= 'A' - '0';
-		else if (*p >= 'P' && *p <= 'Y')
-			*p -= 'P' - '0';
-		else if (*p == 'K' || *p == 'L' || *p == 'Z')
-			*p = '_';
-	}
-	//fprintf(stderr, "\ttranslated dstcall: %s\n", dstcall);
-	
 	/* position ambiquity is going to get ignored now, it's not needed in this application. */
-	if (dstcall[5] == '_') { dstcall[5] = '5'; posambiguity = 1; }
-	if (dstcall[4] == '_') { dstcall[4] = '5'; posambiguity = 2; }
-	if (dstcall[3] == '_') { dstcall[3] = '5'; posambiguity = 3; }
-	if (dstcall[2] == '_') { dstcall[2] = '3'; posambiguity = 4; }
-	if (dstcall[1] == '_' || dstcall[0] == '_') { return 0; } /* cannot use posamb here */
+	if (lat_digit[5] == MICE_AMBIGUOUS) { lat_digit[5] = 5; posambiguity = 1; }
+	if (lat_digit[4] == MICE_AMBIGUOUS) { lat_digit[4] = 5; posambiguity = 2; }
+	if (lat_digit[3] == MICE_AMBIGUOUS) { lat_digit[3] = 5; posambiguity = 3; }
+	if (lat_digit[2] == MICE_AMBIGUOUS) { lat_digit[2] = 3; posambiguity = 4; }
+	if (lat_digit[1] == MICE_AMBIGUOUS || lat_digit[0] == MICE_AMBIGUOUS) { return 0; } /* cannot use posamb here */
 	
 	/* convert to degrees, minutes and decimal degrees, and then to a float lat */
-	if (sscanf(dstcall, "%2u%2u%2u",
-	    &lat_deg, &lat_min, &lat_min_frag) != 3) {
-		DEBUG_LOG("\tsscanf failed");
-		return 0;
-	}
-	lat = (float)lat_deg + (float)lat_min / 60.0 + (float)lat_min_frag / 6000.0;
+	lat_deg = lat_digit[0] * 10 + lat_digit[1];
+	lat_min = lat_digit[2] * 10 + lat_digit[3];
+	lat_min_frag = lat_digit[4] * 10 + lat_digit[5];
+	lat = (float)lat_deg + min_to_deg[lat_min] + min_frag_to_deg[lat_min_frag];
 	
 	/* check the north/south direction and correct the latitude if necessary */
 	if (d_start[3] <= 0x4c)
@@ -683,13 +777,13 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 	switch (posambiguity) {
 	case 0:
 		/* use everything */
-		lng = (float)lng_deg + (float)lng_min / 60.0
-			+ (float)lng_min_frag / 6000.0;
+		lng = (float)lng_deg + min_to_deg[lng_min]
+			+ min_frag_to_deg[lng_min_frag];
 		break;
 	case 1:
 		/* ignore last number of lng_min_frag */
-		lng = (float)lng_deg + (float)lng_min / 60.0
-			+ (float)(lng_min_frag - lng_min_frag % 10 + 5) / 6000.0;
+		lng = (float)lng_deg + min_to_deg[lng_min]
+			+ min_frag_to_deg[lng_min_frag - lng_min_frag % 10 + 5];
 		break;
 	case 2:
 		/* ignore lng_min_frag */
@@ -697,7 +791,7 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 		break;
 	case 3:
 		/* ignore lng_min_frag and last number of lng_min */
-		lng = (float)lng_deg + (float)(lng_min - lng_min % 10 + 5) / 60.0;
+		lng = (float)lng_deg + min_to_deg[lng_min - lng_min % 10 + 5];
 		break;
 	case 4:
 		/* minute is unused -> add 0.5 degrees to longitude */
@@ -735,8 +829,8 @@ static int parse_aprs_mice(struct pbuf_t *pb, const unsigned char *body, const u
 static int parse_aprs_compressed(struct pbuf_t *pb, const char *body, const char *body_end)
 {
 	char sym_table, sym_code;
-	int i;
-	int lat1, lat2, lat3, lat4, lng1, lng2, lng3, lng4;
+	int i, bad = 0;
+	int lat1 = 0, lng1 = 0;
 	double lat = 0.0, lng = 0.0;
 	
 	DEBUG_LOG("parse_aprs_compressed");
@@ -752,27 +846,20 @@ static int parse_aprs_compressed(struct pbuf_t *pb, const char *body, const char
 	sym_table = body[0]; /* has been validated before entering this function */
 	sym_code = body[9];
 	
-	/* base-91 check */
+	/* base-91 check, 0x21 to 0x7b */
 	for (i = 1; i <= 8; i++)
-		if (body[i] < 0x21 || body[i] > 0x7b)
-			return 0;
+		bad |= ((unsigned char)(body[i] - 0x21) > 0x7b - 0x21);
+	
+	if (bad)
+		return 0;
 	
 	// fprintf(stderr, "\tpassed length and format checks, sym %c%c\n", sym_table, sym_code);
 	
 	/* decode */
-	lat1 = (body[1] - 33);
-	lat2 = (body[2] - 33);
-	lat3 = (body[3] - 33);
-	lat4 = (body[4] - 33);
-
-	lat1 = ((((lat1 * 91) + lat2) * 91) + lat3) * 91 + lat4;
-
-	lng1 = (body[5] - 33);
-	lng2 = (body[6] - 33);
-	lng3 = (body[7] - 33);
-	lng4 = (body[8] - 33);
-
-	lng1 = ((((lng1 * 91) + lng2) * 91) + lng3) * 91 + lng4;
+	for (i = 0; i < 4; i++) {
+		lat1 += (body[1+i] - 33) * base91_mul[i];
+		lng1 += (body[5+i] - 33) * base91_mul[i];
+	}
 
 	/* calculate latitude and longitude */
 
@@ -790,7 +877,7 @@ static int parse_aprs_compressed(struct pbuf_t *pb, const char *body, const char
 
 static int parse_aprs_uncompressed(struct pbuf_t *pb, const char *body, const char *body_end)
 {
-	char posbuf[20];
+	char posbuf[UNCOMPRESSED_POS_WORDS*8];
 	unsigned int lat_deg = 0, lat_min = 0, lat_min_frag = 0, lng_deg = 0, lng_min = 0, lng_min_frag = 0;
 	float lat, lng;
 	char lat_hemi, lng_hemi;
@@ -806,8 +893,8 @@ static int parse_aprs_uncompressed(struct pbuf_t *pb, const char *body, const ch
 	}
 	
 	/* make a local copy, so we can overwrite it at will. */
-	memcpy(posbuf, body, 19);
-	posbuf[19] = 0;
+	memcpy(posbuf, body, UNCOMPRESSED_POS_LEN);
+	memset(posbuf + UNCOMPRESSED_POS_LEN, 0, sizeof(posbuf) - UNCOMPRESSED_POS_LEN);
 	// fprintf(stderr, "\tposbuf: %s\n", posbuf);
 	
 	/* position ambiquity is going to get ignored now, it's not needed in this application. */
@@ -824,7 +911,20 @@ static int parse_aprs_uncompressed(struct pbuf_t *pb, const char *body, const ch
 	
 	// fprintf(stderr, "\tafter filling amb: %s\n", posbuf);
 	/* 3210.70N/13132.15E# */
-	if (sscanf(posbuf, "%2u%2u.%2u%c%c%3u%2u.%2u%c%c",
+	if (uncompressed_pos_digits_ok(posbuf)
+	    && posbuf[7] && posbuf[8] && posbuf[17] && posbuf[18]) {
+		/* the usual, well-formed case */
+		lat_deg = DIGITS2(posbuf);
+		lat_min = DIGITS2(posbuf + 2);
+		lat_min_frag = DIGITS2(posbuf + 5);
+		lat_hemi = posbuf[7];
+		sym_table = posbuf[8];
+		lng_deg = DIGITS3(posbuf + 9);
+		lng_min = DIGITS2(posbuf + 12);
+		lng_min_frag = DIGITS2(posbuf + 15);
+		lng_hemi = posbuf[17];
+		sym_code = posbuf[18];
+	} else if (sscanf(posbuf, "%2u%2u.%2u%c%c%3u%2u.%2u%c%c",
 	    &lat_deg, &lat_min, &lat_min_frag, &lat_hemi, &sym_table,
 	    &lng_deg, &lng_min, &lng_min_frag, &lng_hemi, &sym_code) != 10) {
 		DEBUG_LOG("\tsscanf failed");
@@ -847,8 +947,8 @@ static int parse_aprs_uncompressed(struct pbuf_t *pb, const char *body, const ch
 	if (lat_deg > 89 || lng_deg > 179)
 		return 0; /* too large values for lat/lng degrees */
 	
-	lat = (float)lat_deg + (float)lat_min / 60.0 + (float)lat_min_frag / 6000.0;
-	lng = (float)lng_deg + (float)lng_min / 60.0 + (float)lng_min_frag / 6000.0;
+	lat = (float)lat_deg + MIN_TO_DEG(lat_min) + MIN_FRAG_TO_DEG(lat_min_frag);
+	lng = (float)lng_deg + MIN_TO_DEG(lng_min) + MIN_FRAG_TO_DEG(lng_min_frag);
 	
 	/* Finally apply south/west indicators */
 	if (issouth)
@@ -911,6 +1011,8 @@ static int parse_aprs_object(struct pbuf_t *pb, const char *body, const char *bo
 	
 	pb->srcname = body;
 	pb->srcname_len = namelen+1;
+	if (body[9] == '_')
+		pb->flags |= F_KILLED;
 	
 	DEBUG_LOG("object name: '%.*s'", pb->srcname_len, pb->srcname);
 	
@@ -962,6 +1064,8 @@ static int parse_aprs_item(struct pbuf_t *pb, const char *body, const char *body
 	
 	pb->srcname = body;
 	pb->srcname_len = i;
+	if (body[i] == '_')
+		pb->flags |= F_KILLED;
 	
 	//fprintf(stderr, "\titem name: '%.*s'\n", pb->srcname_len, pb->srcname);
 	
@@ -1053,7 +1157,7 @@ static int parse_aprs_3rdparty(struct pbuf_t *pb, const char *info_start)
  *	Parse APRS message slightly (only as much as is necessary for packet forwarding)
  */
 
-static const char *disallow_msg_recipients[] = {
+const char *disallow_msg_recipients[] = {
 	/* old aprsd status messages:
 	 * W5xx>JAVA,qAU,WB5AOH::javaMSG  :Foo_bar Linux APRS Server: 192.168.10.55 connected 2 users online.
 	 */
@@ -1118,9 +1222,20 @@ static int preparse_aprs_message(struct pbuf_t *pb, const char *body, int body_l
 	pb->dstname = body;
 	pb->dstname_len = i;
 	
-	if (check_call_match(disallow_msg_recipients, body, i))
+	if (callmatch_match(disallow_msg_dst_matcher, body, i))
 		return INERR_DIS_MSG_DST;
 	
+	/* Find the message id, after the last {, for parse_aprs_message() */
+	if (body_len > 10 && body[9] == ':') {
+		const char *p = body + body_len - 1;
+		while (p > body + 10 && *p != '{')
+			p--;
+		if (*p == '{') {
+			pb->msgid = p + 1;
+			pb->msgid_len = body_len - (pb->msgid - body);
+		}
+	}
+	
 	return 0;
 }
 
@@ -1220,7 +1335,7 @@ static int parse_aprs_body(struct pbuf_t *pb, const char *info_start)
 	case ':':
 		if (paclen >= 11) {
 			pb->packettype |= T_MESSAGE;
-			return preparse_aprs_message(pb, body, paclen-1);
+			return preparse_aprs_message(pb, body, body_end - body);
 		}
 		return 0;
 
@@ -1346,31 +1461,24 @@ int parse_aprs(struct pbuf_t *pb)
 
 int parse_aprs_message(struct pbuf_t *pb, struct aprs_message_t *am)
 {
-	const char *p;
-	
 	memset(am, 0, sizeof(*am));
 	
 	if (!(pb->packettype & T_MESSAGE))
 		return -1;
-		
-	if (pb->info_start[10] != ':')
+	
+	/* not for the messages within 3rd-party packets */
+	if (pb->dstname != pb->info_start + 1 || pb->info_start[10] != ':')
 		return -2;
 	
 	am->body = pb->info_start + 11;
 	/* -2 for the CRLF already in place */
-	am->body_len = pb->packet_len - 2 - (pb->info_start - pb->data);
+	am->body_len = pb->packet_len - 2 - (am->body - pb->data);
 	
-	/* search for { looking backwards from the end of the packet,
-	 * it separates the msgid
-	 */
-	p = am->body + am->body_len - 1;
-	while (p > am->body && *p != '{')
-		p--;
-	
-	if (*p == '{') {
-		am->msgid = p+1;
-		am->msgid_len = pb->packet_len - 2 - (am->msgid - pb->data);
-		am->body_len = p - am->body;
+	/* the msgid was found by parse_aprs() */
+	if (pb->msgid) {
+		am->msgid = pb->msgid;
+		am->msgid_len = pb->msgid_len;
+		am->body_len = pb->msgid - 1 - am->body;
 	}
 	
 	/* check if this is an ACK */
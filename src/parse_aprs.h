@@ -23,6 +23,9 @@ struct aprs_message_t {
 	int is_ack;
 };
 
+extern const char *disallow_msg_recipients[];
+
+extern void parse_aprs_init(void);
 extern int parse_aprs(struct pbuf_t *pb);
 extern int parse_aprs_message(struct pbuf_t *pb, struct aprs_message_t *am);
 
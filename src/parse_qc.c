@@ -22,6 +22,7 @@
 #include "clientlist.h"
 #include "config.h"
 #include "hlog.h"
+#include "keyhash.h"
 
 /*
  *	Check if a callsign is good for a Q construct
@@ -55,17 +56,25 @@ int check_invalid_q_callsign(const char *call, int len)
  */
 
 #define MAX_Q_CALLS 64
+#define Q_CALLSET_SIZE 128	/* hash set of the calls, power of 2, > MAX_Q_CALLS */
 
-static int q_dropcheck( struct client_t *c, const char *pdata, char *new_q, int new_q_size, char *via_start,
+static int q_dropcheck( struct client_t *c, const char *pdata, const struct header_tokens_t *ht,
+			char *new_q, int new_q_size, char *via_start,
 			int new_q_len, char q_proto, char q_type, char *q_start,
 			char **q_replace, char *path_end )
 {
-	char *qcallv[MAX_Q_CALLS+1];
+	char *qcallv[MAX_Q_CALLS];
+	int qcalll[MAX_Q_CALLS];
+	uint32_t qcallh[MAX_Q_CALLS];
+	uint8_t callset[Q_CALLSET_SIZE]; /* index+1 of a call in qcallv, 0 for an empty slot */
 	int qcallc;
+	const struct header_elem_t *el;
 	char *p;
 	int username_len;
+	uint32_t username_hash, serverid_hash;
 	int login_in_path = 0;
-	int i, j, l;
+	int first_twice = -1;
+	int i, j, k, l;
 	
 	if (q_proto != q_protocol_id && disallow_other_protocol_id) {
 		hlog(LOG_DEBUG, "q: dropping due to q%c%c (wrong Q protocol ID)", q_proto, q_type);
@@ -94,40 +103,68 @@ static int q_dropcheck( struct client_t *c, const char *pdata, char *new_q, int
 	
 	/*
 	 * Produce an array of pointers pointing to each callsign in the path
-	 * after the q construct
-	 */
-	qcallc = 0;
-	if (q_start) {
-		p = q_start + 4;
-		while (qcallc < MAX_Q_CALLS && p < path_end) {
-			while (p < path_end && *p == ',')
-				p++;
-			if (p == path_end)
-				break;
-			qcallv[qcallc++] = p;
-			while (p < path_end && *p != ',')
-				p++;
-		}
-		qcallv[qcallc] = p+1;
-	}
-	
-	/*
-	 * If ,SERVERLOGIN is found after the q construct:
+	 * after the q construct, using the elements found by the header
+	 * tokenizer, which also hashed them for us.
+	 *
+	 * While at it, check if ,SERVERLOGIN is found after the q construct:
 	 * {
 	 *	Dump to the loop log with the sender's IP address for identification
 	 *	Quit processing the packet
 	 * }
 	 *
-	 * (note: if serverlogin is 'XYZ-1', it must not match XYZ-12, so we need to
-	 * match against ,SERVERLOGIN, or ,SERVERLOGIN:)
+	 * (note: if serverlogin is 'XYZ-1', it must not match XYZ-12, so we
+	 * match against whole elements)
+	 *
+	 * The calls are also put in a hash set, to find a callsign-SSID
+	 * which appears twice without comparing every pair of calls.
 	 */
-	
+	qcallc = 0;
 	if (q_start) {
-		p = memmem(q_start+4, path_end-q_start-4, serverid, serverid_len);
-		if (p && *(p-1) == ',' && ( *(p+serverid_len) == ',' || p+serverid_len == path_end || *(p+serverid_len) == ':' )) {
-			/* TODO: The reject log should really log the offending packet */
-			hlog(LOG_DEBUG, "q: dropping due to my callsign appearing in path");
-			return INERR_Q_QPATH_MYCALL; /* drop the packet */
+		serverid_hash = keyhashuc(serverid, serverid_len, 0);
+		memset(callset, 0, sizeof(callset));
+		
+		for (i = ht->q_elem + 1; i < ht->elem_count; i++) {
+			el = &ht->elem[i];
+			p = (char *)pdata + el->off;
+			if (p + el->len > path_end)
+				break;
+			
+			if (el->hash == serverid_hash && el->len == serverid_len && memcmp(p, serverid, serverid_len) == 0) {
+				/* TODO: The reject log should really log the offending packet */
+				hlog(LOG_DEBUG, "q: dropping due to my callsign appearing in path");
+				return INERR_Q_QPATH_MYCALL; /* drop the packet */
+			}
+			
+			if (qcallc == MAX_Q_CALLS)
+				continue;
+			
+			qcallv[qcallc] = p;
+			qcallh[qcallc] = el->hash;
+			/* the last call runs up to the end of the path, which
+			 * includes a trailing comma, if there is one
+			 */
+			if (qcallc < MAX_Q_CALLS - 1 && (i == ht->elem_count - 1 || pdata + ht->elem[i+1].off > path_end))
+				qcalll[qcallc] = path_end - p;
+			else
+				qcalll[qcallc] = el->len;
+			
+			/* this match is case sensitive in javaprssrvr, so that's what
+			 * we'll do, even though the hash is not
+			 */
+			for (k = el->hash & (Q_CALLSET_SIZE-1); callset[k]; k = (k + 1) & (Q_CALLSET_SIZE-1)) {
+				j = callset[k] - 1;
+				if (qcallh[j] == el->hash && qcalll[j] == qcalll[qcallc]
+				    && memcmp(qcallv[j], p, qcalll[qcallc]) == 0) {
+					/* the earlier one is reported, as it is found first */
+					if (first_twice < 0 || j < first_twice)
+						first_twice = j;
+					break;
+				}
+			}
+			if (!callset[k])
+				callset[k] = qcallc + 1;
+			
+			qcallc++;
 		}
 	}
 	
@@ -157,18 +194,16 @@ static int q_dropcheck( struct client_t *c, const char *pdata, char *new_q, int
 	 *
 	 */
 	username_len = strlen(c->username);
+	username_hash = keyhashuc(c->username, username_len, 0);
 	for (i = 0; i < qcallc; i++) {
-		l = qcallv[i+1] - qcallv[i] - 1;
+		l = qcalll[i];
 		/* 1) */
-		for (j = i + 1; j < qcallc; j++) {
-			/* this match is case sensitive in javaprssrvr, so that's what we'll do */
-			if (l == qcallv[j+1] - qcallv[j] - 1 && memcmp(qcallv[i], qcallv[j], l) == 0) {
-				/* TODO: The reject log should really log the offending packet */
-				hlog(LOG_DEBUG, "q: dropping due to callsign-SSID '%.*s' found twice after Q construct", l, qcallv[i]);
-			    	return INERR_Q_QPATH_CALL_TWICE;
-			}
+		if (i == first_twice) {
+			/* TODO: The reject log should really log the offending packet */
+			hlog(LOG_DEBUG, "q: dropping due to callsign-SSID '%.*s' found twice after Q construct", l, qcallv[i]);
+		    	return INERR_Q_QPATH_CALL_TWICE;
 		}
-		if (l == username_len && strncasecmp(qcallv[i], c->username, username_len) == 0) {
+		if (l == username_len && qcallh[i] == username_hash && strncasecmp(qcallv[i], c->username, username_len) == 0) {
 			/* ok, login is client's login, handle step 3) */
 			login_in_path = 1;
 			if (c->state == CSTATE_CONNECTED &&
@@ -270,7 +305,8 @@ static int q_dropcheck( struct client_t *c, const char *pdata, char *new_q, int
  *	reuse some code snippets.
  */
 
-int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size, char *via_start,
+int q_process(struct client_t *c, const char *pdata, const struct header_tokens_t *ht,
+              char *new_q, int new_q_size, char *via_start,
               char **path_end, int pathlen, char **new_q_start, char **q_replace,
               int originated_by_client)
 {
@@ -291,7 +327,9 @@ int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size
 	*/
 	
 	// fprintf(stderr, "q_process\n");
-	q_start = memmem(via_start, *path_end - via_start, ",q", 2);
+	/* the header tokenizer found the first path element starting with a q */
+	if (ht->q_elem >= 0)
+		q_start = (char *)pdata + ht->elem[ht->q_elem].off - 1;
 	if (q_start) {
 		// fprintf(stderr, "\tfound existing q construct\n");
 		/* there is an existing Q construct, check for a callsign after it */
@@ -518,7 +556,7 @@ int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size
 			}
 			
 			/* Skip to "All packets with q constructs" */
-			return q_dropcheck(c, pdata, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
+			return q_dropcheck(c, pdata, ht, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
 		}
 		
 		/*
@@ -530,7 +568,7 @@ int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size
 			/* Not going to modify the construct, update pointer to it */
 			*new_q_start = q_start + 1;
 			/* Skip to "All packets with q constructs" */
-			return q_dropcheck(c, pdata, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
+			return q_dropcheck(c, pdata, ht, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
 		}
 		
 		/* At this point we have packets which do not have Q constructs, and
@@ -597,7 +635,7 @@ int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size
 			q_type = 'S';
 		}
 		/* Skip to "All packets with q constructs" */
-		return q_dropcheck(c, pdata, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
+		return q_dropcheck(c, pdata, ht, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
 	}
 	
 	/*
@@ -651,6 +689,6 @@ int q_process(struct client_t *c, const char *pdata, char *new_q, int new_q_size
 		*new_q_start = q_start + 1;
 	}
 	
-	return q_dropcheck(c, pdata, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
+	return q_dropcheck(c, pdata, ht, new_q, new_q_size, via_start, new_q_len, q_proto, q_type, q_start, q_replace, *path_end);
 }
 
@@ -13,9 +13,11 @@
 
 #include "worker.h" /* struct client_t */
 
+struct header_tokens_t;
+
 extern int check_invalid_q_callsign(const char *call, int len);
 
-extern int q_process(struct client_t *c, const char *pdata,
+extern int q_process(struct client_t *c, const char *pdata, const struct header_tokens_t *ht,
                      char *new_q, int new_q_size, char *via_start,
                      char **path_end, int pathlen, char **new_q_start, char **q_replace,
                      int originated_by_client);
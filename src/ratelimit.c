@@ -0,0 +1,153 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *	
+ */
+
+/*
+ *	Token bucket rate limiter for incoming connections, keyed by
+ *	a short byte string (an IP address, or a network prefix).
+ *
+ *	The buckets live in a fixed-size set-associative table, so that
+ *	a connection storm from a large number of addresses can not make
+ *	it grow without bounds. When a set is full, the bucket which has
+ *	refilled the most is replaced - a full bucket carries no more
+ *	information than a missing one.
+ *
+ *	The buckets are counted in integer units: a bucket holds up to
+ *	burst * interval units, refills by burst units per second, and
+ *	a connection costs interval units. That gives burst connections
+ *	per interval seconds without floating point.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ratelimit.h"
+#include "hmalloc.h"
+#include "hlog.h"
+#include "keyhash.h"
+#include "worker.h"
+
+#define RATELIMIT_WAYS 4
+
+struct ratelimit_entry_t {
+	time_t last;		/* last refill time */
+	int tokens;		/* units left in bucket */
+	uint8_t keylen;		/* 0 if the entry is free */
+	uint8_t key[RATELIMIT_KEYLEN];
+};
+
+struct ratelimit_t {
+	pthread_mutex_t mt;
+	int sets;
+	struct ratelimit_entry_t *entries;
+};
+
+/*
+ *	Allocate a rate limiter table with sets * RATELIMIT_WAYS buckets.
+ *	sets must be a power of two.
+ */
+
+struct ratelimit_t *ratelimit_alloc(int sets)
+{
+	struct ratelimit_t *rl;
+	
+	rl = hmalloc(sizeof(*rl));
+	memset(rl, 0, sizeof(*rl));
+	pthread_mutex_init(&rl->mt, NULL);
+	rl->sets = sets;
+	rl->entries = hmalloc(sizeof(struct ratelimit_entry_t) * sets * RATELIMIT_WAYS);
+	memset(rl->entries, 0, sizeof(struct ratelimit_entry_t) * sets * RATELIMIT_WAYS);
+	
+	return rl;
+}
+
+void ratelimit_free(struct ratelimit_t *rl)
+{
+	if (!rl)
+		return;
+	
+	pthread_mutex_destroy(&rl->mt);
+	hfree(rl->entries);
+	hfree(rl);
+}
+
+/*
+ *	Refill a bucket up to the current time
+ */
+
+static inline int ratelimit_refill(struct ratelimit_entry_t *e, int burst, int interval)
+{
+	long long tokens;
+	int cap = burst * interval;
+	
+	if (tick > e->last) {
+		tokens = e->tokens + (long long)(tick - e->last) * burst;
+		e->tokens = (tokens > cap) ? cap : tokens;
+	}
+	e->last = tick;
+	
+	return e->tokens;
+}
+
+/*
+ *	Take a token from the bucket of the key. Returns 0 if the
+ *	connection is allowed, -1 if the rate limit has been exceeded.
+ */
+
+int ratelimit_check(struct ratelimit_t *rl, const void *key, int keylen, int burst, int interval)
+{
+	struct ratelimit_entry_t *set, *e, *victim;
+	int i, t, best;
+	int ret = 0;
+	
+	if (burst <= 0 || interval <= 0 || keylen <= 0)
+		return 0;
+	
+	if (keylen > RATELIMIT_KEYLEN)
+		keylen = RATELIMIT_KEYLEN;
+	
+	set = &rl->entries[(keyhash(key, keylen, 0) & (rl->sets - 1)) * RATELIMIT_WAYS];
+	
+	pthread_mutex_lock(&rl->mt);
+	
+	victim = NULL;
+	best = -1;
+	for (i = 0; i < RATELIMIT_WAYS; i++) {
+		e = &set[i];
+		if (e->keylen == keylen && memcmp(e->key, key, keylen) == 0)
+			break;
+		
+		/* pick a free entry, or the one which has refilled the most */
+		t = (e->keylen) ? ratelimit_refill(e, burst, interval) : burst * interval + 1;
+		if (t > best) {
+			best = t;
+			victim = e;
+		}
+	}
+	
+	if (i == RATELIMIT_WAYS) {
+		e = victim;
+		e->keylen = keylen;
+		memcpy(e->key, key, keylen);
+		e->tokens = burst * interval;
+		e->last = tick;
+	} else {
+		ratelimit_refill(e, burst, interval);
+	}
+	
+	if (e->tokens >= interval)
+		e->tokens -= interval;
+	else
+		ret = -1;
+	
+	pthread_mutex_unlock(&rl->mt);
+	
+	return ret;
+}
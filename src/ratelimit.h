@@ -0,0 +1,22 @@
+/*
+ *	aprsc
+ *
+ *	(c) Heikki Hannikainen, OH7LZB <hessu@hes.iki.fi>
+ *
+ *     This program is licensed under the BSD license, which can be found
+ *     in the file LICENSE.
+ *	
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#define RATELIMIT_KEYLEN 16	/* max key length: an IPv6 address */
+
+struct ratelimit_t;
+
+extern struct ratelimit_t *ratelimit_alloc(int sets);
+extern void ratelimit_free(struct ratelimit_t *rl);
+extern int ratelimit_check(struct ratelimit_t *rl, const void *key, int keylen, int burst, int interval);
+
+#endif
@@ -222,6 +222,7 @@ int sctp_readable(struct worker_t *self, struct client_t *c)
 	if (e < 0) {
 		if (errno == EAGAIN) {
 			hlog(LOG_DEBUG, "sctp_readable: EAGAIN");
+			xpoll_would_block(&self->xp, c->xfd, XP_IN);
 			return 0;
 		}
 		
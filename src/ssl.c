@@ -79,6 +79,13 @@
 #include <openssl/err.h>
 
 #define SSL_DEFAULT_CIPHERS     "HIGH:eNULL:!aNULL:!MD5"
+
+/* server-side session cache, for resuming sessions of reconnecting
+ * clients without a full handshake
+ */
+#define SSL_SESSION_ID_CONTEXT  "aprsc"
+#define SSL_SESSION_CACHE_SIZE  20480
+#define SSL_SESSION_TIMEOUT     (4*3600)
 #define SSL_PROTOCOLS (NGX_SSL_TLSv1|NGX_SSL_TLSv1_1|NGX_SSL_TLSv1_2)
 
 /* ssl error strings */
@@ -430,8 +437,35 @@ int ssl_create(struct ssl_t *ssl, void *data)
 
 	SSL_CTX_set_mode(ssl->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 	
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Let the kernel do the record encryption, if it has the tls
+	 * module and the negotiated cipher is supported. If not, OpenSSL
+	 * just keeps on doing it. Renegotiation can not be done with
+	 * kernel TLS.
+	 */
+	SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+#ifdef SSL_OP_NO_RENEGOTIATION
+	SSL_CTX_set_options(ssl->ctx, SSL_OP_NO_RENEGOTIATION);
+#endif
+#endif
+	
 	SSL_CTX_set_read_ahead(ssl->ctx, 1);
 	
+	/* Cache sessions, and hand out session tickets, so that clients
+	 * reconnecting after a network glitch or a server restart can
+	 * resume their sessions without doing the public key operations
+	 * again. The session id context must be set for resumption
+	 * to work when client certificates are requested.
+	 */
+	SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ssl->ctx, SSL_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ssl->ctx, SSL_SESSION_TIMEOUT);
+	SSL_CTX_set_session_id_context(ssl->ctx, (const unsigned char *)SSL_SESSION_ID_CONTEXT, strlen(SSL_SESSION_ID_CONTEXT));
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	/* one TLS 1.3 ticket is enough, a client only resumes once at a time */
+	SSL_CTX_set_num_tickets(ssl->ctx, 1);
+#endif
+	
 	SSL_CTX_set_info_callback(ssl->ctx, (void *)ssl_info_callback);
 	
 	if (SSL_CTX_set_cipher_list(ssl->ctx, SSL_DEFAULT_CIPHERS) == 0) {
@@ -567,6 +601,7 @@ int ssl_create_connection(struct ssl_t *ssl, struct client_t *c, int i_am_client
 	struct ssl_connection_t  *sc;
 	
 	sc = hmalloc(sizeof(*sc));
+	memset(sc, 0, sizeof(*sc));
 	sc->connection = SSL_new(ssl->ctx);
 	
 	if (sc->connection == NULL) {
@@ -811,6 +846,7 @@ int ssl_write(struct worker_t *self, struct client_t *c)
 		//hlog(LOG_DEBUG, "ssl_write fd %d: SSL_write wants to write again, marking socket for write events", c->fd);
 		
 		/* tell the poller that we have outgoing data */
+		xpoll_would_block(&self->xp, c->xfd, XP_OUT);
 		xpoll_outgoing(&self->xp, c->xfd, 1);
 		
 		return 0;
@@ -869,6 +905,101 @@ int ssl_writable(struct worker_t *self, struct client_t *c)
 	return ssl_write(self, c);
 }
 
+/*
+ *	Check if the kernel has taken over the encryption of outgoing
+ *	data after the handshake. Returns 1 if it has, 0 if not, and -1
+ *	if the handshake is not done yet.
+ */
+
+int ssl_ktls_send(struct client_t *c)
+{
+	struct ssl_connection_t *sc = c->ssl_con;
+	
+	if (sc->ktls_checked)
+		return sc->ktls_tx;
+	
+	if (!SSL_is_init_finished(sc->connection))
+		return -1;
+	
+	sc->ktls_checked = 1;
+	
+	if (BIO_get_ktls_send(SSL_get_wbio(sc->connection))) {
+		sc->ktls_tx = 1;
+		hlog(LOG_DEBUG, "%s/%d: kernel TLS transmit offload enabled", c->addr_rem, c->fd);
+	}
+	
+	return sc->ktls_tx;
+}
+
+/*
+ *	Run the server side handshake of a new connection, in a handshake
+ *	thread, before the client is given to a worker.
+ */
+
+int ssl_handshake(struct xpoll_t *xp, struct client_t *c)
+{
+	int r;
+	int sslerr, err;
+	
+	ssl_clear_error();
+	
+	r = SSL_do_handshake(c->ssl_con->connection);
+	
+	if (r == 1) {
+		c->ssl_con->handshaked = 1;
+		
+		if (SSL_session_reused(c->ssl_con->connection))
+			return SSL_HANDSHAKE_RESUMED;
+		
+		return SSL_HANDSHAKE_DONE;
+	}
+	
+	sslerr = SSL_get_error(c->ssl_con->connection, r);
+	err = (sslerr == SSL_ERROR_SYSCALL) ? errno : 0;
+	
+	if (sslerr == SSL_ERROR_WANT_READ) {
+		xpoll_would_block(xp, c->xfd, XP_IN);
+		xpoll_outgoing(xp, c->xfd, 0);
+		return SSL_HANDSHAKE_WANT_IO;
+	}
+	
+	if (sslerr == SSL_ERROR_WANT_WRITE) {
+		xpoll_would_block(xp, c->xfd, XP_OUT);
+		xpoll_outgoing(xp, c->xfd, 1);
+		return SSL_HANDSHAKE_WANT_IO;
+	}
+	
+	c->ssl_con->no_wait_shutdown = 1;
+	c->ssl_con->no_send_shutdown = 1;
+	
+	if (sslerr == SSL_ERROR_ZERO_RETURN || ERR_peek_error() == 0) {
+		hlog(LOG_DEBUG, "ssl_handshake fd %d: peer closed connection during handshake%s%s",
+			c->fd, (err) ? ": " : "", (err) ? strerror(err) : "");
+	} else {
+		char ebuf[255];
+		unsigned long e = ERR_peek_error();
+		
+		ERR_error_string_n(e, ebuf, sizeof(ebuf));
+		hlog(LOG_INFO, "%s/%d: SSL handshake failed: %s", c->addr_rem, c->fd, ebuf);
+	}
+	
+	return SSL_HANDSHAKE_FAILED;
+}
+
+/*
+ *	Is there decrypted or buffered data which the next SSL_read
+ *	would return without reading from the socket
+ */
+
+int ssl_pending(struct client_t *c)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return SSL_has_pending(c->ssl_con->connection);
+#else
+	return SSL_pending(c->ssl_con->connection) > 0;
+#endif
+}
+
 int ssl_readable(struct worker_t *self, struct client_t *c)
 {
 	int r;
@@ -893,6 +1024,7 @@ int ssl_readable(struct worker_t *self, struct client_t *c)
 	
 	if (sslerr == SSL_ERROR_WANT_READ) {
 		hlog(LOG_DEBUG, "ssl_readable fd %d: SSL_read wants to read again, doing it later", c->fd);
+		xpoll_would_block(&self->xp, c->xfd, XP_IN);
 		
 		if (c->obuf_end - c->obuf_start > 0) {
 			/* tell the poller that we have outgoing data */
@@ -24,8 +24,15 @@
 #define SSL_VALIDATE_CERT_NO_CALLSIGN -5
 #define SSL_VALIDATE_CERT_CALLSIGN_MISMATCH -6
 
+/* return values of ssl_handshake */
+#define SSL_HANDSHAKE_FAILED -1
+#define SSL_HANDSHAKE_WANT_IO 0
+#define SSL_HANDSHAKE_DONE 1
+#define SSL_HANDSHAKE_RESUMED 2
+
 struct client_t;
 struct worker_t;
+struct xpoll_t;
 
 struct ssl_t {
 	SSL_CTX *ctx;
@@ -42,6 +49,8 @@ struct ssl_connection_t {
 	unsigned	buffer:1;
 	unsigned	no_wait_shutdown:1;
 	unsigned	no_send_shutdown:1;
+	unsigned	ktls_checked:1;	/* kernel TLS state has been looked at after the handshake */
+	unsigned	ktls_tx:1;	/* kernel does the encryption, plain write()s can be used */
 	
 	unsigned	validate;
 	int		ssl_err_code;
@@ -86,6 +95,11 @@ extern int ssl_validate_peer_cert_phase2(struct client_t *c);
 extern int ssl_write(struct worker_t *self, struct client_t *c);
 extern int ssl_writable(struct worker_t *self, struct client_t *c);
 extern int ssl_readable(struct worker_t *self, struct client_t *c);
+extern int ssl_ktls_send(struct client_t *c);
+
+/* handshake of a new server side connection, before a worker gets it */
+extern int ssl_handshake(struct xpoll_t *xp, struct client_t *c);
+extern int ssl_pending(struct client_t *c);
 
 
 #else
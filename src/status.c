@@ -19,6 +19,7 @@
 #include <sys/utsname.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <stddef.h>
 
 #include "status.h"
 #include "cellmalloc.h"
@@ -33,15 +34,14 @@
 #include "incoming.h"
 #include "accept.h"
 #include "cJSON.h"
+#include "jsonbuf.h"
 #include "counterdata.h"
 #include "client_heard.h"
+#include "handshake.h"
+#include "liveupgrade.h"
 
 time_t startup_tick, startup_time;
 
-pthread_mutex_t status_json_mt = PTHREAD_MUTEX_INITIALIZER;
-char *status_json_cached = NULL;
-time_t status_json_cache_t = 0;
-
 struct cdata_list_t {
 	const char *tree;
 	const char *name;
@@ -198,36 +198,12 @@ static void status_check_motd(cJSON *node)
 }
 
 /*
- *	Generate a JSON status string
+ *	Build the JSON tree of everything but the worker sections, which
+ *	are spliced in from the workers' snapshots by status_json_write().
  */
 
-char *status_json_string(int no_cache, int periodical)
+static cJSON *status_json_tree(int periodical)
 {
-	char *out = NULL;
-	int pe;
-	
-	/* if we have a very recent status JSON available, return it instead. */
-	if (!no_cache) {
-		if ((pe = pthread_mutex_lock(&status_json_mt))) {
-			hlog(LOG_ERR, "status_json_string(): could not lock status_json_mt: %s", strerror(pe));
-			return NULL;
-		}
-		if (status_json_cached && (status_json_cache_t == tick || status_json_cache_t == tick - 1)) {
-			out = hstrdup(status_json_cached);
-			if ((pe = pthread_mutex_unlock(&status_json_mt))) {
-				hlog(LOG_ERR, "status_json_string(): could not unlock status_json_mt: %s", strerror(pe));
-				hfree(out);
-				return NULL;
-			}
-			return out;
-		}
-		if ((pe = pthread_mutex_unlock(&status_json_mt))) {
-			hlog(LOG_ERR, "status_json_string(): could not unlock status_json_mt: %s", strerror(pe));
-			return NULL;
-		}
-	}
-	
-	/* Ok, go and build the JSON tree */
 	cJSON *root = cJSON_CreateObject();
 	if (http_status_options)
 		cJSON_AddStringToObject(root, "status_options", http_status_options);
@@ -246,6 +222,8 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(server, "tick_now", tick);
 	cJSON_AddNumberToObject(server, "time_now", now);
 	cJSON_AddNumberToObject(server, "time_started", startup_time);
+	cJSON_AddNumberToObject(server, "live_upgrades", liveupgrade_count);
+	cJSON_AddNumberToObject(server, "log_lines_dropped", hlog_lines_dropped);
 	
 	char q_protocol_id_s[2] = { q_protocol_id, 0 };
 	cJSON_AddStringToObject(server, "q_protocol_id", q_protocol_id_s);
@@ -265,9 +243,14 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "historydb_block_size", (long)cellst.block_size);
 	cJSON_AddNumberToObject(memory, "historydb_blocks", (long)cellst.blocks);
 	cJSON_AddNumberToObject(memory, "historydb_blocks_max", (long)cellst.blocks_max);
+	cJSON_AddNumberToObject(memory, "historydb_blocks_released", (long)cellst.blocks_released);
+	cJSON_AddNumberToObject(memory, "historydb_blocks_freed", (long)cellst.blocks_freed);
+	cJSON_AddNumberToObject(memory, "historydb_blocks_reused", (long)cellst.blocks_reused);
 	cJSON_AddNumberToObject(memory, "historydb_cell_size", cellst.cellsize);
 	cJSON_AddNumberToObject(memory, "historydb_cell_size_aligned", cellst.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "historydb_cell_align", cellst.alignment);
+	cJSON_AddNumberToObject(memory, "historydb_magazine_hits", cellst.magazine_hits);
+	cJSON_AddNumberToObject(memory, "historydb_magazine_misses", cellst.magazine_misses);
 	
 	dupecheck_cell_stats(&cellst), 
 	cJSON_AddNumberToObject(memory, "dupecheck_cells_used", dupecheck_cellgauge);
@@ -277,6 +260,9 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "dupecheck_block_size", (long)cellst.block_size);
 	cJSON_AddNumberToObject(memory, "dupecheck_blocks", (long)cellst.blocks);
 	cJSON_AddNumberToObject(memory, "dupecheck_blocks_max", (long)cellst.blocks_max);
+	cJSON_AddNumberToObject(memory, "dupecheck_blocks_released", (long)cellst.blocks_released);
+	cJSON_AddNumberToObject(memory, "dupecheck_blocks_freed", (long)cellst.blocks_freed);
+	cJSON_AddNumberToObject(memory, "dupecheck_blocks_reused", (long)cellst.blocks_reused);
 	cJSON_AddNumberToObject(memory, "dupecheck_cell_size", cellst.cellsize);
 	cJSON_AddNumberToObject(memory, "dupecheck_cell_size_aligned", cellst.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "dupecheck_cell_align", cellst.alignment);
@@ -293,6 +279,8 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "filter_cell_size", cellst_filter.cellsize);
 	cJSON_AddNumberToObject(memory, "filter_cell_size_aligned", cellst_filter.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "filter_cell_align", cellst_filter.alignment);
+	cJSON_AddNumberToObject(memory, "filter_magazine_hits", cellst_filter.magazine_hits);
+	cJSON_AddNumberToObject(memory, "filter_magazine_misses", cellst_filter.magazine_misses);
 	
 	cJSON_AddNumberToObject(memory, "filter_wx_cells_used", filter_wx_cellgauge);
 	cJSON_AddNumberToObject(memory, "filter_wx_cells_free", cellst_filter_wx.freecount);
@@ -304,6 +292,8 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "filter_wx_cell_size", cellst_filter_wx.cellsize);
 	cJSON_AddNumberToObject(memory, "filter_wx_cell_size_aligned", cellst_filter_wx.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "filter_wx_cell_align", cellst_filter_wx.alignment);
+	cJSON_AddNumberToObject(memory, "filter_wx_magazine_hits", cellst_filter_wx.magazine_hits);
+	cJSON_AddNumberToObject(memory, "filter_wx_magazine_misses", cellst_filter_wx.magazine_misses);
 	
 	cJSON_AddNumberToObject(memory, "filter_entrycall_cells_used", filter_entrycall_cellgauge);
 	cJSON_AddNumberToObject(memory, "filter_entrycall_cells_free", cellst_filter_entrycall.freecount);
@@ -315,9 +305,13 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "filter_entrycall_cell_size", cellst_filter_entrycall.cellsize);
 	cJSON_AddNumberToObject(memory, "filter_entrycall_cell_size_aligned", cellst_filter_entrycall.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "filter_entrycall_cell_align", cellst_filter_entrycall.alignment);
+	cJSON_AddNumberToObject(memory, "filter_entrycall_magazine_hits", cellst_filter_entrycall.magazine_hits);
+	cJSON_AddNumberToObject(memory, "filter_entrycall_magazine_misses", cellst_filter_entrycall.magazine_misses);
 	
 	struct cellstatus_t cellst_pbuf_small, cellst_pbuf_medium, cellst_pbuf_large;
 	incoming_cell_stats(&cellst_pbuf_small, &cellst_pbuf_medium, &cellst_pbuf_large);
+	cJSON_AddNumberToObject(memory, "pbuf_freed_returned", pbuf_freed_returned);
+	cJSON_AddNumberToObject(memory, "pbuf_freed_global", pbuf_freed_global);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cells_used", cellst_pbuf_small.cellcount - cellst_pbuf_small.freecount);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cells_free", cellst_pbuf_small.freecount);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cells_alloc", cellst_pbuf_small.cellcount);
@@ -326,6 +320,9 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "pbuf_small_block_size", (long)cellst_pbuf_small.block_size);
 	cJSON_AddNumberToObject(memory, "pbuf_small_blocks", (long)cellst_pbuf_small.blocks);
 	cJSON_AddNumberToObject(memory, "pbuf_small_blocks_max", (long)cellst_pbuf_small.blocks_max);
+	cJSON_AddNumberToObject(memory, "pbuf_small_blocks_released", (long)cellst_pbuf_small.blocks_released);
+	cJSON_AddNumberToObject(memory, "pbuf_small_blocks_freed", (long)cellst_pbuf_small.blocks_freed);
+	cJSON_AddNumberToObject(memory, "pbuf_small_blocks_reused", (long)cellst_pbuf_small.blocks_reused);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cell_size", cellst_pbuf_small.cellsize);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cell_size_aligned", cellst_pbuf_small.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "pbuf_small_cell_align", cellst_pbuf_small.alignment);
@@ -338,6 +335,9 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "pbuf_medium_block_size", (long)cellst_pbuf_medium.block_size);
 	cJSON_AddNumberToObject(memory, "pbuf_medium_blocks", (long)cellst_pbuf_medium.blocks);
 	cJSON_AddNumberToObject(memory, "pbuf_medium_blocks_max", (long)cellst_pbuf_medium.blocks_max);
+	cJSON_AddNumberToObject(memory, "pbuf_medium_blocks_released", (long)cellst_pbuf_medium.blocks_released);
+	cJSON_AddNumberToObject(memory, "pbuf_medium_blocks_freed", (long)cellst_pbuf_medium.blocks_freed);
+	cJSON_AddNumberToObject(memory, "pbuf_medium_blocks_reused", (long)cellst_pbuf_medium.blocks_reused);
 	cJSON_AddNumberToObject(memory, "pbuf_medium_cell_size", cellst_pbuf_medium.cellsize);
 	cJSON_AddNumberToObject(memory, "pbuf_medium_cell_size_aligned", cellst_pbuf_medium.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "pbuf_medium_cell_align", cellst_pbuf_medium.alignment);
@@ -350,6 +350,9 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "pbuf_large_block_size", (long)cellst_pbuf_large.block_size);
 	cJSON_AddNumberToObject(memory, "pbuf_large_blocks", (long)cellst_pbuf_large.blocks);
 	cJSON_AddNumberToObject(memory, "pbuf_large_blocks_max", (long)cellst_pbuf_large.blocks_max);
+	cJSON_AddNumberToObject(memory, "pbuf_large_blocks_released", (long)cellst_pbuf_large.blocks_released);
+	cJSON_AddNumberToObject(memory, "pbuf_large_blocks_freed", (long)cellst_pbuf_large.blocks_freed);
+	cJSON_AddNumberToObject(memory, "pbuf_large_blocks_reused", (long)cellst_pbuf_large.blocks_reused);
 	cJSON_AddNumberToObject(memory, "pbuf_large_cell_size", cellst_pbuf_large.cellsize);
 	cJSON_AddNumberToObject(memory, "pbuf_large_cell_size_aligned", cellst_pbuf_large.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "pbuf_large_cell_align", cellst_pbuf_large.alignment);
@@ -367,6 +370,8 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(memory, "client_heard_cell_size", cellst_client_heard.cellsize);
 	cJSON_AddNumberToObject(memory, "client_heard_cell_size_aligned", cellst_client_heard.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "client_heard_cell_align", cellst_client_heard.alignment);
+	cJSON_AddNumberToObject(memory, "client_heard_magazine_hits", cellst_client_heard.magazine_hits);
+	cJSON_AddNumberToObject(memory, "client_heard_magazine_misses", cellst_client_heard.magazine_misses);
 #endif
 	
 	cJSON_AddItemToObject(root, "memory", memory);
@@ -403,15 +408,10 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddItemToObject(root, "totals", json_totals);
 	cJSON_AddItemToObject(root, "listeners", json_listeners);
 	
-	cJSON *json_clients = cJSON_CreateArray();
-	cJSON *json_uplinks = cJSON_CreateArray();
-	cJSON *json_peers = cJSON_CreateArray();
-	cJSON *json_workers = cJSON_CreateArray();
-	worker_client_list(json_workers, json_clients, json_uplinks, json_peers, json_totals, memory);
-	cJSON_AddItemToObject(root, "workers", json_workers);
-	cJSON_AddItemToObject(root, "uplinks", json_uplinks);
-	cJSON_AddItemToObject(root, "peers", json_peers);
-	cJSON_AddItemToObject(root, "clients", json_clients);
+	worker_status_totals(json_totals, memory);
+#ifdef USE_SSL
+	handshake_status(json_totals);
+#endif
 	
 	/* if this is a periodical per-minute dump, collect historical data */
 	if (periodical) {
@@ -440,33 +440,305 @@ char *status_json_string(int no_cache, int periodical)
 	cJSON_AddNumberToObject(json_totals, "udp_bytes_tx_rate", cdata_get_last_value("totals.udp_bytes_tx") / CDATA_INTERVAL);
 	cJSON_AddNumberToObject(json_totals, "bytes_rx_rate", (cdata_get_last_value("totals.tcp_bytes_rx") + cdata_get_last_value("totals.udp_bytes_rx")) / CDATA_INTERVAL);
 	cJSON_AddNumberToObject(json_totals, "bytes_tx_rate", (cdata_get_last_value("totals.tcp_bytes_tx") + cdata_get_last_value("totals.udp_bytes_tx")) / CDATA_INTERVAL);
+	cJSON_AddNumberToObject(json_totals, "epoll_ctl_calls_rate", cdata_get_last_value("totals.epoll_ctl_calls") / CDATA_INTERVAL);
 	
 	cJSON *json_rx_errs = cJSON_CreateStringArray(inerr_labels, INERR_BUCKETS);
 	cJSON_AddItemToObject(root, "rx_errs", json_rx_errs);
 	
 	cJSON_AddItemToObject(root, "alarms", status_error_json());
 	
-	/* the tree is built, print it out to a malloc'ed string */
-	out = cJSON_Print(root);
+	return root;
+}
+
+/*
+ *	Write out one of the worker sections as a JSON array, joining the
+ *	comma-separated lists from all of the workers' snapshots.
+ *	If there are a huge amount of clients on a worker, they are not
+ *	listed: the web browser would die due to the big blob. The client
+ *	list API can be used to page through them.
+ */
+
+#define STATUS_CLIENTS_MAX 1000
+
+static int status_json_write_section(status_write_t write, void *arg, const char *key,
+	struct worker_snapshot_t **snaps, int count, size_t offset)
+{
+	struct jsonbuf_t *b;
+	char s[64];
+	int i, l, first = 1;
+	
+	l = snprintf(s, sizeof(s), ",\"%s\":[", key);
+	if (write(arg, s, l))
+		return -1;
+	
+	for (i = 0; i < count; i++) {
+		b = (struct jsonbuf_t *)((char *)snaps[i] + offset);
+		if (!b->len)
+			continue;
+		if (b != &snaps[i]->worker && snaps[i]->client_count > STATUS_CLIENTS_MAX)
+			continue;
+		if (!first && write(arg, ",", 1))
+			return -1;
+		if (write(arg, b->buf, b->len))
+			return -1;
+		first = 0;
+	}
+	
+	return write(arg, "]", 1);
+}
+
+/*
+ *	Generate the status JSON and pass it to the write function
+ *	piece by piece, so that the whole document does not need to be
+ *	built in memory. The worker sections are copied from the workers'
+ *	snapshots without locking the workers' client lists.
+ */
+
+int status_json_write(status_write_t write, void *arg, int periodical)
+{
+	struct worker_snapshot_t **snaps;
+	int count;
+	char *head;
+	int ret = -1;
+	
+	cJSON *root = status_json_tree(periodical);
+	head = cJSON_PrintUnformatted(root);
 	cJSON_Delete(root);
+	if (!head)
+		return -1;
+	
+	snaps = worker_snapshots_get(&count);
+	
+	/* the root object, without the closing brace */
+	if (write(arg, head, strlen(head) - 1))
+		goto out;
+	if (status_json_write_section(write, arg, "workers", snaps, count, offsetof(struct worker_snapshot_t, worker)))
+		goto out;
+	if (status_json_write_section(write, arg, "uplinks", snaps, count, offsetof(struct worker_snapshot_t, uplinks)))
+		goto out;
+	if (status_json_write_section(write, arg, "peers", snaps, count, offsetof(struct worker_snapshot_t, peers)))
+		goto out;
+	if (status_json_write_section(write, arg, "clients", snaps, count, offsetof(struct worker_snapshot_t, clients)))
+		goto out;
+	ret = write(arg, "}", 1);
+	
+out:
+	worker_snapshots_put(snaps, count);
+	hfree(head);
+	
+	return ret;
+}
+
+static int status_json_write_buf(void *arg, const char *data, int len)
+{
+	jsonbuf_append((struct jsonbuf_t *)arg, data, len);
+	
+	return 0;
+}
+
+/*
+ *	Generate a JSON status string
+ */
+
+char *status_json_string(int periodical)
+{
+	struct jsonbuf_t b;
+	
+	jsonbuf_init(&b, 65536);
+	
+	if (status_json_write(status_json_write_buf, &b, periodical)) {
+		jsonbuf_free(&b);
+		return NULL;
+	}
+	
+	return b.buf;
+}
+
+/*
+ *	Client list API: filter, sort and page through the clients in the
+ *	workers' snapshots
+ */
+
+static const char *status_client_sort_names[] = {
+	"id",
+	"username",
+	"app_name",
+	"t_connect",
+	"bytes_rx",
+	"bytes_tx",
+	"pkts_rx",
+	"pkts_tx",
+	"pkts_ign",
+	NULL
+};
+
+static const char *status_client_type_names[] = {
+	"clients",
+	"uplinks",
+	"peers"
+};
+
+int status_client_sort_key(const char *name)
+{
+	int i;
+	
+	for (i = 0; status_client_sort_names[i]; i++)
+		if (strcmp(name, status_client_sort_names[i]) == 0)
+			return i;
+	
+	return -1;
+}
+
+struct status_client_match_t {
+	const struct worker_snapshot_client_t *e;
+	const char *json;
+	long long key;
+};
+
+static int status_client_cmp_num(const void *pa, const void *pb)
+{
+	const struct status_client_match_t *a = pa;
+	const struct status_client_match_t *b = pb;
+	
+	if (a->key != b->key)
+		return (a->key < b->key) ? -1 : 1;
 	
-	/* cache it */
-	if ((pe = pthread_mutex_lock(&status_json_mt))) {
-		hlog(LOG_ERR, "status_json_string(): could not lock status_json_mt: %s", strerror(pe));
-                                return NULL;
+	return a->e->fd - b->e->fd;
+}
+
+static int status_client_cmp_username(const void *pa, const void *pb)
+{
+	const struct status_client_match_t *a = pa;
+	const struct status_client_match_t *b = pb;
+	int r = strcasecmp(a->e->username, b->e->username);
+	
+	return (r) ? r : a->e->fd - b->e->fd;
+}
+
+static int status_client_cmp_app_name(const void *pa, const void *pb)
+{
+	const struct status_client_match_t *a = pa;
+	const struct status_client_match_t *b = pb;
+	int r = strcasecmp(a->e->app_name, b->e->app_name);
+	
+	return (r) ? r : a->e->fd - b->e->fd;
+}
+
+static long long status_client_sort_value(const struct worker_snapshot_client_t *e, int sort)
+{
+	switch (sort) {
+	case STATUS_SORT_T_CONNECT:
+		return e->connect_time;
+	case STATUS_SORT_BYTES_RX:
+		return e->rxbytes;
+	case STATUS_SORT_BYTES_TX:
+		return e->txbytes;
+	case STATUS_SORT_PKTS_RX:
+		return e->rxpackets;
+	case STATUS_SORT_PKTS_TX:
+		return e->txpackets;
+	case STATUS_SORT_PKTS_IGN:
+		return e->rxdrops;
 	}
-	if (status_json_cached)
-		hfree(status_json_cached);
+	
+	return e->fd;
+}
+
+static int status_client_matches(const struct status_client_query_t *q, int worker_id, const struct worker_snapshot_client_t *e)
+{
+	if (e->type != q->type)
+		return 0;
+	if (q->worker >= 0 && worker_id != q->worker)
+		return 0;
+	if (q->listener_set && e->listener_id != q->listener_id)
+		return 0;
+	if (q->username && strncasecmp(e->username, q->username, strlen(q->username)) != 0)
+		return 0;
+	if (q->app_name && strncasecmp(e->app_name, q->app_name, strlen(q->app_name)) != 0)
+		return 0;
+	if (e->rxbytes < q->min_bytes_rx || e->txbytes < q->min_bytes_tx)
+		return 0;
+	if (e->rxpackets < q->min_pkts_rx || e->txpackets < q->min_pkts_tx)
+		return 0;
+	
+	return 1;
+}
+
+int status_clients_write(status_write_t write, void *arg, const struct status_client_query_t *q)
+{
+	struct worker_snapshot_t **snaps;
+	struct worker_snapshot_client_t *e;
+	struct status_client_match_t *m = NULL, *mp;
+	struct jsonbuf_t b;
+	const struct jsonbuf_t *jb;
+	int count, i, j, n = 0, msize = 0;
+	int start, end;
+	int ret = -1;
+	
+	snaps = worker_snapshots_get(&count);
+	
+	for (i = 0; i < count; i++) {
+		if (q->type == SNAPSHOT_CLIENT)
+			jb = &snaps[i]->clients;
+		else if (q->type == SNAPSHOT_UPLINK)
+			jb = &snaps[i]->uplinks;
+		else
+			jb = &snaps[i]->peers;
 		
-	status_json_cached = hstrdup(out);
-	status_json_cache_t = tick;
+		for (j = 0; j < snaps[i]->entry_count; j++) {
+			e = &snaps[i]->entries[j];
+			if (!status_client_matches(q, snaps[i]->worker_id, e))
+				continue;
+			if (n == msize) {
+				msize = (msize) ? msize * 2 : 256;
+				m = hrealloc(m, msize * sizeof(*m));
+			}
+			m[n].e = e;
+			m[n].json = jb->buf + e->json_offset;
+			m[n].key = status_client_sort_value(e, q->sort);
+			n++;
+		}
+	}
 	
-	if ((pe = pthread_mutex_unlock(&status_json_mt))) {
-		hlog(LOG_ERR, "status_json_string(): could not unlock status_json_mt: %s", strerror(pe));
-		return NULL;
+	if (q->sort == STATUS_SORT_USERNAME)
+		qsort(m, n, sizeof(*m), status_client_cmp_username);
+	else if (q->sort == STATUS_SORT_APP_NAME)
+		qsort(m, n, sizeof(*m), status_client_cmp_app_name);
+	else
+		qsort(m, n, sizeof(*m), status_client_cmp_num);
+	
+	start = (q->offset < n) ? q->offset : n;
+	end = (q->limit < n - start) ? start + q->limit : n;
+	
+	jsonbuf_init(&b, 256);
+	jsonbuf_start_object(&b, NULL);
+	jsonbuf_add_int(&b, "tick_now", tick);
+	jsonbuf_add_int(&b, "time_now", now);
+	jsonbuf_add_int(&b, "total", n);
+	jsonbuf_add_int(&b, "offset", q->offset);
+	jsonbuf_add_int(&b, "limit", q->limit);
+	jsonbuf_add_string(&b, "sort", status_client_sort_names[q->sort]);
+	jsonbuf_add_string(&b, "order", (q->desc) ? "desc" : "asc");
+	jsonbuf_start_array(&b, status_client_type_names[q->type]);
+	if (write(arg, b.buf, b.len))
+		goto out;
+	
+	for (i = start; i < end; i++) {
+		mp = &m[(q->desc) ? n - 1 - i : i];
+		if (i > start && write(arg, ",", 1))
+			goto out;
+		if (write(arg, mp->json, mp->e->json_len))
+			goto out;
 	}
 	
-	return out;
+	ret = write(arg, "]}", 2);
+	
+out:
+	jsonbuf_free(&b);
+	hfree(m);
+	worker_snapshots_put(snaps, count);
+	
+	return ret;
 }
 
 #define PATHLEN 500
@@ -527,7 +799,9 @@ int json_write_file(char *basename, const char *s)
 
 static int status_dump_fp(FILE *fp)
 {
-	char *out = status_json_string(1, 1);
+	char *out = status_json_string(1);
+	if (!out)
+		return -1;
 	fputs(out, fp);
 	hfree(out);
 	
@@ -543,6 +817,8 @@ int status_dump_file(void)
 	
 	time(&start_t);
 	
+	worker_snapshots_refresh();
+	
 	snprintf(path, PATHLEN, "%s/aprsc-status.json", rundir);
 	snprintf(tmppath, PATHLEN, "%s.tmp", path);
 	fp = fopen(tmppath,"w");
@@ -587,8 +863,11 @@ int status_dump_file(void)
 	
 	time(&start_t);
 	
-	char *out = status_json_string(1, 1);
-	hfree(out);
+	worker_snapshots_refresh();
+	
+	char *out = status_json_string(1);
+	if (out)
+		hfree(out);
 	
 	/* check if we're having delays */
 	time(&end_t);
@@ -601,33 +880,6 @@ int status_dump_file(void)
 
 #endif
 
-/*
- *	Save enough status to a JSON file so that live upgrade can continue
- *	serving existing clients with it
- */
-
-int status_dump_liveupgrade(void)
-{
-	const char *out;
-	
-	if (!worker_shutdown_clients) {
-		return 0;
-	}
-	
-	cJSON *root = cJSON_CreateObject();
-	cJSON_AddItemToObject(root, "clients", worker_shutdown_clients);
-	
-	/* rx error counter labels */
-	cJSON *json_rx_errs = cJSON_CreateStringArray(inerr_labels, INERR_BUCKETS);
-	cJSON_AddItemToObject(root, "rx_errs", json_rx_errs);
-	
-	out = cJSON_Print(root);
-	cJSON_Delete(root);
-	worker_shutdown_clients = NULL;
-	
-	return json_write_file("liveupgrade", out);
-}
-
 int status_read_liveupgrade(void)
 {
 	char path[PATHLEN+1];
@@ -701,6 +953,7 @@ void status_init(void)
 		{ "totals", "tcp_pkts_tx", "c" },
 		{ "totals", "udp_pkts_rx", "c" },
 		{ "totals", "udp_pkts_tx", "c" }, 
+		{ "totals", "epoll_ctl_calls", "c" },
 #ifdef USE_SCTP		
 		{ "totals", "sctp_bytes_rx", "c" },
 		{ "totals", "sctp_bytes_tx", "c" },
@@ -731,28 +984,12 @@ void status_init(void)
 void status_atend(void)
 {
 	struct cdata_list_t *cl, *cl_next;
-	int pe;
 	
 	for (cl = cdata_list; (cl); cl = cl_next) {
 		cl_next = cl->next;
 		cdata_free(cl->cd);
 		hfree(cl);
 	}
-	
-	if ((pe = pthread_mutex_lock(&status_json_mt))) {
-		hlog(LOG_ERR, "status_atend(): could not lock status_json_mt: %s", strerror(pe));
-		return;
-	}
-	
-	if (status_json_cached) {
-		hfree(status_json_cached);
-		status_json_cached = NULL;
-	}
-	
-	if ((pe = pthread_mutex_unlock(&status_json_mt))) {
-		hlog(LOG_ERR, "status_atend(): could not unlock status_json_mt: %s", strerror(pe));
-		return;
-	}
 }
 
 /*
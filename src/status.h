@@ -19,9 +19,40 @@ extern cJSON *liveupgrade_status;
 
 extern void status_error(int ttl, const char *err);
 
-extern char *status_json_string(int no_cache, int periodical);
+/* returns 0 on success, the status JSON writer stops at the first failure */
+typedef int (*status_write_t)(void *arg, const char *data, int len);
+
+extern int status_json_write(status_write_t write, void *arg, int periodical);
+extern char *status_json_string(int periodical);
+/* client list API query */
+#define STATUS_SORT_ID		0
+#define STATUS_SORT_USERNAME	1
+#define STATUS_SORT_APP_NAME	2
+#define STATUS_SORT_T_CONNECT	3
+#define STATUS_SORT_BYTES_RX	4
+#define STATUS_SORT_BYTES_TX	5
+#define STATUS_SORT_PKTS_RX	6
+#define STATUS_SORT_PKTS_TX	7
+#define STATUS_SORT_PKTS_IGN	8
+
+struct status_client_query_t {
+	int type;			/* SNAPSHOT_CLIENT, _UPLINK or _PEER */
+	int offset, limit;
+	int sort;			/* STATUS_SORT_* */
+	int desc;
+	const char *username;		/* prefixes, NULL: any */
+	const char *app_name;
+	int worker;			/* worker id, -1: any */
+	int listener_set;
+	int listener_id;		/* hash id of the listener */
+	long long min_bytes_rx, min_bytes_tx;
+	long long min_pkts_rx, min_pkts_tx;
+};
+
+extern int status_client_sort_key(const char *name);
+extern int status_clients_write(status_write_t write, void *arg, const struct status_client_query_t *q);
+
 extern int status_dump_file(void);
-extern int status_dump_liveupgrade(void);
 extern int status_read_liveupgrade(void);
 extern void status_init(void);
 extern void status_atend(void);
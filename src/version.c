@@ -21,6 +21,9 @@ const char verstr_features[] =
 #ifdef XP_USE_POLL
 	" poll"
 #endif
+#ifdef XP_USE_URING
+	" io_uring"
+#endif
 #ifdef USE_EVENTFD
 	" eventfd"
 #endif
@@ -39,6 +42,9 @@ const char verstr_features[] =
 #ifdef _FOR_VALGRIND_
 	" valgrind"
 #endif
+#ifdef _FOR_TESTING_
+	" testing"
+#endif
 #ifdef USE_SSL
 	" ssl"
 #endif
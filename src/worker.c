@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include "worker.h"
 
@@ -37,6 +38,10 @@
 #include "version.h"
 #include "status.h"
 #include "sctp.h"
+#include "accept.h"
+#include "affinity.h"
+#include "liveupgrade.h"
+#include "metrics.h"
 
 
 time_t now;	/* current time, updated by the main thread, MAY be spun around by NTP */
@@ -63,6 +68,27 @@ struct pbuf_t  *pbuf_global       = NULL;
 struct pbuf_t **pbuf_global_prevp = &pbuf_global;
 struct pbuf_t  *pbuf_global_dupe       = NULL;
 struct pbuf_t **pbuf_global_dupe_prevp = &pbuf_global_dupe;
+uint32_t pbuf_global_last_seqnum;	/* seqnum of the pbuf at the tail of pbuf_global */
+uint32_t pbuf_global_dupe_last_seqnum;
+
+/* Client migration between workers: only one client is in flight at a
+ * time. The rebalancer claims the slot, and the target worker releases
+ * it after catching the client up. The pbuf purger keeps the packets
+ * from worker_migration_pin onwards while the slot is taken.
+ */
+volatile int worker_migration_inflight;
+volatile uint32_t worker_migration_pin;
+
+#ifdef _FOR_TESTING_
+/* for the test suite: fail taking in migrated clients, as if the
+ * polling set was full (APRSC_TEST_MIGRATE_FAIL in the environment)
+ */
+static int worker_test_migrate_fail;
+#endif
+
+#define WORKER_COST_TXBYTES 32		/* bytes written per cost unit */
+#define WORKER_REBALANCE_MIN_COST 100
+#define WORKER_REBALANCE_THRESHOLD 25
 
 
 /* global inbound connects, and protocol traffic accounters */
@@ -88,17 +114,31 @@ struct portaccount_t client_connects_sctp = {
 };
 #endif
 
+/* received packet length histogram bucket bounds, in bytes */
+const int worker_rxlen_bounds[WORKER_RXLEN_BUCKETS-1] = { 64, 100, 130, 200, 300, 450 };
+
 int worker_corepeer_client_count = 0;
 struct client_t *worker_corepeer_clients[MAX_COREPEERS];
 
 #ifndef _FOR_VALGRIND_
-cellarena_t *client_cells;
+/* the default pool, and pools bound to NUMA nodes */
+cellarena_t *client_cells[NUMA_NODES_MAX+1];
+static pthread_mutex_t client_cells_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
-/* clientlist collected at shutdown for live upgrade */
-cJSON *worker_shutdown_clients = NULL;
+/* Status snapshots: the workers rebuild theirs every second while
+ * someone is reading them, and stop WORKER_SNAPSHOT_IDLE seconds after
+ * the last look, so that a big server does not spend time on listing
+ * its clients for nobody. The mutex protects the snapshot pointers and
+ * the reference counts.
+ */
+#define WORKER_SNAPSHOT_IDLE 10
+#define WORKER_SNAPSHOT_WAIT_MS 2000	/* how long to wait for the workers to refresh old snapshots */
+static pthread_mutex_t worker_snapshot_mt = PTHREAD_MUTEX_INITIALIZER;
+static volatile time_t worker_snapshot_wanted;
 
-static struct cJSON *worker_client_json(struct client_t *c, int liveup_info);
+static void worker_snapshot(struct worker_t *self);
+static void worker_snapshot_drop(struct worker_t *w);
 
 /* port accounters */
 struct portaccount_t *port_accounter_alloc(void)
@@ -346,22 +386,42 @@ static void corepeer_close_all(struct worker_t *self)
  *	set up cellmalloc for clients
  */
 
-void client_init(void)
-{
 #ifndef _FOR_VALGRIND_
-	client_cells  = cellinit( "clients",
+static void client_init_pool(int pool)
+{
+	client_cells[pool] = cellinit( "clients",
 				  sizeof(struct client_t),
 				  __alignof__(struct client_t), CELLMALLOC_POLICY_FIFO,
 				  4096 /* 4 MB at the time */, 0 /* minfree */ );
 	/* 4 MB arena size -> about 100 clients per single arena
 	   .. with 40 arenas -> 4000 clients max. */
+	
+	if (pool)
+		cellnumanode(client_cells[pool], pool - 1);
+}
+#endif
+
+void client_init(void)
+{
+#ifndef _FOR_VALGRIND_
+	client_init_pool(0);
 #endif
 }
 
-struct client_t *client_alloc(void)
+/*
+ *	Allocate a client from a pool set up by worker_numa_setup(),
+ *	so that the client and its buffers are on the worker's NUMA node.
+ */
+
+struct client_t *client_alloc_numa(int pool)
 {
 #ifndef _FOR_VALGRIND_
-	struct client_t *c = cellmalloc(client_cells);
+	struct client_t *c;
+	
+	if (pool < 0 || pool > NUMA_NODES_MAX || !client_cells[pool])
+		pool = 0;
+	
+	c = cellmalloc(client_cells[pool]);
 	if (!c) {
 		hlog(LOG_ERR, "client_alloc: cellmalloc failed");
 		return NULL;
@@ -370,6 +430,9 @@ struct client_t *client_alloc(void)
 	struct client_t *c = hmalloc(sizeof(*c));
 #endif
 	memset((void *)c, 0, sizeof(*c));
+#ifndef _FOR_VALGRIND_
+	c->numa_pool = pool;
+#endif
 	c->fd = -1;
 	c->state = CSTATE_INIT;
 
@@ -393,8 +456,15 @@ struct client_t *client_alloc(void)
 	return c;
 }
 
+struct client_t *client_alloc(void)
+{
+	return client_alloc_numa(0);
+}
+
 void client_free(struct client_t *c)
 {
+	int pool = c->numa_pool;
+	
 	//hlog(LOG_DEBUG, "client_free %p: fd %d name %s addr_loc %s udpclient %p", c, c->fd, c->username, c->addr_loc, c->udpclient);
 	
 	if (c->fd >= 0)	 close(c->fd);
@@ -409,6 +479,9 @@ void client_free(struct client_t *c)
 	filter_free(c->neguserfilters);
 	
 	client_heard_free(c);
+	
+	if (c->liveupgrade)
+		hfree(c->liveupgrade);
 
 	client_udp_free(c->udpclient);
 	clientlist_remove(c);
@@ -421,7 +494,7 @@ void client_free(struct client_t *c)
 	memset(c, 0, sizeof(*c));
 
 #ifndef _FOR_VALGRIND_
-	cellfree(client_cells, c);
+	cellfree(client_cells[pool], c);
 #else
 	hfree(c);
 #endif
@@ -438,6 +511,7 @@ struct client_t *pseudoclient_setup(int portnum)
 	c = client_alloc();
 	if (!c) {
 		hlog(LOG_ERR, "pseudoclient_setup: client_alloc returned NULL");
+		hlog_flush();
 		abort();
 	}
 	c->fd    = -1;
@@ -549,6 +623,9 @@ int pass_client_to_worker(struct worker_t *wc, struct client_t *c)
 	
 	wc->new_clients_last = c;
 	
+	if (c->state == CSTATE_LOGIN)
+		worker_logins_pending_add(wc, 1);
+	
 	/* unlock the queue */
 	if ((pe = pthread_mutex_unlock(&wc->new_clients_mutex))) {
 		hlog(LOG_ERR, "pass_client_to_worker(): could not unlock new_clients_mutex: %s", strerror(pe));
@@ -824,6 +901,20 @@ void client_close(struct worker_t *self, struct client_t *c, int errnum)
 			c->addr_rem, c->username, s);
 	}
 
+	if (c->state == CSTATE_LOGIN)
+		worker_logins_pending_add(self, -1);
+	
+	/* still waiting for us to catch up after a migration? */
+	if (c->migrating) {
+		struct client_t **mp;
+		for (mp = &self->migrating; (*mp); mp = &(*mp)->migrate_next) {
+			if (*mp == c) {
+				*mp = c->migrate_next;
+				break;
+			}
+		}
+	}
+	
 	/* remove from polling list */
 	if (c->xfd) {
 		//hlog(LOG_DEBUG, "client_close: xpoll_remove %p fd %d", c->xfd, c->xfd->fd);
@@ -973,8 +1064,23 @@ static int client_buffer_outgoing_data(struct worker_t *self, struct client_t *c
  */
 
 #ifdef USE_SSL
+static int tcp_client_write(struct worker_t *self, struct client_t *c, char *p, int len);
+static int handle_client_writable(struct worker_t *self, struct client_t *c);
+
 static int ssl_client_write(struct worker_t *self, struct client_t *c, char *p, int len)
 {
+	/* Once the handshake is done and the kernel does the encryption,
+	 * the data is written to the socket as plain TCP. The switch is
+	 * done when the output buffer is empty, so that OpenSSL does not
+	 * have a partially written record pending.
+	 */
+	if (!c->ssl_con->ktls_checked && c->obuf_start == c->obuf_end
+	    && ssl_ktls_send(c) == 1) {
+		c->write = &tcp_client_write;
+		c->handler_client_writable = &handle_client_writable;
+		return tcp_client_write(self, c, p, len);
+	}
+	
 	c->obuf_writes++;
 	
 	if (len > 0)
@@ -997,6 +1103,7 @@ static int ssl_client_write(struct worker_t *self, struct client_t *c, char *p,
 static int tcp_client_write(struct worker_t *self, struct client_t *c, char *p, int len)
 {
 	int i, e;
+	int done = 0;
 	
 	//hlog(LOG_DEBUG, "client_write: %*s\n", len, p);
 	
@@ -1020,18 +1127,32 @@ static int tcp_client_write(struct worker_t *self, struct client_t *c, char *p,
 		clientaccount_add( c, c->ai_protocol, 0, 0, len, 0, 0, 0);
 	}
 	
-	if (client_buffer_outgoing_data(self, c, p, len) == -12)
-		return -12;
-	
-	/* Is it over the flush size ? */
-	if (c->obuf_end > c->obuf_flushsize || ((len == 0) && (c->obuf_end > c->obuf_start))) {
+	/* Is it over the flush size ? Then the buffered data and the new
+	 * data go out with a single writev(), and only what the kernel
+	 * does not take is copied to the output buffer.
+	 */
+	if (c->obuf_end + len > c->obuf_flushsize || ((len == 0) && (c->obuf_end > c->obuf_start))) {
 		/* TODO: move this code to client_try_write and call it */
+		struct iovec iov[2];
+		int pending = c->obuf_end - c->obuf_start;
+		int n = 0;
 		
-		/*if (c->obuf_end > c->obuf_flushsize)
-		 *	hlog(LOG_DEBUG, "flushing fd %d since obuf_end %d > %d", c->fd, c->obuf_end, c->obuf_flushsize);
+		/*if (c->obuf_end + len > c->obuf_flushsize)
+		 *	hlog(LOG_DEBUG, "flushing fd %d since obuf_end %d > %d", c->fd, c->obuf_end + len, c->obuf_flushsize);
 		 */
+		if (pending > 0) {
+			iov[n].iov_base = c->obuf + c->obuf_start;
+			iov[n].iov_len = pending;
+			n++;
+		}
+		if (len > 0) {
+			iov[n].iov_base = p;
+			iov[n].iov_len = len;
+			n++;
+		}
+		
 	write_retry_2:;
-		i = write(c->fd, c->obuf + c->obuf_start, c->obuf_end - c->obuf_start);
+		i = writev(c->fd, iov, n);
 		e = errno;
 		if (i < 0 && e == EINTR)
 			goto write_retry_2;
@@ -1050,6 +1171,9 @@ static int tcp_client_write(struct worker_t *self, struct client_t *c, char *p,
 			 *    dropped 0, fd 59, worker 1 app aprx ver 2.00
 			 */
 			hlog(LOG_DEBUG, "client_write(%s) fails/2c; %s", c->addr_rem, strerror(e));
+			if (client_buffer_outgoing_data(self, c, p, len) == -12)
+				return -12;
+			xpoll_would_block(&self->xp, c->xfd, XP_OUT);
 			return -1;
 		}
 		if (i < 0 && len != 0) {
@@ -1059,9 +1183,23 @@ static int tcp_client_write(struct worker_t *self, struct client_t *c, char *p,
 		}
 		if (i > 0) {
 			//hlog(LOG_DEBUG, "client_write(%s) wrote %d", c->addr_rem, i);
-			c->obuf_start += i;
 			c->obuf_wtime = tick;
+			if (i < pending) {
+				c->obuf_start += i;
+			} else {
+				/* the buffer went out, and maybe some of the new data */
+				c->obuf_start = c->obuf_end = 0;
+				done = i - pending;
+			}
 		}
+		
+		if (client_buffer_outgoing_data(self, c, p + done, len - done) == -12)
+			return -12;
+		
+		if (i > 0 && c->obuf_start < c->obuf_end)
+			xpoll_would_block(&self->xp, c->xfd, XP_OUT);
+	} else if (client_buffer_outgoing_data(self, c, p, len) == -12) {
+		return -12;
 	}
 	
 	/* All done ? */
@@ -1130,8 +1268,12 @@ static int handle_corepeer_readable(struct worker_t *self, struct client_t *c)
 		MSG_DONTWAIT|MSG_TRUNC, (struct sockaddr *)&addr, &addrlen );
 	
 	if (r < 0) {
-		if (errno == EINTR || errno == EAGAIN)
+		if (errno == EINTR)
 			return 0; /* D'oh..  return again latter */
+		
+		xpoll_would_block(&self->xp, c->xfd, XP_IN);
+		if (errno == EAGAIN)
+			return 0;
 
 		hlog( LOG_DEBUG, "recv: Error from corepeer UDP socket fd %d (%s): %s",
 			c->udpclient->fd, c->addr_rem, strerror(errno));
@@ -1272,9 +1414,10 @@ int client_postread(struct worker_t *self, struct client_t *c, int r)
 
 static int handle_client_readable(struct worker_t *self, struct client_t *c)
 {
-	int r;
+	int r, len;
 	
-	r = read(c->fd, c->ibuf + c->ibuf_end, c->ibuf_size - c->ibuf_end - 1);
+	len = c->ibuf_size - c->ibuf_end - 1;
+	r = read(c->fd, c->ibuf + c->ibuf_end, len);
 	
 	if (r == 0) {
 		hlog( LOG_DEBUG, "read: EOF from socket fd %d (%s @ %s)",
@@ -1284,7 +1427,11 @@ static int handle_client_readable(struct worker_t *self, struct client_t *c)
 	}
 	
 	if (r < 0) {
-		if (errno == EINTR || errno == EAGAIN)
+		if (errno == EAGAIN) {
+			xpoll_would_block(&self->xp, c->xfd, XP_IN);
+			return 0;
+		}
+		if (errno == EINTR)
 			return 0; /* D'oh..  return again later */
 
 		hlog( LOG_DEBUG, "read: Error from socket fd %d (%s): %s",
@@ -1295,6 +1442,12 @@ static int handle_client_readable(struct worker_t *self, struct client_t *c)
 		return -1;
 	}
 	
+	/* A short read emptied the TCP receive queue, new data will
+	 * come with a new edge. Saves the read() returning EAGAIN.
+	 */
+	if (r < len)
+		xpoll_would_block(&self->xp, c->xfd, XP_IN);
+	
 	return client_postread(self, c, r);
 }
 
@@ -1311,6 +1464,8 @@ static int handle_client_writable(struct worker_t *self, struct client_t *c)
 	if (r < 0) {
 		if (errno == EINTR || errno == EAGAIN) {
 			hlog(LOG_DEBUG, "writable: Would block fd %d (%s): %s", c->fd, c->addr_rem, strerror(errno));
+			if (errno == EAGAIN)
+				xpoll_would_block(&self->xp, c->xfd, XP_OUT);
 			return 0;
 		}
 		
@@ -1325,6 +1480,9 @@ static int handle_client_writable(struct worker_t *self, struct client_t *c)
 	if (c->obuf_start == c->obuf_end) {
 		xpoll_outgoing(&self->xp, c->xfd, 0);
 		c->obuf_start = c->obuf_end = 0;
+	} else {
+		/* short write, the socket buffer is full */
+		xpoll_would_block(&self->xp, c->xfd, XP_OUT);
 	}
 	
 	return 0;
@@ -1413,6 +1571,9 @@ static void worker_classify_client(struct worker_t *self, struct client_t *c)
 
 void worker_mark_client_connected(struct worker_t *self, struct client_t *c)
 {
+	if (c->state == CSTATE_LOGIN)
+		worker_logins_pending_add(self, -1);
+	
 	c->state = CSTATE_CONNECTED;
 	
 	set_client_sockopt_post_login(c);
@@ -1423,6 +1584,286 @@ void worker_mark_client_connected(struct worker_t *self, struct client_t *c)
 	worker_classify_client(self, c);
 }
 
+/*
+ *	Live client migration between workers.
+ *
+ *	The rebalancer asks an overloaded worker to move some of its load
+ *	to the least loaded one. The old worker detaches a client from its
+ *	polling set and client lists, notes how far it has processed the
+ *	global packet queue, and passes the client to the new worker over
+ *	the new_clients queue. The new worker then catches up: if it is
+ *	ahead of the old one, it sends the client the packets in between,
+ *	and if it is behind, it keeps the client unclassified until it
+ *	reaches the same packet. Either way the client gets every packet
+ *	once. The socket, buffers, filters and login state move along in
+ *	the client structure.
+ *
+ *	Only plain TCP clients on the "other" class list are moved. SSL
+ *	clients may have decrypted data buffered in the library, which the
+ *	new worker's poll would not notice.
+ */
+
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+static void worker_migration_release(void)
+{
+	__sync_synchronize();
+	worker_migration_inflight = 0;
+}
+
+/*
+ *	Classify the migrated clients which have been waiting for us to
+ *	reach the old worker's position in the packet queue, or all of
+ *	them if we're skipping ahead. Called from process_outgoing().
+ */
+
+void worker_migrate_attach(struct worker_t *self, int all)
+{
+	struct client_t *c, **mp;
+	
+	for (mp = &self->migrating; (c = *mp); ) {
+		if (!all && (int32_t)(self->last_pbuf_seqnum - c->migrate_seqnum) < 0) {
+			mp = &c->migrate_next;
+			continue;
+		}
+		
+		*mp = c->migrate_next;
+		c->migrate_next = NULL;
+		c->migrating = 0;
+		worker_classify_client(self, c);
+	}
+}
+
+/*
+ *	Take in a client migrated from another worker
+ */
+
+static void worker_migrate_in(struct worker_t *self, struct client_t *c)
+{
+	int e, r = 0;
+	
+	if ((e = rwl_rdlock(&pbuf_global_rwlock))) {
+		hlog(LOG_CRIT, "worker: Failed to rdlock pbuf_global_rwlock!");
+		exit(1);
+	}
+	
+	self->clients_migrated_in++;
+	
+	if (self->pbuf_resync || (int32_t)(self->last_pbuf_seqnum - c->migrate_seqnum) >= 0) {
+		/* We're ahead of the old worker, send the client the packets
+		 * in between. If we're skipping ahead anyway, the packets are
+		 * lost for all of our clients.
+		 */
+		if (!self->pbuf_resync)
+			r = process_outgoing_replay(self, c, *c->migrate_prevp, self->last_pbuf_seqnum);
+		
+		hlog(LOG_DEBUG, "worker %d: migrated client fd %d caught up with %d packets", self->id, (r >= 0) ? c->fd : -1, r);
+		
+		if (r >= 0) {
+			c->migrating = 0;
+			worker_classify_client(self, c);
+		}
+	} else {
+		/* We're behind, our own position keeps the packets around. */
+		hlog(LOG_DEBUG, "worker %d: migrated client fd %d waits for us to catch up %d packets",
+			self->id, c->fd, (int32_t)(c->migrate_seqnum - self->last_pbuf_seqnum));
+		c->migrate_next = self->migrating;
+		self->migrating = c;
+	}
+	
+	worker_migration_release();
+	
+	if ((e = rwl_rdunlock(&pbuf_global_rwlock))) {
+		hlog(LOG_CRIT, "worker: Failed to rdunlock pbuf_global_rwlock!");
+		exit(1);
+	}
+}
+
+/*
+ *	Give up on a client migrated from another worker, when it cannot
+ *	be taken in after all. Let go of the packet queue pin, so that the
+ *	purger and the rebalancer can carry on.
+ */
+
+static void worker_migrate_abort(struct worker_t *self, struct client_t *c)
+{
+	c->migrating = 0;
+	worker_migration_release();
+}
+
+/*
+ *	Move a client to another worker, as requested by the rebalancer.
+ *	Pick the client which gets closest to the requested amount of
+ *	load. Moving anything below twice the amount narrows the gap
+ *	between the workers, anything bigger would just swap them.
+ */
+
+static void worker_migrate_out(struct worker_t *self)
+{
+	struct worker_t *target = self->migrate_to;
+	int want = self->migrate_cost;
+	struct client_t *c, *best = NULL;
+	int pe;
+	
+	self->migrate_to = NULL;
+	
+	if (target == self || self->pbuf_resync || self->last_pbuf_seqnum == 0)
+		goto cancel;
+	
+	for (c = self->clients_other; (c); c = c->class_next) {
+		if (c->state != CSTATE_CONNECTED || c->fd < 0 || !c->xfd
+		    || c->ai_protocol != IPPROTO_TCP || c->udp_port)
+			continue;
+#ifdef USE_SSL
+		if (c->ssl_con)
+			continue;
+#endif
+		if (c->cost <= 0 || c->cost >= want * 2)
+			continue;
+		if (!best || abs(c->cost - want) < abs(best->cost - want))
+			best = c;
+	}
+	
+	if (!best)
+		goto cancel;
+	
+	c = best;
+	
+	/* detach from our polling set, and the client lists */
+	xpoll_remove(&self->xp, c->xfd);
+	c->xfd = NULL;
+	
+	if ((pe = pthread_mutex_lock(&self->clients_mutex))) {
+		hlog(LOG_ERR, "worker_migrate_out(worker %d): could not lock clients_mutex: %s", self->id, strerror(pe));
+		exit(1);
+	}
+	
+	if (c->next)
+		c->next->prevp = c->prevp;
+	*c->prevp = c->next;
+	
+	*c->class_prevp = c->class_next;
+	if (c->class_next)
+		c->class_next->class_prevp = c->class_prevp;
+	c->class_next = NULL;
+	c->class_prevp = NULL;
+	
+	if ((pe = pthread_mutex_unlock(&self->clients_mutex))) {
+		hlog(LOG_ERR, "worker_migrate_out(worker %d): could not unlock clients_mutex: %s", self->id, strerror(pe));
+		exit(1);
+	}
+	
+	self->client_count--;
+	self->clients_migrated_out++;
+	
+	/* The client has got everything up to our position. Pin it, so
+	 * that the purger keeps the packets after it, if the new worker
+	 * needs to replay them.
+	 */
+	c->migrating = 1;
+	c->migrate_seqnum = self->last_pbuf_seqnum;
+	c->migrate_prevp = self->pbuf_global_prevp;
+	worker_migration_pin = c->migrate_seqnum;
+	__sync_synchronize();
+	
+	hlog(LOG_INFO, "%s (%s): Migrating client fd %d from worker %d to worker %d, cost %d",
+		c->addr_rem, c->username, c->fd, self->id, target->id, c->cost);
+	
+	if (pass_client_to_worker(target, c)) {
+		inbound_connects_account(0, c->portaccount);
+		client_free(c);
+		goto cancel;
+	}
+	
+	return;
+	
+cancel:
+	worker_migration_release();
+}
+#else
+void worker_migrate_attach(struct worker_t *self, int all)
+{
+}
+
+static void worker_migrate_in(struct worker_t *self, struct client_t *c)
+{
+}
+
+static void worker_migrate_abort(struct worker_t *self, struct client_t *c)
+{
+}
+#endif
+
+/*
+ *	Apply a changed CPU affinity configuration. When pinned, allocate
+ *	packet buffers and new clients from pools bound to the NUMA node
+ *	we're running on.
+ */
+
+static void worker_affinity_update(struct worker_t *self)
+{
+	int r, node, pool;
+	
+	r = thread_affinity_update(&self->affinity_generation, AFFINITY_WORKER, self->id);
+	if (r == 0)
+		return;
+	
+	node = (r > 0) ? thread_numa_node() : -1;
+	if (node == self->numa_node)
+		return;
+	
+	pool = pbuf_numa_pool(node);
+	
+#ifndef _FOR_VALGRIND_
+	if (pool) {
+		pthread_mutex_lock(&client_cells_mutex);
+		if (!client_cells[pool])
+			client_init_pool(pool);
+		pthread_mutex_unlock(&client_cells_mutex);
+	}
+#endif
+	
+	self->numa_node = node;
+	__sync_synchronize();
+	self->numa_pool = pool;
+	
+	hlog(LOG_INFO, "Worker %d: NUMA node %d, using %s memory pools", self->id, node, (pool) ? "node-local" : "default");
+}
+
+/*
+ *	Update the smoothed cost metric of the clients and the worker:
+ *	outgoing filter evaluations, bytes written, and data waiting in
+ *	the output buffers. Runs once every KEEPALIVE_POLL_FREQ seconds.
+ */
+
+static void worker_update_cost(struct worker_t *self)
+{
+	struct client_t *c;
+	long long sample;
+	int dt = tick - self->cost_tick;
+	int cost = 0;
+	
+	if (dt <= 0 || dt > 60) {
+		/* first round, or the clock jumped */
+		dt = 0;
+	}
+	
+	for (c = self->clients; (c); c = c->next) {
+		if (dt) {
+			sample = (c->filter_evals - c->cost_filter_evals)
+				+ (c->localaccount.txbytes - c->cost_txbytes) / WORKER_COST_TXBYTES;
+			sample = sample / dt + (c->obuf_end - c->obuf_start) / WORKER_COST_TXBYTES;
+			c->cost = (c->cost * 3 + sample) / 4;
+			cost += c->cost;
+		}
+		c->cost_filter_evals = c->filter_evals;
+		c->cost_txbytes = c->localaccount.txbytes;
+	}
+	
+	if (dt)
+		self->cost = cost;
+	self->cost_tick = tick;
+}
+
 /*
  *	move new clients from the new clients queue to the worker thread
  */
@@ -1431,6 +1872,10 @@ static void collect_new_clients(struct worker_t *self)
 {
 	int pe, n, i;
 	struct client_t *new_clients, *c;
+	struct client_t *migrated = NULL;
+#ifdef USE_SSL
+	struct client_t *ssl_pending_clients = NULL;
+#endif
 	
 	/* lock the queue */
 	if ((pe = pthread_mutex_lock(&self->new_clients_mutex))) {
@@ -1485,11 +1930,17 @@ static void collect_new_clients(struct worker_t *self)
 		self->clients = c;
 		c->prevp = &self->clients;
 		
+		/* restore filters and the heard list of a live upgrade client */
+		if (c->liveupgrade)
+			liveupgrade_client_restore(c);
+		
 		/* If this client is already in connected state, classify it
 		 * (live upgrading). Also, if it's a corepeer, it's not going to
 		 * "log in" later and it needs to be classified now.
+		 * A client migrated from another worker is classified after
+		 * it has caught up with this worker's packet queue position.
 		 */
-		if (c->state == CSTATE_CONNECTED || c->state == CSTATE_COREPEER)
+		if ((c->state == CSTATE_CONNECTED || c->state == CSTATE_COREPEER) && !c->migrating)
 			worker_classify_client(self, c);
 		
 		/* If the new client is an UDP core peer, we will add its FD to the
@@ -1524,10 +1975,20 @@ static void collect_new_clients(struct worker_t *self)
 		
 		/* add to polling list */
 		c->xfd = xpoll_add(&self->xp, c->fd, (void *)c);
+#ifdef _FOR_TESTING_
+		if (c->xfd && c->migrating && worker_test_migrate_fail) {
+			xpoll_remove(&self->xp, c->xfd);
+			c->xfd = NULL;
+		}
+#endif
 		hlog(LOG_DEBUG, "collect_new_clients(worker %d): added fd %d to polling list, xfd %p", self->id, c->fd, c->xfd);
 		if (!c->xfd) {
-			/* ouch, out of xfd space */
-			shutdown(c->fd, SHUT_RDWR);
+			/* ouch, out of xfd space. We would never notice the
+			 * client again, so drop it right away.
+			 */
+			if (c->migrating)
+				worker_migrate_abort(self, c);
+			client_close(self, c, ENOMEM);
 			continue;
 		}
 		
@@ -1552,6 +2013,15 @@ static void collect_new_clients(struct worker_t *self)
 			c->write = &tcp_client_write;
 		}
 
+		if (c->migrating) {
+			/* it might have had some output buffered in the old worker */
+			if (c->obuf_end > c->obuf_start)
+				xpoll_outgoing(&self->xp, c->xfd, 1);
+			c->migrate_next = migrated;
+			migrated = c;
+			continue;
+		}
+		
 		/* The new client may end up destroyed right away, never mind it here.
 		 * We will notice it later and discard the client.
 		 */
@@ -1561,10 +2031,23 @@ static void collect_new_clients(struct worker_t *self)
 		 * In case of a live upgrade, this should maybe be skipped, but
 		 * I'll leave it in for now.
 		 */
-		if (c->flags & CLFLAGS_INPORT)
-			client_printf(self, c, "# %s\r\n", (fake_version) ? fake_version : verstr_aprsis);
+		if (c->flags & CLFLAGS_INPORT) {
+			/* If the write failed immediately, c is already invalid at this point. Don't touch it. */
+			if (client_printf(self, c, "# %s\r\n", (fake_version) ? fake_version : verstr_aprsis) < -2)
+				continue;
+		}
 		
-		/* If the write failed immediately, c is already invalid at this point. Don't touch it. */
+#ifdef USE_SSL
+		/* A client coming from a handshake thread may have sent its
+		 * login line right after the handshake, and OpenSSL may have
+		 * read it already. The socket will not become readable for it,
+		 * so it needs to be read now.
+		 */
+		if (c->ssl_con && c->ssl_con->handshaked && ssl_pending(c)) {
+			c->ssl_pending_next = ssl_pending_clients;
+			ssl_pending_clients = c;
+		}
+#endif
 	}
 	
 	if ((pe = pthread_mutex_unlock(&self->clients_mutex))) {
@@ -1574,6 +2057,20 @@ static void collect_new_clients(struct worker_t *self)
 	
 	hlog( LOG_DEBUG, "Worker %d accepted %d new clients, %d new connections, now total %d clients",
 	      self->id, i, self->xp.pollfd_used - n, self->client_count );
+	
+	/* catch up the migrated clients, without holding clients_mutex */
+	while ((c = migrated)) {
+		migrated = c->migrate_next;
+		worker_migrate_in(self, c);
+	}
+	
+#ifdef USE_SSL
+	while ((c = ssl_pending_clients)) {
+		ssl_pending_clients = c->ssl_pending_next;
+		c->ssl_pending_next = NULL;
+		c->handler_client_readable(self, c);
+	}
+#endif
 }
 
 /* 
@@ -1725,6 +2222,7 @@ void worker_thread(struct worker_t *self)
 
 	sprintf(myname,"worker %d", self->id);
 	pthreads_profiling_reset(myname);
+	worker_affinity_update(self);
 
 	sigemptyset(&sigs_to_block);
 	sigaddset(&sigs_to_block, SIGALRM);
@@ -1763,8 +2261,16 @@ void worker_thread(struct worker_t *self)
 		
 		t4 = tick;
 
+		if (self->listeners_generation != accept_listeners_generation)
+			accept_worker_listeners(self);
+		
 		if (self->new_clients)
 			collect_new_clients(self);
+		
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+		if (self->migrate_to)
+			worker_migrate_out(self);
+#endif
 
 		t5 = tick;
 
@@ -1772,6 +2278,8 @@ void worker_thread(struct worker_t *self)
 		if (tick >= next_keepalive || next_keepalive > tick + KEEPALIVE_POLL_FREQ*2) {
 			next_keepalive = tick + KEEPALIVE_POLL_FREQ; /* Run them every 2 seconds */
 			send_keepalives(self);
+			worker_update_cost(self);
+			worker_affinity_update(self);
 			
 			/* time of daily worker cleanup? */
 			if (tick >= next_24h_cleanup || tick < next_24h_cleanup - 100000) {
@@ -1782,6 +2290,10 @@ void worker_thread(struct worker_t *self)
 			}
 		}
 		
+		/* status snapshot, every second while the status page is being looked at */
+		if (tick != self->snapshot_tick && tick - worker_snapshot_wanted < WORKER_SNAPSHOT_IDLE)
+			worker_snapshot(self);
+		
 		t6 = tick;
 #if 0
 		if (tick > next_lag_query) {
@@ -1800,10 +2312,25 @@ void worker_thread(struct worker_t *self)
 #endif
 	}
 	
+	/* stop accepting on our SO_REUSEPORT sockets, and pick up the
+	 * clients passed to us since the last poll round, so that they
+	 * are closed or carried over with the others
+	 */
+	accept_worker_listeners_close(self);
+	if (self->new_clients)
+		collect_new_clients(self);
+	
 	if (self->shutting_down == 2) {
 		/* live upgrade: must free all UDP client structs - we need to close the UDP listener fd. */
 		/* Must also disconnect all SSL clients - the SSL crypto state cannot be moved over. */
 		struct client_t *c, *next;
+		
+		/* the dupecheck has stopped, pass the packets which made
+		 * it through to the clients, so that they are carried over
+		 * in the output buffers
+		 */
+		process_outgoing(self);
+		
 		for (c = self->clients; (c); c = next) {
 			next = c->next;
 #ifdef USE_SSL
@@ -1814,13 +2341,13 @@ void worker_thread(struct worker_t *self)
 			}
 #endif
 			/* collect client state first before closing or freeing anything */
-			if (worker_shutdown_clients && c->fd >= 0) {
-				cJSON *jc = worker_client_json(c, 1);
-				cJSON_AddItemToArray(worker_shutdown_clients, jc);
-			}
+			liveupgrade_dump_client(c);
 			client_udp_free(c->udpclient);
 			c->udpclient = NULL;
 		}
+		
+		/* packets which did not make it to the dupecheck */
+		liveupgrade_dump_pbufs(self);
 	} else {
 		/* close all clients, if not shutting down for a live upgrade */
 		while (self->clients)
@@ -1858,11 +2385,20 @@ void worker_thread(struct worker_t *self)
 void workers_stop(int stop_all)
 {
 	struct worker_t *w;
-	int e;
+	int e, i;
 	int stopped = 0;
 	
 	hlog(LOG_INFO, "Stopping %d worker threads...",
 		(stop_all) ? workers_running : workers_running - workers_configured);
+	
+	/* A client being migrated refers to the workers on both ends. The
+	 * rebalancer runs in this same thread, so no new ones get started.
+	 */
+	for (i = 0; worker_migration_inflight && i < 500; i++)
+		usleep(10000);
+	if (worker_migration_inflight)
+		hlog(LOG_ERR, "workers_stop: client migration between workers did not complete");
+	
 	while (workers_running > workers_configured || (stop_all && workers_running > 0)) {
 		hlog(LOG_DEBUG, "Stopping a worker thread...");
 		/* find the last worker thread and shut it down...
@@ -1877,6 +2413,7 @@ void workers_stop(int stop_all)
 		w = worker_threads;
 		if (w == NULL) {
 			hlog(LOG_CRIT, "Cannot stop worker threads, none running");
+			hlog_flush();
 			abort();
 		}
 		while ((w) && (w->next))
@@ -1890,7 +2427,22 @@ void workers_stop(int stop_all)
 			stopped++;
 		}
 
+		/* unlink under the write lock, the pbuf purger walks the list */
+		if ((e = rwl_wrlock(&pbuf_global_rwlock))) {
+			hlog(LOG_CRIT, "workers_stop: Failed to wrlock pbuf_global_rwlock!");
+			exit(1);
+		}
 		*(w->prevp) = NULL;
+		if ((e = rwl_wrunlock(&pbuf_global_rwlock))) {
+			hlog(LOG_CRIT, "workers_stop: Failed to wrunlock pbuf_global_rwlock!");
+			exit(1);
+		}
+		
+		/* the purger may have returned buffers after the thread
+		 * exited, now that it's off the list, nothing more comes in
+		 */
+		worker_free_buffers(w);
+		worker_snapshot_drop(w);
 		hfree(w);
 		
 		workers_running--;
@@ -1899,6 +2451,47 @@ void workers_stop(int stop_all)
 	
 }
 
+/*
+ *	Rebalance the load between the workers, by asking the most loaded
+ *	worker to move some clients to the least loaded one. Runs every
+ *	RebalanceInterval seconds in the accept thread, which also starts
+ *	and stops the workers.
+ */
+
+void workers_rebalance(void)
+{
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	struct worker_t *w, *wmax = NULL, *wmin = NULL;
+	int n = 0, total = 0, diff;
+	
+	for (w = worker_threads; (w); w = w->next) {
+		n++;
+		total += w->cost;
+		if (!wmax || w->cost > wmax->cost)
+			wmax = w;
+		if (!wmin || w->cost < wmin->cost)
+			wmin = w;
+	}
+	
+	if (n < 2 || wmax == wmin || wmax->migrate_to)
+		return;
+	
+	diff = wmax->cost - wmin->cost;
+	if (diff < WORKER_REBALANCE_MIN_COST || diff * 100 < total / n * WORKER_REBALANCE_THRESHOLD)
+		return;
+	
+	if (!__sync_bool_compare_and_swap(&worker_migration_inflight, 0, 1))
+		return;
+	
+	hlog(LOG_DEBUG, "workers_rebalance: worker %d cost %d, worker %d cost %d, moving %d",
+		wmax->id, wmax->cost, wmin->id, wmin->cost, diff / 2);
+	
+	wmax->migrate_cost = diff / 2;
+	__sync_synchronize();
+	wmax->migrate_to = wmin;
+#endif
+}
+
 /*
  *	Allocate a worker structure.
  *	This is also called from the http thread which acts as a
@@ -1921,6 +2514,7 @@ struct worker_t *worker_alloc(void)
 	
 	w = hmalloc(sizeof(*w));
 	memset(w, 0, sizeof(*w));
+	w->numa_node = -1;
 
 	pthread_mutex_init(&w->clients_mutex, &mut_recursive);
 	pthread_mutex_init(&w->new_clients_mutex, NULL);
@@ -1959,6 +2553,19 @@ void worker_free_buffers(struct worker_t *self)
 		pn = p->next;
 		pbuf_free(NULL, p); // free to global pool
 	}
+	self->pbuf_free_small = self->pbuf_free_medium = self->pbuf_free_large = NULL;
+	
+	/* and the buffers which the purger has returned to us */
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	p = __sync_lock_test_and_set(&self->pbuf_return, NULL);
+#else
+	p = self->pbuf_return;
+	self->pbuf_return = NULL;
+#endif
+	for (; p; p = pn) {
+		pn = p->next;
+		pbuf_free(NULL, p); // free to global pool
+	}
 }
 
 /*
@@ -1967,13 +2574,17 @@ void worker_free_buffers(struct worker_t *self)
 
 void workers_start(void)
 {
-	int i;
+	int i, e;
 	struct worker_t * volatile w;
  	struct worker_t **prevp;
 	
 	if (workers_running)
 		workers_stop(0);
 	
+#ifdef _FOR_TESTING_
+	worker_test_migrate_fail = (getenv("APRSC_TEST_MIGRATE_FAIL") != NULL);
+#endif
+	
 	hlog(LOG_INFO, "Starting %d worker threads (configured: %d)...",
 		workers_configured - workers_running, workers_configured);
 		
@@ -1989,8 +2600,26 @@ void workers_start(void)
 		}
 		
 		w = worker_alloc();
+		
+		/* Start the worker at the tail of the global packet queues, and
+		 * link it in the worker list, while holding the write lock. The
+		 * pbuf purger will then either see the new worker, or the
+		 * worker's starting point is beyond anything being purged.
+		 */
+		if ((e = rwl_wrlock(&pbuf_global_rwlock))) {
+			hlog(LOG_CRIT, "workers_start: Failed to wrlock pbuf_global_rwlock!");
+			exit(1);
+		}
+		w->pbuf_global_prevp      = pbuf_global_prevp;
+		w->pbuf_global_dupe_prevp = pbuf_global_dupe_prevp;
+		w->last_pbuf_seqnum       = pbuf_global_last_seqnum;
+		w->last_pbuf_dupe_seqnum  = pbuf_global_dupe_last_seqnum;
 		*prevp = w;
 		w->prevp = prevp;
+		if ((e = rwl_wrunlock(&pbuf_global_rwlock))) {
+			hlog(LOG_CRIT, "workers_start: Failed to wrunlock pbuf_global_rwlock!");
+			exit(1);
+		}
 		
 		w->id = i;
 		xpoll_initialize(&w->xp, (void *)w, &handle_client_event);
@@ -2022,45 +2651,10 @@ void json_add_rxerrs(cJSON *root, const char *key, long long vals[])
 }
 
 /*
- *	Client state string
- */
-
-static const char *client_state_string(CStateEnum state)
-{
-	static const char *states[] = {
-		"unknown",
-		"init",
-		"login",
-		"logresp",
-		"connected",
-		"udp",
-		"corepeer"
-	};
-	
-	switch (state) {
-	case CSTATE_CONNECTED:
-		return states[4];
-	case CSTATE_INIT:
-		return states[1];
-	case CSTATE_LOGIN:
-		return states[2];
-	case CSTATE_LOGRESP:
-		return states[3];
-	case CSTATE_UDP:
-		return states[5];
-	case CSTATE_COREPEER:
-		return states[6];
-	};
-	
-	return states[0];
-}
-
-/*
- *	Fill worker client list for status display
- *	(called from another thread - watch out and lock!)
+ *	Write a client's status object
  */
 
-static struct cJSON *worker_client_json(struct client_t *c, int liveup_info)
+static void worker_client_json(struct jsonbuf_t *b, struct client_t *c)
 {
 	char addr_s[80];
 	char *s;
@@ -2072,38 +2666,9 @@ static struct cJSON *worker_client_json(struct client_t *c, int liveup_info)
 	};
 	const char *mode;
 	
-	cJSON *jc = cJSON_CreateObject();
-	cJSON_AddNumberToObject(jc, "fd", c->fd);
-	cJSON_AddNumberToObject(jc, "id", c->fd);
-	
-	/* additional information for live upgrade, not published */
-	if (liveup_info) {
-		cJSON_AddNumberToObject(jc, "listener_id", c->listener_id);
-		cJSON_AddStringToObject(jc, "state", client_state_string(c->state));
-		if (c->udp_port && c->udpclient)
-			cJSON_AddNumberToObject(jc, "udp_port", c->udp_port);
-		
-		/* output buffer and input buffer data */
-		if (c->obuf_end - c->obuf_start > 0) {
-			s = hex_encode(c->obuf + c->obuf_start, c->obuf_end - c->obuf_start);
-			cJSON_AddStringToObject(jc, "obuf", s);
-			hfree(s);
-		}
-		
-		if (c->ibuf_end > 0) {
-			s = hex_encode(c->ibuf, c->ibuf_end);
-			cJSON_AddStringToObject(jc, "ibuf", s);
-			hlog(LOG_DEBUG, "Encoded ibuf %d bytes: '%.*s'", c->ibuf_end, c->ibuf_end, c->ibuf);
-			hlog(LOG_DEBUG, "Hex: %s", s);
-			hfree(s);
-		}
-		
-		/* If message routing for stations heard by this client is enabled,
-		 * dump the client_heard hash table, too.
-		 */
-		if (c->flags & CLFLAGS_IGATE)
-			cJSON_AddItemToObject(jc, "client_heard", client_heard_json(c->client_heard));
-	}
+	jsonbuf_start_object(b, NULL);
+	jsonbuf_add_int(b, "fd", c->fd);
+	jsonbuf_add_int(b, "id", c->fd);
 	
 	if (c->state == CSTATE_COREPEER) {
 		/* cut out ports in the name of security by obscurity */
@@ -2111,55 +2676,53 @@ static struct cJSON *worker_client_json(struct client_t *c, int liveup_info)
 		addr_s[sizeof(addr_s)-1] = 0;
 		if ((s = strrchr(addr_s, ':')))
 			*s = 0;
-		cJSON_AddStringToObject(jc, "addr_rem", addr_s);
+		jsonbuf_add_string(b, "addr_rem", addr_s);
 		strncpy(addr_s, c->addr_loc, sizeof(addr_s));
 		addr_s[sizeof(addr_s)-1] = 0;
 		if ((s = strrchr(addr_s, ':')))
 			*s = 0;
-		cJSON_AddStringToObject(jc, "addr_loc", addr_s);
+		jsonbuf_add_string(b, "addr_loc", addr_s);
 	} else {
-		cJSON_AddStringToObject(jc, "addr_rem", c->addr_rem);
-		cJSON_AddStringToObject(jc, "addr_loc", c->addr_loc);
+		jsonbuf_add_string(b, "addr_rem", c->addr_rem);
+		jsonbuf_add_string(b, "addr_loc", c->addr_loc);
 	}
 	
-	//cJSON_AddStringToObject(jc, "addr_q", c->addr_hex);
-	
 	if (c->udp_port && c->udpclient)
-		cJSON_AddNumberToObject(jc, "udp_downstream", 1);
-	
-	cJSON_AddNumberToObject(jc, "t_connect", c->connect_time);
-	cJSON_AddNumberToObject(jc, "t_connect_tick", c->connect_tick);
-	cJSON_AddNumberToObject(jc, "since_connect", tick - c->connect_tick);
-	cJSON_AddNumberToObject(jc, "since_last_read", tick - c->last_read);
-	cJSON_AddStringToObject(jc, "username", c->username);
-	cJSON_AddStringToObject(jc, "app_name", c->app_name);
-	cJSON_AddStringToObject(jc, "app_version", c->app_version);
-	cJSON_AddNumberToObject(jc, "verified", c->validated);
-	cJSON_AddNumberToObject(jc, "obuf_q", c->obuf_end - c->obuf_start);
-	cJSON_AddNumberToObject(jc, "bytes_rx", c->localaccount.rxbytes);
-	cJSON_AddNumberToObject(jc, "bytes_tx", c->localaccount.txbytes);
-	cJSON_AddNumberToObject(jc, "pkts_rx", c->localaccount.rxpackets);
-	cJSON_AddNumberToObject(jc, "pkts_tx", c->localaccount.txpackets);
-	cJSON_AddNumberToObject(jc, "pkts_ign", c->localaccount.rxdrops);
-	cJSON_AddNumberToObject(jc, "pkts_dup", c->localaccount.rxdupes);
-	cJSON_AddNumberToObject(jc, "heard_count", c->client_heard_count);
-	cJSON_AddNumberToObject(jc, "courtesy_count", c->client_courtesy_count);
+		jsonbuf_add_int(b, "udp_downstream", 1);
+	
+	jsonbuf_add_int(b, "t_connect", c->connect_time);
+	jsonbuf_add_int(b, "t_connect_tick", c->connect_tick);
+	jsonbuf_add_int(b, "since_connect", tick - c->connect_tick);
+	jsonbuf_add_int(b, "since_last_read", tick - c->last_read);
+	jsonbuf_add_string(b, "username", c->username);
+	jsonbuf_add_string(b, "app_name", c->app_name);
+	jsonbuf_add_string(b, "app_version", c->app_version);
+	jsonbuf_add_int(b, "verified", c->validated);
+	jsonbuf_add_int(b, "obuf_q", c->obuf_end - c->obuf_start);
+	jsonbuf_add_int(b, "bytes_rx", c->localaccount.rxbytes);
+	jsonbuf_add_int(b, "bytes_tx", c->localaccount.txbytes);
+	jsonbuf_add_int(b, "pkts_rx", c->localaccount.rxpackets);
+	jsonbuf_add_int(b, "pkts_tx", c->localaccount.txpackets);
+	jsonbuf_add_int(b, "pkts_ign", c->localaccount.rxdrops);
+	jsonbuf_add_int(b, "pkts_dup", c->localaccount.rxdupes);
+	jsonbuf_add_int(b, "heard_count", c->client_heard_count);
+	jsonbuf_add_int(b, "courtesy_count", c->client_courtesy_count);
 	
 	if (c->loc_known) {
-		cJSON_AddNumberToObject(jc, "lat", c->lat);
-		cJSON_AddNumberToObject(jc, "lng", c->lng);
+		jsonbuf_add_double(b, "lat", c->lat);
+		jsonbuf_add_double(b, "lng", c->lng);
 	}
 	
 	if (c->quirks_mode)
-		cJSON_AddNumberToObject(jc, "quirks_mode", c->quirks_mode);
+		jsonbuf_add_int(b, "quirks_mode", c->quirks_mode);
 	
-	json_add_rxerrs(jc, "rx_errs", c->localaccount.rxerrs);
+	jsonbuf_add_int_array(b, "rx_errs", c->localaccount.rxerrs, INERR_BUCKETS);
 	
 	if (c->state == CSTATE_COREPEER) {
-		cJSON_AddStringToObject(jc, "mode", uplink_modes[3]);
+		jsonbuf_add_string(b, "mode", uplink_modes[3]);
 	} else if (c->flags & CLFLAGS_INPORT) {
 		/* client */
-		cJSON_AddStringToObject(jc, "filter", c->filter_s);
+		jsonbuf_add_string(b, "filter", c->filter_s);
 	} else {
 		if (c->flags & CLFLAGS_UPLINKMULTI)
 			mode = uplink_modes[1];
@@ -2168,71 +2731,335 @@ static struct cJSON *worker_client_json(struct client_t *c, int liveup_info)
 		else
 			mode = uplink_modes[2];
 			
-		cJSON_AddStringToObject(jc, "mode", mode);
+		jsonbuf_add_string(b, "mode", mode);
 	}
 	
 #ifdef USE_SSL
+	if (c->ssl_con)
+		jsonbuf_add_int(b, "ktls", c->ssl_con->ktls_tx);
 	if (c->cert_subject[0])
-		cJSON_AddStringToObject(jc, "cert_subject", c->cert_subject);
+		jsonbuf_add_string(b, "cert_subject", c->cert_subject);
 	if (c->cert_issuer[0])
-		cJSON_AddStringToObject(jc, "cert_issuer", c->cert_issuer);
+		jsonbuf_add_string(b, "cert_issuer", c->cert_issuer);
 #endif
 	
-	return jc;
+	jsonbuf_end_object(b);
 }
 
-int worker_client_list(cJSON *workers, cJSON *clients, cJSON *uplinks, cJSON *peers, cJSON *totals, cJSON *memory)
+/*
+ *	Free a snapshot after the last reference has been dropped
+ */
+
+static void worker_snapshot_free(struct worker_snapshot_t *snap)
 {
-	struct worker_t *w = worker_threads;
-	struct client_t *c;
+	jsonbuf_free(&snap->worker);
+	jsonbuf_free(&snap->clients);
+	jsonbuf_free(&snap->uplinks);
+	jsonbuf_free(&snap->peers);
+	hfree(snap->entries);
+	hfree(snap);
+}
+
+static void worker_snapshot_unref(struct worker_snapshot_t *snap)
+{
+	int pe, refcount;
+	
+	if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshot_unref: could not lock worker_snapshot_mt: %s", strerror(pe));
+		return;
+	}
+	
+	refcount = --snap->refcount;
+	
+	if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshot_unref: could not unlock worker_snapshot_mt: %s", strerror(pe));
+		return;
+	}
+	
+	if (refcount == 0)
+		worker_snapshot_free(snap);
+}
+
+/*
+ *	Replace the worker's published snapshot
+ */
+
+static void worker_snapshot_publish(struct worker_t *w, struct worker_snapshot_t *snap)
+{
+	struct worker_snapshot_t *old;
 	int pe;
-	int client_heard_count = 0;
-	int client_courtesy_count = 0;
 	
-	while (w) {
-		if ((pe = pthread_mutex_lock(&w->clients_mutex))) {
-			hlog(LOG_ERR, "worker_client_list(worker %d): could not lock clients_mutex: %s", w->id, strerror(pe));
-			return -1;
-		}
+	if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshot_publish(worker %d): could not lock worker_snapshot_mt: %s", w->id, strerror(pe));
+		if (snap)
+			worker_snapshot_free(snap);
+		return;
+	}
+	
+	old = w->snapshot;
+	w->snapshot = snap;
+	
+	if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshot_publish(worker %d): could not unlock worker_snapshot_mt: %s", w->id, strerror(pe));
+	}
+	
+	if (old)
+		worker_snapshot_unref(old);
+}
+
+static void worker_snapshot_drop(struct worker_t *w)
+{
+	worker_snapshot_publish(w, NULL);
+}
+
+/*
+ *	Add a client to the snapshot, both as JSON and as an entry
+ *	which the client list API filters and sorts on
+ */
+
+static void worker_snapshot_client(struct worker_snapshot_t *snap, struct client_t *c)
+{
+	struct worker_snapshot_client_t *e;
+	struct jsonbuf_t *b;
+	int type;
+	
+	if (c->state == CSTATE_COREPEER) {
+		type = SNAPSHOT_PEER;
+		b = &snap->peers;
+	} else if (c->flags & CLFLAGS_INPORT) {
+		type = SNAPSHOT_CLIENT;
+		b = &snap->clients;
+	} else {
+		type = SNAPSHOT_UPLINK;
+		b = &snap->uplinks;
+	}
+	
+	if (snap->entry_count == snap->entry_size) {
+		snap->entry_size = (snap->entry_size) ? snap->entry_size * 2 : 64;
+		snap->entries = hrealloc(snap->entries, snap->entry_size * sizeof(*snap->entries));
+	}
+	
+	e = &snap->entries[snap->entry_count++];
+	e->type = type;
+	e->fd = c->fd;
+	e->listener_id = c->listener_id;
+	strncpy(e->username, c->username, sizeof(e->username));
+	e->username[sizeof(e->username)-1] = 0;
+	strncpy(e->app_name, c->app_name, sizeof(e->app_name));
+	e->app_name[sizeof(e->app_name)-1] = 0;
+	e->connect_time = c->connect_time;
+	e->rxbytes = c->localaccount.rxbytes;
+	e->txbytes = c->localaccount.txbytes;
+	e->rxpackets = c->localaccount.rxpackets;
+	e->txpackets = c->localaccount.txpackets;
+	e->rxdrops = c->localaccount.rxdrops;
+	
+	/* skip the separating comma */
+	e->json_offset = (b->len) ? b->len + 1 : 0;
+	worker_client_json(b, c);
+	e->json_len = b->len - e->json_offset;
+}
+
+/*
+ *	Take a status snapshot of the worker and its clients.
+ *	Runs in the worker thread, so nothing needs to be locked.
+ */
+
+static void worker_snapshot(struct worker_t *self)
+{
+	struct worker_snapshot_t *snap, *prev;
+	struct jsonbuf_t *b;
+	struct client_t *c;
+	
+	snap = hmalloc(sizeof(*snap));
+	memset(snap, 0, sizeof(*snap));
+	snap->refcount = 1;
+	snap->t = tick;
+	snap->worker_id = self->id;
+	snap->client_count = self->client_count;
+	
+	/* size the buffers after the previous snapshot to avoid regrowing them */
+	prev = self->snapshot;
+	jsonbuf_init(&snap->worker, 1024);
+	jsonbuf_init(&snap->clients, (prev) ? prev->clients.len + 1024 : 1024);
+	jsonbuf_init(&snap->uplinks, (prev) ? prev->uplinks.len + 1024 : 1024);
+	jsonbuf_init(&snap->peers, (prev) ? prev->peers.len + 1024 : 1024);
+	if (prev && prev->entry_count) {
+		snap->entry_size = prev->entry_count + 64;
+		snap->entries = hmalloc(snap->entry_size * sizeof(*snap->entries));
+	}
+	
+	b = &snap->worker;
+	jsonbuf_start_object(b, NULL);
+	jsonbuf_add_int(b, "id", self->id);
+	jsonbuf_add_int(b, "clients", self->client_count);
+	jsonbuf_add_int(b, "logins_pending", self->logins_pending);
+	jsonbuf_add_int(b, "cost", self->cost);
+	jsonbuf_add_int(b, "clients_migrated_in", self->clients_migrated_in);
+	jsonbuf_add_int(b, "clients_migrated_out", self->clients_migrated_out);
+	jsonbuf_add_int(b, "numa_node", self->numa_node);
+	jsonbuf_add_string(b, "poll_backend", xpoll_backend(&self->xp));
+	jsonbuf_add_int(b, "epoll_ctl_calls", xpoll_ctl_calls(&self->xp));
+	jsonbuf_add_int(b, "pbuf_incoming_count", self->pbuf_incoming_count);
+	jsonbuf_add_int(b, "pbuf_incoming_local_count", self->pbuf_incoming_local_count);
+	jsonbuf_add_int(b, "pbuf_return_count", self->pbuf_return_count);
+	jsonbuf_add_int(b, "pbuf_recycled_local", self->pbuf_recycled_local);
+	jsonbuf_add_int(b, "pbuf_alloc_global", self->pbuf_alloc_global);
+	jsonbuf_end_object(b);
+	
+	/* clients on hidden listener sockets are not shown */
+	for (c = self->clients; (c); c = c->next) {
+		if (c->hidden)
+			continue;
 		
-		cJSON *jw = cJSON_CreateObject();
-		cJSON_AddNumberToObject(jw, "id", w->id);
-		cJSON_AddNumberToObject(jw, "clients", w->client_count);
-		cJSON_AddNumberToObject(jw, "pbuf_incoming_count", w->pbuf_incoming_count);
-		cJSON_AddNumberToObject(jw, "pbuf_incoming_local_count", w->pbuf_incoming_local_count);
+		worker_snapshot_client(snap, c);
+	}
+	
+	self->snapshot_tick = tick;
+	worker_snapshot_publish(self, snap);
+}
+
+/*
+ *	Ask the workers to keep their snapshots fresh. If nobody has been
+ *	looking for a while, the snapshots are old: wait a moment for the
+ *	workers to build new ones.
+ */
+
+void worker_snapshots_refresh(void)
+{
+	struct worker_t *w;
+	time_t since = tick;
+	int pe, i, stale;
+	
+	worker_snapshot_wanted = tick;
+	
+	for (i = 0; i < WORKER_SNAPSHOT_WAIT_MS / 50; i++) {
+		stale = 0;
 		
-		for (c = w->clients; (c); c = c->next) {
-			client_heard_count += c->client_heard_count;
-			client_courtesy_count += c->client_courtesy_count;
-			
-			/* clients on hidden listener sockets are not shown */
-			/* if there are a huge amount of clients, don't list them
-			 * - cJSON takes huge amounts of CPU to build the list
-			 * - web browser will die due to the big blob
-			 */
-			if (c->hidden || w->client_count > 1000)
-				continue;
-				
-			cJSON *jc = worker_client_json(c, 0);
-			
-			if (c->state == CSTATE_COREPEER) {
-				cJSON_AddItemToArray(peers, jc);
-			} else if (c->flags & CLFLAGS_INPORT) {
-				cJSON_AddItemToArray(clients, jc);
-			} else {
-				cJSON_AddItemToArray(uplinks, jc);
-			}
+		if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+			hlog(LOG_ERR, "worker_snapshots_refresh: could not lock worker_snapshot_mt: %s", strerror(pe));
+			return;
 		}
 		
-		cJSON_AddItemToArray(workers, jw);
+		/* the ones being kept fresh are at most a second old */
+		for (w = worker_threads; (w); w = w->next)
+			if (!w->snapshot || w->snapshot_tick < since - 1)
+				stale++;
 		
-		if ((pe = pthread_mutex_unlock(&w->clients_mutex))) {
-			hlog(LOG_ERR, "worker_client_list(worker %d): could not unlock clients_mutex: %s", w->id, strerror(pe));
-			/* we'd going to deadlock here... */
-			exit(1);
+		if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+			hlog(LOG_ERR, "worker_snapshots_refresh: could not unlock worker_snapshot_mt: %s", strerror(pe));
 		}
 		
-		w = w->next;
+		if (!stale)
+			return;
+		
+		usleep(50000);
+	}
+}
+
+/*
+ *	Get references to the current snapshots of all workers, for the
+ *	status page. Workers which have not published one yet are skipped.
+ *	The caller must release them with worker_snapshots_put().
+ */
+
+struct worker_snapshot_t **worker_snapshots_get(int *count)
+{
+	struct worker_snapshot_t **snaps;
+	struct worker_t *w;
+	int pe, n = 0;
+	
+	/* ask the workers to keep their snapshots fresh */
+	worker_snapshot_wanted = tick;
+	
+	*count = 0;
+	
+	if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshots_get: could not lock worker_snapshot_mt: %s", strerror(pe));
+		return NULL;
+	}
+	
+	for (w = worker_threads; (w); w = w->next)
+		n++;
+	
+	snaps = hmalloc(sizeof(*snaps) * (n + 1));
+	
+	n = 0;
+	for (w = worker_threads; (w); w = w->next) {
+		if (!w->snapshot)
+			continue;
+		w->snapshot->refcount++;
+		snaps[n++] = w->snapshot;
+	}
+	
+	if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_snapshots_get: could not unlock worker_snapshot_mt: %s", strerror(pe));
+	}
+	
+	*count = n;
+	
+	return snaps;
+}
+
+void worker_snapshots_put(struct worker_snapshot_t **snaps, int count)
+{
+	int i;
+	
+	if (!snaps)
+		return;
+	
+	for (i = 0; i < count; i++)
+		worker_snapshot_unref(snaps[i]);
+	
+	hfree(snaps);
+}
+
+#ifndef _FOR_VALGRIND_
+/*
+ *	Status of the client cell pool, with the NUMA node pools summed in
+ */
+
+void client_cell_stats(struct cellstatus_t *cellst)
+{
+	struct cellstatus_t poolst;
+	int pool;
+	
+	cellstatus(client_cells[0], cellst);
+	for (pool = 1; pool <= NUMA_NODES_MAX; pool++) {
+		if (!client_cells[pool])
+			continue;
+		cellstatus(client_cells[pool], &poolst);
+		cellst->cellcount += poolst.cellcount;
+		cellst->freecount += poolst.freecount;
+		cellst->blocks += poolst.blocks;
+		cellst->blocks_max += poolst.blocks_max;
+		cellst->magazine_hits += poolst.magazine_hits;
+		cellst->magazine_misses += poolst.magazine_misses;
+	}
+}
+#endif
+
+/*
+ *	Fill in the global traffic totals and client memory usage for the
+ *	status display. Does not touch the workers' client lists.
+ */
+
+void worker_status_totals(cJSON *totals, cJSON *memory)
+{
+	struct worker_t *w;
+	long long poll_ctl_calls = 0;
+	int pe;
+	
+	/* the mutex keeps workers_stop() from freeing a worker under us */
+	if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_status_totals: could not lock worker_snapshot_mt: %s", strerror(pe));
+	} else {
+		for (w = worker_threads; (w); w = w->next)
+			poll_ctl_calls += xpoll_ctl_calls(&w->xp);
+		
+		if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+			hlog(LOG_ERR, "worker_status_totals: could not unlock worker_snapshot_mt: %s", strerror(pe));
+		}
 	}
 	
 	cJSON_AddNumberToObject(totals, "tcp_bytes_rx", client_connects_tcp.rxbytes);
@@ -2247,6 +3074,7 @@ int worker_client_list(cJSON *workers, cJSON *clients, cJSON *uplinks, cJSON *pe
 	cJSON_AddNumberToObject(totals, "udp_pkts_ign", client_connects_udp.rxdrops);
 	json_add_rxerrs(totals, "tcp_rx_errs", client_connects_tcp.rxerrs);
 	json_add_rxerrs(totals, "udp_rx_errs", client_connects_udp.rxerrs);
+	cJSON_AddNumberToObject(totals, "epoll_ctl_calls", poll_ctl_calls);
 #ifdef USE_SCTP
 	cJSON_AddNumberToObject(totals, "sctp_bytes_rx", client_connects_sctp.rxbytes);
 	cJSON_AddNumberToObject(totals, "sctp_bytes_tx", client_connects_sctp.txbytes);
@@ -2258,7 +3086,7 @@ int worker_client_list(cJSON *workers, cJSON *clients, cJSON *uplinks, cJSON *pe
 
 #ifndef _FOR_VALGRIND_
 	struct cellstatus_t cellst;
-	cellstatus(client_cells, &cellst);
+	client_cell_stats(&cellst);
 	int used = cellst.cellcount - cellst.freecount;
 	cJSON_AddNumberToObject(memory, "client_cells_used", used);
 	cJSON_AddNumberToObject(memory, "client_cells_free", cellst.freecount);
@@ -2271,6 +3099,62 @@ int worker_client_list(cJSON *workers, cJSON *clients, cJSON *uplinks, cJSON *pe
 	cJSON_AddNumberToObject(memory, "client_cell_size_aligned", cellst.cellsize_aligned);
 	cJSON_AddNumberToObject(memory, "client_cell_align", cellst.alignment);
 #endif
+}
+
+/*
+ *	Per-worker metrics for the /metrics page. The counters are read
+ *	without locking, each of them is only written by its worker.
+ */
+
+void worker_metrics(struct metrics_t *m)
+{
+	struct worker_t *w;
+	char labels[64];
+	long long count, sum;
+	int pe, i;
 	
-	return 0;
+	/* the mutex keeps workers_stop() from freeing a worker under us */
+	if ((pe = pthread_mutex_lock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_metrics: could not lock worker_snapshot_mt: %s", strerror(pe));
+		return;
+	}
+	
+#define WORKER_METRIC(name, type, help, value) \
+	metrics_family(m, name, type, help); \
+	for (w = worker_threads; (w); w = w->next) { \
+		snprintf(labels, sizeof(labels), "worker=\"%d\"", w->id); \
+		metrics_sample(m, name, labels, (value)); \
+	}
+	
+	WORKER_METRIC("aprsc_worker_clients", "gauge", "Clients handled by the worker", w->client_count);
+	WORKER_METRIC("aprsc_worker_logins_pending", "gauge", "Clients queued for the worker or logging in", w->logins_pending);
+	WORKER_METRIC("aprsc_worker_cost", "gauge", "Load of the worker, in cost units per second", w->cost);
+	WORKER_METRIC("aprsc_worker_clients_migrated_in_total", "counter", "Clients moved to the worker by the rebalancer", w->clients_migrated_in);
+	WORKER_METRIC("aprsc_worker_clients_migrated_out_total", "counter", "Clients moved away from the worker by the rebalancer", w->clients_migrated_out);
+	WORKER_METRIC("aprsc_worker_poll_ctl_calls_total", "counter", "Poll set modifications (epoll_ctl calls) done by the worker", xpoll_ctl_calls(&w->xp));
+	WORKER_METRIC("aprsc_worker_pbuf_incoming", "gauge", "Packets waiting for the dupecheck thread", w->pbuf_incoming_count + w->pbuf_incoming_local_count);
+	WORKER_METRIC("aprsc_worker_pbuf_recycled_local_total", "counter", "Packet buffers recycled through the worker's return queue", w->pbuf_recycled_local);
+	WORKER_METRIC("aprsc_worker_pbuf_alloc_global_total", "counter", "Packet buffers allocated from the global pools", w->pbuf_alloc_global);
+	
+#undef WORKER_METRIC
+	
+	metrics_family(m, "aprsc_worker_rx_packet_bytes", "histogram", "Length of the APRS-IS packets received by the worker");
+	for (w = worker_threads; (w); w = w->next) {
+		count = sum = 0;
+		for (i = 0; i < WORKER_RXLEN_BUCKETS; i++) {
+			count += w->rxlen_buckets[i];
+			if (i < WORKER_RXLEN_BUCKETS - 1)
+				snprintf(labels, sizeof(labels), "worker=\"%d\",le=\"%d\"", w->id, worker_rxlen_bounds[i]);
+			else
+				snprintf(labels, sizeof(labels), "worker=\"%d\",le=\"+Inf\"", w->id);
+			metrics_sample(m, "aprsc_worker_rx_packet_bytes_bucket", labels, count);
+		}
+		snprintf(labels, sizeof(labels), "worker=\"%d\"", w->id);
+		metrics_sample(m, "aprsc_worker_rx_packet_bytes_sum", labels, w->rxlen_sum);
+		metrics_sample(m, "aprsc_worker_rx_packet_bytes_count", labels, count);
+	}
+	
+	if ((pe = pthread_mutex_unlock(&worker_snapshot_mt))) {
+		hlog(LOG_ERR, "worker_metrics: could not unlock worker_snapshot_mt: %s", strerror(pe));
+	}
 }
@@ -25,10 +25,12 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "xpoll.h"
 #include "rwlock.h"
 #include "cJSON.h"
+#include "jsonbuf.h"
 #include "errno_aprsc.h"
 #include "ssl.h"
 
@@ -45,6 +47,8 @@ extern pthread_attr_t pthr_attrs;  /* used to setup new threads */
 
 /* packet length limiters and buffer sizes */
 #define PACKETLEN_MIN 10	/* minimum length for a valid APRS-IS packet: "A1A>B1B:\r\n" */
+#define WORKERS_MAX 32		/* maximum number of worker threads */
+
 #define PACKETLEN_MAX 512	/* maximum length for a valid APRS-IS packet (incl. CRLF) */
 
 /*
@@ -69,6 +73,11 @@ extern pthread_attr_t pthr_attrs;  /* used to setup new threads */
 #define PBUF_ALLOCATE_BUNCH_MEDIUM 2000 /* grow to 2000 in production use */
 #define PBUF_ALLOCATE_BUNCH_LARGE    50 /* grow to 50 in production use */
 
+/* max number of freed pbufs queued for return to a worker, the rest
+ * go back to the global pools
+ */
+#define PBUF_RETURN_MAX            8000
+
 /* a packet buffer */
 /* Type flags -- some can happen in combinations: T_CWOP + T_WX / T_CWOP + T_POSITION ... */
 #define T_POSITION  (1 << 0) // Packet is of position type
@@ -91,10 +100,16 @@ extern pthread_attr_t pthr_attrs;  /* used to setup new threads */
 #define F_HAS_TCPIP	(1 << 2)	/* There is a TCPIP* in the path */
 #define F_FROM_UPSTR	(1 << 3)	/* Packet is from an upstream server */
 #define F_FROM_DOWNSTR	(1 << 4)	/* Packet is from a downstream server */
+#define F_KILLED	(1 << 5)	/* Object or item is killed */
 
 struct client_t; /* forward declarator */
+struct worker_t; /* forward declarator */
 
 struct pbuf_t {
+	/* hot section: the fields read for every client in the outgoing
+	 * fanout loop and by the common filters, all within the first
+	 * cache line (PBUF_HOT_SIZE bytes on 64-bit platforms)
+	 */
 	struct pbuf_t *next;
 	struct client_t *origin;
 		/* where did we get it from (don't send it back)
@@ -110,20 +125,35 @@ struct pbuf_t {
 		   is ignored while history dumping is being done.
 		*/
 
+	uint16_t packettype;	/* bitmask: one or more of T_* */
+	uint16_t flags;		/* bitmask: one or more of F_* */
+	int packet_len;		/* the actual length of the packet, including CRLF */
+	uint32_t seqnum;	/* ever increasing counter, dupecheck sets */
+	
 	uint32_t srcname_hash;	/* source name hash */
 	uint32_t srccall_hash;	/* srccall hash */
 	uint32_t dstname_hash;	/* srccall hash */
-	uint16_t packettype;	/* bitmask: one or more of T_* */
-	uint16_t flags;		/* bitmask: one or more of F_* */
+	
+	float lat;	/* if the packet is PT_POSITION, latitude and longitude go here */
+	float lng;	/* .. in RADIAN */
+	float cos_lat;	/* cache of COS of LATitude for radial distance filter    */
+	
 	uint16_t srcname_len;	/* parsed length of source (object, item, srcall) name 3..9 */
-	uint16_t dstcall_len;	/* parsed length of destination callsign *including* SSID */
 	uint16_t dstname_len;   /* parsed length of message destination including SSID */
+	uint16_t dstcall_len;	/* parsed length of destination callsign *including* SSID */
 	uint16_t entrycall_len;
-	uint32_t seqnum;	/* ever increasing counter, dupecheck sets */
-	time_t t;		/* when the packet was received */
 	
-	int packet_len;		/* the actual length of the packet, including CRLF */
+	char symbol[3]; /* 2(+1) chars of symbol, if any, NUL for not found */
+	char is_free;   /* 1: in global free list, 0: not in global free list */
+	
+	/* cold section: set once by the parser, read by a few filters
+	 * and the allocator only
+	 */
+	struct worker_t *owner;	/* worker which allocated the buffer, it will get it back when freed */
+	time_t t;		/* when the packet was received */
 	int buf_len;		/* the length of this buffer */
+	int16_t numa_pool;	/* global pool set the buffer came from, see pbuf_get() */
+	uint16_t msgid_len;	/* length of message id */
 	
 	const char *srccall_end;   /* source callsign with SSID */
 	const char *dstcall_end_or_ssid;   /* end of dest callsign (without SSID) */
@@ -132,23 +162,26 @@ struct pbuf_t {
 	const char *info_start;    /* pointer to start of info field */
 	const char *srcname;       /* source's name (either srccall or object/item name) */
 	const char *dstname;       /* message destination callsign */
+	const char *msgid;         /* message id after the '{', NULL if none */
 	
-	float lat;	/* if the packet is PT_POSITION, latitude and longitude go here */
-	float lng;	/* .. in RADIAN */
-	float cos_lat;	/* cache of COS of LATitude for radial distance filter    */
-
-	char symbol[3]; /* 2(+1) chars of symbol, if any, NUL for not found */
-	char is_free;   /* 1: in global free list, 0: not in global free list */
-
 	char data[1];	/* contains the whole packet, including CRLF, ready to transmit */
 };
 
+/* size of the hot section of pbuf_t, which the allocator zeroes */
+#define PBUF_HOT_SIZE offsetof(struct pbuf_t, owner)
+
+/* pbufs are aligned to cache lines, so that the hot section is not split */
+#define PBUF_CACHELINE 64
+
+
 /* global packet buffer */
 extern rwlock_t pbuf_global_rwlock;
 extern struct pbuf_t  *pbuf_global;
 extern struct pbuf_t **pbuf_global_prevp;
 extern struct pbuf_t  *pbuf_global_dupe;
 extern struct pbuf_t **pbuf_global_dupe_prevp;
+extern uint32_t pbuf_global_last_seqnum;
+extern uint32_t pbuf_global_dupe_last_seqnum;
 
 /* a network client */
 typedef enum {
@@ -310,6 +343,7 @@ struct client_t {
 	
 #ifdef USE_SSL
 	struct ssl_connection_t *ssl_con;
+	struct client_t *ssl_pending_next;	/* new clients with data already decrypted by OpenSSL */
 #endif
 
 	/* first stage read buffer - used to crunch out lines to packet buffers */
@@ -393,6 +427,23 @@ struct client_t {
 	//struct pbuf_t **pbuf_global_dupe_prevp;
 	//uint32_t	last_pbuf_seqnum;
 	//uint32_t	last_pbuf_dupe_seqnum;
+	
+	/* load accounting for balancing clients between workers */
+	long long filter_evals;		/* outgoing packets run through the filters */
+	long long cost_filter_evals;	/* filter_evals at last cost update */
+	long long cost_txbytes;		/* localaccount.txbytes at last cost update */
+	int cost;			/* smoothed cost, units per second */
+	
+	/* migration from one worker to another: the old worker's position
+	 * in pbuf_global, the client catches up from there
+	 */
+	int migrating;
+	uint32_t migrate_seqnum;
+	struct pbuf_t **migrate_prevp;
+	struct client_t *migrate_next;	/* list of clients waiting for the worker to catch up */
+	
+	int numa_pool;			/* client_cells pool this was allocated from */
+	struct worker_t *handshake_worker;	/* worker which gets the client after the SSL handshake */
 
 	char  username[16];     /* The callsign */
 	char  app_name[32];     /* application name, from 'user' command */
@@ -413,16 +464,66 @@ struct client_t {
 	char	obuf[OBUF_SIZE];
 #endif
 	char filter_s[FILTER_S_SIZE];
+	
+	void *liveupgrade;	/* live upgrade state to restore in the worker, see liveupgrade.c */
 };
 
 extern struct client_t *client_alloc(void);
+extern struct client_t *client_alloc_numa(int pool);
 extern void client_free(struct client_t *c);
 extern int set_client_sockopt(struct client_t *c);
 extern int pass_client_to_worker(struct worker_t *wc, struct client_t *c);
 extern void worker_mark_client_connected(struct worker_t *self, struct client_t *c);
+extern void worker_migrate_attach(struct worker_t *self, int all);
 extern struct client_t *pseudoclient_setup(int portnum);
 
 
+/* received packet length histogram, the last bucket is for the longer ones */
+#define WORKER_RXLEN_BUCKETS	7
+extern const int worker_rxlen_bounds[WORKER_RXLEN_BUCKETS-1];
+
+/* client types in a worker snapshot */
+#define SNAPSHOT_CLIENT		0
+#define SNAPSHOT_UPLINK		1
+#define SNAPSHOT_PEER		2
+
+/* a client in a worker snapshot, for filtering and sorting the client list */
+struct worker_snapshot_client_t {
+	int type;			/* SNAPSHOT_* */
+	int fd;
+	int listener_id;
+	char username[16];
+	char app_name[32];
+	time_t connect_time;
+	long long rxbytes, txbytes;
+	long long rxpackets, txpackets;
+	long long rxdrops;
+	int json_offset;		/* the client object in the buffer of its type */
+	int json_len;
+};
+
+/*
+ *	A status snapshot of a worker, built by the worker itself so that
+ *	the status page does not need to lock the client list. It is not
+ *	modified after it has been published: readers take a reference,
+ *	and the last one to let go frees it.
+ */
+struct worker_snapshot_t {
+	int refcount;			/* protected by worker_snapshot_mt */
+	time_t t;			/* tick when taken */
+	int worker_id;
+	int client_count;
+	
+	struct jsonbuf_t worker;	/* the worker object */
+	struct jsonbuf_t clients;	/* client objects, separated by commas */
+	struct jsonbuf_t uplinks;
+	struct jsonbuf_t peers;
+	
+	struct worker_snapshot_client_t *entries;
+	int entry_count;
+	int entry_size;
+};
+
 /* worker thread structure */
 struct worker_t {
 	struct worker_t *next;
@@ -445,14 +546,47 @@ struct worker_t {
 	struct client_t *new_clients_last;	/* last client in the list, to support FIFO queuing */
 	pthread_mutex_t new_clients_mutex;	/* mutex to protect *new_clients */
 	int client_count;			/* modified by worker thread only! */
+	volatile int logins_pending;		/* clients queued or in login state, for admission control */
+	
+	/* load metric, published for pick_next_worker() and the rebalancer */
+	volatile int cost;			/* smoothed cost units per second, sum of clients */
+	time_t cost_tick;			/* when the cost was last updated */
+	
+	/* the rebalancer asks this worker to move about migrate_cost worth
+	 * of clients to the worker migrate_to
+	 */
+	struct worker_t * volatile migrate_to;
+	volatile int migrate_cost;
+	struct client_t *migrating;		/* migrated clients waiting for us to catch up */
+	long long clients_migrated_in;
+	long long clients_migrated_out;
+	
+	/* CPU affinity and NUMA placement */
+	int affinity_generation;		/* affinity configuration last applied */
+	int numa_node;				/* NUMA node we're pinned on, -1: not pinned */
+	volatile int numa_pool;			/* pbuf and client pool index, 0: the default pools */
 	
 	struct xpoll_t xp;			/* poll/epoll/select wrapper */
 	
+	/* this worker's SO_REUSEPORT listening sockets, as pseudoclients */
+	struct client_t *listen_clients;
+	int listeners_generation;		/* accept_listeners_generation when last synced */
+	
 	/* thread-local packet buffer freelist */
 	struct pbuf_t *pbuf_free_small;  /* <= 130 bytes */
 	struct pbuf_t *pbuf_free_medium; /* 131 >= x <= 300 */
 	struct pbuf_t *pbuf_free_large;  /* 301 >= x <= 600 */
 	
+	/* freed pbufs returned to this worker by the purger, lock-free:
+	 * the purger pushes chains with compare-and-swap, the worker
+	 * grabs the whole list at once when a local freelist runs empty
+	 */
+	struct pbuf_t * volatile pbuf_return;
+	volatile int pbuf_return_count;
+	
+	long long pbuf_recycled_local;	/* buffers recycled through the return queue */
+	long long pbuf_alloc_global;	/* buffers allocated from the global pools */
+	
 	/* packets which have been parsed, waiting to be moved into
 	 * pbuf_incoming
 	 */
@@ -473,20 +607,63 @@ struct worker_t {
 
 	uint32_t	last_pbuf_seqnum;
 	uint32_t	last_pbuf_dupe_seqnum;
+	volatile int	pbuf_resync;	/* purger asks a stalled worker to skip to the queue tail */
 	
 	/* how many packets were dropped internally within this worker
 	 * (process hangs and time jumps)
 	 */
 	unsigned int internal_packet_drops;
+	
+	/* received packet lengths for the metrics, counted per bucket
+	 * (not cumulative), written by this worker only
+	 */
+	long long rxlen_buckets[WORKER_RXLEN_BUCKETS];
+	long long rxlen_sum;
+	
+	/* latest status snapshot, see worker_snapshots_get() */
+	struct worker_snapshot_t *snapshot;
+	time_t snapshot_tick;
 };
 
-extern cJSON *worker_shutdown_clients;
+/*
+ *	Count clients in the login state for a worker. The accept thread
+ *	and the handshake threads add clients, and the worker removes them
+ *	once they have logged in or disconnected.
+ */
+
+static inline void worker_logins_pending_add(struct worker_t *w, int n)
+{
+#ifdef HAVE_SYNC_FETCH_AND_ADD
+	__sync_fetch_and_add(&w->logins_pending, n);
+#else
+	w->logins_pending += n;
+#endif
+}
+
+
+/*
+ *	Count a received packet in the worker's packet length histogram
+ */
+
+static inline void worker_rxlen_account(struct worker_t *self, int len)
+{
+	int i;
+	
+	for (i = 0; i < WORKER_RXLEN_BUCKETS - 1 && len > worker_rxlen_bounds[i]; i++)
+		;
+	
+	self->rxlen_buckets[i]++;
+	self->rxlen_sum += len;
+}
 
 extern int workers_running;
 
 extern void pbuf_init(void);
+extern int pbuf_numa_pool(int node);
 extern void pbuf_free(struct worker_t *self, struct pbuf_t *p);
 extern void pbuf_free_many(struct pbuf_t **array, int numbufs);
+extern long long pbuf_freed_returned;
+extern long long pbuf_freed_global;
 extern void pbuf_dump(FILE *fp);
 extern void pbuf_dupe_dump(FILE *fp);
 
@@ -503,6 +680,10 @@ extern struct worker_t *worker_alloc(void);
 extern void worker_free_buffers(struct worker_t *self);
 extern void workers_stop(int stop_all);
 extern void workers_start(void);
+extern void workers_rebalance(void);
+
+extern volatile int worker_migration_inflight;
+extern volatile uint32_t worker_migration_pin;
 
 extern int keepalive_interval;
 extern int fileno_limit;
@@ -523,6 +704,14 @@ extern char *hexsockaddr(const struct sockaddr *sa, const int addr_len);
 extern void clientaccount_add(struct client_t *c, int l4proto, int rxbytes, int rxpackets, int txbytes, int txpackets, int rxerr, int rxdupes);
 
 extern void json_add_rxerrs(cJSON *root, const char *key, long long vals[]);
-extern int worker_client_list(cJSON *workers, cJSON *clients, cJSON *uplinks, cJSON *peers, cJSON *totals, cJSON *memory);
+extern void worker_snapshots_refresh(void);
+extern struct worker_snapshot_t **worker_snapshots_get(int *count);
+extern void worker_snapshots_put(struct worker_snapshot_t **snaps, int count);
+extern void worker_status_totals(cJSON *totals, cJSON *memory);
+
+struct cellstatus_t;
+struct metrics_t;
+extern void client_cell_stats(struct cellstatus_t *cellst);
+extern void worker_metrics(struct metrics_t *m);
 
 #endif
@@ -23,11 +23,18 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include "xpoll.h"
 #include "hmalloc.h"
 #include "hlog.h"
 #include "cellmalloc.h"
 
+#ifdef XP_USE_URING
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #ifdef XP_USE_EPOLL
 const char xpoll_implementation[] = "epoll";
 #endif
@@ -39,12 +46,622 @@ const char xpoll_implementation[] = "poll";
 cellarena_t *xpoll_fd_pool;
 #endif
 
+int xpoll_backend_config = XP_BACKEND_EPOLL;	/* backend for new xpoll sets */
+int xpoll_events = XP_EVENTS_DEFAULT;		/* size of the epoll event array */
+
+#ifdef XP_USE_URING
+
+/*
+ *	io_uring backend
+ *
+ *	Readiness is polled with one-shot IORING_OP_POLL_ADD requests, which
+ *	are re-armed after the event has been handled - that gives the same
+ *	level-triggered semantics as epoll, so the handlers do not need to
+ *	read or write everything at once. The re-arms, the write interest
+ *	changes and the removals are only queued in the submission ring,
+ *	and the whole batch is submitted with the same io_uring_enter() which
+ *	waits for the next events: one system call per round, no epoll_ctl()
+ *	calls at all.
+ *
+ *	A removed fd may still have polls in flight, so the xpoll_fd_t is
+ *	kept on a zombie list until the kernel has completed them.
+ *
+ *	When the submission ring fills up in the middle of a round, the
+ *	queued requests are submitted right away. If the kernel will not
+ *	take them because the completion ring is full, the completions are
+ *	moved to a backlog, and handled at the start of the next round.
+ *	If it still will not take them, the requests which did not fit are
+ *	redone at the start of the next round.
+ */
+
+#define XP_URING_SQ_ENTRIES	512
+#define XP_URING_CQ_ENTRIES	8192
+#define XP_URING_SUBMIT_TRIES	8	/* io_uring_enter() calls to make room in a full ring */
+
+#define XP_URING_ARMED_IN	1	/* read poll in flight */
+#define XP_URING_ARMED_OUT	2	/* write poll in flight */
+#define XP_URING_WANT_OUT	4	/* xpoll_outgoing() enabled */
+#define XP_URING_DEAD		8	/* removed, waiting for the polls to complete */
+
+#define XP_URING_UD_OUT		1	/* user_data tag bit: the write poll of an xfd */
+
+struct xpoll_uring_t {
+	int fd;
+	
+	/* submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail;		/* queued, not yet published to the kernel */
+	struct io_uring_sqe *sqes;
+	
+	/* completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	
+	/* completions moved out of the ring, to be handled in the next round */
+	struct xpoll_uring_cqe_t {
+		uint64_t user_data;
+		int res;
+	} *backlog;
+	int backlog_len, backlog_size;
+	
+	int resubmit;			/* a request did not fit in the ring, redo them */
+	
+	struct xpoll_fd_t *zombies;	/* removed fds with polls still in flight */
+};
+
+/* struct __kernel_timespec, not in all kernel header versions */
+struct xpoll_uring_timespec {
+	int64_t tv_sec;
+	long long tv_nsec;
+};
+
+static int xpoll_uring_setup(struct xpoll_t *xp)
+{
+	struct xpoll_uring_t *u;
+	struct io_uring_params p;
+	unsigned i;
+	
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = XP_URING_CQ_ENTRIES;
+	
+	u = hmalloc(sizeof(*u));
+	memset(u, 0, sizeof(*u));
+	
+	u->fd = syscall(__NR_io_uring_setup, XP_URING_SQ_ENTRIES, &p);
+	if (u->fd < 0) {
+		hlog(LOG_ERR, "xpoll: io_uring_setup failed: %s", strerror(errno));
+		hfree(u);
+		return -1;
+	}
+	
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		hlog(LOG_ERR, "xpoll: io_uring: kernel is too old (features 0x%x)", p.features);
+		close(u->fd);
+		hfree(u);
+		return -1;
+	}
+	
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = u->sq_ring_size;
+	}
+	
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail_sq;
+	
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail_cq;
+	}
+	
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_sqes;
+	
+	u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	
+	u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+	
+	/* the SQEs are always used in ring order */
+	for (i = 0; i < p.sq_entries; i++)
+		u->sq_array[i] = i;
+	
+	xp->uring = u;
+	
+	return 0;
+	
+fail_sqes:
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+fail_cq:
+	munmap(u->sq_ring, u->sq_ring_size);
+fail_sq:
+	hlog(LOG_ERR, "xpoll: io_uring mmap failed: %s", strerror(errno));
+	close(u->fd);
+	hfree(u);
+	return -1;
+}
+
+static void xpoll_uring_free(struct xpoll_t *xp)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct xpoll_fd_t *xfd;
+	
+	/* closing the ring cancels all of the polls */
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	
+	while ((xfd = u->zombies)) {
+		u->zombies = xfd->next;
+#ifndef _FOR_VALGRIND_
+		cellfree( xpoll_fd_pool, xfd );
+#else
+		hfree(xfd);
+#endif
+	}
+	
+	if (u->backlog)
+		hfree(u->backlog);
+	hfree(u);
+	xp->uring = NULL;
+}
+
+/*
+ *	Submit the queued requests, and optionally wait for completions
+ */
+
+static int xpoll_uring_enter(struct xpoll_t *xp, int wait, int timeout)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct io_uring_getevents_arg arg;
+	struct xpoll_uring_timespec ts;
+	unsigned to_submit;
+	int r, flags = 0;
+	
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	
+	if (!to_submit && !wait)
+		return 0;
+	
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+	
+	r = syscall(__NR_io_uring_enter, u->fd, to_submit, (wait) ? 1 : 0, flags,
+		(wait) ? &arg : NULL, (wait) ? sizeof(arg) : 0);
+	
+	if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		hlog(LOG_ERR, "xpoll: io_uring_enter failed: %s", strerror(errno));
+	
+	return r;
+}
+
+/*
+ *	Move the completions out of the ring to the backlog, so that the
+ *	kernel has room for more
+ */
+
+static void xpoll_uring_reap(struct xpoll_t *xp)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		if (!cqe->user_data)
+			continue;
+		
+		if (u->backlog_len == u->backlog_size) {
+			u->backlog_size = (u->backlog_size) ? u->backlog_size * 2 : 256;
+			u->backlog = hrealloc(u->backlog, u->backlog_size * sizeof(*u->backlog));
+		}
+		u->backlog[u->backlog_len].user_data = cqe->user_data;
+		u->backlog[u->backlog_len].res = cqe->res;
+		u->backlog_len++;
+	}
+	
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ *	Get a free submission queue entry. Returns NULL if the ring is
+ *	full and the kernel will not take the queued requests; the caller
+ *	leaves its request to be redone in the next round.
+ */
+
+static struct io_uring_sqe *xpoll_uring_sqe(struct xpoll_t *xp)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct io_uring_sqe *sqe;
+	int tries = 0;
+	
+	/* submission ring full, push the queued ones to the kernel first */
+	while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if (tries++ == XP_URING_SUBMIT_TRIES) {
+			hlog(LOG_ERR, "xpoll: io_uring submission ring stays full, retrying in the next round");
+			u->resubmit = 1;
+			return NULL;
+		}
+		
+		/* completion ring full, the kernel wants room for the
+		 * completions of what we submit
+		 */
+		if (xpoll_uring_enter(xp, 0, 0) < 0 && (errno == EBUSY || errno == EAGAIN))
+			xpoll_uring_reap(xp);
+	}
+	
+	sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_local_tail++;
+	
+	return sqe;
+}
+
+static void xpoll_uring_arm(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int out)
+{
+	struct io_uring_sqe *sqe = xpoll_uring_sqe(xp);
+	unsigned events = (out) ? POLLOUT : POLLIN;
+	
+	if (!sqe)
+		return;
+	
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = xfd->fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = (uint64_t)(uintptr_t)xfd | ((out) ? XP_URING_UD_OUT : 0);
+	
+	xfd->uring_state |= (out) ? XP_URING_ARMED_OUT : XP_URING_ARMED_IN;
+}
+
+static void xpoll_uring_cancel(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int out)
+{
+	struct io_uring_sqe *sqe = xpoll_uring_sqe(xp);
+	
+	if (!sqe)
+		return;
+	
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)xfd | ((out) ? XP_URING_UD_OUT : 0);
+	sqe->user_data = 0; /* completion of the remove itself is ignored */
+}
+
+static void xpoll_uring_remove(struct xpoll_t *xp, struct xpoll_fd_t *xfd)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	
+	if (xfd->uring_state & XP_URING_ARMED_IN)
+		xpoll_uring_cancel(xp, xfd, 0);
+	if (xfd->uring_state & XP_URING_ARMED_OUT)
+		xpoll_uring_cancel(xp, xfd, 1);
+	
+	/* freed at the end of the next round, after the polls have
+	 * completed - a handler may be running on this one right now
+	 */
+	xfd->uring_state |= XP_URING_DEAD;
+	xfd->p = NULL;
+	xfd->next = u->zombies;
+	u->zombies = xfd;
+}
+
+/*
+ *	Redo the requests which did not fit in the submission ring: arm
+ *	the polls of the fds which have none in flight, and cancel the
+ *	polls of the removed ones again
+ */
+
+static void xpoll_uring_resubmit(struct xpoll_t *xp)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct xpoll_fd_t *xfd;
+	
+	u->resubmit = 0;
+	
+	for (xfd = xp->fds; (xfd) && !u->resubmit; xfd = xfd->next) {
+		if (!(xfd->uring_state & XP_URING_ARMED_IN))
+			xpoll_uring_arm(xp, xfd, 0);
+		if ((xfd->uring_state & (XP_URING_WANT_OUT|XP_URING_ARMED_OUT)) == XP_URING_WANT_OUT)
+			xpoll_uring_arm(xp, xfd, 1);
+	}
+	
+	for (xfd = u->zombies; (xfd) && !u->resubmit; xfd = xfd->next) {
+		if (xfd->uring_state & XP_URING_ARMED_IN)
+			xpoll_uring_cancel(xp, xfd, 0);
+		if (xfd->uring_state & XP_URING_ARMED_OUT)
+			xpoll_uring_cancel(xp, xfd, 1);
+	}
+}
+
+/*
+ *	Handle a completed poll. Returns 1 if the handler was called.
+ */
+
+static int xpoll_uring_complete(struct xpoll_t *xp, uint64_t ud, int res)
+{
+	struct xpoll_fd_t *xfd;
+	int out;
+	
+	if (!ud)
+		return 0;
+	
+	out = ud & XP_URING_UD_OUT;
+	xfd = (struct xpoll_fd_t *)(uintptr_t)(ud & ~(uint64_t)XP_URING_UD_OUT);
+	xfd->uring_state &= ~((out) ? XP_URING_ARMED_OUT : XP_URING_ARMED_IN);
+	
+	if (xfd->uring_state & XP_URING_DEAD)
+		return 0;
+	
+	xfd->result = 0;
+	if (res < 0) {
+		xfd->result |= XP_ERR;
+	} else {
+		if (res & (POLLIN|POLLPRI))
+			xfd->result |= XP_IN;
+		if ((res & POLLOUT) && (xfd->uring_state & XP_URING_WANT_OUT))
+			xfd->result |= XP_OUT;
+		if (res & (POLLERR|POLLHUP|POLLNVAL))
+			xfd->result |= XP_ERR;
+	}
+	
+	if (xfd->result)
+		(*xp->handler)(xp, xfd);
+	
+	/* re-arm, unless the handler removed the fd */
+	if (!(xfd->uring_state & XP_URING_DEAD)) {
+		if (!(xfd->uring_state & XP_URING_ARMED_IN))
+			xpoll_uring_arm(xp, xfd, 0);
+		if ((xfd->uring_state & (XP_URING_WANT_OUT|XP_URING_ARMED_OUT)) == XP_URING_WANT_OUT)
+			xpoll_uring_arm(xp, xfd, 1);
+	}
+	
+	return (xfd->result) ? 1 : 0;
+}
+
+static int xpoll_uring(struct xpoll_t *xp, int timeout)
+{
+	struct xpoll_uring_t *u = xp->uring;
+	struct xpoll_fd_t *xfd, **zp;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t ud;
+	int i, res, n = 0;
+	
+	if (u->resubmit)
+		xpoll_uring_resubmit(xp);
+	
+	/* the completions moved aside in the previous round; the handlers
+	 * may add more to the backlog while it is being gone through
+	 */
+	for (i = 0; i < u->backlog_len; i++)
+		n += xpoll_uring_complete(xp, u->backlog[i].user_data, u->backlog[i].res);
+	u->backlog_len = 0;
+	
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	
+	/* submit, and wait for events unless we already have some */
+	if (xpoll_uring_enter(xp, (head == tail && n == 0), (n) ? 0 : timeout) < 0 && errno == EINTR)
+		return -1;
+	
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	
+	while (head != tail) {
+		cqe = &u->cqes[head & *u->cq_mask];
+		ud = cqe->user_data;
+		res = cqe->res;
+		
+		/* let the kernel reuse the slot right away, the handlers
+		 * may need to flush the submission ring
+		 */
+		head++;
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		
+		n += xpoll_uring_complete(xp, ud, res);
+		
+		/* a handler may have moved the rest to the backlog */
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	
+	/* free the removed fds which have no polls in flight any more */
+	zp = &u->zombies;
+	while ((xfd = *zp)) {
+		if (xfd->uring_state & (XP_URING_ARMED_IN|XP_URING_ARMED_OUT)) {
+			zp = &xfd->next;
+			continue;
+		}
+		*zp = xfd->next;
+#ifndef _FOR_VALGRIND_
+		cellfree( xpoll_fd_pool, xfd );
+#else
+		hfree(xfd);
+#endif
+	}
+	
+	return n;
+}
+
+#endif /* XP_USE_URING */
+
+/*
+ *	which backend is in use for this set
+ */
+
+const char *xpoll_backend(struct xpoll_t *xp)
+{
+	/* without a set, the configured one */
+	if (!xp) {
+#ifdef XP_USE_EPOLL
+#ifdef XP_USE_URING
+		if (xpoll_backend_config == XP_BACKEND_URING)
+			return "io_uring";
+#endif
+		if (xpoll_backend_config == XP_BACKEND_EPOLL_ET)
+			return "epoll_et";
+#endif
+		return xpoll_implementation;
+	}
+	
+#ifdef XP_USE_URING
+	if (xp->uring)
+		return "io_uring";
+#endif
+#ifdef XP_USE_EPOLL
+	if (xp->edge_triggered)
+		return "epoll_et";
+#endif
+	return xpoll_implementation;
+}
+
+/*
+ *	number of epoll_ctl() calls done for a set
+ */
+
+long long xpoll_ctl_calls(struct xpoll_t *xp)
+{
+#ifdef XP_USE_EPOLL
+	return xp->ctl_calls;
+#else
+	return 0;
+#endif
+}
+
+#ifdef XP_USE_EPOLL
+/*
+ *	edge-triggered mode: the ready list holds the fds which have
+ *	received an edge which the handlers have not consumed yet
+ */
+
+static void xpoll_ready_add(struct xpoll_t *xp, struct xpoll_fd_t *xfd)
+{
+	if (xfd->ready_prevp)
+		return;
+	
+	xfd->ready_next = xp->ready;
+	xfd->ready_prevp = &xp->ready;
+	if (xfd->ready_next)
+		xfd->ready_next->ready_prevp = &xfd->ready_next;
+	xp->ready = xfd;
+}
+
+static void xpoll_ready_del(struct xpoll_fd_t *xfd)
+{
+	if (!xfd->ready_prevp)
+		return;
+	
+	*xfd->ready_prevp = xfd->ready_next;
+	if (xfd->ready_next)
+		xfd->ready_next->ready_prevp = xfd->ready_prevp;
+	xfd->ready_prevp = NULL;
+}
+
+/* the readiness the handler should hear about */
+static inline int xpoll_ready_result(struct xpoll_fd_t *xfd)
+{
+	return xfd->ready & ((xfd->want_out) ? (XP_IN|XP_OUT|XP_ERR) : (XP_IN|XP_ERR));
+}
+
+static int xpoll_edge(struct xpoll_t *xp, int timeout)
+{
+	struct xpoll_fd_t *xfd, *pending;
+	int nfds, n, handled = 0;
+	
+	/* don't sleep if the handlers left something unread or unwritten */
+	nfds = epoll_wait(xp->epollfd, xp->events, xp->events_len, (xp->ready) ? 0 : timeout);
+	
+	for (n = 0; n < nfds; ++n) {
+		xfd = (struct xpoll_fd_t*) xp->events[n].data.ptr;
+		if (xp->events[n].events & (EPOLLIN|EPOLLPRI|EPOLLRDHUP))
+			xfd->ready |= XP_IN;
+		if (xp->events[n].events & EPOLLOUT)
+			xfd->ready |= XP_OUT;
+		/* errors are found by reading */
+		if (xp->events[n].events & (EPOLLERR|EPOLLHUP))
+			xfd->ready |= XP_IN|XP_ERR;
+		xpoll_ready_add(xp, xfd);
+	}
+	
+	/* Take the list over, fds which still have readiness left after
+	 * their handler has run are put on a new one for the next round.
+	 * The handlers may remove any fd, which unlinks it from the list.
+	 */
+	pending = xp->ready;
+	if (pending)
+		pending->ready_prevp = &pending;
+	xp->ready = NULL;
+	
+	while ((xfd = pending)) {
+		xpoll_ready_del(xfd);
+		
+		xfd->result = xpoll_ready_result(xfd);
+		if (!xfd->result)
+			continue;
+		
+		xfd->ready &= ~XP_ERR;
+		handled++;
+		
+		xp->dispatching = xfd;
+		(*xp->handler)(xp, xfd);
+		
+		/* if the fd was not removed, and the handler did not read
+		 * or write until it would block, come back next round
+		 */
+		if (xp->dispatching == xfd && xpoll_ready_result(xfd))
+			xpoll_ready_add(xp, xfd);
+	}
+	
+	xp->dispatching = NULL;
+	
+	return handled;
+}
+#endif
+
 void xpoll_init(void) {
 #ifndef _FOR_VALGRIND_
 	xpoll_fd_pool = cellinit( "xpollfd",
 				  sizeof(struct xpoll_fd_t),
 				  __alignof__(struct xpoll_fd_t),
-				  CELLMALLOC_POLICY_FIFO,
+				  CELLMALLOC_POLICY_FIFO | CELLMALLOC_POLICY_MAGAZINE,
 				  128 /* 128 kB */,
 				  0 /* minfree */ );
 #endif
@@ -57,6 +674,22 @@ struct xpoll_t *xpoll_initialize(struct xpoll_t *xp, void *tp, int (*handler) (s
 	xp->handler = handler;
 	
 #ifdef XP_USE_EPOLL
+	xp->events = NULL;
+	xp->edge_triggered = 0;
+	xp->ready = NULL;
+	xp->dispatching = NULL;
+	xp->ctl_calls = 0;
+#ifdef XP_USE_URING
+	xp->uring = NULL;
+	if (xpoll_backend_config == XP_BACKEND_URING) {
+		if (xpoll_uring_setup(xp) == 0) {
+			xp->epollfd = -1;
+			xp->pollfd_used = 0;
+			return xp;
+		}
+		hlog(LOG_ERR, "xpoll: io_uring not available, using epoll");
+	}
+#endif
 	//hlog(LOG_DEBUG, "xpoll: initializing %p using epoll()", (void *)xp);
 	xp->epollfd = epoll_create(1000);
 	if (xp->epollfd < 0) {
@@ -64,6 +697,10 @@ struct xpoll_t *xpoll_initialize(struct xpoll_t *xp, void *tp, int (*handler) (s
 		return NULL;
 	}
 	
+	xp->edge_triggered = (xpoll_backend_config == XP_BACKEND_EPOLL_ET);
+	xp->events_len = (xpoll_events > 0) ? xpoll_events : XP_EVENTS_DEFAULT;
+	xp->events = hmalloc(sizeof(struct epoll_event) * xp->events_len);
+	
 	if (fcntl(xp->epollfd, F_SETFL, FD_CLOEXEC) == -1) {
 		hlog(LOG_ERR, "xpoll: fnctl FD_CLOEXEC on epollfd failed: %s", strerror(errno));
 	}
@@ -84,8 +721,18 @@ int xpoll_free(struct xpoll_t *xp)
 	struct xpoll_fd_t *xfd;
 	
 #ifdef XP_USE_EPOLL
-	close(xp->epollfd);
+#ifdef XP_USE_URING
+	if (xp->uring)
+		xpoll_uring_free(xp);
+	else
+#endif
+	{
+		close(xp->epollfd);
+		hfree(xp->events);
+		xp->events = NULL;
+	}
 	xp->epollfd = -1;
+	xp->ready = NULL;
 #endif
 	while (xp->fds) {
 		xfd = xp->fds->next;
@@ -125,12 +772,39 @@ struct xpoll_fd_t *xpoll_add(struct xpoll_t *xp, int fd, void *p)
 		xfd->next->prevp = &xfd->next;
 	xp->fds = xfd;
 
+#ifdef XP_USE_URING
+	if (xp->uring) {
+		xfd->uring_state = 0;
+		xpoll_uring_arm(xp, xfd, 0);
+		xp->pollfd_used++;
+		return xfd;
+	}
+#endif
 #ifdef XP_USE_EPOLL
-	xfd->ev.events   = EPOLLIN; // | EPOLLET ?
+	xfd->ready = 0;
+	xfd->want_out = 0;
+	xfd->ready_prevp = NULL;
+	
+	/* in edge-triggered mode the fd is registered for writability
+	 * right away, so that xpoll_outgoing() never needs epoll_ctl()
+	 */
+	if (xp->edge_triggered)
+		xfd->ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+	else
+		xfd->ev.events = EPOLLIN;
 	// Each event has initialized callback pointer to struct xpoll_fd_t...
 	xfd->ev.data.ptr = xfd;
+	xp->ctl_calls++;
 	if (epoll_ctl(xp->epollfd, EPOLL_CTL_ADD, fd, &xfd->ev) == -1) {
 		hlog(LOG_ERR, "xpoll: epoll_ctl EPOL_CTL_ADD %d failed: %s", fd, strerror(errno));
+		*xfd->prevp = xfd->next;
+		if (xfd->next)
+			xfd->next->prevp = xfd->prevp;
+#ifndef _FOR_VALGRIND_
+		cellfree( xpoll_fd_pool, xfd );
+#else
+		hfree(xfd);
+#endif
 		return NULL;
 	}
 #else
@@ -153,9 +827,24 @@ struct xpoll_fd_t *xpoll_add(struct xpoll_t *xp, int fd, void *p)
 
 int xpoll_remove(struct xpoll_t *xp, struct xpoll_fd_t *xfd)
 {
+#ifdef XP_USE_URING
+	if (xp->uring) {
+		xp->pollfd_used--;
+		*xfd->prevp = xfd->next;
+		if (xfd->next)
+			xfd->next->prevp = xfd->prevp;
+		xpoll_uring_remove(xp, xfd);
+		return 0;
+	}
+#endif
 #ifdef XP_USE_EPOLL
+	xpoll_ready_del(xfd);
+	if (xp->dispatching == xfd)
+		xp->dispatching = NULL;
+	
 	if (xfd->fd >= 0) {
 		// Remove it from kernel polled events
+		xp->ctl_calls++;
 		if (epoll_ctl(xp->epollfd, EPOLL_CTL_DEL, xfd->fd, NULL) == -1) {
 			hlog(LOG_ERR, "xpoll: epoll_ctl EPOL_CTL_DEL %d failed: %s", xfd->fd, strerror(errno));
 		}
@@ -203,12 +892,41 @@ int xpoll_remove(struct xpoll_t *xp, struct xpoll_fd_t *xfd)
 
 void xpoll_outgoing(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int have_outgoing)
 {
+#ifdef XP_USE_URING
+	if (xp->uring) {
+		/* a write poll which is no longer wanted is just left to
+		 * fire and ignored, instead of cancelling it
+		 */
+		if (!have_outgoing) {
+			xfd->uring_state &= ~XP_URING_WANT_OUT;
+			return;
+		}
+		xfd->uring_state |= XP_URING_WANT_OUT;
+		if (!(xfd->uring_state & XP_URING_ARMED_OUT))
+			xpoll_uring_arm(xp, xfd, 1);
+		return;
+	}
+#endif
 #ifdef XP_USE_EPOLL
+	/* the interest is tracked here, and the kernel is only told
+	 * when it changes - never in edge-triggered mode
+	 */
+	if (xfd->want_out == have_outgoing)
+		return;
+	xfd->want_out = have_outgoing;
+	
+	if (xp->edge_triggered) {
+		if (have_outgoing && (xfd->ready & XP_OUT))
+			xpoll_ready_add(xp, xfd);
+		return;
+	}
+	
 	if (have_outgoing) {
 		xfd->ev.events |= EPOLLOUT;
 	} else {
 		xfd->ev.events &= EPOLLIN|EPOLLPRI|EPOLLERR|EPOLLHUP;
 	}
+	xp->ctl_calls++;
 	if (epoll_ctl(xp->epollfd, EPOLL_CTL_MOD, xfd->fd, &xfd->ev) == -1) {
 		hlog(LOG_ERR, "xpoll_outgoing: epoll_ctl EPOL_CTL_MOD %d failed: %s", xfd->fd, strerror(errno));
 	}
@@ -222,17 +940,35 @@ void xpoll_outgoing(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int have_outgoin
 #endif
 }
 
+/*
+ *	a handler reports that reading (XP_IN) or writing (XP_OUT) would
+ *	block; in edge-triggered mode the fd then waits for the next edge
+ */
+
+void xpoll_would_block(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int what)
+{
+#ifdef XP_USE_EPOLL
+	if (xp->edge_triggered)
+		xfd->ready &= ~what;
+#endif
+}
+
 /*
  *	do a poll
  */
 
 int xpoll(struct xpoll_t *xp, int timeout)
 {
+#ifdef XP_USE_URING
+	if (xp->uring)
+		return xpoll_uring(xp, timeout);
+#endif
 #ifdef XP_USE_EPOLL
-#define MAX_EPOLL_EVENTS 32
-	struct epoll_event events[MAX_EPOLL_EVENTS];
+	if (xp->edge_triggered)
+		return xpoll_edge(xp, timeout);
 	
-	int nfds = epoll_wait( xp->epollfd, events, MAX_EPOLL_EVENTS, timeout );
+	struct epoll_event *events = xp->events;
+	int nfds = epoll_wait( xp->epollfd, events, xp->events_len, timeout );
 	int n;
 	for (n = 0; n < nfds; ++n) {
 		// Each event has initialized callback pointer to struct xpoll_fd_t...
@@ -21,6 +21,17 @@
 #define XP_USE_EPOLL 1
 #include <sys/epoll.h>
 
+// io_uring can be used instead of epoll, if enabled at run time.
+// Needs kernel headers new enough to have a timeout for io_uring_enter.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define XP_USE_URING 1
+#endif
+#endif
+#endif
+
 #else
 
 #define XP_USE_POLL 1
@@ -32,6 +43,14 @@
 #define XP_OUT	2
 #define XP_ERR	4
 
+/* backends, selected with PollBackend */
+#define XP_BACKEND_EPOLL	0	/* level-triggered epoll, or poll */
+#define XP_BACKEND_EPOLL_ET	1	/* edge-triggered epoll */
+#define XP_BACKEND_URING	2	/* io_uring */
+
+#define XP_EVENTS_DEFAULT	128	/* epoll events returned per round */
+#define XP_EVENTS_MAX		8192
+
 struct xpoll_fd_t {
 	int fd;
 	void *p;	/* a fd-specific pointer, which will be passed to handlers */
@@ -40,6 +59,17 @@ struct xpoll_fd_t {
 
 #ifdef XP_USE_EPOLL
 	struct epoll_event ev;  // event flags for this fd.
+	
+	/* edge-triggered mode: readiness is tracked here, and the fd
+	 * stays on the ready list until the handlers have consumed it
+	 */
+	int ready;		/* XP_* edges received and not yet consumed */
+	int want_out;		/* xpoll_outgoing() enabled */
+	struct xpoll_fd_t *ready_next;
+	struct xpoll_fd_t **ready_prevp;	/* NULL: not on the ready list */
+#ifdef XP_USE_URING
+	int uring_state;	/* XP_URING_* flags, io_uring polls in flight */
+#endif
 #else
 #ifdef XP_USE_POLL
 	int pollfd_n;	/* index to xp->pollfd[] */
@@ -58,8 +88,17 @@ struct xpoll_t {
 
 #ifdef XP_USE_EPOLL
 	int epollfd;
-  // #define MAX_EPOLL_EVENTS 32
-  //	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct epoll_event *events;
+	int events_len;
+	
+	int edge_triggered;
+	struct xpoll_fd_t *ready;	/* fds with readiness left over */
+	struct xpoll_fd_t *dispatching;	/* fd whose handler is running, NULL if removed */
+	
+	long long ctl_calls;		/* epoll_ctl() calls done */
+#ifdef XP_USE_URING
+	struct xpoll_uring_t *uring;	/* io_uring state, NULL: using epoll */
+#endif
 
 #else
 #ifdef XP_USE_POLL
@@ -75,9 +114,14 @@ extern int xpoll_free(struct xpoll_t *xp);
 extern struct xpoll_fd_t *xpoll_add(struct xpoll_t *xp, int fd, void *p);
 extern int xpoll_remove(struct xpoll_t *xp, struct xpoll_fd_t *xfd);
 extern void xpoll_outgoing(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int have_outgoing);
+extern void xpoll_would_block(struct xpoll_t *xp, struct xpoll_fd_t *xfd, int what);
+extern long long xpoll_ctl_calls(struct xpoll_t *xp);
 extern int xpoll(struct xpoll_t *xp, int timeout);
 extern void xpoll_init(void);
+extern const char *xpoll_backend(struct xpoll_t *xp);
 
 extern const char xpoll_implementation[];
+extern int xpoll_backend_config;
+extern int xpoll_events;
 
 #endif
@@ -2,7 +2,7 @@
 # Test login rejections
 
 use Test;
-BEGIN { plan tests => 5 };
+BEGIN { plan tests => 6 };
 use runproduct;
 use Ham::APRS::IS;
 ok(1); # If we made it this far, we're ok.
@@ -23,7 +23,20 @@ my @reject_login = (
 	"loginb",
 	"0prrej",
 	"mi0rej",
-	"sufrej"
+	"sufrej",
+	# case folded
+	"logina",
+	"MIXXREJ",
+	"SUFREJECT",
+);
+
+# Callsigns which almost match the rejected ones, and should be accepted
+my @accept_login = (
+	"LOGINAB",
+	"LOGINB-1",
+	"PRREJX",
+	"XMIREJX",
+	"XSUFRE"
 );
 
 my $fail = 0;
@@ -50,5 +63,19 @@ foreach my $s (@reject_login) {
 
 ok($fail, 0, "Server accepted logins which it should have rejected.");
 
+$fail = 0;
+foreach my $s (@accept_login) {
+	my $is = new Ham::APRS::IS("localhost:55152", $s);
+	my $ret = $is->connect('retryuntil' => 8);
+	if (!$ret) {
+		warn "Failed to connect to the server as '$s': " . $is->{'error'};
+		$fail++;
+	}
+	
+	$is->disconnect();
+}
+
+ok($fail, 0, "Server rejected logins which it should have accepted.");
+
 ok($p->stop(), 1, "Failed to stop product");
 
@@ -0,0 +1,43 @@
+#
+# Test the longest prefix matching of the listener ACLs, only on aprsc
+#
+
+use Test;
+
+my @cases = (
+	# port, should be allowed, description
+	[ 55581, 1, "specific allow after a wider deny" ],
+	[ 55582, 0, "specific deny after wider allows" ],
+	[ 55583, 0, "same prefix twice, first one applied" ],
+	[ 55584, 1, "nested prefixes, innermost one applied" ],
+);
+
+BEGIN {
+	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 4 + 1 : 0;
+};
+
+if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
+	exit(0);
+}
+
+use runproduct;
+use Ham::APRS::IS;
+
+my $p = new runproduct('acl-lpm');
+
+ok(defined $p, 1, "Failed to initialize product runner");
+ok($p->start(), 1, "Failed to start product");
+
+my $n = 0;
+foreach my $c (@cases) {
+	my($port, $allow, $desc) = @{ $c };
+	
+	$n++;
+	my $is = new Ham::APRS::IS("localhost:$port", "N5CAL-$n");
+	my $ret = $is->connect('retryuntil' => 8);
+	ok($ret ? 1 : 0, $allow, "ACL on port $port ($desc): " . ($ret ? "connection accepted" : "connection rejected: " . $is->{'error'}));
+	$is->disconnect() if ($ret);
+}
+
+ok($p->stop(), 1, "Failed to stop product");
+
@@ -0,0 +1,64 @@
+#
+# Test the per-address connection rate limit, only on aprsc
+#
+
+use Test;
+
+BEGIN {
+	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 3 + 1 + 2 + 1 : 0;
+};
+
+if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
+	exit(0);
+}
+
+use runproduct;
+use Ham::APRS::IS;
+use LWP;
+use LWP::UserAgent;
+use HTTP::Request::Common;
+use JSON::XS;
+
+my $p = new runproduct('ratelimit');
+
+ok(defined $p, 1, "Failed to initialize product runner");
+ok($p->start(), 1, "Failed to start product");
+
+# the burst of 3 connections is accepted
+my @clients;
+for (my $i = 1; $i <= 3; $i++) {
+	my $is = new Ham::APRS::IS("localhost:55580", "N5CAL-$i");
+	my $ret = $is->connect('retryuntil' => 8);
+	ok($ret, 1, "Connection $i within the rate limit was rejected: " . $is->{'error'});
+	push @clients, $is;
+}
+
+# the next one goes over the limit
+my $is = new Ham::APRS::IS("localhost:55580", "N5CAL-4");
+my $ret = $is->connect('retryuntil' => 8);
+ok($ret ? 1 : 0, 0, "Connection over the rate limit was accepted");
+$is->disconnect() if ($ret);
+
+# the rejection is counted for the listener
+my $ua = LWP::UserAgent->new;
+$ua->agent(
+	agent => "httpaprstester/1.0",
+	timeout => 10,
+	max_redirect => 0,
+);
+my $res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/status.json"));
+ok($res->code, 200, "HTTP GET of status.json returned wrong response code, message: " . $res->message);
+
+my $rejects = 0;
+my $j = JSON::XS->new->decode($res->decoded_content(charset => 'none'));
+foreach my $l (@{ $j->{'listeners'} }) {
+	$rejects = $l->{'rejects'}->{'rate_ip'} if ($l->{'addr'} =~ /:55580$/);
+}
+ok($rejects, 1, "status.json does not count the rate limited connection");
+
+foreach my $c (@clients) {
+	$c->disconnect();
+}
+
+ok($p->stop(), 1, "Failed to stop product");
+
@@ -7,7 +7,7 @@
 #
 
 use Test;
-BEGIN { plan tests => 8 + 1 + 5 };
+BEGIN { plan tests => 8 + 1 + 1 + 5 };
 use runproduct;
 use istest;
 use Ham::APRS::IS;
@@ -96,6 +96,20 @@ my @pkts = (
 	"GLDROP>DST,DIGI,qAR,$login:>should drop, GLDROP as source callsign matches *DROP",
 	"DRGLOB>DST,DIGI,qAR,$login:>should drop, DRGLOB as source callsign matches DRG*",
 	"OH7DRU>DST,DIGI,qAR,$login:>should drop, OH7DRU as source callsign matches OH?DRUP",
+	"N8CALL-5>DST,DIGI,qAR,$login:>should drop, N8CALL-5 as source callsign matches N8CALL*",
+	"gldrop>DST,DIGI,qAR,$login:>should drop, gldrop as source callsign matches *DROP, case folded",
+	"oh7dru>DST,DIGI,qAR,$login:>should drop, oh7dru as source callsign matches OH?DRU, case folded",
+	"OH2ZZZ>DST,DIGI,qAR,$login:>should drop, OH2ZZZ as source callsign matches O*ZZZ",
+	"OZZZ>DST,DIGI,qAR,$login:>should drop, OZZZ as source callsign matches O*ZZZ",
+	"N0CALL-5>DST,DIGI,qAR,$login:>should drop, N0CALL-5 as source callsign, N0CALL is a prefix",
+	# malformed headers
+	"SRCDST,DIGI,qAR,$login:>should drop, no > after srccall",
+	">DST,DIGI,qAR,$login:>should drop, empty srccall",
+	"SRC>,DIGI,qAR,$login:>should drop, empty dstcall",
+	"SRC>:>should drop, empty dstcall and no path",
+	"SRC>DST,,DIGI,qAR,$login:>should drop, empty path element",
+	"SRC>DST,DIGI,,qAR,$login:>should drop, empty path element before q construct",
+	"SRC>DST,DIGI,qAR,$login>should drop, no colon after the path",
 	# DX spots
 	"SRC>DST,DIGI,qAR,$login:DX de FOO: BAR - should drop",
 	# Disallowed message recipients, status messages and such
@@ -103,9 +117,30 @@ my @pkts = (
 	"SRC>APRS,qAR,${login}::javaMSG  :Foo_BAR Linux APRS Server: 192.168.10.72 connected 2 users online.",
 );
 
+# Packets which are close to the dropped ones, but should pass
+my @pass_pkts = (
+	# source callsigns which almost match the disallowed ones
+	"N7CALX>DST,DIGI,qAR,$login:>should pass, N7CALX does not match N7CALL",
+	"N8CAL>DST,DIGI,qAR,$login:>should pass, N8CAL does not match N8CALL*",
+	"GLDROPX>DST,DIGI,qAR,$login:>should pass, GLDROPX does not match *DROP",
+	"DRAGLOB>DST,DIGI,qAR,$login:>should pass, DRAGLOB does not match DRG*",
+	"OH77DRU>DST,DIGI,qAR,$login:>should pass, OH77DRU does not match OH?DRU",
+	"OH7DRUX>DST,DIGI,qAR,$login:>should pass, OH7DRUX does not match OH?DRU",
+	"OH2ZZZA>DST,DIGI,qAR,$login:>should pass, OH2ZZZA does not match O*ZZZ",
+	"XN0CALL>DST,DIGI,qAR,$login:>should pass, XN0CALL does not start with N0CALL",
+	# headers without a q construct get one added
+	[ "SRC>DST,DIGI:>should pass, no q construct",
+	  "SRC>DST,DIGI,qAS,$login:>should pass, no q construct" ],
+	[ "SRC>DST:>should pass, no path and no q construct",
+	  "SRC>DST,qAS,$login:>should pass, no path and no q construct" ],
+);
+
+# the packets as they should come out
+my @pass_expect = map { ref $_ ? $_->[1] : $_ } @pass_pkts;
+
 # send the packets
-foreach my $s (@pkts) {
-	$i_tx->sendline($s);
+foreach my $s (@pkts, @pass_pkts) {
+	$i_tx->sendline(ref $s ? $s->[0] : $s);
 }
 
 # check that a packet passes at all and the previous packets were dropped
@@ -114,9 +149,12 @@ $i_tx->sendline($tx);
 
 my $fail = 0;
 my $success = 0;
+my %passed;
 while (my $rx = $i_rx->getline_noncomment(0.5)) {
-	if ($rx =~ /should pass/) {
+	if ($rx =~ /should pass$/) {
 		$success = 1; # ok
+	} elsif (grep { $_ eq $rx } @pass_expect) {
+		$passed{$rx} = 1;
 	} else {
 		warn "Server passed packet it should have dropped: $rx\n";
 		$fail++;
@@ -126,6 +164,15 @@ while (my $rx = $i_rx->getline_noncomment(0.5)) {
 ok($fail, 0, "Server passed packets which it should have dropped.");
 ok($success, 1, "Server did not pass final packet which it should have passed.");
 
+my $missing = 0;
+foreach my $s (@pass_expect) {
+	if (!$passed{$s}) {
+		warn "Server dropped packet it should have passed: $s\n";
+		$missing++;
+	}
+}
+ok($missing, 0, "Server dropped packets which it should have passed.");
+
 # disconnect
 
 $ret = $i_tx->disconnect();
@@ -0,0 +1,219 @@
+#
+# Test the position decoders and the range filter distance:
+# - uncompressed positions with ambiguity spaces, overflowing minutes,
+#   hemisphere letters in both cases and the sscanf() fallback
+# - Mic-E destination calls in all quadrants, with the longitude
+#   offset, message bit letters and ambiguity
+# - positions which must not decode at all
+# - r/ filter edges at latitudes up to 89 degrees, to check the
+#   cos(latitude) used by the range filters against perl's cos()
+#
+
+use Test;
+BEGIN { plan tests => 5 + 2 + 17 + 1 + 2 + 10 + 1 + 2 + 8 + 3 };
+use runproduct;
+use istest;
+use Ham::APRS::IS;
+use POSIX qw(floor);
+ok(1); # If we made it this far, we're ok.
+
+my $p = new runproduct('basic');
+
+ok(defined $p, 1, "Failed to initialize product runner");
+ok($p->start(), 1, "Failed to start product");
+
+my $login = "N5CAL-1";
+my $i_tx = new Ham::APRS::IS("localhost:55580", $login);
+ok(defined $i_tx, 1, "Failed to initialize Ham::APRS::IS");
+
+my $ret;
+$ret = $i_tx->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_tx->{'error'});
+
+sub deg($$$)
+{
+	my($d, $m, $f) = @_;
+
+	return $d + $m / 60 + $f / 6000;
+}
+
+# Mic-E packet from the destination call and the absolute longitude,
+# the longitude offset comes from the 5th character of the call
+sub mice($$$$$)
+{
+	my($src, $dst, $lng_deg, $lng_min, $lng_frag) = @_;
+
+	my $raw = $lng_deg;
+	if (substr($dst, 4, 1) ge 'P') {
+		if ($lng_deg < 10) {
+			$raw = $lng_deg + 90;
+		} elsif ($lng_deg < 110) {
+			$raw = $lng_deg - 20;
+		} else {
+			$raw = $lng_deg - 100;
+		}
+	}
+	my $min = ($lng_min < 10) ? $lng_min + 60 : $lng_min;
+
+	return "$src>$dst:`" . chr($raw + 28) . chr($min + 28) . chr($lng_frag + 28) . "l!u>/";
+}
+
+# packet, latitude, longitude
+my @pass = (
+	# lower case hemisphere letters
+	[ "OH2DEC-1>APRS:!3012.34s/14523.45w#", -deg(30, 12, 34), -deg(145, 23, 45) ],
+	# ambiguity: 1 to 4 digits blanked out
+	[ "OH2DEC-2>APRS:!6028.5 N/02505.6 E#", deg(60, 28, 55), deg(25, 5, 65) ],
+	[ "OH2DEC-3>APRS:!6028.  N/02505.  E#", deg(60, 28, 55), deg(25, 5, 55) ],
+	[ "OH2DEC-4>APRS:!602 .  N/0250 .  E#", deg(60, 25, 55), deg(25, 5, 55) ],
+	[ "OH2DEC-5>APRS:!60  .  N/025  .  W#", deg(60, 35, 55), -deg(25, 35, 55) ],
+	# minutes over 59 are not rejected
+	[ "OH2DEC-6>APRS:!4075.00N/02090.00E#", deg(41, 15, 0), deg(21, 30, 0) ],
+	# the largest degrees accepted
+	[ "OH2DEC-7>APRS:!8959.99S/17959.99W#", -deg(89, 59, 99), -deg(179, 59, 99) ],
+	# not in the fixed digit layout, decoded by sscanf()
+	[ "OH2DEC-8>APRS:!6 28.51N/02505.68E#", deg(6, 28, 51), deg(25, 5, 68) ],
+	# Mic-E: digits only, south and east
+	[ mice("OH2MIC-1", "123456", 45, 30, 12), -deg(12, 34, 56), deg(45, 30, 12) ],
+	# P-Y: north, longitude offset, west
+	[ mice("OH2MIC-2", "PQRSTU", 130, 45, 67), deg(1, 23, 45), -deg(130, 45, 67) ],
+	# minutes below 10, no offset
+	[ mice("OH2MIC-3", "3X2Q5P", 75, 5, 0), deg(38, 21, 50), -deg(75, 5, 0) ],
+	# longitudes 100-109 and 0-9 with the offset
+	[ mice("OH2MIC-4", "4Y1PPU", 105, 20, 40), deg(49, 10, 5), -deg(105, 20, 40) ],
+	[ mice("OH2MIC-5", "0A12QR", 5, 30, 0), -deg(0, 12, 12), -deg(5, 30, 0) ],
+	# message bit letters A-J in the first 3 characters
+	[ mice("OH2MIC-6", "ABCPQR", 120, 15, 25), deg(1, 20, 12), -deg(120, 15, 25) ],
+	# ambiguity of 1, 2 and 4 digits
+	[ mice("OH2MIC-7", "5123PZ", 120, 33, 47), -deg(51, 23, 5), -deg(120, 33, 45) ],
+	[ mice("OH2MIC-8", "4512LZ", 65, 40, 99), -deg(45, 12, 55), -deg(65, 40, 50) ],
+	[ mice("OH2MIC-9", "45KZZZ", 140, 20, 30), deg(45, 35, 55), -140.5 ],
+);
+
+# A box of 0.0001 degrees around each position, smaller than the
+# 0.01 minute resolution
+my $i_rx = new Ham::APRS::IS("localhost:55581", "N5CAL-2",
+	'filter' => join(' ', map { sprintf('a/%.6f/%.6f/%.6f/%.6f',
+		$_->[1] + 0.0001, $_->[2] - 0.0001, $_->[1] - 0.0001, $_->[2] + 0.0001) } @pass));
+ok(defined $i_rx, 1, "Failed to initialize Ham::APRS::IS");
+
+$ret = $i_rx->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_rx->{'error'});
+
+my($tx, $rx);
+
+foreach my $t (@pass) {
+	$tx = $t->[0];
+	($rx = $tx) =~ s/:/,qAS,$login:/;
+	istest::txrx(\&ok, $i_tx, $i_rx, $tx, $rx);
+}
+
+$ret = $i_rx->disconnect();
+ok($ret, 1, "Failed to disconnect from the server: " . $i_rx->{'error'});
+
+# Packets which do not have a position; the helper is anywhere.
+# Each has its own source call, so that no position is found for it
+# in the history database.
+my $helper = "OH2DEC-9>APRS:!6028.51N/02505.68E#helper";
+my @drop = (
+	"OH2BAD-1>APRS:!9000.00N/02505.68E#lat",
+	"OH2BAD-2>APRS:!6028.51N/18000.00E#lng",
+	"OH2BAD-3>APRS:!6028.51X/02505.68E#hemi",
+	"OH2BAD-4>APRS:!6028.51N/02505.68Q#hemi",
+	"OH2BAD-5>APRS:!60A8.51N/02505.68E#digit",
+	"OH2BAD-6>APRS:!6028,51N/02505.68E#dot",
+	mice("OH2BAD-7", "123A56", 45, 30, 12),
+	mice("OH2BAD-8", "1M3456", 45, 30, 12),
+	mice("OH2BAD-9", "K23456", 45, 30, 12),
+	mice("OH2BAD-10", "12345", 45, 30, 12),
+);
+
+$i_rx = new Ham::APRS::IS("localhost:55581", "N5CAL-3",
+	'filter' => 'a/89.9/-179.9/-89.9/179.9');
+ok(defined $i_rx, 1, "Failed to initialize Ham::APRS::IS");
+
+$ret = $i_rx->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_rx->{'error'});
+
+foreach $tx (@drop) {
+	istest::should_drop(\&ok, $i_tx, $i_rx, $tx, $helper);
+}
+
+$ret = $i_rx->disconnect();
+ok($ret, 1, "Failed to disconnect from the server: " . $i_rx->{'error'});
+
+# r/lat/0/dist filters with a range of about 30 degrees of longitude,
+# and compressed positions on the same latitude just inside and just
+# outside the range as calculated by perl. The latitudes are picked so
+# that they decode exactly, and the longitudes are rounded away from
+# the edge, so the margin only needs to cover the single precision
+# distance calculation, and catches cos(lat) errors larger than that.
+my $pi = 3.14159265358979323846;
+my $km_per_rad = 111.2 * 180.0 / $pi;
+my $margin = 5e-6;
+my @lats = (0, 30, 60, 80, 85, 89, -60, -88);
+
+sub b91($)
+{
+	my($v) = @_;
+	my $s = '';
+
+	foreach my $m (91*91*91, 91*91, 91, 1) {
+		$s .= chr(33 + int($v / $m));
+		$v %= $m;
+	}
+
+	return $s;
+}
+
+sub range_at($)
+{
+	my($lat) = @_;
+
+	my $latr = unpack('f', pack('f', $lat * $pi / 180));
+	my $s = cos($latr) * sin(15 * $pi / 180);
+
+	return int($km_per_rad * 2 * atan2($s, sqrt(1 - $s * $s)));
+}
+
+# compressed position at $lat and the longitude at distance $d,
+# west if $d is negative
+sub compressed_at($$$)
+{
+	my($src, $lat, $d) = @_;
+
+	# latitude in radians as a float, like the filter and the parser
+	my $latr = unpack('f', pack('f', $lat * $pi / 180));
+	my $s = sin(abs($d) / $km_per_rad / 2) / cos($latr);
+	my $dlng = 2 * atan2($s, sqrt(1 - $s * $s)) * 180 / $pi;
+	$dlng = -$dlng if ($d < 0);
+
+	return "$src>APRS:!/" . b91((90 - $lat) * 380926)
+		. b91(floor((180 + $dlng) * 190463)) . ">{-A";
+}
+
+$i_rx = new Ham::APRS::IS("localhost:55581", "N5CAL-4",
+	'filter' => join(' ', map { "r/$_/0/" . range_at($_) } @lats));
+ok(defined $i_rx, 1, "Failed to initialize Ham::APRS::IS");
+
+$ret = $i_rx->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_rx->{'error'});
+
+foreach my $lat (@lats) {
+	my $in = compressed_at("OH2COS-1", $lat, range_at($lat) * (1 - $margin));
+	my $out = compressed_at("OH2COS-2", $lat, -range_at($lat) * (1 + $margin));
+	istest::should_drop(\&ok, $i_tx, $i_rx, $out, $in);
+}
+
+# disconnect
+
+$ret = $i_rx->disconnect();
+ok($ret, 1, "Failed to disconnect from the server: " . $i_rx->{'error'});
+
+$ret = $i_tx->disconnect();
+ok($ret, 1, "Failed to disconnect from the server: " . $i_tx->{'error'});
+
+# stop
+
+ok($p->stop(), 1, "Failed to stop product");
+
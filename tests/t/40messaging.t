@@ -18,7 +18,7 @@
 #
 
 use Test;
-BEGIN { plan tests => 8 + 9 + 1 + 2 + 3 + 2 + 6 + 4 + 1 };
+BEGIN { plan tests => 8 + 9 + 1 + 2 + 3 + 2 + 6 + 4 + 6 + 1 };
 use runproduct;
 use istest;
 use Ham::APRS::IS;
@@ -141,6 +141,29 @@ istest::should_drop(\&ok, $i_tx, $i_rx, $tx, $helper);
 $rx = $tx = "$msg_src>APRS,TCPIP*,qAC,$msg_src:!5528.51N/00505.68E# should pass TCPIP*";
 istest::txrx(\&ok, $i_rx, $i_tx, $tx, $rx);
 
+# A TCPIP* which is added by this server in a new Q construct does not
+# count, when a station heard on an igate logs in itself and sends
+# without a path.
+my $self_src = "M5SELF";
+$tx = "$self_src>APRS,OH2RDG*,WIDE,$login_tx,I:!5528.51N/00505.68E# heard";
+$helper = "H1LP-S>APRS,OH2RDG*,WIDE:!6028.51N/02505.68E# should pass";
+istest::should_drop(\&ok, $i_tx, $i_rx, $tx, $helper);
+
+my $i_src = new Ham::APRS::IS("localhost:55581", $self_src);
+ok(defined $i_src, 1, "Failed to initialize Ham::APRS::IS");
+$ret = $i_src->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_src->{'error'});
+
+$tx = "$self_src>APRS:!5528.51N/00505.68E# should drop, TCPIP* added here";
+$helper = "$self_src>APRS:!6028.51N/02505.68E# should pass, in filter";
+istest::should_drop(\&ok, $i_src, $i_tx, $tx, $helper);
+# the helper is in the filter of the other igate, too
+my $read = $i_rx->getline_noncomment();
+ok(defined $read && $read =~ /should pass, in filter/ ? 1 : 0, 1, "Did not get the helper on the other igate: " . (defined $read ? $read : 'timeout'));
+
+$ret = $i_src->disconnect();
+ok($ret, 1, "Failed to disconnect from the server: " . $i_src->{'error'});
+
 #
 # Message to the client's callsign
 #
@@ -0,0 +1,144 @@
+#
+# Test that a client migration between workers, which fails on the
+# receiving worker, drops the client and lets the rebalancer carry on.
+# The failure is faked with APRSC_TEST_MIGRATE_FAIL, only on aprsc
+# built with "make testing".
+#
+
+use Test;
+
+my $receivers = 3;
+
+BEGIN {
+	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 1 + 1 + 3 + 1 : 0;
+};
+
+if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
+	exit(0);
+}
+
+use runproduct;
+use Ham::APRS::IS;
+use LWP;
+use LWP::UserAgent;
+use HTTP::Request::Common;
+use JSON::XS;
+use Time::HiRes qw( time sleep );
+
+my $ua = LWP::UserAgent->new;
+$ua->agent(
+	agent => "httpaprstester/1.0",
+	timeout => 10,
+	max_redirect => 0,
+);
+
+sub get_json($)
+{
+	my($uri) = @_;
+	
+	my $res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501$uri"));
+	return undef if ($res->code ne 200);
+	return JSON::XS->new->decode($res->decoded_content(charset => 'none'));
+}
+
+$ENV{'APRSC_TEST_MIGRATE_FAIL'} = 1;
+
+my $p = new runproduct('migrate-fail');
+
+ok(defined $p, 1, "Failed to initialize product runner");
+ok($p->start(), 1, "Failed to start product");
+
+# the fault injection hook is only in a testing build
+my $features = get_json("/status.json");
+$features = (defined $features) ? $features->{'server'}->{'software_build_features'} : '';
+if ($features !~ /\btesting\b/) {
+	skip("aprsc not built with 'make testing'", 1) for (1 .. 5);
+	ok($p->stop(), 1, "Failed to stop product");
+	exit(0);
+}
+
+# the packet source, and a bunch of clients spread over the workers
+my $i_tx = new Ham::APRS::IS("localhost:55580", "N5CAL-1");
+my $ret = $i_tx->connect('retryuntil' => 8);
+
+my %clients;
+for (my $i = 2; $i <= 9; $i++) {
+	my $is = new Ham::APRS::IS("localhost:55580", "N5CAL-$i");
+	$ret = $is->connect('retryuntil' => 8) if ($ret);
+	$clients{"N5CAL-$i"} = $is;
+}
+ok($ret, 1, "Failed to connect the clients");
+
+# Find a worker with enough clients, other than the one of the packet
+# source, and load it up by giving them a filter. The rest go away.
+sleep(3);
+my $status = get_json("/status.json");
+my($busy, @busy_clients);
+foreach my $w (@{ $status->{'workers'} }) {
+	my $j = get_json("/clients.json?worker=" . $w->{'id'} . "&username=N5CAL&sort=username");
+	my @c = map { $_->{'username'} } @{ $j->{'clients'} };
+	next if (grep { $_ eq 'N5CAL-1' } @c);
+	if (@c >= $receivers) {
+		$busy = $w->{'id'};
+		@busy_clients = @c[0 .. $receivers-1];
+		last;
+	}
+}
+ok(defined $busy, 1, "Did not find a worker with $receivers clients");
+
+foreach my $c (keys %clients) {
+	if (grep { $_ eq $c } @busy_clients) {
+		$clients{$c}->sendline("#filter p/OH2MIG");
+	} else {
+		$clients{$c}->disconnect();
+		delete $clients{$c};
+	}
+}
+
+# The rebalancer tries to move the loaded clients to the idle worker,
+# one at a time, and each of them is dropped. Depending on how the cost
+# decays, the last one may or may not be worth moving.
+my $end_t = time() + 30;
+my $seq = 0;
+my @closed;
+while (time() < $end_t) {
+	for (my $i = 0; $i < 5; $i++) {
+		$seq++;
+		$i_tx->sendline("OH2MIG>APRS,TCPIP*:>migration load $seq");
+	}
+	@closed = ();
+	foreach my $c (@busy_clients) {
+		my $is = $clients{$c};
+		$is->getline(0.01) while ($is->{'state'} eq 'connected' && $is->{'ibuf'} ne '');
+		$is->getline(0.01);
+		push @closed, $c if ($is->{'state'} ne 'connected');
+	}
+	last if (@closed >= 2);
+	sleep(0.05);
+}
+
+ok(scalar @closed >= 2 ? 1 : 0, 1, "Too few clients dropped after a failed migration: " . scalar @closed);
+
+# without the load, the costs go down and the migrations stop
+sleep(3);
+@closed = ();
+foreach my $c (@busy_clients) {
+	my $is = $clients{$c};
+	1 while ($is->{'state'} eq 'connected' && defined $is->getline(0.1));
+	push @closed, $c if ($is->{'state'} ne 'connected');
+}
+$status = get_json("/status.json");
+my($migrated_out, $clients_left) = (0, 0);
+foreach my $w (@{ $status->{'workers'} }) {
+	$migrated_out += $w->{'clients_migrated_out'};
+	$clients_left += $w->{'clients'};
+}
+ok($migrated_out, scalar @closed, "Wrong number of clients migrated out");
+ok($clients_left, $receivers - scalar(@closed) + 1, "The dropped clients are still counted on the workers");
+
+foreach my $c (values %clients) {
+	$c->disconnect() if ($c->{'state'} eq 'connected');
+}
+$i_tx->disconnect();
+
+ok($p->stop(), 1, "Failed to stop product");
@@ -6,7 +6,7 @@
 use Test;
 
 BEGIN {
-	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 16 + 1 : 0;
+	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 16 + 4 + 3 + 1 + 12 : 0;
 };
 
 if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
@@ -14,6 +14,7 @@ if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
 }
 
 use runproduct;
+use Ham::APRS::IS;
 use LWP;
 use LWP::UserAgent;
 use HTTP::Request::Common;
@@ -76,6 +77,26 @@ ok(defined $j, 1, "JSON decoding of (compressed) status.json failed");
 ok(defined $j->{'server'}, 1, "status.json (compressed) does not define 'server'");
 
 
+$req = HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?sort=bytes_rx&order=desc&limit=10");
+$res = $ua->simple_request($req);
+ok($res->code, 200, "HTTP GET of status server /clients.json returned wrong response code, message: " . $res->message);
+$j = $json->decode($res->decoded_content(charset => 'none'));
+ok(defined $j->{'total'} && ref $j->{'clients'} eq 'ARRAY', 1, "clients.json does not define 'total' and 'clients'");
+
+$req = HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?sort=nosuchkey");
+$res = $ua->simple_request($req);
+ok($res->code, 400, "HTTP GET of /clients.json with a bad sort key did not return 400");
+$req = HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?limit=x");
+$res = $ua->simple_request($req);
+ok($res->code, 400, "HTTP GET of /clients.json with a bad limit did not return 400");
+
+$req = HTTP::Request::Common::GET("http://127.0.0.1:55501/metrics");
+$res = $ua->simple_request($req);
+ok($res->code, 200, "HTTP GET of status server /metrics returned wrong response code, message: " . $res->message);
+ok($res->header('Content-Type'), qr/^text\/plain; version=0\.0\.4/, "/metrics has a wrong Content-Type");
+ok($res->decoded_content(charset => 'none'), qr/^# TYPE aprsc_worker_rx_packet_bytes histogram$/m, "/metrics does not have the packet length histogram");
+
+
 $req = HTTP::Request::Common::GET("http://127.0.0.1:55501/counterdata?totals.tcp_bytes_rx");
 $res = $ua->simple_request($req);
 ok($res->code, 200, "HTTP GET of status server /counterdata?totals.tcp_bytes_rx returned wrong response code, message: " . $res->message);
@@ -93,6 +114,75 @@ ok(defined $j->{'interval'}, 1, "counterdata json (compressed) does not define '
 ok(defined $j->{'values'}, 1, "counterdata json (compressed) does not define 'values'");
 
 
+# the client list API with a few logged-in clients ############
+
+my @clients;
+for (my $i = 1; $i <= 3; $i++) {
+	my $is = new Ham::APRS::IS("localhost:55580", "N5STA-$i");
+	ok($is->connect('retryuntil' => 8), 1, "Failed to connect N5STA-$i: " . $is->{'error'});
+	# a different amount of traffic from each, for sorting
+	for (my $n = 0; $n < $i; $n++) {
+		$is->sendline("N5STA-$i>APRS,TCPIP*:>status api test $n");
+	}
+	push @clients, $is;
+}
+my $is_ff = new Ham::APRS::IS("localhost:55152", "N5STB-1");
+ok($is_ff->connect('retryuntil' => 8), 1, "Failed to connect N5STB-1: " . $is_ff->{'error'});
+push @clients, $is_ff;
+
+# let the workers account the packets in their snapshots
+sleep(2);
+
+sub get_clients($)
+{
+	my($query) = @_;
+	
+	my $res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?$query"));
+	return undef if ($res->code ne 200);
+	
+	return $json->decode($res->decoded_content(charset => 'none'));
+}
+
+sub usernames($)
+{
+	my($j) = @_;
+	
+	return join(',', map { $_->{'username'} } @{ $j->{'clients'} });
+}
+
+$j = get_clients("username=n5sta&sort=username");
+ok($j->{'total'}, 3, "clients.json username prefix gave a wrong total");
+ok(usernames($j), "N5STA-1,N5STA-2,N5STA-3", "clients.json username prefix gave wrong clients");
+
+$j = get_clients("username=N5STA&sort=username&order=desc&limit=2");
+ok(usernames($j) . " total " . $j->{'total'}, "N5STA-3,N5STA-2 total 3", "clients.json limit with descending order gave wrong clients");
+
+$j = get_clients("username=N5STA&sort=username&offset=2&limit=2");
+ok(usernames($j) . " total " . $j->{'total'}, "N5STA-3 total 3", "clients.json offset gave wrong clients");
+
+$j = get_clients("username=N5STA&sort=bytes_rx&order=desc");
+ok(usernames($j), "N5STA-3,N5STA-2,N5STA-1", "clients.json sorting by bytes_rx gave a wrong order");
+
+# only the full feed client on the full feed TCP listener
+$res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/status.json"));
+$j = $json->decode($res->decoded_content(charset => 'none'));
+my $ff_id;
+foreach my $l (@{ $j->{'listeners'} }) {
+	$ff_id = $l->{'id'} if ($l->{'proto'} eq 'tcp' && $l->{'addr'} =~ /:55152$/);
+}
+$j = get_clients("listener=$ff_id");
+ok(usernames($j) . " total " . $j->{'total'}, "N5STB-1 total 1", "clients.json listener filter gave wrong clients");
+
+$j = get_clients("listener=$ff_id&username=N5STA");
+ok($j->{'total'}, 0, "clients.json listener and username filters gave clients");
+
+$res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?listener=99999"));
+ok($res->code, 400, "HTTP GET of /clients.json with an unknown listener did not return 400");
+
+foreach my $c (@clients) {
+	$c->disconnect();
+}
+
 # stop
 
 ok($p->stop(), 1, "Failed to stop product");
@@ -6,7 +6,7 @@
 use Test;
 
 BEGIN {
-	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 8 + 2 + 8 + 1 : 0;
+	plan tests => (!defined $ENV{'TEST_PRODUCT'} || $ENV{'TEST_PRODUCT'} =~ /aprsc/) ? 2 + 8 + 2 + 4 + 8 + 8 + 1 : 0;
 };
 
 if (defined $ENV{'TEST_PRODUCT'} && $ENV{'TEST_PRODUCT'} !~ /aprsc/) {
@@ -81,29 +81,46 @@ istest::should_drop(\&ok, $i_tx, $i_rx,
 	"SRC>DST,DIGI1*,qAR,$login:foo1", # should drop
 	"SRC>DST:dummy1", 1); # will pass (helper packet)
 
-# delete old liveupgrade status file, ignore errors if it doesn't happen to exist yet
-my $liveupgrade_json_old = "data/liveupgrade.json.old";
-unlink($liveupgrade_json_old);
+# an igate client with a filter and two stations in its heard list
+my $login_gate = "N5CAL-11";
+my $filter_gate = "r/60.4752/25.0947/1";
+my $i_gate = new Ham::APRS::IS("localhost:55580", $login_gate, 'filter' => $filter_gate);
+ok(defined $i_gate, 1, "Failed to initialize Ham::APRS::IS");
+$ret = $i_gate->connect('retryuntil' => 8);
+ok($ret, 1, "Failed to connect to the server: " . $i_gate->{'error'});
+
+foreach my $call ("M1DST", "M2DST") {
+	istest::txrx(\&ok, $i_gate, $i_rx,
+		"$call>APRS,OH2RDG*,WIDE,$login_gate,I:!6028.51N/02505.68E# heard",
+		"$call>APRS,OH2RDG*,WIDE,qAR,$login_gate:!6028.51N/02505.68E# heard");
+}
 
 ok($p->signal('USR2'), 1, "Failed to signal product to live upgrade");
 
 # it takes some time for aprsc to shut down and reload, wait for
-# the new instance to finish reloading status.json, some 0.5s usually
-# but a virtual machine in TA might be slow
+# the new instance to come up and report the live upgrade in
+# status.json, some 0.5s usually but a virtual machine in TA might be slow
 my $maxwait = 10;
 my $wait_start = time();
 my $wait_end = time() + $maxwait;
-while (time() < $wait_end && ! -e $liveupgrade_json_old) {
+my $live_upgrades = 0;
+while (time() < $wait_end) {
+	$res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/status.json"));
+	if ($res->code == 200) {
+		my $js = $json->decode($res->decoded_content(charset => 'none'));
+		$live_upgrades = $js->{'server'}->{'live_upgrades'} if (defined $js && defined $js->{'server'});
+		last if ($live_upgrades);
+	}
 	sleep(0.1);
 }
 #warn sprintf("waited %.3f s\n", time() - $wait_start);
-ok(-e $liveupgrade_json_old, 1, "live upgrade not done, timed out in $maxwait s, $liveupgrade_json_old not present");
+ok($live_upgrades, 1, "live upgrade not done, timed out in $maxwait s, status.json live_upgrades not 1");
 
-# do the same test again - dupecheck cache has been lost in the
-# upgrade
-istest::txrx(\&ok, $i_tx, $i_rx,
-	"SRC>DST,qAR,$login:foo1",
-	"SRC>DST,qAR,$login:foo1");
+# do the same test again - the dupecheck cache has been carried over
+# in the upgrade, so the packet is still a duplicate
+istest::should_drop(\&ok, $i_tx, $i_rx,
+	"SRC>DST,qAR,$login:foo1", # should drop
+	"SRC>DST:dummy2", 1); # will pass (helper packet)
 
 istest::should_drop(\&ok, $i_tx, $i_rx,
 	"SRC>DST,DIGI1*,qAR,$login:foo1", # should drop
@@ -116,12 +133,32 @@ sleep(1.5);
 $res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/status.json"));
 ok($res->code, 200, "post-upgrade HTTP GET of status.json returned wrong response code, message: " . $res->message);
 
-# validate that the counters include packets sent after the reload only (2 uniques, 1 dupe)
+# validate that the counters include packets sent after the reload only (2 uniques, 2 dupes)
 my $j2 = $json->decode($res->decoded_content(charset => 'none'));
 ok(defined $j2, 1, "post-upgrade JSON decoding of status.json failed");
 ok(defined $j2->{'dupecheck'}, 1, "post-upgrade status.json does not define 'dupecheck'");
 ok($j2->{'dupecheck'}->{'uniques_out'}, 2, "post-upgrade uniques_out check");
-ok($j2->{'dupecheck'}->{'dupes_dropped'}, 1, "post-upgrade dupes_dropped check");
+ok($j2->{'dupecheck'}->{'dupes_dropped'}, 2, "post-upgrade dupes_dropped check");
+
+# the igate client was carried over with its login, filter and heard list
+$res = $ua->simple_request(HTTP::Request::Common::GET("http://127.0.0.1:55501/clients.json?username=$login_gate"));
+ok($res->code, 200, "post-upgrade HTTP GET of clients.json returned wrong response code, message: " . $res->message);
+my $jc = $json->decode($res->decoded_content(charset => 'none'));
+my $gate = (defined $jc && defined $jc->{'clients'}) ? $jc->{'clients'}->[0] : {};
+ok($gate->{'username'}, $login_gate, "post-upgrade igate client username");
+ok($gate->{'app_name'}, "IS", "post-upgrade igate client app_name");
+ok($gate->{'app_version'}, "0.01", "post-upgrade igate client app_version");
+ok($gate->{'filter'}, $filter_gate, "post-upgrade igate client filter");
+ok($gate->{'heard_count'}, 2, "post-upgrade igate client heard_count");
+
+# a message to a heard station is routed to the igate, and its filter
+# still passes positions
+istest::txrx(\&ok, $i_tx, $i_gate,
+	"M1SRC>APRS,OH2RDG*,WIDE,$login,I::M2DST    :hello",
+	"M1SRC>APRS,OH2RDG*,WIDE,qAR,${login}::M2DST    :hello");
+istest::txrx(\&ok, $i_tx, $i_gate,
+	"M3SRC>APRS,OH2RDG*,WIDE,$login,I:!6028.51N/02505.68E# filter",
+	"M3SRC>APRS,OH2RDG*,WIDE,qAR,$login:!6028.51N/02505.68E# filter");
 
 # stop
 